@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "finger.h"
+
+/**
+ * closest preceding finger search, scalar against whatever finger_search
+ * picked for this cpu, over full tables of random fingers
+ */
+
+#define BENCH_TABLES 64
+#define BENCH_LOOKUPS (1 << 20)
+
+static uint32_t rng_state = 0x9E3779B9;
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static double run(struct finger_table** tables, const hash_type* targets,
+        int (*search)(const uint32_t*, int, uint32_t), long* sum)
+{
+    uint64_t start = now_ns();
+    long s = 0;
+    for (int i = 0; i < BENCH_LOOKUPS; ++i){
+        const struct finger_table* ft = tables[i % BENCH_TABLES];
+        s += search(ft->rel, ft->n, targets[i] - ft->self_id);
+    }
+    *sum = s;
+    return (double)(now_ns() - start) / BENCH_LOOKUPS;
+}
+
+int main(void)
+{
+    static const unsigned int bases[] = {2, 4, 16};
+    struct finger_table* tables[BENCH_TABLES];
+    hash_type* targets = malloc(sizeof(hash_type) * BENCH_LOOKUPS);
+    if (!targets){
+        return 1; }
+
+    printf("finger search: %s\n", finger_search_name());
+    for (size_t b = 0; b < sizeof(bases) / sizeof(bases[0]); ++b){
+        for (int t = 0; t < BENCH_TABLES; ++t){
+            tables[t] = finger_table_create(rng(), bases[b]);
+            if (!tables[t]){
+                return 1; }
+            // a few empty fingers, like a table still being fixed
+            for (int f = 0; f < finger_count(tables[t]); ++f){
+                struct node_info n = {rng(), 0x7F000001, (uint16_t)(rng() | 1)};
+                if (rng() % 8 == 0){
+                    n.IP = 0; }
+                finger_set(tables[t], f, n);
+            }
+        }
+        for (int i = 0; i < BENCH_LOOKUPS; ++i){
+            targets[i] = rng(); }
+
+        int mismatch = 0;
+        for (int i = 0; i < BENCH_LOOKUPS; ++i){
+            const struct finger_table* ft = tables[i % BENCH_TABLES];
+            uint32_t dist = targets[i] - ft->self_id;
+            if (finger_search(ft->rel, ft->n, dist) != finger_search_scalar(ft->rel, ft->n, dist)){
+                ++mismatch; }
+        }
+
+        long s1, s2;
+        double scalar_ns = run(tables, targets, finger_search_scalar, &s1);
+        double simd_ns = run(tables, targets, finger_search, &s2);
+        printf("base %2u, %3d fingers: scalar %6.1f ns  %s %6.1f ns  (%.2fx)%s\n",
+                bases[b], finger_count(tables[0]), scalar_ns, finger_search_name(), simd_ns,
+                scalar_ns / simd_ns, (mismatch || s1 != s2) ? "  RESULTS DIFFER" : "");
+
+        for (int t = 0; t < BENCH_TABLES; ++t){
+            finger_table_destroy(tables[t]); }
+        if (mismatch){
+            free(targets);
+            return 1;
+        }
+    }
+    free(targets);
+    return 0;
+}
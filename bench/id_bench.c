@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "libdht.h"
+#include "idhash.h"
+
+/**
+ * names to ids, keys/s for get_id one at a time against get_ids in batches,
+ * with the SHA-1 versions this cpu runs and with ID_HASH_FAST. names are
+ * short keys like the examples use, plus a run of names too long for one block.
+ * every batched result is checked against get_id first
+ */
+
+#define BENCH_KEYS 4096
+#define BENCH_ROUNDS 200
+#define BENCH_LONG 80
+
+static char names[BENCH_KEYS][BENCH_LONG + 1];
+static const char* name_ptrs[BENCH_KEYS];
+static hash_type ids[BENCH_KEYS];
+static hash_type want[BENCH_KEYS];
+static volatile uint64_t sink;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static void make_names(size_t len)
+{
+    uint32_t x = 0x9E3779B9;
+    for (int i = 0; i < BENCH_KEYS; ++i){
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        int n = snprintf(names[i], sizeof(names[i]), "key-%08x-%d", x, i);
+        // pad to len, or leave the short key when len is 0
+        while ((size_t) n < len){
+            names[i][n] = (char)('a' + n % 26);
+            ++n;
+        }
+        names[i][n] = 0;
+        name_ptrs[i] = names[i];
+    }
+}
+
+static double bench_get_id(void)
+{
+    uint64_t s = 0;
+    uint64_t t0 = now_ns();
+    for (int r = 0; r < BENCH_ROUNDS; ++r){
+        for (int i = 0; i < BENCH_KEYS; ++i){
+            s += get_id(name_ptrs[i]); }
+    }
+    double secs = (double)(now_ns() - t0) / 1e9;
+    sink += s;
+    return (double) BENCH_ROUNDS * BENCH_KEYS / secs;
+}
+
+static double bench_many(void (*fn)(const char**, size_t, hash_type*))
+{
+    uint64_t t0 = now_ns();
+    for (int r = 0; r < BENCH_ROUNDS; ++r){
+        fn(name_ptrs, BENCH_KEYS, ids);
+        sink += ids[r & (BENCH_KEYS - 1)];
+    }
+    double secs = (double)(now_ns() - t0) / 1e9;
+    return (double) BENCH_ROUNDS * BENCH_KEYS / secs;
+}
+
+// every id get_ids gives matches get_id, in the current mode
+static int check(void)
+{
+    for (int i = 0; i < BENCH_KEYS; ++i){
+        want[i] = get_id(name_ptrs[i]); }
+    // odd sizes so batches end part full
+    for (size_t n = 1; n <= 19; n += 3){
+        memset(ids, 0, sizeof(ids));
+        get_ids(name_ptrs, n, ids);
+        for (size_t i = 0; i < n; ++i){
+            if (ids[i] != want[i]){
+                fprintf(stderr, "get_ids(%s) of %s: %08x, get_id %08x\n",
+                        get_ids_name(), name_ptrs[i], ids[i], want[i]);
+                return -1;
+            }
+        }
+    }
+    get_ids(name_ptrs, BENCH_KEYS, ids);
+    return memcmp(ids, want, sizeof(ids)) == 0 ? 0 : -1;
+}
+
+static int run(const char* label, size_t len)
+{
+    make_names(len);
+    set_id_hash(ID_HASH_SHA1);
+    if (check() < 0){
+        return -1; }
+    double one = bench_get_id();
+    double scalar = bench_many(idhash_sha1_many_scalar);
+    double many = bench_many(get_ids);
+    printf("%-6s get_id          %10.0f keys/s\n", label, one);
+    printf("%-6s get_ids scalar  %10.0f keys/s  %4.2fx\n", label, scalar, scalar / one);
+    printf("%-6s get_ids %-7s %10.0f keys/s  %4.2fx\n", label, get_ids_name(), many, many / one);
+
+    set_id_hash(ID_HASH_FAST);
+    if (check() < 0){
+        return -1; }
+    double fast = bench_many(get_ids);
+    printf("%-6s get_ids fast    %10.0f keys/s  %4.2fx\n", label, fast, fast / one);
+    set_id_hash(ID_HASH_SHA1);
+    return 0;
+}
+
+int main(void)
+{
+    if (run("short", 0) < 0 || run("long", BENCH_LONG) < 0){
+        fprintf(stderr, "get_ids and get_id disagree\n");
+        return 1;
+    }
+    return 0;
+}
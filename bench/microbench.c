@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <event2/buffer.h>
+
+#include "libdht.h"
+#include "node.h"
+#include "netio.h"
+#include "finger.h"
+#include "peer.h"
+#include "proto.h"
+#include "logging.h"
+
+/**
+ * the functions every request goes through, timed one at a time (make microbench).
+ * each is run with doubling op counts until a run takes MB_MIN_RUN_NS, which
+ * is the warmup, then MB_REPS more times at that count. one json line per
+ * function goes to stdout:
+ *   {"name", "ops" per rep, "reps", "warmup_ops", "ns_per_op" (median),
+ *    "ns_per_op_min", "allocs_per_op"}
+ * allocs are malloc/calloc/realloc calls, counted with glibc only (-1 elsewhere).
+ * args are name prefixes to run just those
+ */
+
+#define MB_MIN_RUN_NS 50000000ull
+#define MB_REPS 7
+// inputs are cycled through, powers of 2
+#define MB_KEYS 1024
+#define MB_HEADERS 1024
+
+//
+// allocation counting
+//
+
+static unsigned long mb_allocs = 0;
+
+#ifdef __GLIBC__
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* p, size_t size);
+
+void* malloc(size_t size)
+{
+    ++mb_allocs;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    ++mb_allocs;
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size)
+{
+    ++mb_allocs;
+    return __libc_realloc(p, size);
+}
+#define MB_COUNTS_ALLOCS 1
+#else
+#define MB_COUNTS_ALLOCS 0
+#endif // __GLIBC__
+
+//
+// inputs
+//
+
+static uint32_t rng_state = 0x9E3779B9;
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static volatile uint64_t mb_sink; // keeps results alive
+
+static char mb_names[MB_KEYS][24];
+static const char* mb_name_ptrs[MB_KEYS];
+static hash_type mb_ids[MB_KEYS][3];
+static struct node_self* mb_node;
+static struct net_server* mb_srv;
+static struct evbuffer* mb_headers;
+static char mb_header_block[MB_HEADERS * MSG_HEADER_BYTES + 1];
+static size_t mb_header_block_len;
+static int mb_conn;
+static uint16_t mb_port; // the node listens on any free port
+static struct evbuffer* mb_out;
+
+static int mb_setup(void)
+{
+    for (int i = 0; i < MB_KEYS; ++i){
+        snprintf(mb_names[i], sizeof(mb_names[i]), "key-%08x", rng());
+        mb_name_ptrs[i] = mb_names[i];
+        for (int j = 0; j < 3; ++j){
+            mb_ids[i][j] = rng(); }
+    }
+
+    // a node with full routing tables, never started
+    mb_node = node_create(0, "microbench");
+    if (!mb_node){
+        return -1; }
+    struct finger_table* ft = node_get_fingers(mb_node);
+    struct peer_table* pt = node_get_peers(mb_node);
+    for (int f = 0; f < finger_count(ft); ++f){
+        struct node_info n = {finger_start(ft, f) + rng() % 1024, 0x7F000001, (uint16_t)(20000 + f)};
+        finger_set(ft, f, n);
+        peer_reply_received(pt, n.IP, n.port, 1000 + rng() % 50000);
+    }
+    hash_type self_id = get_id("microbench");
+    struct node_info succs[NUM_OF_SUCCS];
+    for (int i = 0; i < NUM_OF_SUCCS; ++i){
+        succs[i] = (struct node_info){self_id + (i + 1) * 4096, 0x7F000001, (uint16_t)(21000 + i)};
+        peer_reply_received(pt, succs[i].IP, succs[i].port, 1000 + rng() % 50000);
+    }
+    node_adopt_succ_list(mb_node, succs[0], succs + 1);
+
+    mb_header_block_len = 0;
+    for (int i = 0; i < MB_HEADERS; ++i){
+        mb_header_block_len += sprintf(mb_header_block + mb_header_block_len, MSG_FMT,
+                MSG_T_SUCC_REQ, rng() % 4096);
+    }
+    mb_headers = evbuffer_new();
+
+    // an outgoing connection to ourselves, activated now so sends only frame
+    mb_srv = node_get_net(mb_node);
+    mb_port = net_server_get_port(mb_srv);
+    if (!mb_port){
+        return -1; }
+    mb_conn = net_connection_create(mb_srv, 0x7F000001, mb_port);
+    if (!mb_headers || mb_conn < 0 || net_connection_activate(mb_srv, mb_conn) < 0){
+        return -1; }
+    mb_out = net_connection_get_write_buffer(mb_srv, mb_conn);
+    // and half the slots taken, so finding a free one has to look
+    for (int i = 1; i < MAX_OPEN_CONNECTIONS / 2; ++i){
+        if (net_connection_create(mb_srv, 0x7F000001, mb_port) < 0){
+            return -1; }
+    }
+    return 0;
+}
+
+//
+// cases, each does n ops
+//
+
+static void mb_get_id(long n)
+{
+    uint64_t s = 0;
+    for (long i = 0; i < n; ++i){
+        s += get_id(mb_names[i & (MB_KEYS - 1)]); }
+    mb_sink += s;
+}
+
+// an op is one key, hashed MB_ID_BATCH at a time
+#define MB_ID_BATCH 64
+
+static void mb_get_ids(long n)
+{
+    hash_type ids[MB_ID_BATCH];
+    uint64_t s = 0;
+    for (long i = 0; i < n; i += MB_ID_BATCH){
+        long k = n - i < MB_ID_BATCH ? n - i : MB_ID_BATCH;
+        get_ids(mb_name_ptrs + (i & (MB_KEYS - 1)), (size_t) k, ids);
+        s += ids[0];
+    }
+    mb_sink += s;
+}
+
+static void mb_id_in_range(long n)
+{
+    uint64_t s = 0;
+    for (long i = 0; i < n; ++i){
+        const hash_type* t = mb_ids[i & (MB_KEYS - 1)];
+        s += node_id_in_range(t[0], t[1], t[2]);
+    }
+    mb_sink += s;
+}
+
+static void mb_closest_preceding(long n)
+{
+    uint64_t s = 0;
+    for (long i = 0; i < n; ++i){
+        s += node_closest_preceding_node(mb_node, mb_ids[i & (MB_KEYS - 1)][0]).port; }
+    mb_sink += s;
+}
+
+// refilling the buffer is counted too, one copy per MB_HEADERS parses
+static void mb_parse_header(long n)
+{
+    struct node_message msg;
+    uint64_t s = 0;
+    for (long i = 0; i < n; ++i){
+        if (evbuffer_get_length(mb_headers) < MSG_HEADER_BYTES){
+            evbuffer_add(mb_headers, mb_header_block, mb_header_block_len); }
+        node_parse_message_header(&msg, mb_headers);
+        s += msg.len;
+    }
+    mb_sink += s;
+}
+
+// sends to a connection that's already active, draining what's written every MB_HEADERS
+static void mb_send_message(long n)
+{
+    char content[] = "0123456789abcdef";
+    struct node_message msg = {{0, 0, 0}, {0, 0, 0}, MSG_T_NODE_MSG, sizeof(content) - 1, content};
+    for (long i = 0; i < n; ++i){
+        node_send_message(mb_node, &msg, mb_conn);
+        if ((i & (MB_HEADERS - 1)) == MB_HEADERS - 1){
+            evbuffer_drain(mb_out, evbuffer_get_length(mb_out)); }
+    }
+    evbuffer_drain(mb_out, evbuffer_get_length(mb_out));
+}
+
+static void mb_empty_slot(long n)
+{
+    uint64_t s = 0;
+    for (long i = 0; i < n; ++i){
+        s += net_empty_connection_slot(mb_srv); }
+    mb_sink += s;
+}
+
+//
+// harness
+//
+
+struct mb_case{
+    const char* name;
+    void (*run)(long n);
+};
+
+static uint64_t mb_time(const struct mb_case* c, long n)
+{
+    uint64_t start = now_ns();
+    c->run(n);
+    return now_ns() - start;
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+static void mb_measure(const struct mb_case* c)
+{
+    long n = 16;
+    long warmup = 0;
+    for (;;){
+        uint64_t t = mb_time(c, n);
+        warmup += n;
+        if (t >= MB_MIN_RUN_NS){
+            break; }
+        n *= 2;
+    }
+
+    double ns[MB_REPS];
+    unsigned long allocs = 0;
+    for (int r = 0; r < MB_REPS; ++r){
+        unsigned long a0 = mb_allocs;
+        ns[r] = (double) mb_time(c, n) / n;
+        allocs += mb_allocs - a0;
+    }
+    qsort(ns, MB_REPS, sizeof(double), cmp_double);
+    printf("{\"name\":\"%s\",\"ops\":%ld,\"reps\":%d,\"warmup_ops\":%ld,"
+            "\"ns_per_op\":%.2f,\"ns_per_op_min\":%.2f,\"allocs_per_op\":%.3f}\n",
+            c->name, n, MB_REPS, warmup, ns[MB_REPS / 2], ns[0],
+            MB_COUNTS_ALLOCS ? (double) allocs / ((double) n * MB_REPS) : -1.0);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct mb_case cases[] = {
+        {"get_id", mb_get_id},
+        {"get_ids", mb_get_ids},
+        {"node_id_in_range", mb_id_in_range},
+        {"node_closest_preceding_node", mb_closest_preceding},
+        {"node_parse_message_header", mb_parse_header},
+        {"node_send_message", mb_send_message},
+        {"net_empty_connection_slot", mb_empty_slot},
+    };
+
+    log_set_level(LOG_SYS_COUNT, ERROR);
+    if (mb_setup() < 0){
+        fprintf(stderr, "microbench setup failed\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i){
+        int run = argc < 2;
+        for (int a = 1; a < argc; ++a){
+            if (strncmp(cases[i].name, argv[a], strlen(argv[a])) == 0){
+                run = 1; }
+        }
+        if (run){
+            mb_measure(&(cases[i])); }
+    }
+
+    net_connection_close(mb_srv, mb_conn);
+    evbuffer_free(mb_headers);
+    node_destroy(mb_node);
+    return 0;
+}
@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "libdhtnet.h"
+
+/**
+ * the two connection backends against each other over loopback, an echo
+ * server and a client on their own event loops both using the backend:
+ *   connect:  a new connection for every request, like lookups between nodes
+ *   pingpong: requests back to back over connections kept open
+ * prints requests/s, latency percentiles and cpu time per request. both listen
+ * on ports the kernel picks, so the TIME_WAIT sockets a run leaves behind
+ * don't stop the next one
+ */
+
+#define BENCH_MSG 32
+// stays under NET_MAX_OUTBOUND so nothing queues in the client
+#define BENCH_CONC 48
+#define BENCH_CONNECT_REQS 20000
+#define BENCH_PINGPONG_REQS 200000
+
+struct bench{
+    struct net_server* srv;
+    struct net_server* cli;
+    uint16_t port; // srv's
+    int pingpong;
+    int total;
+    int started;
+    int done;
+    int failed;
+    uint64_t* lat_ns;
+    uint64_t sent_at[256]; // by client connection
+    volatile int stop;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t cpu_us(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ull +
+        (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+//
+// server: echo every BENCH_MSG bytes
+//
+
+static void srv_read_cb(int conn, void* arg)
+{
+    struct bench* b = (struct bench*) arg;
+    struct evbuffer* in = net_connection_get_read_buffer(b->srv, conn);
+    struct evbuffer* out = net_connection_get_write_buffer(b->srv, conn);
+    char msg[BENCH_MSG];
+    while (evbuffer_get_length(in) >= BENCH_MSG){
+        evbuffer_remove(in, msg, BENCH_MSG);
+        evbuffer_add(out, msg, BENCH_MSG);
+    }
+}
+
+static void srv_event_cb(int conn, short type, void* arg)
+{
+    struct bench* b = (struct bench*) arg;
+    if (type & (BEV_EVENT_ERROR|BEV_EVENT_EOF|BEV_EVENT_TIMEOUT)){
+        net_connection_close(b->srv, conn); }
+}
+
+static void srv_incoming_cb(int conn, short type, void* arg)
+{
+    struct bench* b = (struct bench*) arg;
+    net_connection_set_cb_arg(b->srv, conn, b);
+    net_connection_set_read_cb(b->srv, conn, srv_read_cb);
+    net_connection_set_event_cb(b->srv, conn, srv_event_cb);
+    net_connection_set_read_watermark(b->srv, conn, BENCH_MSG);
+}
+
+static void srv_tick_cb(evutil_socket_t fd, short what, void* arg)
+{
+    struct bench* b = (struct bench*) arg;
+    if (b->stop){
+        event_base_loopbreak(net_get_base(b->srv)); }
+}
+
+static void* srv_thread(void* arg)
+{
+    struct bench* b = (struct bench*) arg;
+    struct timeval tick = {0, 10000};
+    struct event* ev = event_new(net_get_base(b->srv), -1, EV_PERSIST, srv_tick_cb, b);
+    event_add(ev, &tick);
+    net_server_run(b->srv);
+    event_free(ev);
+    return NULL;
+}
+
+//
+// client
+//
+
+static void cli_send(struct bench* b, int conn)
+{
+    char msg[BENCH_MSG];
+    memset(msg, 'x', sizeof(msg));
+    b->sent_at[conn] = now_ns();
+    ++b->started;
+    evbuffer_add(net_connection_get_write_buffer(b->cli, conn), msg, BENCH_MSG);
+}
+
+static void cli_start(struct bench* b);
+
+static void cli_finish(struct bench* b, int conn, short ok)
+{
+    if (ok){
+        b->lat_ns[b->done] = now_ns() - b->sent_at[conn]; }
+    ++b->done;
+    if (!ok){
+        ++b->failed; }
+    if (!b->pingpong || !ok){
+        net_connection_close(b->cli, conn);
+        if (b->started < b->total){
+            cli_start(b); }
+    }else if (b->started < b->total){
+        cli_send(b, conn);
+    }else{
+        net_connection_close(b->cli, conn);
+    }
+    if (b->done == b->total){
+        event_base_loopbreak(net_get_base(b->cli)); }
+}
+
+static void cli_read_cb(int conn, void* arg)
+{
+    struct bench* b = (struct bench*) arg;
+    struct evbuffer* in = net_connection_get_read_buffer(b->cli, conn);
+    if (evbuffer_get_length(in) < BENCH_MSG){
+        return; }
+    evbuffer_drain(in, BENCH_MSG);
+    cli_finish(b, conn, 1);
+}
+
+static void cli_event_cb(int conn, short type, void* arg)
+{
+    struct bench* b = (struct bench*) arg;
+    if (type & (BEV_EVENT_ERROR|BEV_EVENT_EOF|BEV_EVENT_TIMEOUT)){
+        cli_finish(b, conn, 0); }
+}
+
+static void cli_start(struct bench* b)
+{
+    int conn = net_connection_create(b->cli, 0x7F000001, b->port);
+    if (conn < 0){
+        fprintf(stderr, "no client connection\n");
+        exit(1);
+    }
+    net_connection_set_cb_arg(b->cli, conn, b);
+    net_connection_set_read_cb(b->cli, conn, cli_read_cb);
+    net_connection_set_event_cb(b->cli, conn, cli_event_cb);
+    net_connection_set_read_watermark(b->cli, conn, BENCH_MSG);
+    cli_send(b, conn);
+    net_connection_activate(b->cli, conn);
+}
+
+static void cli_kick_cb(evutil_socket_t fd, short what, void* arg)
+{
+    struct bench* b = (struct bench*) arg;
+    for (int i = 0; i < BENCH_CONC && b->started < b->total; ++i){
+        cli_start(b); }
+}
+
+static int run(int backend, int pingpong, int total)
+{
+    struct bench b;
+    memset(&b, 0, sizeof(b));
+    b.pingpong = pingpong;
+    b.total = total;
+    b.lat_ns = malloc(sizeof(uint64_t) * total);
+    b.srv = net_server_create_backend(0, srv_incoming_cb, &b, backend);
+    b.cli = net_server_create_backend(0, NULL, NULL, backend);
+    if (b.srv){
+        b.port = net_server_get_port(b.srv); }
+    if (!b.lat_ns || !b.srv || !b.cli || !b.port){
+        fprintf(stderr, "backend %d not available\n", backend);
+        if (b.cli){
+            net_server_destroy(b.cli); }
+        if (b.srv){
+            net_server_destroy(b.srv); }
+        free(b.lat_ns);
+        return -1;
+    }
+
+    pthread_t thr;
+    pthread_create(&thr, NULL, srv_thread, &b);
+
+    struct timeval now = {0, 0};
+    event_base_once(net_get_base(b.cli), -1, EV_TIMEOUT, cli_kick_cb, &b, &now);
+    uint64_t cpu0 = cpu_us();
+    uint64_t t0 = now_ns();
+    net_server_run(b.cli);
+    double secs = (double)(now_ns() - t0) / 1e9;
+    uint64_t cpu = cpu_us() - cpu0;
+
+    b.stop = 1;
+    pthread_join(thr, NULL);
+
+    int ok = b.done - b.failed;
+    qsort(b.lat_ns, ok, sizeof(uint64_t), cmp_u64);
+    printf("%-8s %-8s %8.0f req/s  p50 %7.1f us  p99 %7.1f us  p99.9 %7.1f us  cpu %5.1f us/req%s\n",
+            backend == NET_BACKEND_URING ? "io_uring" : "libevent", pingpong ? "pingpong" : "connect",
+            total / secs, b.lat_ns[ok / 2] / 1e3, b.lat_ns[(ok * 99) / 100] / 1e3,
+            b.lat_ns[(ok * 999) / 1000] / 1e3, (double) cpu / total,
+            b.failed ? "  (some failed)" : "");
+
+    net_server_destroy(b.cli);
+    net_server_destroy(b.srv);
+    free(b.lat_ns);
+    return b.failed ? -1 : 0;
+}
+
+int main(void)
+{
+    static const int backends[] = {NET_BACKEND_LIBEVENT, NET_BACKEND_URING};
+    int rc = 0;
+    for (int pp = 0; pp < 2; ++pp){
+        for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i){
+            if (run(backends[i], pp, pp ? BENCH_PINGPONG_REQS : BENCH_CONNECT_REQS) < 0){
+                rc = 1; }
+        }
+    }
+    return rc;
+}
@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <event2/event.h>
+
+#include "libdht.h"
+#include "node.h"
+#include "logging.h"
+
+/**
+ * quorum writes and reads on a ring of nodes in this process, each on its own
+ * event loop with a store of its own. the nodes other than the one the
+ * workload runs on stall their loops now and then, like replicas with a slow
+ * disk, too often for the client to pick replicas round them by their rtt.
+ * requests are started at a steady rate whether or not earlier ones are done,
+ * so the ones a stall holds up all count. reads are run with hedging off and
+ * on to see what the stalls do to their tail latency. every value read is
+ * checked
+ */
+
+#define BENCH_PORT 17411
+#define BENCH_NODES 6
+#define BENCH_KEYS 20000
+#define BENCH_VALUE 100
+// requests started every msec
+#define BENCH_RATE 10
+// each node blocks for BENCH_STALL_MS in one of every BENCH_STALL_ODDS BENCH_STALL_EVERY_MS
+#define BENCH_STALL_MS 20
+#define BENCH_STALL_EVERY_MS 50
+#define BENCH_STALL_ODDS 10
+// ring settles for this long before the first write, stabilizing every BENCH_STABILIZE_MS
+#define BENCH_SETTLE_MS 2000
+#define BENCH_STABILIZE_MS 100
+
+struct bench_node{
+    struct node_self* node;
+    char dir[1024];
+    char name[32];
+    int i;
+    unsigned int seed;
+    struct event* stabilize_evt;
+    int stabilized;
+    volatile int joined;
+    pthread_t thread;
+};
+
+static struct bench_node nodes[BENCH_NODES];
+static struct node_self* client; // the last node, runs the workload
+
+static int phase; // 0 writes, 1 reads unhedged, 2 reads hedged, 3 deletes, 4 reads of deleted
+static int started;
+static int finished;
+static int failed;
+static uint64_t started_ns[BENCH_KEYS];
+static uint64_t lat_ns[BENCH_KEYS];
+static uint64_t phase_ns;
+static struct event* tick_evt;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static void make_key(int i, char* key)
+{
+    sprintf(key, "qkey-%06d", i);
+}
+
+static void make_value(int i, char* val)
+{
+    for (int j = 0; j < BENCH_VALUE; ++j){
+        val[j] = (char)('a' + (i * 7 + j) % 26); }
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+// deletes only touch the first quarter of the keys
+static int phase_keys(void)
+{
+    return phase >= 3 ? BENCH_KEYS / 4 : BENCH_KEYS;
+}
+
+static void remove_dir(const char* dir)
+{
+    DIR* d = opendir(dir);
+    if (!d){
+        return; }
+    struct dirent* de;
+    char path[2048];
+    while ((de = readdir(d))){
+        if (de->d_name[0] == '.'){
+            continue; }
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+// the other loops are still running, so this leaves without tearing them down
+static void bench_exit(int rc)
+{
+    for (int i = 0; i < BENCH_NODES; ++i){
+        remove_dir(nodes[i].dir); }
+    if (rc){
+        fprintf(stderr, "quorum bench failed\n"); }
+    fflush(stdout);
+    _exit(rc);
+}
+
+static void start_phase(int p);
+
+static void print_phase(void);
+
+static void op_done(int i, short ok)
+{
+    lat_ns[i] = now_ns() - started_ns[i];
+    if (!ok){
+        ++failed; }
+    if (++finished < phase_keys()){
+        return; }
+    print_phase();
+    if (failed){
+        bench_exit(1); }
+    if (phase == 4){
+        bench_exit(0); }
+    start_phase(phase + 1);
+}
+
+static void put_done(short status, void* arg)
+{
+    op_done((int)(intptr_t) arg, status == 0);
+}
+
+static void get_done(short status, const char* val, size_t len, void* arg)
+{
+    int i = (int)(intptr_t) arg;
+    char want[BENCH_VALUE];
+    make_value(i, want);
+    if (phase == 4){
+        op_done(i, status == 1);
+    }else{
+        op_done(i, status == 0 && len == BENCH_VALUE && memcmp(val, want, BENCH_VALUE) == 0);
+    }
+}
+
+static void print_phase(void)
+{
+    static const char* names[] = {"put", "get, no hedging", "get, hedged at p95", "delete", "get deleted"};
+    int n = phase_keys();
+    double secs = (double)(now_ns() - phase_ns) / 1e9;
+    qsort(lat_ns, (size_t) n, sizeof(uint64_t), cmp_u64);
+    printf("%-20s %8.0f ops/s  p50 %7.2f ms  p99 %7.2f ms  p99.9 %7.2f ms  %d failed\n", names[phase],
+            n / secs, lat_ns[n / 2] / 1e6, lat_ns[n * 99 / 100] / 1e6, lat_ns[n * 999 / 1000] / 1e6, failed);
+}
+
+static void start_phase(int p)
+{
+    phase = p;
+    started = finished = failed = 0;
+    node_set_read_hedge(client, phase == 1 ? 0 : 95);
+    phase_ns = now_ns();
+}
+
+static void start_one(void)
+{
+    int i = started++;
+    char key[32], val[BENCH_VALUE];
+    make_key(i, key);
+    started_ns[i] = now_ns();
+    int rc;
+    if (phase == 0){
+        make_value(i, val);
+        rc = node_quorum_put(client, key, val, BENCH_VALUE, put_done, (void*)(intptr_t) i);
+    }else if (phase == 3){
+        rc = node_quorum_delete(client, key, put_done, (void*)(intptr_t) i);
+    }else{
+        rc = node_quorum_get(client, key, get_done, (void*)(intptr_t) i);
+    }
+    if (rc < 0){
+        op_done(i, 0); }
+}
+
+static void tick(evutil_socket_t fd, short what, void* arg)
+{
+    for (int n = 0; n < BENCH_RATE && started < phase_keys(); ++n){
+        start_one(); }
+}
+
+static void start_workload(evutil_socket_t fd, short what, void* arg)
+{
+    printf("%d nodes, n 3 r 2 w 2, servers stall %d ms in 1 of %d ticks of %d ms\n", BENCH_NODES,
+            BENCH_STALL_MS, BENCH_STALL_ODDS, BENCH_STALL_EVERY_MS);
+    start_phase(0);
+    struct timeval tv = {0, 1000};
+    event_add(tick_evt, &tv);
+}
+
+static void stall(evutil_socket_t fd, short what, void* arg)
+{
+    struct bench_node* bn = (struct bench_node*) arg;
+    if (rand_r(&(bn->seed)) % BENCH_STALL_ODDS == 0){
+        usleep(BENCH_STALL_MS * 1000); }
+}
+
+// the ring is stabilized often while it settles, so successor lists are whole before the first write
+static void stabilize(evutil_socket_t fd, short what, void* arg)
+{
+    struct bench_node* bn = (struct bench_node*) arg;
+    node_network_stabalize(bn->node);
+    if (++bn->stabilized * BENCH_STABILIZE_MS >= BENCH_SETTLE_MS){
+        event_del(bn->stabilize_evt); }
+}
+
+static void joined(void* arg)
+{
+    struct bench_node* bn = (struct bench_node*) arg;
+    struct event_base* base = net_get_base(node_get_net(bn->node));
+    struct timeval stab_tv = {0, BENCH_STABILIZE_MS * 1000};
+    bn->stabilize_evt = event_new(base, -1, EV_PERSIST, stabilize, bn);
+    event_add(bn->stabilize_evt, &stab_tv);
+    if (bn->node != client){
+        struct timeval tv = {0, BENCH_STALL_EVERY_MS * 1000};
+        event_add(event_new(base, -1, EV_PERSIST, stall, bn), &tv);
+    }else{
+        struct timeval tv = {BENCH_SETTLE_MS / 1000, (BENCH_SETTLE_MS % 1000) * 1000};
+        event_add(evtimer_new(base, start_workload, NULL), &tv);
+        tick_evt = event_new(base, -1, EV_PERSIST, tick, NULL);
+    }
+    bn->joined = 1;
+}
+
+static void* run_node(void* arg)
+{
+    struct bench_node* bn = (struct bench_node*) arg;
+    if (bn->i == 0){
+        node_network_create(bn->node, joined, bn);
+    }else{
+        struct node_info seed = {0, 0x7F000001, BENCH_PORT};
+        node_network_join(bn->node, seed, joined, bn);
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    log_set_level(LOG_SYS_COUNT, ERROR);
+    for (int i = 0; i < BENCH_NODES; ++i){
+        struct bench_node* bn = &(nodes[i]);
+        bn->i = i;
+        bn->seed = (unsigned int) i * 2654435761u;
+        snprintf(bn->name, sizeof(bn->name), "quorum-bench-%d", i);
+        snprintf(bn->dir, sizeof(bn->dir), "/tmp/quorum_bench.XXXXXX");
+        if (!mkdtemp(bn->dir)){
+            fprintf(stderr, "failed to make %s\n", bn->dir);
+            bench_exit(1);
+        }
+        bn->node = node_create(BENCH_PORT + i, bn->name);
+        if (!bn->node || node_set_store(bn->node, bn->dir) < 0){
+            bench_exit(1); }
+    }
+    client = nodes[BENCH_NODES - 1].node;
+    // one at a time, each joins once the ring before it is up
+    for (int i = 0; i < BENCH_NODES; ++i){
+        pthread_create(&(nodes[i].thread), NULL, run_node, &(nodes[i]));
+        for (int t = 0; !nodes[i].joined; ++t){
+            if (t > 500){
+                fprintf(stderr, "node %d didn't join\n", i);
+                bench_exit(1);
+            }
+            usleep(10000);
+        }
+    }
+    // the client's loop exits the process once the workload is done
+    sleep(120);
+    fprintf(stderr, "workload didn't finish\n");
+    bench_exit(1);
+    return 1;
+}
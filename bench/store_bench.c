@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "store.h"
+#include "logging.h"
+
+/**
+ * the on-disk store: puts and gets per second, then how long opening takes
+ * from a checkpoint, with a tail appended after it, from a full scan and with
+ * a torn record at the end, then compaction of the half that was overwritten.
+ * every record is checked after each reopen. STORE_BENCH_DIR says where,
+ * STORE_BENCH_KEYS how many
+ */
+
+#define BENCH_KEYS 1000000
+#define BENCH_VALUE 200
+#define BENCH_TAIL 50000
+
+static long n_keys = BENCH_KEYS;
+static char dir[1024];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static size_t make_key(long i, char* key)
+{
+    return (size_t) sprintf(key, "key-%08ld", i);
+}
+
+// generation gen of key i's value
+static void make_value(long i, int gen, char* val)
+{
+    for (int j = 0; j < BENCH_VALUE; ++j){
+        val[j] = (char)('a' + (i * 7 + gen * 13 + j) % 26); }
+}
+
+static int put_all(struct store* st, long from, long to, int gen)
+{
+    char key[32], val[BENCH_VALUE];
+    for (long i = from; i < to; ++i){
+        make_value(i, gen, val);
+        if (store_put(st, key, make_key(i, key), val, BENCH_VALUE) < 0){
+            return -1; }
+    }
+    return 0;
+}
+
+// the first half was overwritten once, and the first tail keys again after that
+static int gen_of(long i, long tail)
+{
+    return i < tail ? 2 : (i < n_keys / 2 ? 1 : 0);
+}
+
+static int check_all(struct store* st, long tail)
+{
+    char key[32], val[BENCH_VALUE], want[BENCH_VALUE];
+    for (long i = 0; i < n_keys; ++i){
+        size_t len = 0;
+        make_value(i, gen_of(i, tail), want);
+        if (store_get(st, key, make_key(i, key), val, sizeof(val), &len, NULL) < 0 ||
+                len != BENCH_VALUE || memcmp(val, want, BENCH_VALUE) != 0){
+            fprintf(stderr, "%s is wrong\n", key);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static struct store* reopen(struct store* st, const char* what)
+{
+    if (st){
+        store_close(st); }
+    uint64_t t0 = now_ns();
+    st = store_open(dir);
+    double ms = (double)(now_ns() - t0) / 1e6;
+    struct store_stats stats;
+    if (st){
+        store_get_stats(st, &stats);
+        printf("open %-22s %8.1f ms  %ld keys  %d segments  %llu MB\n", what, ms, (long) stats.keys,
+                stats.segments, (unsigned long long)(stats.bytes >> 20));
+    }
+    return st;
+}
+
+static void remove_dir(void)
+{
+    DIR* d = opendir(dir);
+    if (!d){
+        return; }
+    struct dirent* de;
+    char path[2048];
+    while ((de = readdir(d))){
+        if (de->d_name[0] == '.'){
+            continue; }
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+// the end of the newest segment, as a crash mid write would leave it
+static void tear_tail(void)
+{
+    DIR* d = opendir(dir);
+    char last[256] = "";
+    struct dirent* de;
+    while ((de = readdir(d))){
+        if (strncmp(de->d_name, "seg-", 4) == 0 && strcmp(de->d_name, last) > 0){
+            snprintf(last, sizeof(last), "%s", de->d_name); }
+    }
+    closedir(d);
+    char path[2048];
+    snprintf(path, sizeof(path), "%s/%s", dir, last);
+    FILE* f = fopen(path, "ab");
+    const char junk[40] = {0x11, 0x22, 0x33, 0x44, 8, 0};
+    fwrite(junk, 1, sizeof(junk), f);
+    fclose(f);
+}
+
+static int run(void)
+{
+    struct store* st = reopen(NULL, "empty");
+    if (!st){
+        return -1; }
+
+    uint64_t t0 = now_ns();
+    if (put_all(st, 0, n_keys, 0) < 0){
+        return -1; }
+    double secs = (double)(now_ns() - t0) / 1e9;
+    printf("put   %10.0f records/s  (%d byte values)\n", n_keys / secs, BENCH_VALUE);
+
+    // half of it overwritten, so there is something to compact
+    if (put_all(st, 0, n_keys / 2, 1) < 0){
+        return -1; }
+
+    char key[32], val[BENCH_VALUE];
+    uint32_t x = 0x9E3779B9;
+    t0 = now_ns();
+    for (long i = 0; i < n_keys; ++i){
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        if (store_get(st, key, make_key(x % n_keys, key), val, sizeof(val), NULL, NULL) < 0){
+            return -1; }
+    }
+    secs = (double)(now_ns() - t0) / 1e9;
+    printf("get   %10.0f records/s\n", n_keys / secs);
+
+    if (!(st = reopen(st, "from checkpoint")) || check_all(st, 0) < 0){
+        return -1; }
+    store_close(st);
+
+    // a child appends after the checkpoint and dies without closing, so only that tail is scanned
+    pid_t pid = fork();
+    if (pid == 0){
+        st = store_open(dir);
+        _exit(st && put_all(st, 0, BENCH_TAIL, 2) == 0 ? 0 : 1);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+        return -1; }
+    if (!(st = reopen(NULL, "checkpoint + tail")) || check_all(st, BENCH_TAIL) < 0){
+        return -1; }
+    store_close(st);
+
+    char path[2048];
+    snprintf(path, sizeof(path), "%s/index.ckpt", dir);
+    unlink(path);
+    if (!(st = reopen(NULL, "full scan")) || check_all(st, BENCH_TAIL) < 0){
+        return -1; }
+    store_close(st);
+
+    tear_tail();
+    if (!(st = reopen(NULL, "torn tail")) || check_all(st, BENCH_TAIL) < 0){
+        return -1; }
+
+    struct store_stats before, after;
+    store_get_stats(st, &before);
+    t0 = now_ns();
+    int n = 0;
+    while (store_compact(st) == 1){
+        ++n; }
+    secs = (double)(now_ns() - t0) / 1e9;
+    store_get_stats(st, &after);
+    // the background thread compacts too, so some of it may be done already
+    printf("compact %d segments in %.2f s, %llu MB -> %llu MB, %llu MB live\n", n, secs,
+            (unsigned long long)(before.bytes >> 20), (unsigned long long)(after.bytes >> 20),
+            (unsigned long long)(after.live_bytes >> 20));
+
+    if (!(st = reopen(st, "after compaction")) || check_all(st, BENCH_TAIL) < 0){
+        return -1; }
+    store_close(st);
+    return 0;
+}
+
+int main(void)
+{
+    log_set_level(LOG_SYS_COUNT, WARN);
+    if (getenv("STORE_BENCH_KEYS")){
+        n_keys = strtol(getenv("STORE_BENCH_KEYS"), NULL, 10); }
+    if (n_keys < 4 * BENCH_TAIL){
+        n_keys = 4 * BENCH_TAIL; }
+    snprintf(dir, sizeof(dir), "%s/store_bench.XXXXXX", getenv("STORE_BENCH_DIR") ? getenv("STORE_BENCH_DIR") : "/tmp");
+    if (!mkdtemp(dir)){
+        fprintf(stderr, "failed to make %s\n", dir);
+        return 1;
+    }
+    int rc = run();
+    remove_dir();
+    if (rc < 0){
+        fprintf(stderr, "store bench failed\n");
+        return 1;
+    }
+    return 0;
+}
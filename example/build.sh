@@ -1,2 +1,2 @@
-gcc -o textsend -Wall textsend.c -g -ldht -levent -lpthread -lssl
+gcc -o textsend -Wall textsend.c -g -ldht -levent -lpthread -lssl -lcrypto -lm
 #gcc -Wall textsend.c -g -L/home/michael/Documents/uni/fyp-dht/build/ -ldht -levent -lpthread -lssl
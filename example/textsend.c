@@ -13,6 +13,7 @@
 
 #include "libdht.h"
 #include "proto.h"
+#include "logging.h"
 
 struct node_self *node;
 struct net_server* net;
@@ -43,8 +44,13 @@ void out_conn_event(int connection, short type, void *arg)
 void found_node(struct node_info ninfo, void* arg, short hops)
 {
     //printf("found node?\n");
-    printf("found node in %d hops\n", hops);
     char *msg = (char*) arg;
+    if (hops < 0){
+        printf("lookup failed\n");
+        free(msg);
+        return;
+    }
+    printf("found node in %d hops\n", hops);
     //printf("sending [%lu] %s\n", strlen(msg), msg);
     struct node_message nmsg;
     nmsg.to = ninfo;
@@ -58,21 +64,44 @@ void found_node(struct node_info ninfo, void* arg, short hops)
 
 }
 
+void trace_path(hash_type id, const struct node_trace* trace, short found, void* arg)
+{
+    printf("lookup of %08X %s, path:\n", id, found ? "found" : "failed");
+    for (int i = 0; i < trace->n_hops; ++i){
+        const struct node_trace_hop* hop = &(trace->hops[i]);
+        printf("  %08X queue %uus proc %uus wait %uus\n", hop->id, hop->queue_us, hop->proc_us, hop->wait_us);
+    }
+}
+
 void *in_thread(void *arg)
 {
     char name[256];
     while (running){
         printf("enter name\n");
         char *msg = malloc(sizeof(char) * 1024);
-        while (!fgets(name, 256, stdin));
+        // stdin closed, stop asking rather than spin where cancelling can't reach
+        if (!fgets(name, 256, stdin)){
+            free(msg);
+            break;
+        }
         printf("enter message\n");
-        while (!fgets(msg, 1024, stdin));
+        if (!fgets(msg, 1024, stdin)){
+            free(msg);
+            break;
+        }
         //printf("sending %s\n", msg);
         node_find_successor(node, get_id(name), found_node, (void*)msg);
     }
     pthread_exit(NULL);
 }
 
+// SIGINT/SIGTERM leave gracefully, the server stops once neighbours know
+void leave_signal(evutil_socket_t sig, short what, void* arg)
+{
+    printf("Leaving Network\n");
+    node_network_leave(node, NULL, NULL);
+}
+
 void net_joined(void* arg)
 {
     printf("Joined Network\n");
@@ -85,6 +114,21 @@ int main(int argc, char **argv){
     char* endptr;
     uint16_t port = (uint16_t)strtoul(argv[1], &endptr, 10);
 
+    // DHT_LOG=file logs in the background to file instead of stdout
+    if (getenv("DHT_LOG")){
+        log_set_level(LOG_SYS_COUNT, INFO);
+        log_start(getenv("DHT_LOG"));
+    }
+
+    // DHT_NET_BACKEND=uring does connection io with io_uring
+    if (getenv("DHT_NET_BACKEND") && strcmp(getenv("DHT_NET_BACKEND"), "uring") == 0){
+        net_set_default_backend(NET_BACKEND_URING);
+    }
+
+    // DHT_ID_HASH=fast hashes names with murmur3, every node has to do the same
+    if (getenv("DHT_ID_HASH") && strcmp(getenv("DHT_ID_HASH"), "fast") == 0){
+        set_id_hash(ID_HASH_FAST);
+    }
 
     node = node_create(port, argv[2]);
     if (!node){
@@ -95,20 +139,51 @@ int main(int argc, char **argv){
         return -1;
     }
     node_set_node_msg_handler(node, read_in_msg, NULL);
+    // DHT_TRACE=n prints the path of one in every n lookups
+    if (getenv("DHT_TRACE")){
+        node_set_trace_handler(node, trace_path, NULL);
+        node_set_trace_sample_rate(node, (unsigned int) strtoul(getenv("DHT_TRACE"), &endptr, 10));
+    }
+    // DHT_FINGER_BASE=k keeps k - 1 fingers per level, fewer hops for more state
+    if (getenv("DHT_FINGER_BASE")){
+        node_set_finger_base(node, (unsigned int) strtoul(getenv("DHT_FINGER_BASE"), &endptr, 10));
+    }
+    // DHT_ROUTE_CACHE=ms caches the owners of hot keys for that long
+    if (getenv("DHT_ROUTE_CACHE")){
+        node_set_route_cache(node, 1024, (unsigned int) strtoul(getenv("DHT_ROUTE_CACHE"), &endptr, 10));
+    }
+    struct event* int_ev = evsignal_new(net_get_base(net), SIGINT, leave_signal, NULL);
+    struct event* term_ev = evsignal_new(net_get_base(net), SIGTERM, leave_signal, NULL);
+    event_add(int_ev, NULL);
+    event_add(term_ev, NULL);
+    // DHT_SNAPSHOT=file keeps routing state in file and rejoins from it on restart
+    char* snapshot = getenv("DHT_SNAPSHOT");
+    if (snapshot){
+        node_set_snapshot_file(node, snapshot);
+    }
 
 
     if (argc > 4){
-        unsigned char buf[sizeof(struct in_addr)];
-        inet_pton(AF_INET, argv[3], buf);
-        uint32_t ip = 0;
-        for(int i = 0; i < 4; i++){
-            ip += (buf[i] << (8* (3 - i)));
+        // any number of seed ip port pairs, the first that answers is joined through
+        struct node_info seeds[8];
+        int n_seeds = 0;
+        for (int a = 3; a + 1 < argc && n_seeds < 8; a += 2){
+            unsigned char buf[sizeof(struct in_addr)];
+            inet_pton(AF_INET, argv[a], buf);
+            uint32_t ip = 0;
+            for(int i = 0; i < 4; i++){
+                ip += (buf[i] << (8* (3 - i)));
+            }
+            seeds[n_seeds].id = 0;
+            seeds[n_seeds].IP = ip;
+            seeds[n_seeds].port = (uint16_t) strtoul(argv[a + 1], &endptr, 10);
+            ++n_seeds;
+        }
+        if (snapshot){
+            node_network_warm_join(node, snapshot, seeds[0], net_joined, NULL);
+        }else{
+            node_network_join_seeds(node, seeds, n_seeds, net_joined, NULL);
         }
-        uint16_t port = (uint16_t) strtoul(argv[4], &endptr, 10);
-        struct node_info ninfo;
-        ninfo.IP = ip;
-        ninfo.port = port;
-        node_network_join(node, ninfo, net_joined, NULL);
     }else{
         node_network_create(node, net_joined, NULL);
     }
@@ -116,9 +191,15 @@ int main(int argc, char **argv){
 
     //pthread_kill(inthr, SIGKILL);
 
-    running = 0;
-    pthread_join(inthr, NULL);
-
+    if (running){
+        running = 0;
+        pthread_cancel(inthr); // blocked reading stdin
+        pthread_join(inthr, NULL);
+    }
+    event_free(int_ev);
+    event_free(term_ev);
+    node_destroy(node);
+    log_stop();
 
     return 0;
 }
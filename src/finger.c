@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "finger.h"
+
+#define LOG_SUBSYS LOG_SYS_ROUTING
+#include "logging.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FINGER_X86
+#endif
+
+_Static_assert(NODE_MAX_FINGERS % FINGER_SEARCH_LANES == 0, "searches read whole vectors");
+
+struct finger_table* finger_table_create(hash_type self_id, unsigned int base)
+{
+    struct finger_table* ft = aligned_alloc(32, sizeof(struct finger_table));
+    if (!ft){
+        log_err("failed to malloc finger table");
+        return NULL; }
+    ft->self_id = self_id;
+    if (finger_set_base(ft, base) < 0){
+        free(ft);
+        return NULL;
+    }
+    return ft;
+}
+
+void finger_table_destroy(struct finger_table* ft)
+{
+    free(ft);
+}
+
+int finger_set_base(struct finger_table* ft, unsigned int base)
+{
+    int bits = 0;
+    while ((1u << bits) < base){
+        ++bits; }
+    if (base < 2 || base > NODE_FINGER_BASE_MAX || (1u << bits) != base){
+        log_err("finger base must be a power of 2 from 2 to %d", NODE_FINGER_BASE_MAX);
+        return -1;
+    }
+
+    // base - 1 fingers per level, at digit * base^level
+    int n = 0;
+    for (int shift = 0; shift < ID_BITS; shift += bits){
+        for (uint64_t digit = 1; digit < base; ++digit){
+            uint64_t offset = digit << shift;
+            if (offset >> ID_BITS){
+                break; } // top level only part fits in the id space
+            ft->offset[n++] = (hash_type) offset;
+        }
+    }
+    ft->n = n;
+    memset(ft->rel, 0, sizeof(ft->rel));
+    memset(ft->nodes, 0, sizeof(ft->nodes));
+    return 0;
+}
+
+void finger_set(struct finger_table* ft, int f, struct node_info n)
+{
+    if (f < 0 || f >= ft->n){
+        return; }
+    if (n.IP == 0 || n.id == ft->self_id){
+        memset(&(ft->nodes[f]), 0, sizeof(struct node_info));
+        ft->rel[f] = 0;
+        return;
+    }
+    ft->nodes[f] = n;
+    ft->rel[f] = n.id - ft->self_id;
+}
+
+void finger_replace(struct finger_table* ft, struct node_info gone, struct node_info next)
+{
+    for (int f = 0; f < ft->n; ++f){
+        if (ft->rel[f] != 0 && ft->nodes[f].IP == gone.IP && ft->nodes[f].port == gone.port){
+            finger_set(ft, f, next); }
+    }
+}
+
+int finger_within(const struct finger_table* ft, uint32_t lo, uint32_t hi, int* out, int max)
+{
+    int n = 0;
+    for (int f = 0; f < ft->n && n < max; ++f){
+        if (ft->rel[f] != 0 && ft->rel[f] >= lo && ft->rel[f] <= hi){
+            out[n++] = f; }
+    }
+    return n;
+}
+
+//
+// closest preceding search
+//
+
+int finger_search_scalar(const uint32_t* rel, int n, uint32_t dist)
+{
+    int best = -1;
+    uint32_t best_rel = 0;
+    for (int i = 0; i < n; ++i){
+        // empty entries are 0, so 0 - 1 wraps and never passes
+        if (rel[i] - 1 < dist && rel[i] > best_rel){
+            best_rel = rel[i];
+            best = i;
+        }
+    }
+    return best;
+}
+
+#ifdef FINGER_X86
+
+// unsigned a < b as a signed compare, there is no unsigned one
+#define FINGER_BIAS 0x80000000u
+
+__attribute__((target("avx2")))
+static int finger_search_avx2(const uint32_t* rel, int n, uint32_t dist)
+{
+    const __m256i bias  = _mm256_set1_epi32((int) FINGER_BIAS);
+    const __m256i one   = _mm256_set1_epi32(1);
+    const __m256i limit = _mm256_set1_epi32((int)(dist ^ FINGER_BIAS));
+    __m256i best = _mm256_setzero_si256();
+
+    for (int i = 0; i < n; i += 8){
+        __m256i v = _mm256_load_si256((const __m256i*)(rel + i));
+        __m256i below = _mm256_xor_si256(_mm256_sub_epi32(v, one), bias);
+        __m256i in = _mm256_cmpgt_epi32(limit, below); // v - 1 < dist
+        best = _mm256_max_epu32(best, _mm256_and_si256(v, in));
+    }
+    // fold to one lane then find where it came from
+    __m128i m = _mm_max_epu32(_mm256_castsi256_si128(best), _mm256_extracti128_si256(best, 1));
+    m = _mm_max_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_max_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+    uint32_t best_rel = (uint32_t) _mm_cvtsi128_si32(m);
+    if (best_rel == 0){
+        return -1; }
+
+    const __m256i want = _mm256_set1_epi32((int) best_rel);
+    for (int i = 0; i < n; i += 8){
+        __m256i v = _mm256_load_si256((const __m256i*)(rel + i));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, want)));
+        if (mask){
+            return i + __builtin_ctz(mask); }
+    }
+    return -1;
+}
+
+__attribute__((target("sse4.1")))
+static int finger_search_sse41(const uint32_t* rel, int n, uint32_t dist)
+{
+    const __m128i bias  = _mm_set1_epi32((int) FINGER_BIAS);
+    const __m128i one   = _mm_set1_epi32(1);
+    const __m128i limit = _mm_set1_epi32((int)(dist ^ FINGER_BIAS));
+    __m128i best = _mm_setzero_si128();
+
+    for (int i = 0; i < n; i += 4){
+        __m128i v = _mm_load_si128((const __m128i*)(rel + i));
+        __m128i below = _mm_xor_si128(_mm_sub_epi32(v, one), bias);
+        __m128i in = _mm_cmplt_epi32(below, limit); // v - 1 < dist
+        best = _mm_max_epu32(best, _mm_and_si128(v, in));
+    }
+    __m128i m = _mm_max_epu32(best, _mm_shuffle_epi32(best, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_max_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+    uint32_t best_rel = (uint32_t) _mm_cvtsi128_si32(m);
+    if (best_rel == 0){
+        return -1; }
+
+    const __m128i want = _mm_set1_epi32((int) best_rel);
+    for (int i = 0; i < n; i += 4){
+        __m128i v = _mm_load_si128((const __m128i*)(rel + i));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, want)));
+        if (mask){
+            return i + __builtin_ctz(mask); }
+    }
+    return -1;
+}
+
+#endif // FINGER_X86
+
+typedef int (*finger_search_fn)(const uint32_t*, int, uint32_t);
+
+static finger_search_fn finger_search_impl = finger_search_scalar;
+static const char* finger_search_impl_name = "scalar";
+static pthread_once_t finger_search_once = PTHREAD_ONCE_INIT;
+
+static void finger_search_pick(void)
+{
+#ifdef FINGER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        finger_search_impl = finger_search_avx2;
+        finger_search_impl_name = "avx2";
+    }else if (__builtin_cpu_supports("sse4.1")){
+        finger_search_impl = finger_search_sse41;
+        finger_search_impl_name = "sse4.1";
+    }
+#endif // FINGER_X86
+}
+
+int finger_search(const uint32_t* rel, int n, uint32_t dist)
+{
+    pthread_once(&finger_search_once, finger_search_pick);
+    // whole vectors, the padding past n is always 0
+    n = (n + FINGER_SEARCH_LANES - 1) & ~(FINGER_SEARCH_LANES - 1);
+    return finger_search_impl(rel, n, dist);
+}
+
+const char* finger_search_name(void)
+{
+    pthread_once(&finger_search_once, finger_search_pick);
+    return finger_search_impl_name;
+}
+
+int finger_closest_preceding(const struct finger_table* ft, hash_type id)
+{
+    return finger_search(ft->rel, ft->n, id - ft->self_id);
+}
@@ -0,0 +1,92 @@
+#ifndef FINGER_H
+#define FINGER_H
+
+#include <stdint.h>
+
+#include "node.h"
+
+/**
+ * a node's fingers, structure of arrays: the ids, rotated so the owning node
+ * is 0, sit in one contiguous array that the closest preceding search scans
+ * with SIMD, and the addresses sit alongside to be read once a finger is picked
+ */
+
+// rel entries scanned per step by the widest search, NODE_MAX_FINGERS must be a multiple
+#define FINGER_SEARCH_LANES 8
+
+struct finger_table{
+    uint32_t rel[NODE_MAX_FINGERS] __attribute__((aligned(32))); // id - self id, 0 if empty
+    struct node_info nodes[NODE_MAX_FINGERS];
+    hash_type offset[NODE_MAX_FINGERS]; // finger f starts at self + offset[f], ascending
+    hash_type self_id;
+    int n;
+};
+
+/**
+ * NULL if base isn't a power of 2 from 2 to NODE_FINGER_BASE_MAX
+ */
+struct finger_table* finger_table_create(hash_type self_id, unsigned int base);
+
+void finger_table_destroy(struct finger_table* ft);
+
+/**
+ * lay the table out as base - 1 fingers per level and empty it. returns 0 on success
+ */
+int finger_set_base(struct finger_table* ft, unsigned int base);
+
+static inline int finger_count(const struct finger_table* ft)
+{
+    return ft->n;
+}
+
+// where finger f starts
+static inline hash_type finger_start(const struct finger_table* ft, int f)
+{
+    return ft->self_id + ft->offset[f];
+}
+
+// where finger f's interval ends, the next finger's start or back round to us
+static inline hash_type finger_end(const struct finger_table* ft, int f)
+{
+    return (f + 1 < ft->n) ? ft->self_id + ft->offset[f + 1] : ft->self_id;
+}
+
+static inline struct node_info finger_get(const struct finger_table* ft, int f)
+{
+    return ft->nodes[f];
+}
+
+/**
+ * set finger f to n, an empty node or the owning node clears it
+ */
+void finger_set(struct finger_table* ft, int f, struct node_info n);
+
+/**
+ * point every finger at gone (by address) to next instead, or clear them if next is empty
+ */
+void finger_replace(struct finger_table* ft, struct node_info gone, struct node_info next);
+
+/**
+ * finger whose node is closest before or at id, -1 if none are
+ */
+int finger_closest_preceding(const struct finger_table* ft, hash_type id);
+
+/**
+ * indices of up to max fingers whose node is from lo to hi past the owning node, returns how many
+ */
+int finger_within(const struct finger_table* ft, uint32_t lo, uint32_t hi, int* out, int max);
+
+/**
+ * index of the largest rel in [1, dist] among rel[0..n), -1 if there is none.
+ * entries from n up to the next multiple of FINGER_SEARCH_LANES must be 0.
+ * finger_search picks the widest version the cpu runs
+ */
+int finger_search(const uint32_t* rel, int n, uint32_t dist);
+int finger_search_scalar(const uint32_t* rel, int n, uint32_t dist);
+
+/**
+ * which version finger_search uses, "avx2", "sse4.1" or "scalar"
+ */
+const char* finger_search_name(void);
+
+#endif // FINGER_H
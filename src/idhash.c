@@ -0,0 +1,236 @@
+#include <string.h>
+#include <pthread.h>
+#include <openssl/sha.h>
+
+#include "idhash.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IDHASH_X86
+#endif
+
+#define IDHASH_H0 0x67452301u
+#define IDHASH_H1 0xEFCDAB89u
+#define IDHASH_H2 0x98BADCFEu
+#define IDHASH_H3 0x10325476u
+#define IDHASH_H4 0xC3D2E1F0u
+
+hash_type idhash_sha1(const char* name, size_t len)
+{
+    unsigned char sha_1[SHA_DIGEST_LENGTH];
+    hash_type hash_id = 0;
+
+    SHA1((const unsigned char *)name, len, sha_1);
+    int bytes = sizeof(hash_type);
+    for (int i = 0; i < bytes; ++i){
+        hash_id += ((hash_type)sha_1[i]) << 8*(bytes-(i+1)); //uff...
+    }
+
+    return hash_id;
+}
+
+//
+// fast mode, murmur3 (x86 32 bit), not for names anyone could choose
+//
+
+#define IDHASH_FAST_SEED 0x9E3779B9u
+
+static uint32_t idhash_rotl(uint32_t x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+hash_type idhash_fast(const char* name, size_t len)
+{
+    const unsigned char* p = (const unsigned char*) name;
+    const uint32_t c1 = 0xCC9E2D51, c2 = 0x1B873593;
+    uint32_t h = IDHASH_FAST_SEED;
+
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4){
+        uint32_t k = (uint32_t) p[i] | ((uint32_t) p[i + 1] << 8) |
+            ((uint32_t) p[i + 2] << 16) | ((uint32_t) p[i + 3] << 24);
+        k *= c1;
+        k = idhash_rotl(k, 15);
+        k *= c2;
+        h ^= k;
+        h = idhash_rotl(h, 13);
+        h = h * 5 + 0xE6546B64;
+    }
+    uint32_t k = 0;
+    switch (len & 3){
+        case 3: k ^= (uint32_t) p[i + 2] << 16; // fall through
+        case 2: k ^= (uint32_t) p[i + 1] << 8; // fall through
+        case 1: k ^= p[i];
+            k *= c1;
+            k = idhash_rotl(k, 15);
+            k *= c2;
+            h ^= k;
+    }
+    h ^= (uint32_t) len;
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    h ^= h >> 16;
+    return h;
+}
+
+//
+// SHA-1 of one block names, several at once
+//
+
+// the message schedule of a batch, w[t][lane]
+typedef uint32_t idhash_words[16][IDHASH_MAX_LANES];
+
+// pad name into lane's column of w, len must be at most IDHASH_BLOCK_MAX
+static void idhash_block(const char* name, size_t len, idhash_words w, int lane)
+{
+    unsigned char b[64];
+    memset(b, 0, sizeof(b));
+    memcpy(b, name, len);
+    b[len] = 0x80;
+    uint64_t bits = (uint64_t) len * 8;
+    for (int i = 0; i < 8; ++i){
+        b[63 - i] = (unsigned char)(bits >> (8 * i)); }
+    for (int t = 0; t < 16; ++t){
+        w[t][lane] = ((uint32_t) b[4 * t] << 24) | ((uint32_t) b[4 * t + 1] << 16) |
+            ((uint32_t) b[4 * t + 2] << 8) | (uint32_t) b[4 * t + 3];
+    }
+}
+
+typedef void (*idhash_lanes_fn)(idhash_words w, uint32_t* out);
+
+#ifdef IDHASH_X86
+
+#define IDHASH_ROUNDS(V, SET1, ADD, XOR, AND, OR, ANDNOT, SLLI, SRLI) do { \
+    V a = SET1((int) IDHASH_H0), b = SET1((int) IDHASH_H1), c = SET1((int) IDHASH_H2); \
+    V d = SET1((int) IDHASH_H3), e = SET1((int) IDHASH_H4); \
+    for (int t = 0; t < 80; ++t){ \
+        if (t >= 16){ \
+            V x = XOR(XOR(v[(t - 3) & 15], v[(t - 8) & 15]), XOR(v[(t - 14) & 15], v[t & 15])); \
+            v[t & 15] = OR(SLLI(x, 1), SRLI(x, 31)); \
+        } \
+        V f, k; \
+        if (t < 20){ \
+            f = OR(AND(b, c), ANDNOT(b, d)); \
+            k = SET1(0x5A827999); \
+        }else if (t < 40){ \
+            f = XOR(XOR(b, c), d); \
+            k = SET1(0x6ED9EBA1); \
+        }else if (t < 60){ \
+            f = OR(AND(b, c), AND(d, OR(b, c))); \
+            k = SET1((int) 0x8F1BBCDC); \
+        }else{ \
+            f = XOR(XOR(b, c), d); \
+            k = SET1((int) 0xCA62C1D6); \
+        } \
+        V tmp = ADD(ADD(OR(SLLI(a, 5), SRLI(a, 27)), f), ADD(ADD(e, k), v[t & 15])); \
+        e = d; \
+        d = c; \
+        c = OR(SLLI(b, 30), SRLI(b, 2)); \
+        b = a; \
+        a = tmp; \
+    } \
+    res = ADD(a, SET1((int) IDHASH_H0)); \
+} while (0)
+
+__attribute__((target("avx2")))
+static void idhash_sha1_avx2(idhash_words w, uint32_t* out)
+{
+    __m256i v[16];
+    __m256i res;
+    for (int t = 0; t < 16; ++t){
+        v[t] = _mm256_loadu_si256((const __m256i*) w[t]); }
+    IDHASH_ROUNDS(__m256i, _mm256_set1_epi32, _mm256_add_epi32, _mm256_xor_si256, _mm256_and_si256,
+            _mm256_or_si256, _mm256_andnot_si256, _mm256_slli_epi32, _mm256_srli_epi32);
+    _mm256_storeu_si256((__m256i*) out, res);
+}
+
+__attribute__((target("sse2")))
+static void idhash_sha1_sse2(idhash_words w, uint32_t* out)
+{
+    __m128i v[16];
+    __m128i res;
+    for (int t = 0; t < 16; ++t){
+        v[t] = _mm_loadu_si128((const __m128i*) w[t]); }
+    IDHASH_ROUNDS(__m128i, _mm_set1_epi32, _mm_add_epi32, _mm_xor_si128, _mm_and_si128,
+            _mm_or_si128, _mm_andnot_si128, _mm_slli_epi32, _mm_srli_epi32);
+    _mm_storeu_si128((__m128i*) out, res);
+}
+
+#endif // IDHASH_X86
+
+// batches of one block names through fn, lanes at a time, the rest one by one
+static void idhash_sha1_batched(const char** names, size_t n, hash_type* out, idhash_lanes_fn fn, int lanes)
+{
+    idhash_words w;
+    uint32_t res[IDHASH_MAX_LANES];
+    size_t idx[IDHASH_MAX_LANES];
+    int k = 0;
+
+    memset(w, 0, sizeof(w)); // lanes not filled in the last batch are hashed but not used
+    for (size_t i = 0; i < n; ++i){
+        size_t len = strlen(names[i]);
+        if (len > IDHASH_BLOCK_MAX){
+            out[i] = idhash_sha1(names[i], len);
+            continue;
+        }
+        idhash_block(names[i], len, w, k);
+        idx[k++] = i;
+        if (k == lanes){
+            fn(w, res);
+            for (int l = 0; l < k; ++l){
+                out[idx[l]] = res[l]; }
+            k = 0;
+        }
+    }
+    if (k){
+        fn(w, res);
+        for (int l = 0; l < k; ++l){
+            out[idx[l]] = res[l]; }
+    }
+}
+
+void idhash_sha1_many_scalar(const char** names, size_t n, hash_type* out)
+{
+    for (size_t i = 0; i < n; ++i){
+        out[i] = idhash_sha1(names[i], strlen(names[i])); }
+}
+
+static idhash_lanes_fn idhash_impl = NULL;
+static int idhash_impl_lanes = 1;
+static const char* idhash_impl_name = "scalar";
+static pthread_once_t idhash_once = PTHREAD_ONCE_INIT;
+
+static void idhash_pick(void)
+{
+#ifdef IDHASH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        idhash_impl = idhash_sha1_avx2;
+        idhash_impl_lanes = 8;
+        idhash_impl_name = "avx2";
+    }else if (__builtin_cpu_supports("sse2")){
+        idhash_impl = idhash_sha1_sse2;
+        idhash_impl_lanes = 4;
+        idhash_impl_name = "sse2";
+    }
+#endif // IDHASH_X86
+}
+
+void idhash_sha1_many(const char** names, size_t n, hash_type* out)
+{
+    pthread_once(&idhash_once, idhash_pick);
+    if (!idhash_impl){
+        idhash_sha1_many_scalar(names, n, out);
+        return;
+    }
+    idhash_sha1_batched(names, n, out, idhash_impl, idhash_impl_lanes);
+}
+
+const char* idhash_sha1_name(void)
+{
+    pthread_once(&idhash_once, idhash_pick);
+    return idhash_impl_name;
+}
@@ -0,0 +1,36 @@
+#ifndef IDHASH_H
+#define IDHASH_H
+
+#include <stddef.h>
+
+#include "libdht.h"
+
+/**
+ * names to ids: the first 32 bits of the name's SHA-1, or murmur3 in
+ * ID_HASH_FAST mode. the id is the first word of the digest, so batches of
+ * names that fit in one SHA-1 block are hashed side by side in vector lanes
+ * and only that word is kept
+ */
+
+// longest name that fits in one block with its padding
+#define IDHASH_BLOCK_MAX 55
+// names per batch for the widest version
+#define IDHASH_MAX_LANES 8
+
+hash_type idhash_sha1(const char* name, size_t len);
+
+hash_type idhash_fast(const char* name, size_t len);
+
+/**
+ * idhash_sha1 of each of names into out, idhash_sha1_many picks the widest
+ * version the cpu runs
+ */
+void idhash_sha1_many(const char** names, size_t n, hash_type* out);
+void idhash_sha1_many_scalar(const char** names, size_t n, hash_type* out);
+
+/**
+ * which version idhash_sha1_many uses, "avx2", "sse2" or "scalar"
+ */
+const char* idhash_sha1_name(void);
+
+#endif // IDHASH_H
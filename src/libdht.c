@@ -1,23 +1,35 @@
-#include <openssl/sha.h>
 #include <string.h>
 #include "libdht.h"
+#include "idhash.h"
 #include "logging.h"
 
 #include <stdlib.h>
 
+static int id_hash_mode = ID_HASH_SHA1;
+
+void set_id_hash(int mode)
+{
+    id_hash_mode = mode;
+}
+
 hash_type get_id(const char* name)
 {
-    unsigned char sha_1[SHA_DIGEST_LENGTH];
-    hash_type hash_id = 0;
+    if (id_hash_mode == ID_HASH_FAST){
+        return idhash_fast(name, strlen(name)); }
+    return idhash_sha1(name, strlen(name));
+}
 
-    SHA1((unsigned char *)name, strlen(name), sha_1);
-    int bytes = sizeof(hash_type);
-    for (int i = 0; i < bytes; ++i){
-        hash_id += ((hash_type)sha_1[i]) << 8*(bytes-(i+1)); //uff...
+void get_ids(const char** names, size_t n, hash_type* out)
+{
+    if (id_hash_mode == ID_HASH_FAST){
+        for (size_t i = 0; i < n; ++i){
+            out[i] = idhash_fast(names[i], strlen(names[i])); }
+        return;
     }
-
-    return hash_id;
+    idhash_sha1_many(names, n, out);
 }
 
-
-
+const char* get_ids_name(void)
+{
+    return id_hash_mode == ID_HASH_FAST ? "fast" : idhash_sha1_name();
+}
@@ -1,6 +1,7 @@
 #ifndef LIBDHT_H
 #define LIBDHT_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "libdhtnet.h"
@@ -8,6 +9,7 @@
 typedef uint32_t hash_type;
 
 struct node_self;
+struct store;
 
 struct node_info{
     hash_type id;
@@ -23,9 +25,32 @@ struct node_message{
     char* content;
 };
 
+// a traced lookup's path is cut short after this many hops
+#define NODE_TRACE_MAX_HOPS 32
+
+/**
+ * time a lookup spent at one node, usecs. queue is how long the request
+ * waited behind other events, proc the node's own work, wait the time spent
+ * waiting on the next hop (so wait minus the next hop's total is the network)
+ */
+struct node_trace_hop{
+    hash_type id;
+    uint32_t queue_us;
+    uint32_t proc_us;
+    uint32_t wait_us;
+};
+
+struct node_trace{
+    short n_hops;
+    struct node_trace_hop hops[NODE_TRACE_MAX_HOPS]; // from the asking node on
+};
+
 typedef void (*on_join_cb_t)(void* arg);
+typedef void (*on_leave_cb_t)(void* arg);
 typedef void (*node_found_cb_t)(struct node_info, void *, short);
 typedef void (*node_msg_cb_t)(struct node_self*, struct node_message*, int, void *);
+// called with a sampled lookup's path just before its node_found_cb_t, found is 0 if it failed
+typedef void (*node_trace_cb_t)(hash_type id, const struct node_trace* trace, short found, void *);
 
 struct node_self* node_create(uint16_t listen_port, char* name);
 
@@ -35,6 +60,45 @@ struct net_server* node_get_net(struct node_self* self);
 
 hash_type get_id(const char* name);
 
+// how names become ids, see set_id_hash
+#define ID_HASH_SHA1 0
+#define ID_HASH_FAST 1
+
+/**
+ * get_id of each of n names into out. batches of names up to 55 bytes are
+ * hashed several at once in vector lanes where the cpu has them
+ */
+void get_ids(const char** names, size_t n, hash_type* out);
+
+/**
+ * how get_ids hashes: "avx2", "sse2" or "scalar" SHA-1, or "fast"
+ */
+const char* get_ids_name(void);
+
+/**
+ * hash names with mode from now on, for node ids as well as keys, so every
+ * node in a network must use the same one. ID_HASH_SHA1 is the default,
+ * ID_HASH_FAST (murmur3) is several times quicker but anyone can make names
+ * that collide with it: only for deployments where every name is trusted.
+ * call before creating nodes
+ */
+void set_id_hash(int mode);
+
+/**
+ * keep base - 1 fingers per level (at digit * base^level from this node) so
+ * lookups take log_base(N) hops rather than log_2(N). base is a power of 2 up
+ * to 16, default 2. call before creating or joining a network
+ */
+int node_set_finger_base(struct node_self* self, unsigned int base);
+
+/**
+ * remember the owners of keys this node often routes lookups for, for ttl_ms,
+ * and answer later lookups of them straight away. an answer may be out of
+ * date by up to ttl_ms after the ring changes. entries 0 turns it off (the
+ * default). call before creating or joining a network
+ */
+int node_set_route_cache(struct node_self* self, int entries, unsigned int ttl_ms);
+
 /**
  * creates a new overlay network
  */
@@ -48,10 +112,110 @@ void node_set_node_msg_handler(struct node_self* self, node_msg_cb_t, void* cb_a
 int node_network_join(struct node_self* self, struct node_info node, on_join_cb_t join_cb, void * cb_arg);
 
 /**
- * find successor of id
+ * join through whichever of up to NODE_JOIN_MAX_SEEDS seed nodes answers first
+ */
+int node_network_join_seeds(struct node_self* self, const struct node_info* seeds, int n_seeds,
+                            on_join_cb_t join_cb, void * cb_arg);
+
+/**
+ * leave the network gracefully: the predecessor, successors and fingers are
+ * told who takes over so they route round this node without waiting for it
+ * to time out. once they have answered (or given up) cb is called, or if cb
+ * is NULL the node's server stops. call from the node's event loop
+ */
+int node_network_leave(struct node_self* self, on_leave_cb_t cb, void* cb_arg);
+
+/**
+ * rejoin using the routing state saved in path by an earlier run of this node.
+ * saved neighbours are checked in parallel and lookups use the saved fingers
+ * meanwhile. falls back to joining through bootstrap like node_network_join
+ * if there is no usable snapshot or no saved successor is still alive
+ */
+int node_network_warm_join(struct node_self* self, const char* path, struct node_info bootstrap,
+                           on_join_cb_t join_cb, void * cb_arg);
+
+/**
+ * write this node's routing state to path now, returns 0 on success
+ */
+int node_snapshot_save(struct node_self* self, const char* path);
+
+/**
+ * save routing state to path periodically and when the node is destroyed, NULL stops
+ */
+int node_set_snapshot_file(struct node_self* self, const char* path);
+
+/**
+ * keep this node's records on disk in dir (see store.h), so they survive a
+ * restart. opened now, which is quick if it was closed cleanly, and closed
+ * with the node. NULL closes it. safe to call while the node is running,
+ * replicas turn quorum ops away until the new store is open
+ */
+int node_set_store(struct node_self* self, const char* dir);
+
+/**
+ * NULL if there is none. only good until the next node_set_store or node_destroy
+ */
+struct store* node_get_store(struct node_self* self);
+
+// key and value together, a record goes to each replica in one datagram
+#define NODE_QUORUM_MAX_RECORD 1024
+
+// status 0 if w replicas stored it, -1 if not
+typedef void (*node_put_cb_t)(short status, void* arg);
+// status 0 with the newest value r replicas had, 1 if none had it (or it was deleted), -1 if fewer answered
+typedef void (*node_get_cb_t)(short status, const char* val, size_t len, void* arg);
+
+/**
+ * keep each record on n nodes, the key's owner and the next n - 1 in its
+ * successor list. writes go to all n at once and are done once w have stored
+ * them, reads once r have answered; r + w > n means a read sees the last
+ * write. n is at most NUM_OF_SUCCS + 1, default 3, 2, 2. replicas need
+ * node_set_store to keep anything. on a ring of fewer than n nodes every node
+ * is a replica and r and w are capped at the ring's size, otherwise an op
+ * fails if the owner's successor list is too short of live nodes for it
+ */
+int node_set_quorum(struct node_self* self, int n, int r, int w);
+
+/**
+ * reads ask the r replicas expected to answer first and one more each time
+ * they have taken longer than this percentile of replies to reads, so a slow
+ * replica doesn't hold reads up. 0 turns it off, default 95
+ */
+void node_set_read_hedge(struct node_self* self, unsigned int percentile);
+
+/**
+ * write or delete key on its replicas. the newest write of a key wins, by
+ * wall clock time of the node it was made on. returns -1 without calling cb
+ * if the record is too big, otherwise cb is called exactly once. call from
+ * the node's event loop
+ */
+int node_quorum_put(struct node_self* self, const char* key, const void* val, size_t len,
+                    node_put_cb_t cb, void* cb_arg);
+
+int node_quorum_delete(struct node_self* self, const char* key, node_put_cb_t cb, void* cb_arg);
+
+/**
+ * read key from its replicas, any that answered with an older version are
+ * sent the newest. like node_quorum_put otherwise
+ */
+int node_quorum_get(struct node_self* self, const char* key, node_get_cb_t cb, void* cb_arg);
+
+/**
+ * find successor of id. cb is called exactly once, if the lookup fails
+ * (error or timeout) it gets an all zero node_info and -1 hops
  */
 int node_find_successor(struct node_self* self, hash_type id, node_found_cb_t cb, void* found_cb_arg);
 
+/**
+ * trace one in every lookups started with node_find_successor, 0 turns tracing off
+ */
+void node_set_trace_sample_rate(struct node_self* self, unsigned int every);
+
+/**
+ * where sampled lookup paths go
+ */
+void node_set_trace_handler(struct node_self* self, node_trace_cb_t trace_cb, void* cb_arg);
+
 /**
  * send a message over a given connection opened from this nodes net_server
  */
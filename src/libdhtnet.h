@@ -14,13 +14,50 @@ struct net_server;
 
 typedef void (*net_connection_data_cb_t)(int connection, void *arg);
 typedef void (*net_connection_event_cb_t)(int connection, short type, void *arg);
+typedef void (*net_connect_observer_t)(uint32_t IP, uint16_t port, uint64_t connect_us, short connected, void *arg);
+typedef void (*net_dgram_cb_t)(uint32_t IP, uint16_t port, const char *data, size_t len, void *arg);
 
+// largest datagram that is sent or received
+#define NET_MAX_DGRAM 1400
+
+// how connections do their io, see net_server_create_backend
+#define NET_BACKEND_LIBEVENT 0
+#define NET_BACKEND_URING 1
 
 
 struct net_server* net_server_create(const uint16_t port, net_connection_event_cb_t incoming_connection_cb, void* incoming_cb_arg);
 
+/*
+ * as net_server_create, with connections using the given backend. NET_BACKEND_URING
+ * (io_uring, linux only) returns NULL if the kernel won't set up a ring.
+ * datagrams and timers use the event base whichever backend is used
+ */
+struct net_server* net_server_create_backend(const uint16_t port, net_connection_event_cb_t incoming_connection_cb, void* incoming_cb_arg, int backend);
+
+/*
+ * backend for servers made by net_server_create from now on, NET_BACKEND_LIBEVENT unless set
+ */
+void net_set_default_backend(int backend);
+
 void net_server_set_incoming_cb_arg(struct net_server *srv, void* arg);
 
+/*
+ * observer called when an outgoing connection finishes connecting (with the time it took)
+ * or fails before connecting, for every outgoing connection on the server
+ */
+void net_server_set_connect_observer(struct net_server *srv, net_connect_observer_t cb, void* arg);
+
+/*
+ * whether the server has so many incoming connections open that it should turn
+ * away work it can (with a busy reply) rather than take on more
+ */
+int net_server_busy(struct net_server* srv);
+
+/*
+ * port the server is listening on, the one picked for it if it was created with port 0
+ */
+uint16_t net_server_get_port(struct net_server* srv);
+
 void net_server_stop(struct net_server* srv);
 
 void net_server_destroy(struct net_server* srv);
@@ -55,10 +92,25 @@ void* net_connection_get_cb_arg(struct net_server* srv, const int conn);
 
 void net_connection_set_timeouts(struct net_server* srv, const int conn, const struct timeval* read_tm, const struct timeval* write_tm);
 
+/*
+ * the read callback is only called once at least low bytes are in the read buffer, 0 for any
+ */
+int net_connection_set_read_watermark(struct net_server* srv, const int conn, size_t low);
+
+/*
+ * call the read callback now if there is anything in the read buffer,
+ * e.g. when whoever reads the connection has changed since the data arrived
+ */
+void net_connection_trigger_read(struct net_server* srv, const int conn);
+
+/*
+ * the connection's bufferevent, NULL for servers not using NET_BACKEND_LIBEVENT
+ */
 struct bufferevent* net_connection_get_bufev(struct net_server* srv, const int conn);
 /*
  * actually open connection and begin I/O
- * for outgoing connections it is best to add message to write buffer then activating
+ * for outgoing connections it is best to add message to write buffer then activating.
+ * if NET_MAX_OUTBOUND are already open it waits, in order, for one of them to close
  */
 int net_connection_activate(struct net_server* srv, const int conn);
 
@@ -74,6 +126,22 @@ struct evbuffer* net_connection_get_write_buffer(struct net_server* srv, const i
 
 uint32_t net_connection_get_remote_address(struct net_server* srv, const int conn);
 
+/*
+ * remote port of the connection, for outgoing connections this is the port the remote listens on
+ */
+uint16_t net_connection_get_remote_port(struct net_server* srv, const int conn);
+
+/*
+ * set handler for datagrams received on the server's UDP socket (same port as the listener)
+ */
+void net_server_set_dgram_cb(struct net_server* srv, net_dgram_cb_t cb, void* arg);
+
+/*
+ * send a single datagram from the server's UDP socket, len must be at most NET_MAX_DGRAM
+ * returns 0 on success
+ */
+int net_dgram_send(struct net_server* srv, const uint32_t IP, const uint16_t port, const void* data, size_t len);
+
 
 
 #endif // LIBDHTNET_H
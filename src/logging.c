@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "logging.h"
+
+#ifdef NDEBUG
+#define LOG_DEFAULT_LEVEL WARN
+#else
+#define LOG_DEFAULT_LEVEL INFO
+#endif // NDEBUG
+
+volatile unsigned char log_levels[LOG_SYS_COUNT] = {
+    LOG_DEFAULT_LEVEL, LOG_DEFAULT_LEVEL, LOG_DEFAULT_LEVEL, LOG_DEFAULT_LEVEL };
+
+static const char* log_level_str[] = { "ERROR", "WARN", "INFO", "OTHER" };
+
+struct log_line{
+    unsigned short len;
+    char text[LOG_LINE_BYTES];
+};
+
+/**
+ * single producer (the thread that owns it) single consumer (the writer)
+ */
+struct log_ring{
+    struct log_line lines[LOG_RING_LINES];
+    unsigned long head; // next to write, only the owner moves it
+    unsigned long tail; // next to read, only the writer moves it
+    short orphaned; // owner thread has exited, free once drained
+    struct log_ring* next;
+};
+
+static struct log_ring* log_rings = NULL; // every ring, under log_rings_lock
+static pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t log_ring_key;
+static pthread_once_t log_key_once = PTHREAD_ONCE_INIT;
+static __thread struct log_ring* log_my_ring = NULL;
+
+static FILE* log_file = NULL;
+static pthread_t log_writer;
+static int log_running = 0; // atomic
+static unsigned long log_dropped_lines = 0; // atomic
+
+static void log_ring_release(void* arg)
+{
+    struct log_ring* ring = (struct log_ring*) arg;
+    __atomic_store_n(&(ring->orphaned), 1, __ATOMIC_RELEASE);
+}
+
+static void log_make_key(void)
+{
+    pthread_key_create(&log_ring_key, log_ring_release);
+}
+
+static struct log_ring* log_thread_ring(void)
+{
+    if (log_my_ring){
+        return log_my_ring; }
+
+    struct log_ring* ring = calloc(1, sizeof(struct log_ring));
+    if (!ring){
+        return NULL; }
+    pthread_once(&log_key_once, log_make_key);
+    pthread_setspecific(log_ring_key, ring);
+
+    pthread_mutex_lock(&log_rings_lock);
+    ring->next = log_rings;
+    log_rings = ring;
+    pthread_mutex_unlock(&log_rings_lock);
+
+    log_my_ring = ring;
+    return ring;
+}
+
+static size_t log_format(char* buf, size_t size, loglevel_t level,
+        const char* file, int line, const char* fmt, va_list ap)
+{
+    int n = snprintf(buf, size, "[%s] (%s:%d) ", log_level_str[level], file, line);
+    if (n < 0){
+        n = 0; }
+    if ((size_t)n < size){
+        int m = vsnprintf(buf + n, size - n, fmt, ap);
+        if (m > 0){
+            n += m; }
+    }
+    if ((size_t)n > size - 2){
+        n = size - 2; } // cut short, still room for the newline
+    buf[n++] = '\n';
+    buf[n] = '\0';
+    return n;
+}
+
+void log_write(loglevel_t level, const char* file, int line, const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+
+    struct log_ring* ring = NULL;
+    if (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)){
+        ring = log_thread_ring(); }
+
+    if (!ring){ // no backend, print here like always
+        char buf[LOG_LINE_BYTES];
+        size_t len = log_format(buf, sizeof(buf), level, file, line, fmt, ap);
+        fwrite(buf, 1, len, stdout);
+        va_end(ap);
+        return;
+    }
+
+    unsigned long head = ring->head;
+    if (head - __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE) >= LOG_RING_LINES){
+        __atomic_add_fetch(&log_dropped_lines, 1, __ATOMIC_RELAXED);
+        va_end(ap);
+        return;
+    }
+    struct log_line* l = &(ring->lines[head % LOG_RING_LINES]);
+    l->len = log_format(l->text, LOG_LINE_BYTES, level, file, line, fmt, ap);
+    __atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+    va_end(ap);
+}
+
+// write out everything waiting, returns lines written
+static int log_drain(void)
+{
+    int written = 0;
+    pthread_mutex_lock(&log_rings_lock);
+    struct log_ring** rp = &log_rings;
+    while (*rp){
+        struct log_ring* ring = *rp;
+        short orphaned = __atomic_load_n(&(ring->orphaned), __ATOMIC_ACQUIRE);
+        unsigned long head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+        unsigned long tail = ring->tail;
+        for (; tail != head; ++tail, ++written){
+            struct log_line* l = &(ring->lines[tail % LOG_RING_LINES]);
+            fwrite(l->text, 1, l->len, log_file);
+        }
+        __atomic_store_n(&(ring->tail), tail, __ATOMIC_RELEASE);
+
+        if (orphaned){ // its thread is gone and we've read it all
+            *rp = ring->next;
+            free(ring);
+        }else{
+            rp = &(ring->next);
+        }
+    }
+    pthread_mutex_unlock(&log_rings_lock);
+    if (written){
+        fflush(log_file); }
+    return written;
+}
+
+static void* log_writer_main(void* arg)
+{
+    struct timespec period = { 0, LOG_WRITER_PERIOD_MS * 1000000 };
+    while (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)){
+        if (log_drain() == 0){
+            nanosleep(&period, NULL); }
+    }
+    log_drain();
+    return arg;
+}
+
+void log_set_level(logsys_t sys, loglevel_t level)
+{
+    if (sys == LOG_SYS_COUNT){
+        for (int i = 0; i < LOG_SYS_COUNT; ++i){
+            log_levels[i] = level; }
+        return;
+    }
+    if (sys < LOG_SYS_COUNT){
+        log_levels[sys] = level; }
+}
+
+int log_start(const char* path)
+{
+    if (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)){
+        return -1; }
+
+    log_file = fopen(path, "a");
+    if (!log_file){
+        log_err("failed to open log file %s", path);
+        return -1;
+    }
+    __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&log_writer, NULL, log_writer_main, NULL) != 0){
+        __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+        fclose(log_file);
+        log_file = NULL;
+        log_err("failed to start log writer");
+        return -1;
+    }
+    return 0;
+}
+
+void log_stop(void)
+{
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)){
+        return; }
+    __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+    pthread_join(log_writer, NULL);
+    fclose(log_file);
+    log_file = NULL;
+}
+
+unsigned long log_dropped(void)
+{
+    return __atomic_load_n(&log_dropped_lines, __ATOMIC_RELAXED);
+}
@@ -1,16 +1,63 @@
 #ifndef LOGGING_H
 #define LOGGING_H
 
+#include <stdio.h>
+
 typedef enum {ERROR, WARN, INFO, OTHER} loglevel_t;
 
-#define log_err(M, ...) printf("[ERROR] (%s:%d) " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+/**
+ * subsystems that can be filtered separately. a source file sets LOG_SUBSYS
+ * before including this to say which one its log_* lines belong to
+ */
+typedef enum {LOG_SYS_GENERAL, LOG_SYS_NET, LOG_SYS_ROUTING, LOG_SYS_MAINT, LOG_SYS_COUNT} logsys_t;
+
+#ifndef LOG_SUBSYS
+#define LOG_SUBSYS LOG_SYS_GENERAL
+#endif // LOG_SUBSYS
+
+// longest line kept, longer ones are cut short
+#define LOG_LINE_BYTES 256
+// lines each thread can have waiting for the writer, more are dropped
+#define LOG_RING_LINES 1024
+// how often the writer looks for lines
+#define LOG_WRITER_PERIOD_MS 5
+
+// highest level enabled for each subsystem, so a disabled line costs one compare
+extern volatile unsigned char log_levels[LOG_SYS_COUNT];
+
+void log_write(loglevel_t level, const char* file, int line, const char* fmt, ...)
+        __attribute__((format(printf, 4, 5)));
+
+#define log_sys(L, S, M, ...) do { if ((L) <= log_levels[(S)]) \
+        log_write((L), __FILE__, __LINE__, M, ##__VA_ARGS__); } while (0)
+
+#define log_err(M, ...) log_sys(ERROR, LOG_SUBSYS, M, ##__VA_ARGS__)
+
+#define log_warn(M, ...) log_sys(WARN, LOG_SUBSYS, M, ##__VA_ARGS__)
+
+#define log_info(M, ...) log_sys(INFO, LOG_SUBSYS, M, ##__VA_ARGS__)
+
+/**
+ * set the highest level logged for a subsystem, or every subsystem if sys is
+ * LOG_SYS_COUNT. defaults to WARN when built with NDEBUG, INFO otherwise
+ */
+void log_set_level(logsys_t sys, loglevel_t level);
+
+/**
+ * from now on lines are formatted into a per thread ring and written to path
+ * by a background thread, instead of printed to stdout by the caller.
+ * returns 0 on success
+ */
+int log_start(const char* path);
 
-#define log_warn(M, ...) printf("[WARN] (%s:%d) " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+/**
+ * write out what's left and go back to printing to stdout
+ */
+void log_stop(void);
 
-#ifdef NDEBUG
-#define log_info(M, ...)
-#else
-#define log_info(M, ...) printf("[INFO] (%s:%d) " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
-#endif // DEBUG
+/**
+ * lines dropped because a thread's ring was full
+ */
+unsigned long log_dropped(void);
 
 #endif // LOGGING_H
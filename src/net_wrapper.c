@@ -3,66 +3,133 @@
 #include <event2/buffer.h>
 #include "net_wrapper.h"
 
+#define LOG_SUBSYS LOG_SYS_NET
+#include "logging.h"
+
 #define INIT_MAX_HANDLERS 8
-#define HANDLER_NAME_LEN 16
 
 struct netw_handler{
     net_connection_event_cb_t incoming_connection_cb;
     void* incoming_cb_arg;
 };
 
-static pthread_mutex_t handlers_lock;
-static int netw_num_handlers = 0;
-static int netw_max_handlers = INIT_MAX_HANDLERS;
-static struct netw_handler *handlers;
+/*
+ * the handler table is read on every incoming connection and changed hardly
+ * ever, so readers take no lock: changes are made to a copy under
+ * handlers_lock and the copy published in one atomic store. replaced tables
+ * are kept until netw_destroy as a reader may still be looking at one
+ */
+struct netw_table{
+    int num;
+    int max;
+    struct netw_table* retired; // the table this one replaced
+    struct netw_handler handlers[];
+};
 
-void netw_incomming_cb(int connection, short type, void *arg)
+static pthread_mutex_t handlers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct netw_table* handlers = NULL;
+
+static struct netw_table* netw_table_get()
 {
-    struct net_server* net = (struct net_server*)arg;
-    size_t line_len;
+    return __atomic_load_n(&handlers, __ATOMIC_ACQUIRE);
+}
 
-    char* endptr;
-    char* token;
+// must use lock with this!!!
+static struct netw_table* netw_table_copy(int max)
+{
+    struct netw_table* old = handlers;
+    struct netw_table* t = malloc(sizeof(struct netw_table) + sizeof(struct netw_handler) * max);
+    if (!t){
+        log_err("failed to malloc handler table");
+        return NULL; }
+    t->num = old ? old->num : 0;
+    t->max = max;
+    t->retired = old;
+    if (old){
+        memcpy(t->handlers, old->handlers, sizeof(struct netw_handler) * old->num); }
+    return t;
+}
+
+// must use lock with this!!!
+static void netw_table_publish(struct netw_table* t)
+{
+    __atomic_store_n(&handlers, t, __ATOMIC_RELEASE);
+}
 
+// first byte of a new connection: which handler it's for
+void netw_select_cb(int connection, void *arg)
+{
+    struct net_server* net = (struct net_server*)arg;
     struct evbuffer *read_buf = net_connection_get_read_buffer(net, connection);
-    token = evbuffer_readln(read_buf, &line_len, EVBUFFER_EOL_LF);
-    int h_id = strtol(token, &endptr, 16);
+    unsigned char h_id;
 
-    pthread_mutex_lock(&handlers_lock);
-    if (h_id < 0 || h_id > netw_num_handlers){
-        pthread_mutex_unlock(&handlers_lock);
+    if (evbuffer_remove(read_buf, &h_id, 1) < 1){
+        return; } // wait for it
 
+    struct netw_table* t = netw_table_get();
+    if (!t || h_id >= t->num || !t->handlers[h_id].incoming_connection_cb){
+        log_warn("connection for unknown handler %d", h_id);
+        net_connection_close(net, connection);
         return;
     }
-    struct netw_handler* h = &(handlers[h_id]);
+    struct netw_handler h = t->handlers[h_id];
 
-    pthread_mutex_lock(&handlers_lock);
+    net_connection_set_read_cb(net, connection, NULL);
+    net_connection_set_event_cb(net, connection, NULL);
+    h.incoming_connection_cb(connection, BEV_EVENT_CONNECTED, h.incoming_cb_arg);
+    // the rest may have arrived with the selector, the handler's read cb won't see it otherwise
+    net_connection_trigger_read(net, connection);
+}
 
-    h->incoming_connection_cb(connection, type, h->incoming_cb_arg);
+// closed or failed before saying which handler it was for
+void netw_select_event_cb(int connection, short type, void *arg)
+{
+    struct net_server* net = (struct net_server*)arg;
+    if (type & (BEV_EVENT_ERROR|BEV_EVENT_TIMEOUT|BEV_EVENT_EOF)){
+        net_connection_close(net, connection); }
+}
 
-    free(token);
+void netw_incomming_cb(int connection, short type, void *arg)
+{
+    struct net_server* net = (struct net_server*)arg;
+    if (type & BEV_EVENT_CONNECTED){
+        net_connection_set_cb_arg(net, connection, net);
+        net_connection_set_read_cb(net, connection, netw_select_cb);
+        net_connection_set_event_cb(net, connection, netw_select_event_cb);
+    }
 }
 
 int netw_init()
 {
-    pthread_mutex_init(&handlers_lock, NULL);
-    handlers = malloc(sizeof(struct netw_handler) * netw_max_handlers);
-    return (handlers ? 0 : -1);
+    pthread_mutex_lock(&handlers_lock);
+    if (!handlers){
+        struct netw_table* t = netw_table_copy(INIT_MAX_HANDLERS);
+        if (t){
+            netw_table_publish(t); }
+    }
+    int rc = handlers ? 0 : -1;
+    pthread_mutex_unlock(&handlers_lock);
+    return rc;
 }
 
 void netw_destroy()
 {
     pthread_mutex_lock(&handlers_lock);
-    if (handlers){
-        free(handlers);
+    struct netw_table* t = handlers;
+    netw_table_publish(NULL);
+    while (t){
+        struct netw_table* next = t->retired;
+        free(t);
+        t = next;
     }
     pthread_mutex_unlock(&handlers_lock);
-    pthread_mutex_destroy(&handlers_lock);
 }
 
 struct net_server* netw_net_server_create(const uint16_t port)
 {
     struct net_server* srv = net_server_create(port, netw_incomming_cb, NULL);
+    if (!srv){
+        return NULL; }
 
     net_server_set_incoming_cb_arg(srv, srv);
 
@@ -72,12 +139,16 @@ struct net_server* netw_net_server_create(const uint16_t port)
 int netw_handler_set_cb(int handler_id, net_connection_event_cb_t incoming_connection_cb)
 {
     pthread_mutex_lock(&handlers_lock);
-    if (handler_id < 0 || handler_id > netw_num_handlers){
+    if (!handlers || handler_id < 0 || handler_id >= handlers->num){
         pthread_mutex_unlock(&handlers_lock);
         return -1; }
 
-    struct netw_handler* h = &(handlers[handler_id]);
-    h->incoming_connection_cb = incoming_connection_cb;
+    struct netw_table* t = netw_table_copy(handlers->max);
+    if (!t){
+        pthread_mutex_unlock(&handlers_lock);
+        return -1; }
+    t->handlers[handler_id].incoming_connection_cb = incoming_connection_cb;
+    netw_table_publish(t);
 
     pthread_mutex_unlock(&handlers_lock);
     return 0;
@@ -86,12 +157,16 @@ int netw_handler_set_cb(int handler_id, net_connection_event_cb_t incoming_conne
 int netw_handler_set_cb_arg(int handler_id, void* incoming_cb_arg)
 {
     pthread_mutex_lock(&handlers_lock);
-    if (handler_id < 0 || handler_id > netw_num_handlers){
+    if (!handlers || handler_id < 0 || handler_id >= handlers->num){
         pthread_mutex_unlock(&handlers_lock);
         return -1; }
 
-    struct netw_handler* h = &(handlers[handler_id]);
-    h->incoming_cb_arg = incoming_cb_arg;
+    struct netw_table* t = netw_table_copy(handlers->max);
+    if (!t){
+        pthread_mutex_unlock(&handlers_lock);
+        return -1; }
+    t->handlers[handler_id].incoming_cb_arg = incoming_cb_arg;
+    netw_table_publish(t);
 
     pthread_mutex_unlock(&handlers_lock);
     return 0;
@@ -100,20 +175,22 @@ int netw_handler_set_cb_arg(int handler_id, void* incoming_cb_arg)
 int netw_register_handler(net_connection_event_cb_t incoming_connection_cb, void* incoming_cb_arg)
 {
     pthread_mutex_lock(&handlers_lock);
+    if (!handlers || handlers->num >= NETW_MAX_HANDLERS){
+        pthread_mutex_unlock(&handlers_lock);
+        return -1; }
 
-    if (netw_num_handlers == netw_max_handlers){
-        struct netw_handler* tmp_hand = malloc(sizeof(struct netw_handler) * netw_max_handlers * 2);
-        memcpy(handlers, tmp_hand, sizeof(struct netw_handler) * netw_max_handlers);
-        free(handlers);
-        netw_max_handlers *= 2;
-        handlers = tmp_hand;
-    }
+    int max = handlers->max;
+    if (handlers->num == max){
+        max = (max * 2 > NETW_MAX_HANDLERS) ? NETW_MAX_HANDLERS : max * 2; }
+    struct netw_table* t = netw_table_copy(max);
+    if (!t){
+        pthread_mutex_unlock(&handlers_lock);
+        return -1; }
 
-    int h_id = netw_num_handlers;
-    netw_num_handlers++;
-    struct netw_handler* h = &(handlers[netw_num_handlers]);
-    h->incoming_connection_cb = incoming_connection_cb;
-    h->incoming_cb_arg = incoming_cb_arg;
+    int h_id = t->num++;
+    t->handlers[h_id].incoming_connection_cb = incoming_connection_cb;
+    t->handlers[h_id].incoming_cb_arg = incoming_cb_arg;
+    netw_table_publish(t);
 
     pthread_mutex_unlock(&handlers_lock);
     return h_id;
@@ -121,15 +198,16 @@ int netw_register_handler(net_connection_event_cb_t incoming_connection_cb, void
 
 int netw_net_connection_create(struct net_server* srv, const uint32_t IP, const uint16_t port, int handler_id)
 {
-    pthread_mutex_lock(&handlers_lock);
-    if (handler_id < 0 || handler_id > netw_num_handlers){
-        pthread_mutex_unlock(&handlers_lock);
-        return -1;
-    }
-    pthread_mutex_unlock(&handlers_lock);
+    struct netw_table* t = netw_table_get();
+    if (!t || handler_id < 0 || handler_id >= t->num){
+        return -1; }
+
     int conn = net_connection_create(srv, IP, port);
+    if (conn < 0){
+        return conn; }
+    unsigned char h_id = (unsigned char) handler_id;
     struct evbuffer* wbuf = net_connection_get_write_buffer(srv, conn);
-    evbuffer_add_printf(wbuf, "%X\n", handler_id);
+    evbuffer_add(wbuf, &h_id, 1);
 
     return conn;
 }
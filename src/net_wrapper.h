@@ -4,9 +4,14 @@
 #include "netio.h"
 
 /**
- *  this wrapper is used to direct incoming messages to the appropriate layer
+ *  this wrapper is used to direct incoming messages to the appropriate layer.
+ *  every connection made through it starts with one byte, the id of the
+ *  handler (protocol) that should get it at the other end
  */
 
+// handler ids are one byte on the wire
+#define NETW_MAX_HANDLERS 256
+
 int netw_init();
 
 void netw_destroy();
@@ -17,6 +22,9 @@ int netw_handler_set_cb(int handler_id, net_connection_event_cb_t incoming_conne
 
 int netw_handler_set_cb_arg(int handler_id, void* incoming_cb_arg);
 
+/**
+ * returns the new handler's id, or -1 if there are NETW_MAX_HANDLERS already
+ */
 int netw_register_handler(net_connection_event_cb_t incoming_connection_cb, void* incoming_cb_arg);
 
 int netw_net_connection_create(struct net_server* srv, const uint32_t IP, const uint16_t port, int handler_id);
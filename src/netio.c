@@ -1,33 +1,13 @@
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
+#include <sys/socket.h>
 
 #include "netio.h"
-#include "logging.h"
-
-struct net_connection{
-    struct bufferevent* bev;
-    struct sockaddr_in sin;
-    net_connection_data_cb_t read_cb;
-    net_connection_data_cb_t write_cb;
-    net_connection_event_cb_t evt_cb;
-    void* upper_cb_arg;
-    struct net_conn_cb_arg *net_cb_arg;
-};
-
-struct net_server{
-    struct event_base *base;
-    struct evconnlistener *listener_evt;
-    struct net_connection connections[MAX_OPEN_CONNECTIONS];
-    pthread_mutex_t connections_lock;
-    net_connection_event_cb_t incoming_handler;
-    void* incoming_handler_arg;
-};
 
-struct net_conn_cb_arg{
-    int conn;
-    struct net_server* srv;
-};
+#define LOG_SUBSYS LOG_SYS_NET
+#include "logging.h"
 
 //
 // helpers
@@ -38,12 +18,32 @@ int net_valid_connection_num(int connection)
     return !(connection < 0 || connection >= MAX_OPEN_CONNECTIONS);
 }
 
+static uint64_t net_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+// tell the observer how an outgoing connect went
+static void net_connect_finished(struct net_server* srv, struct net_connection* connection, short connected)
+{
+    if (!connection->connect_started){
+        return; }
+    uint64_t took = net_now_us() - connection->connect_started;
+    connection->connect_started = 0;
+    if (srv->connect_observer){
+        srv->connect_observer(ntohl(connection->sin.sin_addr.s_addr), ntohs(connection->sin.sin_port),
+                took, connected, srv->connect_observer_arg);
+    }
+}
+
 // must use locks with this!!!
 int net_empty_connection_slot(struct net_server* srv)
 {
     int conn = -1;
     for(int i = 0; i < MAX_OPEN_CONNECTIONS; ++i){
-        if (srv->connections[i].bev == NULL){
+        if (srv->connections[i].bev == NULL && srv->connections[i].uring == NULL){
             conn = i;
             break;
         }
@@ -52,14 +52,142 @@ int net_empty_connection_slot(struct net_server* srv)
     return conn;
 }
 
+//
+// admission control
+//
+
+static int net_connection_start(struct net_server* srv, const int conn);
+
+// must use locks with this!!!
+static void net_listener_pause(struct net_server* srv)
+{
+    if (srv->listener_paused){
+        return; }
+    log_warn("%d incoming connections, pausing the listener", srv->n_in);
+#ifdef NET_HAVE_URING
+    if (srv->uring){
+        net_uring_listen(srv, 0); }
+#endif // NET_HAVE_URING
+    if (srv->listener_evt){
+        evconnlistener_disable(srv->listener_evt); }
+    srv->listener_paused = 1;
+    struct timeval tv = {0, NET_LISTENER_RETRY_MS * 1000};
+    event_add(srv->listener_retry_evt, &tv);
+}
+
+// must use locks with this!!!
+static void net_listener_resume(struct net_server* srv)
+{
+    if (!srv->listener_paused || srv->n_in > NET_INBOUND_RESUME){
+        return; }
+    log_info("%d incoming connections, listening again", srv->n_in);
+    event_del(srv->listener_retry_evt);
+    srv->listener_paused = 0;
+#ifdef NET_HAVE_URING
+    if (srv->uring){
+        net_uring_listen(srv, 1); }
+#endif // NET_HAVE_URING
+    if (srv->listener_evt){
+        evconnlistener_enable(srv->listener_evt); }
+}
+
+static void net_listener_retry_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct net_server* srv = (struct net_server*) arg;
+    pthread_mutex_lock(&(srv->connections_lock));
+    net_listener_resume(srv);
+    if (srv->listener_paused){
+        struct timeval tv = {0, NET_LISTENER_RETRY_MS * 1000};
+        event_add(srv->listener_retry_evt, &tv);
+    }
+    pthread_mutex_unlock(&(srv->connections_lock));
+}
+
+// accept failed (most likely out of fds) or there's no room: stop accepting for a while
+void net_accept_pause(struct net_server* srv)
+{
+    pthread_mutex_lock(&(srv->connections_lock));
+    net_listener_pause(srv);
+    pthread_mutex_unlock(&(srv->connections_lock));
+}
+
+static void net_listener_error_cb(struct evconnlistener *listener, void *arg)
+{
+    log_warn("accept failed: %s", evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+    net_accept_pause((struct net_server*) arg);
+}
+
+// must use locks with this!!!
+// a connection is going, give back what it counted against
+static void net_connection_release(struct net_server* srv, struct net_connection* connection)
+{
+    if (connection->incoming){
+        --srv->n_in;
+        connection->incoming = 0;
+        net_listener_resume(srv);
+    }
+    if (connection->out_state == NET_OUT_ACTIVE){
+        --srv->n_out;
+        if (srv->n_queued > 0){
+            event_active(srv->start_queued_evt, 0, 0); }
+    }else if (connection->out_state == NET_OUT_QUEUED){
+        --srv->n_queued;
+    }
+    connection->out_state = NET_OUT_NONE;
+}
+
+// start the longest waiting outgoing connections there's now room for
+static void net_start_queued_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct net_server* srv = (struct net_server*) arg;
+    int start[NET_MAX_OUTBOUND];
+    int n_start = 0;
+
+    pthread_mutex_lock(&(srv->connections_lock));
+    while (srv->n_queued > 0 && srv->n_out < NET_MAX_OUTBOUND){
+        int oldest = -1;
+        for (int i = 0; i < MAX_OPEN_CONNECTIONS; ++i){
+            if (srv->connections[i].out_state == NET_OUT_QUEUED &&
+                    (oldest < 0 || srv->connections[i].queued_seq < srv->connections[oldest].queued_seq)){
+                oldest = i; }
+        }
+        srv->connections[oldest].out_state = NET_OUT_ACTIVE;
+        --srv->n_queued;
+        ++srv->n_out;
+        start[n_start++] = oldest;
+    }
+    pthread_mutex_unlock(&(srv->connections_lock));
+
+    for (int i = 0; i < n_start; ++i){
+        struct net_connection* connection = &(srv->connections[start[i]]);
+        if (net_connection_start(srv, start[i]) < 0 && connection->evt_cb){
+            connection->evt_cb(start[i], BEV_EVENT_ERROR, connection->upper_cb_arg); }
+    }
+}
+
+int net_server_busy(struct net_server* srv)
+{
+    pthread_mutex_lock(&(srv->connections_lock));
+    int busy = srv->n_in >= NET_INBOUND_BUSY || srv->listener_paused;
+    pthread_mutex_unlock(&(srv->connections_lock));
+    return busy;
+}
+
+uint16_t net_server_get_port(struct net_server* srv)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (srv->listen_fd < 0 || getsockname(srv->listen_fd, (struct sockaddr*)&addr, &addr_len) < 0){
+        return 0; }
+    return ntohs(addr.sin_port);
+}
+
 //
 // connection callbacks
 //
 
-void net_connection_read_cb(struct bufferevent *bev, void *ctx)
+void net_connection_dispatch_read(struct net_server* srv, const int conn)
 {
-    struct net_server* srv = ((struct net_conn_cb_arg*) ctx)->srv;
-    int conn = ((struct net_conn_cb_arg*) ctx)->conn;
     //log_info("connection read ready %d", conn);
     if(net_valid_connection_num(conn)){
         struct net_connection* connection = &(srv->connections[conn]);
@@ -68,10 +196,8 @@ void net_connection_read_cb(struct bufferevent *bev, void *ctx)
     }
 }
 
-void net_connection_write_cb(struct bufferevent *bev, void *ctx)
+void net_connection_dispatch_write(struct net_server* srv, const int conn)
 {
-    struct net_server* srv = ((struct net_conn_cb_arg*) ctx)->srv;
-    int conn = ((struct net_conn_cb_arg*) ctx)->conn;
     //log_info("connection write ready %d", conn);
     if(net_valid_connection_num(conn)){
         struct net_connection* connection = &(srv->connections[conn]);
@@ -80,25 +206,316 @@ void net_connection_write_cb(struct bufferevent *bev, void *ctx)
     }
 }
 
-void net_connection_event_cb(struct bufferevent *bev, short what, void *ctx)
+void net_connection_dispatch_event(struct net_server* srv, const int conn, short what)
 {
-
-    struct net_server* srv = ((struct net_conn_cb_arg*) ctx)->srv;
-    int conn = ((struct net_conn_cb_arg*) ctx)->conn;
     //log_info("event occurred on connection %d", conn);
     if(net_valid_connection_num(conn)){
         struct net_connection* connection = &(srv->connections[conn]);
+        if (what & BEV_EVENT_CONNECTED){
+            net_connect_finished(srv, connection, 1);
+        }else if (what & (BEV_EVENT_ERROR|BEV_EVENT_TIMEOUT|BEV_EVENT_EOF)){
+            net_connect_finished(srv, connection, 0);
+        }
         if (connection->evt_cb)
             connection->evt_cb(conn, what, connection->upper_cb_arg);
         // TODO close/cleanup on error?
     }
 }
 
+void net_connection_read_cb(struct bufferevent *bev, void *ctx)
+{
+    struct net_conn_cb_arg* cb_arg = (struct net_conn_cb_arg*) ctx;
+    net_connection_dispatch_read(cb_arg->srv, cb_arg->conn);
+}
+
+void net_connection_write_cb(struct bufferevent *bev, void *ctx)
+{
+    struct net_conn_cb_arg* cb_arg = (struct net_conn_cb_arg*) ctx;
+    net_connection_dispatch_write(cb_arg->srv, cb_arg->conn);
+}
+
+void net_connection_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+    struct net_conn_cb_arg* cb_arg = (struct net_conn_cb_arg*) ctx;
+    net_connection_dispatch_event(cb_arg->srv, cb_arg->conn, what);
+}
+
+// whatever does the connection's io, to tell if a slot was reused
+static void* net_connection_io(struct net_connection* connection)
+{
+    return connection->bev ? (void*) connection->bev : (void*) connection->uring;
+}
+
+//
+// delay shim
+//
+
+#ifdef NET_DELAY_SHIM
+/*
+ * test builds only (make delayshim): DHT_DELAY="port:ms,port:ms..." puts the
+ * nodes on those ports ms further away. datagrams and connects between two
+ * nodes are held back half the sum of their delays, so round trips take the sum
+ */
+
+#define NET_SHIM_MAX_PORTS 64
+
+static struct { uint16_t port; uint32_t ms; } net_shim_delays[NET_SHIM_MAX_PORTS];
+static int net_shim_n = 0;
+static pthread_once_t net_shim_once = PTHREAD_ONCE_INIT;
+
+static void net_shim_load(void)
+{
+    const char* spec = getenv("DHT_DELAY");
+    while (spec && *spec && net_shim_n < NET_SHIM_MAX_PORTS){
+        char* end;
+        unsigned long port = strtoul(spec, &end, 10);
+        if (*end != ':'){
+            break; }
+        unsigned long ms = strtoul(end + 1, &end, 10);
+        net_shim_delays[net_shim_n].port = (uint16_t) port;
+        net_shim_delays[net_shim_n].ms = (uint32_t) ms;
+        ++net_shim_n;
+        log_warn("delay shim: %lums to port %lu", ms, port);
+        spec = (*end == ',') ? end + 1 : end;
+    }
+}
+
+static uint32_t net_shim_port_ms(uint16_t port)
+{
+    pthread_once(&net_shim_once, net_shim_load);
+    for (int i = 0; i < net_shim_n; ++i){
+        if (net_shim_delays[i].port == port){
+            return net_shim_delays[i].ms; }
+    }
+    return 0;
+}
+
+static uint32_t net_shim_delay_ms(struct net_server* srv, uint16_t port)
+{
+    return (net_shim_port_ms(srv->shim_port) + net_shim_port_ms(port)) / 2;
+}
+
+struct net_shim_dgram{
+    evutil_socket_t fd;
+    struct sockaddr_in to;
+    size_t len;
+    char data[NET_MAX_DGRAM];
+};
+
+static void net_shim_dgram_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct net_shim_dgram* d = (struct net_shim_dgram*) arg;
+    sendto(d->fd, d->data, d->len, 0, (struct sockaddr*)&(d->to), sizeof(d->to));
+    free(d);
+}
+
+struct net_shim_connect{
+    struct net_server* srv;
+    int conn;
+    void* io; // the slot may have been closed and reused meanwhile
+};
+
+static int net_connection_connect(struct net_server* srv, const int conn);
+
+static void net_shim_connect_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct net_shim_connect* c = (struct net_shim_connect*) arg;
+    struct net_connection* connection = &(c->srv->connections[c->conn]);
+    if (net_connection_io(connection) == c->io && net_connection_connect(c->srv, c->conn) < 0 && connection->evt_cb){
+        connection->evt_cb(c->conn, BEV_EVENT_ERROR, connection->upper_cb_arg); }
+    free(c);
+}
+#endif // NET_DELAY_SHIM
+
+//
+// datagrams
+//
+
+void net_dgram_read_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct net_server* srv = (struct net_server*) arg;
+    char buf[NET_MAX_DGRAM];
+    struct sockaddr_in from;
+    socklen_t from_len;
+
+    for (;;){
+        from_len = sizeof(from);
+        ssize_t len = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr*)&from, &from_len);
+        if (len < 0){
+            break; } // EAGAIN, drained the socket
+        if (srv->dgram_cb){
+            srv->dgram_cb(ntohl(from.sin_addr.s_addr), ntohs(from.sin_port), buf, len, srv->dgram_cb_arg);
+        }
+    }
+}
+
+// bind a UDP socket to the same port as the listener
+static int net_dgram_open(struct net_server* srv)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+
+    if (getsockname(srv->listen_fd, (struct sockaddr*)&addr, &addr_len) < 0){
+        return -1; }
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    srv->dgram_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (srv->dgram_fd < 0){
+        return -1; }
+    evutil_make_socket_nonblocking(srv->dgram_fd);
+    evutil_make_socket_closeonexec(srv->dgram_fd);
+    evutil_make_listen_socket_reuseable(srv->dgram_fd);
+
+    if (bind(srv->dgram_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0){
+        evutil_closesocket(srv->dgram_fd);
+        return -1;
+    }
+
+    srv->dgram_evt = event_new(srv->base, srv->dgram_fd, EV_READ|EV_PERSIST, net_dgram_read_cb, srv);
+    if (!srv->dgram_evt || event_add(srv->dgram_evt, NULL) < 0){
+        if (srv->dgram_evt){ event_free(srv->dgram_evt); }
+        evutil_closesocket(srv->dgram_fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void net_dgram_close(struct net_server* srv)
+{
+    if (srv->dgram_evt){
+        event_free(srv->dgram_evt);
+        srv->dgram_evt = NULL;
+    }
+    if (srv->dgram_fd >= 0){
+        evutil_closesocket(srv->dgram_fd);
+        srv->dgram_fd = -1;
+    }
+}
+
+void net_server_set_dgram_cb(struct net_server* srv, net_dgram_cb_t cb, void* arg)
+{
+    srv->dgram_cb = cb;
+    srv->dgram_cb_arg = arg;
+}
+
+int net_dgram_send(struct net_server* srv, const uint32_t IP, const uint16_t port, const void* data, size_t len)
+{
+    if (!srv || srv->dgram_fd < 0 || len > NET_MAX_DGRAM){
+        return -1; }
+
+    struct sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = htonl(IP);
+    to.sin_port = htons(port);
+
+#ifdef NET_DELAY_SHIM
+    uint32_t delay_ms = net_shim_delay_ms(srv, port);
+    if (delay_ms){
+        struct net_shim_dgram* d = malloc(sizeof(struct net_shim_dgram));
+        if (!d){
+            return -1; }
+        d->fd = srv->dgram_fd;
+        d->to = to;
+        d->len = len;
+        memcpy(d->data, data, len);
+        struct timeval tv = {delay_ms / 1000, (delay_ms % 1000) * 1000};
+        if (event_base_once(srv->base, -1, EV_TIMEOUT, net_shim_dgram_cb, d, &tv) < 0){
+            free(d);
+            return -1;
+        }
+        return 0;
+    }
+#endif // NET_DELAY_SHIM
+
+    if (sendto(srv->dgram_fd, data, len, 0, (struct sockaddr*)&to, sizeof(to)) < 0){
+        return -1; }
+    return 0;
+}
+
 //
 // server_ creation etc.
 //
 
+static int net_default_backend = NET_BACKEND_LIBEVENT;
+
+void net_set_default_backend(int backend)
+{
+    net_default_backend = backend;
+}
+
 struct net_server* net_server_create(const uint16_t port, net_connection_event_cb_t incoming_connection_cb, void* incoming_cb_arg)
+{
+    return net_server_create_backend(port, incoming_connection_cb, incoming_cb_arg, net_default_backend);
+}
+
+#ifdef NET_HAVE_URING
+// the io_uring backend accepts on a plain listening socket
+static evutil_socket_t net_listen_socket(struct sockaddr_in* addr)
+{
+    evutil_socket_t fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0){
+        return -1; }
+    evutil_make_socket_nonblocking(fd);
+    evutil_make_socket_closeonexec(fd);
+#ifndef DNDEBUG
+    evutil_make_listen_socket_reuseable(fd);
+#endif
+    if (bind(fd, (struct sockaddr*)addr, sizeof(struct sockaddr_in)) < 0 || listen(fd, SOMAXCONN) < 0){
+        evutil_closesocket(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif // NET_HAVE_URING
+
+static int net_listener_open(struct net_server* srv, struct sockaddr_in* addr)
+{
+    if (srv->backend == NET_BACKEND_LIBEVENT){
+        srv->listener_evt = evconnlistener_new_bind(srv->base, listen_evt_cb, (void*) srv,
+#ifndef DNDEBUG
+                                    LEV_OPT_REUSEABLE |
+#endif
+                                    LEV_OPT_CLOSE_ON_FREE, -1,
+                                    (struct sockaddr*)addr, sizeof(struct sockaddr_in));
+        if (!srv->listener_evt){
+            return -1; }
+        evconnlistener_set_error_cb(srv->listener_evt, net_listener_error_cb);
+        srv->listen_fd = evconnlistener_get_fd(srv->listener_evt);
+        return 0;
+    }
+#ifdef NET_HAVE_URING
+    if (srv->backend == NET_BACKEND_URING){
+        srv->listen_fd = net_listen_socket(addr);
+        if (srv->listen_fd < 0){
+            return -1; }
+        if (net_uring_create(srv) < 0){
+            evutil_closesocket(srv->listen_fd);
+            return -1;
+        }
+        return 0;
+    }
+#endif // NET_HAVE_URING
+    log_err("net backend %d not available", srv->backend);
+    return -1;
+}
+
+static void net_listener_close(struct net_server* srv)
+{
+    if (srv->listener_evt){
+        evconnlistener_free(srv->listener_evt); // closes listen_fd
+        srv->listener_evt = NULL;
+    }
+#ifdef NET_HAVE_URING
+    if (srv->uring){
+        net_uring_destroy(srv);
+        evutil_closesocket(srv->listen_fd);
+    }
+#endif // NET_HAVE_URING
+    srv->listen_fd = -1;
+}
+
+struct net_server* net_server_create_backend(const uint16_t port, net_connection_event_cb_t incoming_connection_cb, void* incoming_cb_arg, int backend)
 {
     struct net_server *srv;
     struct sockaddr_in serv_addr; //socket address to bind to
@@ -127,25 +544,64 @@ struct net_server* net_server_create(const uint16_t port, net_connection_event_c
         return NULL;
     }
 
+    srv->backend = backend;
+    srv->listener_evt = NULL;
+    srv->uring = NULL;
+    srv->listen_fd = -1;
     srv->incoming_handler = incoming_connection_cb;
     srv->incoming_handler_arg = incoming_cb_arg;
+    srv->connect_observer = NULL;
+    srv->connect_observer_arg = NULL;
+    srv->dgram_fd = -1;
+    srv->dgram_evt = NULL;
+    srv->dgram_cb = NULL;
+    srv->dgram_cb_arg = NULL;
+    srv->n_in = 0;
+    srv->n_out = 0;
+    srv->n_queued = 0;
+    srv->queue_seq = 0;
+    srv->listener_paused = 0;
+#ifdef NET_DELAY_SHIM
+    srv->shim_port = port;
+#endif // NET_DELAY_SHIM
+    memset(srv->connections, 0, sizeof(srv->connections));
+
+    // the lock first, the io_uring backend starts accepting straight away
+    if (pthread_mutex_init(&(srv->connections_lock), NULL) != 0){
+        log_err("failed to create connections lock mutex");
+        event_base_free(srv->base);
+        free(srv);
+        return NULL;
+    }
 
-    srv->listener_evt = evconnlistener_new_bind(srv->base, listen_evt_cb, (void*) srv,
-#ifndef DNDEBUG
-                                LEV_OPT_REUSEABLE |
-#endif
-                                LEV_OPT_CLOSE_ON_FREE, -1,
-                                (struct sockaddr*)&serv_addr, sizeof(serv_addr));
-    if (!srv->listener_evt){ // error creating listener
+    srv->start_queued_evt = event_new(srv->base, -1, 0, net_start_queued_cb, srv);
+    srv->listener_retry_evt = evtimer_new(srv->base, net_listener_retry_cb, srv);
+    if (!srv->start_queued_evt || !srv->listener_retry_evt){
+        log_err("failed to create admission events");
+        if (srv->start_queued_evt){ event_free(srv->start_queued_evt); }
+        if (srv->listener_retry_evt){ event_free(srv->listener_retry_evt); }
+        pthread_mutex_destroy(&(srv->connections_lock));
+        event_base_free(srv->base);
+        free(srv);
+        return NULL;
+    }
+
+    if (net_listener_open(srv, &serv_addr) < 0){ // error creating listener
         log_err("failed to create listen socket");
+        event_free(srv->start_queued_evt);
+        event_free(srv->listener_retry_evt);
+        pthread_mutex_destroy(&(srv->connections_lock));
         event_base_free(srv->base);
         free(srv);
         return NULL;
     }
 
-    if (pthread_mutex_init(&(srv->connections_lock), NULL) != 0){
-        log_err("failed to create connections lock mutex");
-        evconnlistener_free(srv->listener_evt);
+    if (net_dgram_open(srv) < 0){
+        log_err("failed to create datagram socket");
+        net_listener_close(srv);
+        event_free(srv->start_queued_evt);
+        event_free(srv->listener_retry_evt);
+        pthread_mutex_destroy(&(srv->connections_lock));
         event_base_free(srv->base);
         free(srv);
         return NULL;
@@ -159,6 +615,12 @@ void net_server_set_incoming_cb_arg(struct net_server *srv, void* arg)
     srv->incoming_handler_arg = arg;
 }
 
+void net_server_set_connect_observer(struct net_server *srv, net_connect_observer_t cb, void* arg)
+{
+    srv->connect_observer = cb;
+    srv->connect_observer_arg = arg;
+}
+
 void net_server_stop(struct net_server* srv)
 {
     if(srv){
@@ -175,9 +637,11 @@ void net_server_destroy(struct net_server* srv)
         for(int i = 0; i < MAX_OPEN_CONNECTIONS; ++i){
             net_connection_close(srv, i);
         }
-        evconnlistener_disable(srv->listener_evt);
         event_base_loopbreak(srv->base);
-        evconnlistener_free(srv->listener_evt);
+        net_dgram_close(srv);
+        net_listener_close(srv);
+        event_free(srv->start_queued_evt);
+        event_free(srv->listener_retry_evt);
         event_base_free(srv->base);
         pthread_mutex_destroy(&(srv->connections_lock));
         free(srv);
@@ -193,31 +657,57 @@ struct event_base* net_get_base(struct net_server* srv)
 void listen_evt_cb(struct evconnlistener *listener, evutil_socket_t fd,
         struct sockaddr *addr, int socklen, void *arg)
 {
-
     //log_info("listen event callback");
-    struct net_server *srv = (struct net_server *) arg;
+    net_accept_fd((struct net_server *) arg, fd);
+}
 
-    struct event_base* base = evconnlistener_get_base(listener);
+int net_accept_full(struct net_server* srv)
+{
+    pthread_mutex_lock(&(srv->connections_lock));
+    int full = srv->listener_paused || srv->n_in >= NET_MAX_INBOUND || net_empty_connection_slot(srv) < 0;
+    pthread_mutex_unlock(&(srv->connections_lock));
+    return full;
+}
 
+void net_accept_fd(struct net_server* srv, evutil_socket_t fd)
+{
     pthread_mutex_lock(&(srv->connections_lock));
-    int conn = net_empty_connection_slot(srv);
+    int conn = (srv->n_in < NET_MAX_INBOUND) ? net_empty_connection_slot(srv) : -1;
     if (conn < 0){
-        // TODO log errors etc.
-        // connections are full
+        // full, the listener waits for room and the connector for the listener
+        log_warn("no room for incoming connection");
+        net_listener_pause(srv);
         pthread_mutex_unlock(&(srv->connections_lock));
+        evutil_closesocket(fd);
         return;
     }
 
     //log_info("creating connection %d", conn);
-    struct bufferevent *bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
-    srv->connections[conn].bev = bev;
+    struct bufferevent *bev = NULL;
+#ifdef NET_HAVE_URING
+    if (srv->uring){
+        if (net_uring_conn_open(srv, conn, fd) < 0){
+            pthread_mutex_unlock(&(srv->connections_lock));
+            evutil_closesocket(fd);
+            return;
+        }
+    }else
+#endif // NET_HAVE_URING
+    {
+        bev = bufferevent_socket_new(srv->base, fd, BEV_OPT_CLOSE_ON_FREE);
+        srv->connections[conn].bev = bev;
+        if (!bev){
+            pthread_mutex_unlock(&(srv->connections_lock));
+            evutil_closesocket(fd);
+            return;
+        }
+    }
+    srv->connections[conn].incoming = 1;
+    if (++srv->n_in >= NET_MAX_INBOUND){
+        net_listener_pause(srv); }
 
     pthread_mutex_unlock(&(srv->connections_lock));
 
-    if (!bev){
-        return;
-    }
-
     srv->connections[conn].net_cb_arg = malloc(sizeof(struct net_conn_cb_arg));
     if (!srv->connections[conn].net_cb_arg){
         net_connection_close(srv, conn);
@@ -226,12 +716,18 @@ void listen_evt_cb(struct evconnlistener *listener, evutil_socket_t fd,
     srv->connections[conn].net_cb_arg->conn = conn;
     srv->connections[conn].net_cb_arg->srv = srv;
 
-    bufferevent_setcb(bev, net_connection_read_cb, net_connection_write_cb, net_connection_event_cb, srv->connections[conn].net_cb_arg);
+    if (bev){
+        bufferevent_setcb(bev, net_connection_read_cb, net_connection_write_cb, net_connection_event_cb, srv->connections[conn].net_cb_arg); }
 
     //log_info("calling handler %d", conn);
     srv->incoming_handler(conn, BEV_EVENT_CONNECTED, srv->incoming_handler_arg);
 
-    bufferevent_enable(bev, EV_READ|EV_WRITE);
+    if (bev){
+        bufferevent_enable(bev, EV_READ|EV_WRITE); }
+#ifdef NET_HAVE_URING
+    else{
+        net_uring_conn_enable(srv, conn); }
+#endif // NET_HAVE_URING
 
     //log_info("incoming enabled %d", conn);
 }
@@ -263,13 +759,25 @@ int net_connection_create(struct net_server* srv, const uint32_t IP, const uint1
 
     struct sockaddr_in *sin = &(srv->connections[conn].sin);
 
-    srv->connections[conn].bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
-    struct bufferevent *bev = srv->connections[conn].bev;
-
-    if (!bev){
-        pthread_mutex_unlock(&(srv->connections_lock));
-        return -1;
+    struct bufferevent *bev = NULL;
+#ifdef NET_HAVE_URING
+    if (srv->uring){
+        if (net_uring_conn_open(srv, conn, -1) < 0){
+            pthread_mutex_unlock(&(srv->connections_lock));
+            return -1;
+        }
+    }else
+#endif // NET_HAVE_URING
+    {
+        srv->connections[conn].bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+        bev = srv->connections[conn].bev;
+        if (!bev){
+            pthread_mutex_unlock(&(srv->connections_lock));
+            return -1;
+        }
     }
+    srv->connections[conn].incoming = 0;
+    srv->connections[conn].out_state = NET_OUT_NONE;
 
     memset(sin, 0, sizeof(struct sockaddr_in));
     sin->sin_family = AF_INET;
@@ -279,13 +787,14 @@ int net_connection_create(struct net_server* srv, const uint32_t IP, const uint1
 
     srv->connections[conn].net_cb_arg = malloc(sizeof(struct net_conn_cb_arg));
     if (!srv->connections[conn].net_cb_arg){
-        net_connection_close(srv, conn);
         pthread_mutex_unlock(&(srv->connections_lock));
+        net_connection_close(srv, conn);
         return -1;
     }
     srv->connections[conn].net_cb_arg->conn = conn;
     srv->connections[conn].net_cb_arg->srv = srv;
-    bufferevent_setcb(bev, net_connection_read_cb, net_connection_write_cb, net_connection_event_cb, srv->connections[conn].net_cb_arg);
+    if (bev){
+        bufferevent_setcb(bev, net_connection_read_cb, net_connection_write_cb, net_connection_event_cb, srv->connections[conn].net_cb_arg); }
 
     pthread_mutex_unlock(&(srv->connections_lock));
     //log_info("created connection %d", conn);
@@ -301,11 +810,20 @@ void net_connection_close(struct net_server* srv, const int conn)
         if(bev) {
             bufferevent_free(bev);
         }
+#ifdef NET_HAVE_URING
+        if (srv->connections[conn].uring){
+            net_uring_conn_close(srv, conn); }
+#endif // NET_HAVE_URING
         if (srv->connections[conn].net_cb_arg){
             free(srv->connections[conn].net_cb_arg);
         }
+        net_connect_finished(srv, &(srv->connections[conn]), 0);
+        pthread_mutex_lock(&(srv->connections_lock));
+        net_connection_release(srv, &(srv->connections[conn]));
+        pthread_mutex_unlock(&(srv->connections_lock));
         srv->connections[conn].net_cb_arg = NULL;
         srv->connections[conn].bev = NULL;
+        srv->connections[conn].uring = NULL;
         memset(&(srv->connections[conn].sin), 0, sizeof(struct sockaddr));
     }
 }
@@ -358,26 +876,118 @@ void net_connection_set_timeouts(struct net_server* srv, const int conn, const s
 {
     if (!net_valid_connection_num(conn)){
         return; }
-    bufferevent_set_timeouts(srv->connections[conn].bev, read_tm, write_tm);
+#ifdef NET_HAVE_URING
+    if (srv->connections[conn].uring){
+        net_uring_set_timeouts(srv, conn, read_tm, write_tm);
+        return;
+    }
+#endif // NET_HAVE_URING
+    if (srv->connections[conn].bev){
+        bufferevent_set_timeouts(srv->connections[conn].bev, read_tm, write_tm); }
 }
 
-int net_connection_activate(struct net_server* srv, const int conn)
+int net_connection_set_read_watermark(struct net_server* srv, const int conn, size_t low)
 {
-    if (net_valid_connection_num(conn)){
+    if (!net_valid_connection_num(conn)){
+        return -1; }
+#ifdef NET_HAVE_URING
+    if (srv->connections[conn].uring){
+        net_uring_set_read_watermark(srv, conn, low);
+        return 0;
+    }
+#endif // NET_HAVE_URING
+    if (!srv->connections[conn].bev){
+        return -1; }
+    bufferevent_setwatermark(srv->connections[conn].bev, EV_READ, low, 0);
+    return 0;
+}
 
-        //log_info("activating connection %d", conn);
+void net_connection_trigger_read(struct net_server* srv, const int conn)
+{
+    if (!net_valid_connection_num(conn)){
+        return; }
+#ifdef NET_HAVE_URING
+    if (srv->connections[conn].uring){
+        net_uring_trigger_read(srv, conn);
+        return;
+    }
+#endif // NET_HAVE_URING
+    struct bufferevent* bev = srv->connections[conn].bev;
+    if (bev && evbuffer_get_length(bufferevent_get_input(bev)) > 0){
+        bufferevent_trigger(bev, EV_READ, 0); }
+}
 
-        struct sockaddr_in *sin = &(srv->connections[conn].sin);
-        struct bufferevent *bev = srv->connections[conn].bev;
+static int net_connection_connect(struct net_server* srv, const int conn)
+{
+#ifdef NET_HAVE_URING
+    if (srv->connections[conn].uring){
+        if (net_uring_connect(srv, conn) < 0){
+            net_connection_close(srv, conn);
+            return -1;
+        }
+        return 0;
+    }
+#endif // NET_HAVE_URING
+    struct sockaddr_in *sin = &(srv->connections[conn].sin);
+    struct bufferevent *bev = srv->connections[conn].bev;
 
-        if (bufferevent_socket_connect(bev, (struct sockaddr *)sin, sizeof(struct sockaddr)) < 0) {
+    if (bufferevent_socket_connect(bev, (struct sockaddr *)sin, sizeof(struct sockaddr)) < 0) {
+        net_connection_close(srv, conn);
+        return -1;
+    }
+    bufferevent_enable(bev, EV_READ|EV_WRITE);
+    return 0;
+}
+
+// connect now, the connection already counts against NET_MAX_OUTBOUND
+static int net_connection_start(struct net_server* srv, const int conn)
+{
+    srv->connections[conn].connect_started = net_now_us();
+#ifdef NET_DELAY_SHIM
+    uint32_t delay_ms = net_shim_delay_ms(srv, ntohs(srv->connections[conn].sin.sin_port));
+    if (delay_ms){
+        struct net_shim_connect* c = malloc(sizeof(struct net_shim_connect));
+        if (!c){
+            net_connection_close(srv, conn);
+            return -1;
+        }
+        c->srv = srv;
+        c->conn = conn;
+        c->io = net_connection_io(&(srv->connections[conn]));
+        struct timeval tv = {delay_ms / 1000, (delay_ms % 1000) * 1000};
+        if (event_base_once(srv->base, -1, EV_TIMEOUT, net_shim_connect_cb, c, &tv) < 0){
+            free(c);
             net_connection_close(srv, conn);
             return -1;
         }
-        bufferevent_enable(bev, EV_READ|EV_WRITE);
         return 0;
     }
-    return -1;
+#endif // NET_DELAY_SHIM
+    return net_connection_connect(srv, conn);
+}
+
+int net_connection_activate(struct net_server* srv, const int conn)
+{
+    if (!net_valid_connection_num(conn) || !net_connection_io(&(srv->connections[conn]))){
+        return -1; }
+
+    //log_info("activating connection %d", conn);
+    struct net_connection* connection = &(srv->connections[conn]);
+    pthread_mutex_lock(&(srv->connections_lock));
+    if (connection->out_state != NET_OUT_NONE){
+        pthread_mutex_unlock(&(srv->connections_lock));
+        return 0; }
+    if (srv->n_out >= NET_MAX_OUTBOUND){ // wait for an open one to close
+        connection->out_state = NET_OUT_QUEUED;
+        connection->queued_seq = ++srv->queue_seq;
+        ++srv->n_queued;
+        pthread_mutex_unlock(&(srv->connections_lock));
+        return 0;
+    }
+    connection->out_state = NET_OUT_ACTIVE;
+    ++srv->n_out;
+    pthread_mutex_unlock(&(srv->connections_lock));
+    return net_connection_start(srv, conn);
 }
 
 struct bufferevent* net_connection_get_bufev(struct net_server* srv, const int conn)
@@ -391,7 +1001,12 @@ struct bufferevent* net_connection_get_bufev(struct net_server* srv, const int c
 struct evbuffer* net_connection_get_read_buffer(struct net_server* srv, const int conn)
 {
     if (net_valid_connection_num(conn)){
-        return bufferevent_get_input(srv->connections[conn].bev);
+#ifdef NET_HAVE_URING
+        if (srv->connections[conn].uring){
+            return net_uring_input(srv, conn); }
+#endif // NET_HAVE_URING
+        if (srv->connections[conn].bev){
+            return bufferevent_get_input(srv->connections[conn].bev); }
     }
     return NULL;
 }
@@ -399,11 +1014,27 @@ struct evbuffer* net_connection_get_read_buffer(struct net_server* srv, const in
 struct evbuffer* net_connection_get_write_buffer(struct net_server* srv, const int conn)
 {
     if (net_valid_connection_num(conn)){
-        return bufferevent_get_output(srv->connections[conn].bev);
+#ifdef NET_HAVE_URING
+        if (srv->connections[conn].uring){
+            return net_uring_output(srv, conn); }
+#endif // NET_HAVE_URING
+        if (srv->connections[conn].bev){
+            return bufferevent_get_output(srv->connections[conn].bev); }
     }
     return NULL;
 }
 
+static evutil_socket_t net_connection_fd(struct net_server* srv, const int conn)
+{
+#ifdef NET_HAVE_URING
+    if (srv->connections[conn].uring){
+        return net_uring_fd(srv, conn); }
+#endif // NET_HAVE_URING
+    if (srv->connections[conn].bev){
+        return bufferevent_getfd(srv->connections[conn].bev); }
+    return -1;
+}
+
 uint32_t net_connection_get_remote_address(struct net_server* srv, const int conn)
 {
     if (net_valid_connection_num(conn)){
@@ -412,10 +1043,26 @@ uint32_t net_connection_get_remote_address(struct net_server* srv, const int con
         struct sockaddr_in* s = (struct sockaddr_in*)(&addr);
         socklen_t len = sizeof(addr);
 
-        int fd = bufferevent_getfd(srv->connections[conn].bev);
+        int fd = net_connection_fd(srv, conn);
 
         int rc = getpeername(fd , &addr , &len);
         return ntohl(s->sin_addr.s_addr);
     }
     return 0;
 }
+
+uint16_t net_connection_get_remote_port(struct net_server* srv, const int conn)
+{
+    if (net_valid_connection_num(conn) && net_connection_io(&(srv->connections[conn]))){
+
+        struct sockaddr_in s;
+        socklen_t len = sizeof(s);
+
+        int fd = net_connection_fd(srv, conn);
+
+        if (fd < 0 || getpeername(fd, (struct sockaddr*)&s, &len) < 0){
+            return 0; }
+        return ntohs(s.sin_port);
+    }
+    return 0;
+}
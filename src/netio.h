@@ -2,6 +2,9 @@
 #define NETIO_H
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
 
 #include <event2/event.h>
 #include <event2/util.h>
@@ -12,13 +15,141 @@
 #include "libdhtnet.h"
 
 #define MAX_OPEN_CONNECTIONS 256
+// connections accepted at once, past this the listener is paused until
+// NET_INBOUND_RESUME are left and new connects wait in the kernel's backlog
+#define NET_MAX_INBOUND 160
+#define NET_INBOUND_RESUME 120
+// past this net_server_busy says to turn low priority work away
+#define NET_INBOUND_BUSY 96
+// outgoing connections connecting or open at once, the rest wait their turn
+#define NET_MAX_OUTBOUND 64
+// how often a paused listener checks whether it can take connections again
+#define NET_LISTENER_RETRY_MS 100
 
+// io_uring needs linux and its headers, elsewhere only libevent is built
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define NET_HAVE_URING
+#endif
+#endif
 
+struct net_uring;
+struct net_uring_conn;
+
+struct net_connection{
+    struct bufferevent* bev; // libevent backend
+    struct net_uring_conn* uring; // io_uring backend, a slot is free when neither is set
+    struct sockaddr_in sin;
+    net_connection_data_cb_t read_cb;
+    net_connection_data_cb_t write_cb;
+    net_connection_event_cb_t evt_cb;
+    void* upper_cb_arg;
+    struct net_conn_cb_arg *net_cb_arg;
+    uint64_t connect_started; // usecs, 0 unless an outgoing connect is in progress
+    short incoming; // accepted by the listener, counts against NET_MAX_INBOUND
+    short out_state; // NET_OUT_*, outgoing connections only
+    uint64_t queued_seq; // order queued outgoing connections are started in
+};
+
+// outgoing connection states, only active ones count against NET_MAX_OUTBOUND
+#define NET_OUT_NONE 0
+#define NET_OUT_QUEUED 1
+#define NET_OUT_ACTIVE 2
+
+struct net_server{
+    struct event_base *base;
+    int backend; // NET_BACKEND_*
+    struct evconnlistener *listener_evt; // libevent backend
+    struct net_uring* uring; // io_uring backend
+    evutil_socket_t listen_fd;
+    struct net_connection connections[MAX_OPEN_CONNECTIONS];
+    pthread_mutex_t connections_lock;
+    net_connection_event_cb_t incoming_handler;
+    void* incoming_handler_arg;
+    net_connect_observer_t connect_observer;
+    void* connect_observer_arg;
+    evutil_socket_t dgram_fd;
+    struct event* dgram_evt;
+    net_dgram_cb_t dgram_cb;
+    void* dgram_cb_arg;
+    // admission control, counts under connections_lock
+    int n_in;
+    int n_out;
+    int n_queued;
+    uint64_t queue_seq;
+    struct event* start_queued_evt; // starts queued connections once there's room
+    struct event* listener_retry_evt; // retries a paused listener
+    short listener_paused;
+#ifdef NET_DELAY_SHIM
+    uint16_t shim_port; // our own, its delay applies to everything we send
+#endif // NET_DELAY_SHIM
+};
+
+struct net_conn_cb_arg{
+    int conn;
+    struct net_server* srv;
+};
 
 int net_valid_connection_num(const int conn);
 
+// first free connection slot, -1 if none. must use locks with this!!!
+int net_empty_connection_slot(struct net_server* srv);
+
 void listen_evt_cb(struct evconnlistener *listener, evutil_socket_t fd,
         struct sockaddr *addr, int socklen, void *arg);
 
+// backends report what happened on a connection through these
+void net_connection_dispatch_read(struct net_server* srv, const int conn);
+void net_connection_dispatch_write(struct net_server* srv, const int conn);
+void net_connection_dispatch_event(struct net_server* srv, const int conn, short what);
+
+/**
+ * admit a socket accepted by either backend: takes a slot and tells the
+ * incoming handler, or closes it and pauses the listener if there's no room
+ */
+void net_accept_fd(struct net_server* srv, evutil_socket_t fd);
+
+// stop accepting, the listener is retried every NET_LISTENER_RETRY_MS
+void net_accept_pause(struct net_server* srv);
+
+// whether net_accept_fd would turn a connection away now
+int net_accept_full(struct net_server* srv);
+
+#ifdef NET_HAVE_URING
+// netio_uring.c
+
+/**
+ * set up the ring for srv, accepting on srv->listen_fd. -1 if the kernel
+ * won't give us one
+ */
+int net_uring_create(struct net_server* srv);
+
+void net_uring_destroy(struct net_server* srv);
+
+// start or stop accepting
+void net_uring_listen(struct net_server* srv, short on);
+
+// io for slot conn, fd is an accepted socket or -1 for one to connect
+int net_uring_conn_open(struct net_server* srv, const int conn, evutil_socket_t fd);
+
+void net_uring_conn_close(struct net_server* srv, const int conn);
+
+int net_uring_connect(struct net_server* srv, const int conn);
+
+// start receiving on an accepted connection, once its handler has set it up
+void net_uring_conn_enable(struct net_server* srv, const int conn);
+
+void net_uring_set_timeouts(struct net_server* srv, const int conn, const struct timeval* read_tm, const struct timeval* write_tm);
+
+void net_uring_set_read_watermark(struct net_server* srv, const int conn, size_t low);
+
+void net_uring_trigger_read(struct net_server* srv, const int conn);
+
+struct evbuffer* net_uring_input(struct net_server* srv, const int conn);
+
+struct evbuffer* net_uring_output(struct net_server* srv, const int conn);
+
+evutil_socket_t net_uring_fd(struct net_server* srv, const int conn);
+#endif // NET_HAVE_URING
 
 #endif // NETIO_H
@@ -0,0 +1,863 @@
+#include "netio.h"
+
+#ifdef NET_HAVE_URING
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#define LOG_SUBSYS LOG_SYS_NET
+#include "logging.h"
+
+/*
+ * io_uring backend for connections, without liburing: the rings are mapped
+ * and driven by hand. the event base still runs everything, an eventfd the
+ * ring signals on completions is just one more event on it.
+ *
+ * the listener takes one multishot accept and every connection one multishot
+ * recv into buffers registered with the kernel, so a busy connection costs
+ * no syscalls to read. sends and everything else queued while callbacks run
+ * go to the kernel in one io_uring_enter at the end of the loop pass
+ */
+
+#define NET_URING_SQ_ENTRIES 256
+// multishot ops can post many completions each, have plenty of room for them
+#define NET_URING_CQ_ENTRIES 4096
+// provided recv buffers, must be a power of 2
+#define NET_URING_BUFS 256
+#define NET_URING_BUF_SIZE 4096
+#define NET_URING_BGID 0
+// most taken out of the write buffer for one send
+#define NET_URING_SEND_MAX 16384
+// accepted while full, held until the listener resumes. multishot accept
+// keeps going until the cancel gets there, these would be dropped otherwise
+#define NET_URING_HELD 512
+
+// what a completion is for, in the low bits of user_data (the rest is a pointer)
+#define NET_URING_OP_NONE 0 // cancels and closes, nothing to do when they finish
+#define NET_URING_OP_ACCEPT 1
+#define NET_URING_OP_RECV 2
+#define NET_URING_OP_SEND 3
+#define NET_URING_OP_CONNECT 4
+#define NET_URING_OP_MASK 7
+
+struct net_uring_conn{
+    struct net_server* srv;
+    int conn; // -1 once closed, it stays around until the kernel is done with it
+    evutil_socket_t fd;
+    struct sockaddr_in sin; // connect reads it when submitted, the slot may be reused by then
+    struct evbuffer* input;
+    struct evbuffer* output;
+    size_t read_low; // watermark
+    struct event* read_tm_evt;
+    struct event* write_tm_evt;
+    struct timeval read_tm;
+    struct timeval write_tm;
+    short has_read_tm;
+    short has_write_tm;
+    short connecting;
+    short connected;
+    short enabled; // accepted connections wait for their handler before reading
+    short recving; // a multishot recv is armed
+    char* send_buf; // taken out of output, the kernel reads it until the send completes
+    size_t send_cap;
+    size_t send_len; // 0 unless a send is in flight
+    size_t send_off;
+    int inflight; // ops that will still complete
+    struct net_uring_conn* next; // on the closed list
+};
+
+struct net_uring{
+    struct net_server* srv;
+    int ring_fd;
+    // submission ring
+    unsigned sq_entries;
+    unsigned sq_mask;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_flags;
+    unsigned* sq_array;
+    unsigned sq_tail_local; // filled in up to here, published on enter
+    struct io_uring_sqe* sqes;
+    // completion ring
+    unsigned cq_mask;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    struct io_uring_cqe* cqes;
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+    pthread_mutex_t sq_lock; // the submission ring and the closed list
+    // batching: the loop thread submits once per pass, anyone else right away
+    pthread_t loop_thread;
+    short loop_known;
+    short submit_pending;
+    struct event* submit_evt;
+    evutil_socket_t event_fd;
+    struct event* cq_evt;
+    // provided recv buffers
+    struct io_uring_buf_ring* buf_ring;
+    size_t buf_ring_size;
+    char* bufs;
+    unsigned short buf_tail;
+    short listening;
+    short accepting; // a multishot accept is armed
+    evutil_socket_t held[NET_URING_HELD];
+    int n_held;
+    struct event* unhold_evt;
+    struct net_uring_conn* closed; // waiting for their last completions
+};
+
+//
+// rings
+//
+
+static int net_uring_sys_setup(unsigned entries, struct io_uring_params* p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int net_uring_sys_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// must use lock with this!!!
+static int net_uring_enter(struct net_uring* u)
+{
+    __atomic_store_n(u->sq_tail, u->sq_tail_local, __ATOMIC_RELEASE);
+    unsigned n = u->sq_tail_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = 0;
+    if (__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW){
+        flags |= IORING_ENTER_GETEVENTS; } // flush completions the kernel is holding back
+    u->submit_pending = 0;
+    if (!n && !flags){
+        return 0; }
+    int rc;
+    do{
+        rc = (int) syscall(__NR_io_uring_enter, u->ring_fd, n, 0, flags, NULL, 0);
+    }while (rc < 0 && errno == EINTR);
+    if (rc < 0){
+        log_err("io_uring_enter failed: %s", strerror(errno)); }
+    return rc;
+}
+
+// must use lock with this!!!
+// next free submission entry, zeroed. NULL if the ring is full even after submitting
+static struct io_uring_sqe* net_uring_sqe(struct net_uring* u)
+{
+    unsigned tail = u->sq_tail_local;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries){
+        net_uring_enter(u);
+        if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries){
+            log_err("io_uring submission ring full");
+            return NULL;
+        }
+    }
+    unsigned idx = tail & u->sq_mask;
+    struct io_uring_sqe* sqe = &(u->sqes[idx]);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    u->sq_array[idx] = idx;
+    u->sq_tail_local = tail + 1;
+    return sqe;
+}
+
+// must use lock with this!!!
+// get what was just queued to the kernel, at the end of this loop pass if we're in it
+static void net_uring_queued(struct net_uring* u)
+{
+    if (u->loop_known && pthread_equal(pthread_self(), u->loop_thread)){
+        if (!u->submit_pending){
+            u->submit_pending = 1;
+            event_active(u->submit_evt, 0, 0);
+        }
+        return;
+    }
+    net_uring_enter(u);
+}
+
+static void net_uring_submit_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct net_uring* u = (struct net_uring*) arg;
+    pthread_mutex_lock(&(u->sq_lock));
+    net_uring_enter(u);
+    pthread_mutex_unlock(&(u->sq_lock));
+}
+
+static uint64_t net_uring_data(void* ptr, int op)
+{
+    return (uint64_t)(uintptr_t) ptr | (uint64_t) op;
+}
+
+// give a recv buffer back to the kernel
+static void net_uring_buf_put(struct net_uring* u, unsigned short bid)
+{
+    struct io_uring_buf* b = &(u->buf_ring->bufs[u->buf_tail & (NET_URING_BUFS - 1)]);
+    b->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t) bid * NET_URING_BUF_SIZE);
+    b->len = NET_URING_BUF_SIZE;
+    b->bid = bid;
+    ++u->buf_tail;
+    __atomic_store_n(&(u->buf_ring->tail), u->buf_tail, __ATOMIC_RELEASE);
+}
+
+//
+// ops
+//
+
+static void net_uring_accept(struct net_uring* u)
+{
+    pthread_mutex_lock(&(u->sq_lock));
+    struct io_uring_sqe* sqe = net_uring_sqe(u);
+    if (sqe){
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = u->srv->listen_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = net_uring_data(u, NET_URING_OP_ACCEPT);
+        u->accepting = 1;
+        net_uring_queued(u);
+    }
+    pthread_mutex_unlock(&(u->sq_lock));
+}
+
+static void net_uring_recv(struct net_uring* u, struct net_uring_conn* uc)
+{
+    pthread_mutex_lock(&(u->sq_lock));
+    struct io_uring_sqe* sqe = net_uring_sqe(u);
+    if (sqe){
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = uc->fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = NET_URING_BGID;
+        sqe->user_data = net_uring_data(uc, NET_URING_OP_RECV);
+        uc->recving = 1;
+        ++uc->inflight;
+        net_uring_queued(u);
+    }
+    pthread_mutex_unlock(&(u->sq_lock));
+}
+
+// (re)submit what's left of send_buf
+static int net_uring_send_rest(struct net_uring* u, struct net_uring_conn* uc)
+{
+    pthread_mutex_lock(&(u->sq_lock));
+    struct io_uring_sqe* sqe = net_uring_sqe(u);
+    if (sqe){
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = uc->fd;
+        sqe->addr = (uint64_t)(uintptr_t)(uc->send_buf + uc->send_off);
+        sqe->len = (uint32_t)(uc->send_len - uc->send_off);
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = net_uring_data(uc, NET_URING_OP_SEND);
+        ++uc->inflight;
+        net_uring_queued(u);
+    }
+    pthread_mutex_unlock(&(u->sq_lock));
+    if (uc->has_write_tm){
+        event_add(uc->write_tm_evt, &(uc->write_tm)); }
+    return sqe ? 0 : -1;
+}
+
+// send the start of the write buffer, unless a send is already going
+static void net_uring_send(struct net_uring* u, struct net_uring_conn* uc)
+{
+    if (uc->send_len || !uc->connected){
+        return; }
+    size_t len = evbuffer_get_length(uc->output);
+    if (!len){
+        return; }
+    if (len > NET_URING_SEND_MAX){
+        len = NET_URING_SEND_MAX; }
+    if (uc->send_cap < len){
+        char* buf = realloc(uc->send_buf, len);
+        if (!buf){
+            log_err("failed to malloc send buffer");
+            return; }
+        uc->send_buf = buf;
+        uc->send_cap = len;
+    }
+    uc->send_len = (size_t) evbuffer_remove(uc->output, uc->send_buf, len);
+    uc->send_off = 0;
+    if (uc->send_len && net_uring_send_rest(u, uc) < 0){
+        uc->send_len = 0; }
+}
+
+static void net_uring_output_cb(struct evbuffer *buffer, const struct evbuffer_cb_info *info, void *arg)
+{
+    struct net_uring_conn* uc = (struct net_uring_conn*) arg;
+    if (info->n_added && uc->conn >= 0){
+        net_uring_send(uc->srv->uring, uc); }
+}
+
+//
+// completions
+//
+
+static void net_uring_conn_free(struct net_uring* u, struct net_uring_conn* uc)
+{
+    pthread_mutex_lock(&(u->sq_lock));
+    struct net_uring_conn** p = &(u->closed);
+    while (*p && *p != uc){
+        p = &((*p)->next); }
+    if (*p){
+        *p = uc->next; }
+    pthread_mutex_unlock(&(u->sq_lock));
+    free(uc->send_buf);
+    free(uc);
+}
+
+static void net_uring_accepted(struct net_uring* u, struct io_uring_cqe* cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE)){
+        u->accepting = 0; }
+    if (cqe->res >= 0){
+        if (u->n_held < NET_URING_HELD && (u->n_held || net_accept_full(u->srv))){
+            u->held[u->n_held++] = cqe->res;
+            net_accept_pause(u->srv); // resuming lets them in
+        }else{
+            net_accept_fd(u->srv, cqe->res); }
+    }else if (cqe->res != -ECANCELED){
+        log_warn("accept failed: %s", strerror(-cqe->res));
+        net_accept_pause(u->srv);
+    }
+    if (u->listening && !u->accepting){
+        net_uring_accept(u); }
+}
+
+static void net_uring_recvd(struct net_uring* u, struct net_uring_conn* uc, struct io_uring_cqe* cqe)
+{
+    short more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    if (!more){
+        uc->recving = 0; }
+    if (cqe->res > 0 || cqe->res == -ENOBUFS){ // out of buffers only until they're given back
+        if (!more){
+            net_uring_recv(u, uc); }
+        if (cqe->res < 0){
+            return; }
+        if (uc->has_read_tm){
+            event_add(uc->read_tm_evt, &(uc->read_tm)); }
+        if (evbuffer_get_length(uc->input) >= uc->read_low){
+            net_connection_dispatch_read(uc->srv, uc->conn); }
+        return;
+    }
+    if (cqe->res == -ECANCELED){
+        return; }
+    event_del(uc->read_tm_evt);
+    net_connection_dispatch_event(uc->srv, uc->conn,
+            BEV_EVENT_READING | (cqe->res == 0 ? BEV_EVENT_EOF : BEV_EVENT_ERROR));
+}
+
+static void net_uring_sent(struct net_uring* u, struct net_uring_conn* uc, struct io_uring_cqe* cqe)
+{
+    if (cqe->res < 0){
+        uc->send_len = 0;
+        event_del(uc->write_tm_evt);
+        net_connection_dispatch_event(uc->srv, uc->conn, BEV_EVENT_WRITING|BEV_EVENT_ERROR);
+        return;
+    }
+    uc->send_off += cqe->res;
+    if (uc->send_off < uc->send_len){ // short send
+        if (net_uring_send_rest(u, uc) < 0){
+            uc->send_len = 0; }
+        return;
+    }
+    uc->send_len = 0;
+    if (evbuffer_get_length(uc->output)){
+        net_uring_send(u, uc);
+        return;
+    }
+    event_del(uc->write_tm_evt);
+    net_connection_dispatch_write(uc->srv, uc->conn);
+}
+
+static void net_uring_connected(struct net_uring* u, struct net_uring_conn* uc, struct io_uring_cqe* cqe)
+{
+    uc->connecting = 0;
+    event_del(uc->write_tm_evt);
+    if (cqe->res < 0){
+        net_connection_dispatch_event(uc->srv, uc->conn, BEV_EVENT_ERROR);
+        return;
+    }
+    uc->connected = 1;
+    uc->enabled = 1;
+    net_uring_recv(u, uc);
+    if (uc->has_read_tm){
+        event_add(uc->read_tm_evt, &(uc->read_tm)); }
+    net_uring_send(u, uc);
+    net_connection_dispatch_event(uc->srv, uc->conn, BEV_EVENT_CONNECTED);
+}
+
+static void net_uring_complete(struct net_uring* u, struct io_uring_cqe* cqe)
+{
+    int op = (int)(cqe->user_data & NET_URING_OP_MASK);
+    void* ptr = (void*)(uintptr_t)(cqe->user_data & ~(uint64_t) NET_URING_OP_MASK);
+
+    if (op == NET_URING_OP_ACCEPT){
+        net_uring_accepted(u, cqe);
+        return; }
+    if (op == NET_URING_OP_NONE || !ptr){
+        return; }
+
+    struct net_uring_conn* uc = (struct net_uring_conn*) ptr;
+    if (!(cqe->flags & IORING_CQE_F_MORE)){
+        --uc->inflight; }
+    if (cqe->flags & IORING_CQE_F_BUFFER){
+        unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (cqe->res > 0 && uc->conn >= 0){
+            evbuffer_add(uc->input, u->bufs + (size_t) bid * NET_URING_BUF_SIZE, cqe->res); }
+        net_uring_buf_put(u, bid);
+    }
+    if (uc->conn < 0){ // closed, only counting off what the kernel still had
+        if (!uc->inflight){
+            net_uring_conn_free(u, uc); }
+        return;
+    }
+
+    // these may end in callbacks that close the connection, nothing touches uc after
+    switch (op){
+        case NET_URING_OP_RECV:
+            net_uring_recvd(u, uc, cqe);
+            break;
+        case NET_URING_OP_SEND:
+            net_uring_sent(u, uc, cqe);
+            break;
+        case NET_URING_OP_CONNECT:
+            net_uring_connected(u, uc, cqe);
+            break;
+    }
+}
+
+static void net_uring_cq_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct net_uring* u = (struct net_uring*) arg;
+    uint64_t n;
+    if (read(u->event_fd, &n, sizeof(n)) < 0){
+        // EAGAIN, someone got here first
+    }
+    u->loop_thread = pthread_self();
+    u->loop_known = 1;
+
+    unsigned head = *(u->cq_head);
+    for (;;){
+        if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)){
+            break; }
+        struct io_uring_cqe cqe = u->cqes[head & u->cq_mask];
+        __atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+        net_uring_complete(u, &cqe);
+    }
+    if (__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW){
+        pthread_mutex_lock(&(u->sq_lock));
+        net_uring_enter(u); // the held back completions signal the eventfd again
+        pthread_mutex_unlock(&(u->sq_lock));
+    }
+}
+
+// admit held connections, oldest first, while there's room
+static void net_uring_unhold_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct net_uring* u = (struct net_uring*) arg;
+    int n = 0;
+    while (n < u->n_held && !net_accept_full(u->srv)){
+        net_accept_fd(u->srv, u->held[n++]); }
+    memmove(u->held, u->held + n, sizeof(evutil_socket_t) * (u->n_held - n));
+    u->n_held -= n;
+    if (u->n_held){
+        net_accept_pause(u->srv); }
+}
+
+//
+// timeouts
+//
+
+static void net_uring_read_tm_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct net_uring_conn* uc = (struct net_uring_conn*) arg;
+    net_connection_dispatch_event(uc->srv, uc->conn, BEV_EVENT_READING|BEV_EVENT_TIMEOUT);
+}
+
+static void net_uring_write_tm_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct net_uring_conn* uc = (struct net_uring_conn*) arg;
+    net_connection_dispatch_event(uc->srv, uc->conn, BEV_EVENT_WRITING|BEV_EVENT_TIMEOUT);
+}
+
+//
+// setup
+//
+
+static void net_uring_unmap(struct net_uring* u)
+{
+    if (u->sqes){
+        munmap(u->sqes, u->sqes_size); }
+    if (u->cq_ptr && u->cq_ptr != u->sq_ptr){
+        munmap(u->cq_ptr, u->cq_size); }
+    if (u->sq_ptr){
+        munmap(u->sq_ptr, u->sq_size); }
+    if (u->buf_ring){
+        munmap(u->buf_ring, u->buf_ring_size); }
+    free(u->bufs);
+}
+
+static int net_uring_map(struct net_uring* u, struct io_uring_params* p)
+{
+    u->sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    u->cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP){
+        if (u->cq_size > u->sq_size){
+            u->sq_size = u->cq_size; }
+        u->cq_size = u->sq_size;
+    }
+    u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED){
+        u->sq_ptr = NULL;
+        return -1; }
+    if (p->features & IORING_FEAT_SINGLE_MMAP){
+        u->cq_ptr = u->sq_ptr;
+    }else{
+        u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+        if (u->cq_ptr == MAP_FAILED){
+            u->cq_ptr = NULL;
+            return -1; }
+    }
+    u->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED){
+        u->sqes = NULL;
+        return -1; }
+
+    char* sq = (char*) u->sq_ptr;
+    char* cq = (char*) u->cq_ptr;
+    u->sq_entries = p->sq_entries;
+    u->sq_mask = *(unsigned*)(sq + p->sq_off.ring_mask);
+    u->sq_head = (unsigned*)(sq + p->sq_off.head);
+    u->sq_tail = (unsigned*)(sq + p->sq_off.tail);
+    u->sq_flags = (unsigned*)(sq + p->sq_off.flags);
+    u->sq_array = (unsigned*)(sq + p->sq_off.array);
+    u->sq_tail_local = *(u->sq_tail);
+    u->cq_mask = *(unsigned*)(cq + p->cq_off.ring_mask);
+    u->cq_head = (unsigned*)(cq + p->cq_off.head);
+    u->cq_tail = (unsigned*)(cq + p->cq_off.tail);
+    u->cqes = (struct io_uring_cqe*)(cq + p->cq_off.cqes);
+    return 0;
+}
+
+// register the recv buffers the kernel picks from
+static int net_uring_bufs(struct net_uring* u)
+{
+    u->buf_ring_size = NET_URING_BUFS * sizeof(struct io_uring_buf);
+    u->buf_ring = mmap(NULL, u->buf_ring_size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+    if (u->buf_ring == MAP_FAILED){
+        u->buf_ring = NULL;
+        return -1; }
+    u->bufs = malloc((size_t) NET_URING_BUFS * NET_URING_BUF_SIZE);
+    if (!u->bufs){
+        return -1; }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t) u->buf_ring;
+    reg.ring_entries = NET_URING_BUFS;
+    reg.bgid = NET_URING_BGID;
+    if (net_uring_sys_register(u->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+        return -1; }
+    u->buf_tail = 0;
+    for (unsigned short i = 0; i < NET_URING_BUFS; ++i){
+        net_uring_buf_put(u, i); }
+    return 0;
+}
+
+int net_uring_create(struct net_server* srv)
+{
+    struct net_uring* u = malloc(sizeof(struct net_uring));
+    if (!u){
+        log_err("failed to malloc io_uring");
+        return -1; }
+    memset(u, 0, sizeof(struct net_uring));
+    u->srv = srv;
+    u->event_fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = NET_URING_CQ_ENTRIES;
+    u->ring_fd = net_uring_sys_setup(NET_URING_SQ_ENTRIES, &p);
+    if (u->ring_fd < 0){
+        log_err("io_uring_setup failed: %s", strerror(errno));
+        free(u);
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_NODROP)){
+        log_warn("kernel may drop io_uring completions"); }
+
+    if (net_uring_map(u, &p) < 0 || net_uring_bufs(u) < 0){
+        log_err("failed to set up io_uring: %s", strerror(errno));
+        net_uring_unmap(u);
+        close(u->ring_fd);
+        free(u);
+        return -1;
+    }
+
+    u->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (u->event_fd < 0 || net_uring_sys_register(u->ring_fd, IORING_REGISTER_EVENTFD, &(u->event_fd), 1) < 0){
+        log_err("failed to register io_uring eventfd: %s", strerror(errno));
+        if (u->event_fd >= 0){ close(u->event_fd); }
+        net_uring_unmap(u);
+        close(u->ring_fd);
+        free(u);
+        return -1;
+    }
+
+    u->cq_evt = event_new(srv->base, u->event_fd, EV_READ|EV_PERSIST, net_uring_cq_cb, u);
+    u->submit_evt = event_new(srv->base, -1, 0, net_uring_submit_cb, u);
+    u->unhold_evt = event_new(srv->base, -1, 0, net_uring_unhold_cb, u);
+    if (!u->cq_evt || !u->submit_evt || !u->unhold_evt || event_add(u->cq_evt, NULL) < 0 ||
+            pthread_mutex_init(&(u->sq_lock), NULL) != 0){
+        log_err("failed to create io_uring events");
+        if (u->cq_evt){ event_free(u->cq_evt); }
+        if (u->submit_evt){ event_free(u->submit_evt); }
+        if (u->unhold_evt){ event_free(u->unhold_evt); }
+        close(u->event_fd);
+        net_uring_unmap(u);
+        close(u->ring_fd);
+        free(u);
+        return -1;
+    }
+
+    srv->uring = u;
+    u->listening = 1;
+    net_uring_accept(u);
+    return 0;
+}
+
+void net_uring_destroy(struct net_server* srv)
+{
+    struct net_uring* u = srv->uring;
+    if (!u){
+        return; }
+
+    // the closes of the last connections are still queued
+    pthread_mutex_lock(&(u->sq_lock));
+    net_uring_enter(u);
+    pthread_mutex_unlock(&(u->sq_lock));
+
+    event_free(u->cq_evt);
+    event_free(u->submit_evt);
+    event_free(u->unhold_evt);
+    for (int i = 0; i < u->n_held; ++i){
+        close(u->held[i]); }
+    close(u->ring_fd); // cancels whatever is left
+    close(u->event_fd);
+    net_uring_unmap(u);
+    while (u->closed){
+        struct net_uring_conn* uc = u->closed;
+        u->closed = uc->next;
+        free(uc->send_buf);
+        free(uc);
+    }
+    pthread_mutex_destroy(&(u->sq_lock));
+    free(u);
+    srv->uring = NULL;
+}
+
+void net_uring_listen(struct net_server* srv, short on)
+{
+    struct net_uring* u = srv->uring;
+    u->listening = on;
+    if (on && u->n_held){ // not here, this is under the connections lock
+        event_active(u->unhold_evt, 0, 0); }
+    if (on && !u->accepting){
+        net_uring_accept(u);
+    }else if (!on && u->accepting){
+        pthread_mutex_lock(&(u->sq_lock));
+        struct io_uring_sqe* sqe = net_uring_sqe(u);
+        if (sqe){
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = net_uring_data(u, NET_URING_OP_ACCEPT);
+            sqe->user_data = net_uring_data(NULL, NET_URING_OP_NONE);
+            net_uring_queued(u);
+        }
+        pthread_mutex_unlock(&(u->sq_lock));
+    }
+}
+
+//
+// connections
+//
+
+int net_uring_conn_open(struct net_server* srv, const int conn, evutil_socket_t fd)
+{
+    struct net_uring_conn* uc = malloc(sizeof(struct net_uring_conn));
+    if (!uc){
+        log_err("failed to malloc io_uring connection");
+        return -1; }
+    memset(uc, 0, sizeof(struct net_uring_conn));
+    uc->srv = srv;
+    uc->conn = conn;
+    uc->fd = fd;
+    uc->input = evbuffer_new();
+    uc->output = evbuffer_new();
+    uc->read_tm_evt = evtimer_new(srv->base, net_uring_read_tm_cb, uc);
+    uc->write_tm_evt = evtimer_new(srv->base, net_uring_write_tm_cb, uc);
+    if (!uc->input || !uc->output || !uc->read_tm_evt || !uc->write_tm_evt ||
+            !evbuffer_add_cb(uc->output, net_uring_output_cb, uc)){
+        log_err("failed to create io_uring connection");
+        if (uc->input){ evbuffer_free(uc->input); }
+        if (uc->output){ evbuffer_free(uc->output); }
+        if (uc->read_tm_evt){ event_free(uc->read_tm_evt); }
+        if (uc->write_tm_evt){ event_free(uc->write_tm_evt); }
+        free(uc);
+        return -1;
+    }
+    uc->connected = fd >= 0;
+    srv->connections[conn].uring = uc;
+    return 0;
+}
+
+void net_uring_conn_enable(struct net_server* srv, const int conn)
+{
+    struct net_uring_conn* uc = srv->connections[conn].uring;
+    if (!uc || uc->enabled){ // closed by its handler
+        return; }
+    uc->enabled = 1;
+    net_uring_recv(srv->uring, uc);
+    if (uc->has_read_tm){
+        event_add(uc->read_tm_evt, &(uc->read_tm)); }
+    net_uring_send(srv->uring, uc);
+}
+
+int net_uring_connect(struct net_server* srv, const int conn)
+{
+    struct net_uring* u = srv->uring;
+    struct net_uring_conn* uc = srv->connections[conn].uring;
+    if (uc->fd >= 0){
+        return -1; }
+    uc->sin = srv->connections[conn].sin;
+    uc->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (uc->fd < 0){
+        return -1; }
+
+    pthread_mutex_lock(&(u->sq_lock));
+    struct io_uring_sqe* sqe = net_uring_sqe(u);
+    if (sqe){
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = uc->fd;
+        sqe->addr = (uint64_t)(uintptr_t) &(uc->sin);
+        sqe->off = sizeof(struct sockaddr_in);
+        sqe->user_data = net_uring_data(uc, NET_URING_OP_CONNECT);
+        uc->connecting = 1;
+        ++uc->inflight;
+        net_uring_queued(u);
+    }
+    pthread_mutex_unlock(&(u->sq_lock));
+    if (!sqe){
+        return -1; }
+    if (uc->has_write_tm){
+        event_add(uc->write_tm_evt, &(uc->write_tm)); }
+    return 0;
+}
+
+void net_uring_conn_close(struct net_server* srv, const int conn)
+{
+    struct net_uring* u = srv->uring;
+    struct net_uring_conn* uc = srv->connections[conn].uring;
+
+    uc->conn = -1;
+    event_free(uc->read_tm_evt);
+    event_free(uc->write_tm_evt);
+    evbuffer_free(uc->input);
+    evbuffer_free(uc->output);
+
+    pthread_mutex_lock(&(u->sq_lock));
+    if (uc->fd >= 0){
+        // cancel what the kernel has on the socket, then close it. hard linked
+        // so the close happens even when there was nothing to cancel
+        struct io_uring_sqe* cancel = net_uring_sqe(u);
+        struct io_uring_sqe* cl = cancel ? net_uring_sqe(u) : NULL;
+        if (cl){
+            cancel->opcode = IORING_OP_ASYNC_CANCEL;
+            cancel->fd = uc->fd;
+            cancel->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            cancel->flags = IOSQE_IO_HARDLINK;
+            cancel->user_data = net_uring_data(NULL, NET_URING_OP_NONE);
+            cl->opcode = IORING_OP_CLOSE;
+            cl->fd = uc->fd;
+            cl->user_data = net_uring_data(NULL, NET_URING_OP_NONE);
+            net_uring_queued(u);
+        }else{
+            if (cancel){ // don't leave half of it queued
+                cancel->opcode = IORING_OP_NOP;
+                cancel->user_data = net_uring_data(NULL, NET_URING_OP_NONE);
+            }
+            close(uc->fd);
+        }
+        uc->fd = -1;
+    }
+    if (uc->inflight){
+        uc->next = u->closed;
+        u->closed = uc;
+    }
+    pthread_mutex_unlock(&(u->sq_lock));
+    if (!uc->inflight){
+        free(uc->send_buf);
+        free(uc);
+    }
+}
+
+void net_uring_set_timeouts(struct net_server* srv, const int conn, const struct timeval* read_tm, const struct timeval* write_tm)
+{
+    struct net_uring_conn* uc = srv->connections[conn].uring;
+    uc->has_read_tm = read_tm != NULL;
+    uc->has_write_tm = write_tm != NULL;
+    if (read_tm){
+        uc->read_tm = *read_tm; }
+    if (write_tm){
+        uc->write_tm = *write_tm; }
+
+    if (uc->has_read_tm && uc->enabled){
+        event_add(uc->read_tm_evt, &(uc->read_tm));
+    }else{
+        event_del(uc->read_tm_evt); }
+    if (uc->has_write_tm && (uc->connecting || uc->send_len)){
+        event_add(uc->write_tm_evt, &(uc->write_tm));
+    }else{
+        event_del(uc->write_tm_evt); }
+}
+
+void net_uring_set_read_watermark(struct net_server* srv, const int conn, size_t low)
+{
+    srv->connections[conn].uring->read_low = low;
+}
+
+void net_uring_trigger_read(struct net_server* srv, const int conn)
+{
+    struct net_uring_conn* uc = srv->connections[conn].uring;
+    size_t len = evbuffer_get_length(uc->input);
+    if (len > 0 && len >= uc->read_low){
+        net_connection_dispatch_read(srv, conn); }
+}
+
+struct evbuffer* net_uring_input(struct net_server* srv, const int conn)
+{
+    return srv->connections[conn].uring->input;
+}
+
+struct evbuffer* net_uring_output(struct net_server* srv, const int conn)
+{
+    return srv->connections[conn].uring->output;
+}
+
+evutil_socket_t net_uring_fd(struct net_server* srv, const int conn)
+{
+    return srv->connections[conn].uring->fd;
+}
+
+#endif // NET_HAVE_URING
@@ -2,12 +2,27 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <stddef.h>
+#include <sys/time.h>
 
 #include "node.h"
 #include "netio.h"
+#include "peer.h"
+#include "rpc.h"
+#include "request.h"
+#include "pool.h"
 #include "proto.h"
+#include "snapshot.h"
+#include "store.h"
+#include "finger.h"
+#include "route_cache.h"
+
+#define LOG_SUBSYS LOG_SYS_ROUTING
 #include "logging.h"
 
+// stabilize, notify and checks
+#define log_maint(M, ...) log_sys(INFO, LOG_SYS_MAINT, M, ##__VA_ARGS__)
+
 #ifdef USE_NETW
 #include "net_wrapper.h"
 #endif // USE_NETW
@@ -18,16 +33,63 @@ const struct timeval *NODE_WAIT_TM_LONG = NULL;
 
 struct node_found_cb_data;
 
+// an owner's successors, the rest of the replicas of the keys it owns
+struct node_replicas{
+    struct node_info owner;
+    struct node_info succs[NUM_OF_SUCCS];
+    uint64_t expires_us;
+    short refreshing;
+};
+
 struct node_self{
     struct node_info self;
     struct node_info successor[NUM_OF_SUCCS];
     pthread_mutex_t succs_lock;
     struct node_info predecessor;
     short has_pred;
-    struct node_info* finger_table;
+    short pred_notified; // predecessor notified us itself, rather than being a guess
+    struct finger_table* fingers;
+    struct route_cache* route_cache; // NULL means off
+    struct vivaldi_coord coord; // where we think we are, see vivaldi.h
+    pthread_mutex_t coord_lock;
     struct net_server* net;
     node_msg_cb_t msg_cb;
     void* msg_cb_arg;
+    struct peer_table* peers;
+    struct request_table* requests;
+    struct rpc* rpc;
+    // per request state, recycled rather than malloc'd
+    struct pool* found_pool;
+    struct pool* finger_pool;
+    struct pool* succ_pool;
+    struct pool* check_pool;
+    struct pool* handler_pool;
+    struct pool* msg_pool;
+    struct pool* trace_pool;
+    struct pool* quorum_pool;
+    struct pool* fallback_pool;
+    // lookup tracing, every 0 means off
+    unsigned int trace_every;
+    unsigned int trace_count;
+    node_trace_cb_t trace_cb;
+    void* trace_cb_arg;
+    short leaving; // node_network_leave called, don't start another
+    struct event* maint_evts[NODE_MAINT_EVTS]; // stabilize, fix fingers and probe timers
+    short destroying; // requests failing now are not to be retried
+    // routing state snapshot, NULL path means off
+    char* snapshot_path;
+    struct event* snapshot_evt;
+    struct store* store; // NULL means records aren't kept
+    pthread_mutex_t store_lock; // held while store is used or swapped, see node_set_store
+    // quorum reads and writes, only used from the event loop
+    short quorum_n;
+    short quorum_r;
+    short quorum_w;
+    unsigned int hedge_pct; // 0 means reads don't hedge
+    uint32_t read_hist[NODE_HEDGE_BUCKETS]; // read reply times, see node_hedge_bucket
+    uint32_t read_hist_total;
+    uint64_t last_version;
+    struct node_replicas replicas[NODE_REPLICA_CACHE];
 #ifdef USE_NETW
     int netw_handle;
 #endif // USE_NETW
@@ -38,6 +100,9 @@ struct node_join_cb_data{
     void *joined_cb_arg;
     struct node_self* self;
     struct event* evt;
+    struct node_info seeds[NODE_JOIN_MAX_SEEDS]; // asked again if every join lookup fails
+    int n_seeds;
+    short warm; // fingers already filled in, don't refresh them all at once
 };
 
 struct node_found_cb_data{
@@ -47,21 +112,38 @@ struct node_found_cb_data{
     struct node_info node;
     struct event* evt;
     short hops;
+    uint32_t req_id; // remote lookups only
+    int connection;
+    struct node_info asked; // node this attempt went to
+    short tries; // attempts so far
+    short route_around; // on failure evict asked and try the next best node
+    short not_found; // asked answered but couldn't find it, not a dead node
+    short busy; // asked was too busy to take it, also not a dead node
+    short busy_tries; // times asked nodes were busy, these don't use up tries
+    short cacheable; // a user's lookup, may be answered from and go in the route cache
+    // traced lookups only
+    hash_type target;
+    struct node_trace* trace; // hops[0] is this node
+    short trace_owned; // started here, goes to trace_cb then back to the pool
+    uint64_t started_us;
+    uint64_t sent_us;
 };
 
 struct finger_update_arg{
     struct node_self* self;
     int finger_num;
+    struct node_info first; // successor of the finger's start
 };
 
 struct succ_update_arg{
     struct node_self* self;
-    int succ_num;
+    struct node_info succ;
 };
 
 struct incoming_handler_data{
     struct node_self* self;
     int connection;
+    struct node_trace* trace; // NULL unless the asker wants the path
 };
 
 struct node_msg_arg{
@@ -69,14 +151,71 @@ struct node_msg_arg{
     struct node_message msg;
 };
 
+struct node_quorum_op;
+
+// one replica's part in a quorum op, the arg of the request sent to it
+struct node_quorum_call{
+    struct node_quorum_op* op;
+    struct node_info node;
+    short state; // QUORUM_*
+    uint64_t sent_us;
+    uint64_t version; // what it answered with
+};
+
+struct node_quorum_op{
+    struct node_self* self;
+    char type; // MSG_T_QPUT_REQ or MSG_T_QGET_REQ
+    struct node_info owner;
+    struct node_quorum_call calls[NODE_QUORUM_MAX_N]; // reads ask them in this order
+    int n_calls;
+    int need; // answers that complete the op
+    int n_ok;
+    int refs; // requests outstanding, plus one while the op is being started
+    short done; // cb has been called
+    struct event* hedge_evt;
+    node_put_cb_t put_cb;
+    node_get_cb_t get_cb;
+    void* cb_arg;
+    // the record written, or the newest one read so far
+    uint64_t version;
+    short deleted;
+    size_t key_len;
+    size_t val_len;
+    char key[NODE_QUORUM_MAX_RECORD + 1];
+    char val[NODE_QUORUM_MAX_RECORD];
+};
+
 typedef void (*node_check_cb)(struct node_self*, short, void *);
 
+struct node_found_cb_data* node_found_cb_data_new(struct node_self* self, node_found_cb_t cb, void* found_cb_arg);
+
+int node_route_lookup(struct node_self* self, struct node_found_cb_data* cb_data);
+
 struct node_check_arg{
     struct node_self* self;
+    struct node_info node;
     node_check_cb cb;
     void* arg;
 };
 
+// the payload of a control request with a TCP form is at most a notify's
+#define NODE_FALLBACK_PAYLOAD (ID_BYTES + 2)
+
+// a control request to a node that hasn't answered a datagram yet, see node_rpc_call
+struct node_rpc_fallback{
+    struct node_self* self;
+    struct node_info to;
+    char type;
+    char payload[NODE_FALLBACK_PAYLOAD];
+    size_t len;
+    int want; // bytes of the TCP reply, -1 if it has no TCP form
+    rpc_reply_cb_t cb;
+    void* arg;
+    uint32_t req_id; // while it goes over TCP
+    int connection;
+    char reply[1 + NODE_INFO_BYTES + SUCC_LIST_BYTES]; // a pred reply is the longest
+};
+
 
 void node_tm_stabilise(evutil_socket_t fd, short what, void *arg);
 
@@ -111,6 +250,12 @@ int node_id_in_range(hash_type id, hash_type min, hash_type max)
     }
 }
 
+// same node, whatever id it was given with
+int node_same(struct node_info a, struct node_info b)
+{
+    return a.IP == b.IP && a.port == b.port;
+}
+
 int node_first_alive_succ(struct node_self* self)
 {
     for (int i = 0; i < NUM_OF_SUCCS; ++i){
@@ -123,12 +268,433 @@ int node_first_alive_succ(struct node_self* self)
     return -1;
 }
 
+//
+// wire helpers
+//
+
+#define PRED_REPLY_BYTES (1 + NODE_INFO_BYTES + SUCC_LIST_BYTES)
+// followed by however many fingers the successor keeps
+#define JOIN_REPLY_MIN_BYTES PRED_REPLY_BYTES
+#define LEAVE_BYTES (ID_BYTES + 2 + PRED_REPLY_BYTES)
+
+int node_read_node_info(struct evbuffer* buf, struct node_info* n)
+{
+    if (evbuffer_get_length(buf) < NODE_INFO_BYTES){
+        return -1; }
+    evbuffer_remove(buf, (char*)&(n->id), ID_BYTES);
+    evbuffer_remove(buf, (char*)&(n->IP), 4);
+    evbuffer_remove(buf, (char*)&(n->port), 2);
+    return 0;
+}
+
+// same layout as node_read_node_info, for replies built on the stack
+size_t node_pack_node_info(char* buf, const struct node_info* n)
+{
+    memcpy(buf, &(n->id), ID_BYTES);
+    memcpy(buf + ID_BYTES, &(n->IP), 4);
+    memcpy(buf + ID_BYTES + 4, &(n->port), 2);
+    return NODE_INFO_BYTES;
+}
+
+void node_unpack_node_info(const char* buf, struct node_info* n)
+{
+    memcpy(&(n->id), buf, ID_BYTES);
+    memcpy(&(n->IP), buf + ID_BYTES, 4);
+    memcpy(&(n->port), buf + ID_BYTES + 4, 2);
+}
+
+// always writes NUM_OF_SUCCS entries so the reply has a fixed size
+size_t node_pack_succ_list(struct node_self* self, char* buf)
+{
+    struct node_info succs[NUM_OF_SUCCS];
+    pthread_mutex_lock(&(self->succs_lock));
+    memcpy(succs, self->successor, sizeof(succs));
+    pthread_mutex_unlock(&(self->succs_lock));
+
+    for (int i = 0; i < NUM_OF_SUCCS; ++i){
+        node_pack_node_info(buf + i * NODE_INFO_BYTES, &(succs[i]));
+    }
+    return SUCC_LIST_BYTES;
+}
+
+void node_unpack_succ_list(const char* buf, struct node_info* list)
+{
+    for (int i = 0; i < NUM_OF_SUCCS; ++i){
+        node_unpack_node_info(buf + i * NODE_INFO_BYTES, &(list[i]));
+    }
+}
+
+void node_write_succ_list(struct node_self* self, struct evbuffer* buf)
+{
+    char list[SUCC_LIST_BYTES];
+    evbuffer_add(buf, list, node_pack_succ_list(self, list));
+}
+
+size_t node_pack_pred_reply(struct node_self* self, char* buf)
+{
+    if (self->has_pred){
+        //log_info("pred is %08X@%08X:%04X", self->predecessor.id, self->predecessor.IP, self->predecessor.port);
+        buf[0] = 'Y';
+        node_pack_node_info(buf + 1, &(self->predecessor));
+    }else{
+        //log_info("No pred");
+        buf[0] = 'N';
+        memset(buf + 1, 0, NODE_INFO_BYTES);
+    }
+    node_pack_succ_list(self, buf + 1 + NODE_INFO_BYTES);
+    return PRED_REPLY_BYTES;
+}
+
+// n failed to answer: stop routing through it until it is heard from again
+void node_evict(struct node_self* self, struct node_info n)
+{
+    if (n.IP == 0 || node_same(n, self->self) || self->destroying){
+        return; }
+    peer_mark_dead(self->peers, n.IP, n.port, (uint64_t)NODE_DEAD_SECS * 1000000);
+
+    finger_replace(self->fingers, n, (struct node_info){0, 0, 0});
+    if (self->route_cache){
+        route_cache_forget(self->route_cache, n); }
+
+    pthread_mutex_lock(&(self->succs_lock));
+    int left = 0;
+    for (int i = 0; i < NUM_OF_SUCCS; ++i){
+        if (self->successor[i].IP != 0 && !node_same(self->successor[i], n)){
+            ++left; }
+    }
+    if (left > 0){ // the last successor stays, stabilize has nothing else to ask
+        int k = 0;
+        for (int i = 0; i < NUM_OF_SUCCS; ++i){
+            if (!node_same(self->successor[i], n)){
+                self->successor[k++] = self->successor[i]; }
+        }
+        for (; k < NUM_OF_SUCCS; ++k){
+            memset(&(self->successor[k]), 0, sizeof(struct node_info)); }
+    }
+    pthread_mutex_unlock(&(self->succs_lock));
+
+    if (self->has_pred && node_same(self->predecessor, n)){
+        self->has_pred = 0;
+        memset(&(self->predecessor), 0, sizeof(struct node_info));
+    }
+}
+
+//
+// network coordinates
+//
+
+void node_get_coord(struct node_self* self, struct vivaldi_coord* c)
+{
+    pthread_mutex_lock(&(self->coord_lock));
+    *c = self->coord;
+    pthread_mutex_unlock(&(self->coord_lock));
+}
+
+// a reply time to IP:port moves us if we know where it is
+void node_coord_sample(struct node_self* self, uint32_t IP, uint16_t port, uint64_t rtt_us)
+{
+    struct vivaldi_coord remote;
+    if (rtt_us == 0 || peer_get_coord(self->peers, IP, port, &remote) < 0){
+        return; }
+    pthread_mutex_lock(&(self->coord_lock));
+    vivaldi_update(&(self->coord), &remote, (double) rtt_us);
+    pthread_mutex_unlock(&(self->coord_lock));
+}
+
+// our coordinate then the coordinate of each of n, zero for those we don't know
+size_t node_pack_coords(struct node_self* self, char* buf, const struct node_info* list, int n)
+{
+    struct vivaldi_coord c;
+    node_get_coord(self, &c);
+    size_t len = vivaldi_pack(buf, &c);
+    for (int i = 0; i < n; ++i){
+        if (node_same(list[i], self->self)){
+            node_get_coord(self, &c);
+        }else if (list[i].IP == 0 || peer_get_coord(self->peers, list[i].IP, list[i].port, &c) < 0){
+            memset(&c, 0, sizeof(struct vivaldi_coord)); }
+        len += vivaldi_pack(buf + len, &c);
+    }
+    return len;
+}
+
+// remember the coordinates from a reply by from that listed the n nodes in list
+void node_take_coords(struct node_self* self, struct node_info from, const char* buf, size_t len,
+        const struct node_info* list, int n)
+{
+    if (len < (size_t) VIVALDI_BYTES * (1 + n)){
+        return; } // sent without them
+    struct vivaldi_coord c;
+    vivaldi_unpack(buf, &c);
+    peer_set_coord(self->peers, from.IP, from.port, &c);
+    for (int i = 0; i < n; ++i){
+        if (list[i].IP == 0 || node_same(list[i], self->self) || node_same(list[i], from)){
+            continue; }
+        vivaldi_unpack(buf + VIVALDI_BYTES * (1 + i), &c);
+        peer_set_coord(self->peers, list[i].IP, list[i].port, &c);
+    }
+}
+
+// connect times are the RTT samples, they don't include any remote processing
+void node_connect_observed(uint32_t IP, uint16_t port, uint64_t connect_us, short connected, void *arg)
+{
+    struct node_self* self = (struct node_self*) arg;
+    if (connected){
+        peer_reply_received(self->peers, IP, port, connect_us);
+        node_coord_sample(self, IP, port, connect_us);
+    }else{
+        peer_request_failed(self->peers, IP, port);
+        node_evict(self, (struct node_info){0, IP, port});
+    }
+}
+
+// time to wait for the reply to a lookup sent to n
+void node_lookup_timeout(struct node_self* self, struct node_info n, struct timeval* tv)
+{
+    peer_timeout(self->peers, n.IP, n.port, tv);
+    uint64_t tm_us = ((uint64_t)tv->tv_sec * 1000000 + tv->tv_usec) * NODE_LOOKUP_TIMEOUT_MULT;
+    if (tm_us > (uint64_t)NODE_TIMEOUT * 3 * 1000000){
+        tm_us = (uint64_t)NODE_TIMEOUT * 3 * 1000000; }
+    tv->tv_sec  = tm_us / 1000000;
+    tv->tv_usec = tm_us % 1000000;
+}
+
+int node_is_suspect(struct node_self* self, struct node_info node)
+{
+    return peer_is_dead(self->peers, node.IP, node.port) ||
+            peer_phi(self->peers, node.IP, node.port) >= PEER_PHI_SUSPECT;
+}
+
+// any reply on an outgoing connection shows the remote is alive
+void node_heard_from_connection(struct node_self* self, int connection)
+{
+    peer_heard_from(self->peers,
+            net_connection_get_remote_address(self->net, connection),
+            net_connection_get_remote_port(self->net, connection));
+}
+
+// an answered datagram shows the node takes them. an unanswered one only counts
+// against a node known to, otherwise the call's node_rpc_fallback decides
+void node_rpc_observed(uint32_t IP, uint16_t port, uint64_t reply_us, short answered, void *arg)
+{
+    struct node_self* self = (struct node_self*) arg;
+    if (answered){
+        peer_set_dgrams(self->peers, IP, port, PEER_DGRAMS_YES);
+    }else if (peer_dgrams(self->peers, IP, port) != PEER_DGRAMS_YES){
+        return;
+    }
+    node_connect_observed(IP, port, reply_us, answered, arg);
+}
+
+// bytes the TCP form of a control request is answered with, -1 if it only goes
+// as a datagram. these are the ones nodes from before rpc.h know
+int node_tcp_reply_bytes(char type)
+{
+    switch (type){
+        case MSG_T_PRED_REQ:  return PRED_REPLY_BYTES;
+        case MSG_T_SUCCS_REQ: return 1 + SUCC_LIST_BYTES;
+        case MSG_T_ALIVE_REQ: return 1; // "Y\n", the newline isn't waited for
+        case MSG_T_NOTIF:     return 0; // no reply, done once it is sent
+        default:              return -1;
+    }
+}
+
+void node_rpc_tcp_done(uint32_t req_id, short status, void *result, void *arg)
+{
+    struct node_rpc_fallback* fb = (struct node_rpc_fallback*) arg;
+    struct node_self* self = fb->self;
+
+    if (fb->connection >= 0){
+        // close leaves the write cb set, the slot's next user wouldn't expect it
+        net_connection_set_write_cb(self->net, fb->connection, NULL);
+        net_connection_close(self->net, fb->connection);
+    }
+    if (status == REQ_OK){
+        peer_set_dgrams(self->peers, fb->to.IP, fb->to.port, PEER_DGRAMS_NO);
+        fb->cb(RPC_OK, fb->reply, (size_t) fb->want, fb->arg);
+    }else{
+        fb->cb(status, NULL, 0, fb->arg);
+    }
+    pool_put(self->fallback_pool, fb);
+}
+
+void node_rpc_tcp_read(int connection, void *arg)
+{
+    struct node_rpc_fallback* fb = (struct node_rpc_fallback*) arg;
+    struct node_self* self = fb->self;
+    struct evbuffer* read_buf = net_connection_get_read_buffer(self->net, connection);
+
+    if (evbuffer_get_length(read_buf) < (size_t) fb->want){
+        return; } // rest of the reply still to come
+    node_heard_from_connection(self, connection);
+    evbuffer_remove(read_buf, fb->reply, fb->want);
+    request_complete(self->requests, fb->req_id, REQ_OK, NULL);
+}
+
+// a notify isn't answered, it's done once it has all gone
+void node_rpc_tcp_written(int connection, void *arg)
+{
+    struct node_rpc_fallback* fb = (struct node_rpc_fallback*) arg;
+    struct node_self* self = fb->self;
+    if (evbuffer_get_length(net_connection_get_write_buffer(self->net, connection)) == 0){
+        request_complete(self->requests, fb->req_id, REQ_OK, NULL); }
+}
+
+void node_rpc_tcp_event(int connection, short type, void *arg)
+{
+    struct node_rpc_fallback* fb = (struct node_rpc_fallback*) arg;
+    if (type & (BEV_EVENT_ERROR|BEV_EVENT_TIMEOUT|BEV_EVENT_EOF)){
+        request_complete(fb->self->requests, fb->req_id, REQ_ERROR, NULL); }
+}
+
+// send fb's request the way nodes did before rpc.h, to the same TCP handlers
+void node_rpc_tcp(struct node_rpc_fallback* fb)
+{
+    struct node_self* self = fb->self;
+    struct node_message msg;
+    msg.from = self->self;
+    msg.to   = fb->to;
+    msg.type = fb->type;
+    msg.len  = fb->len;
+    msg.content = NULL;
+
+    struct timeval tm;
+    peer_timeout(self->peers, fb->to.IP, fb->to.port, &tm);
+    fb->connection = -1;
+    fb->req_id = request_start(self->requests, &tm, node_rpc_tcp_done, NULL, fb);
+    if (!fb->req_id){
+        fb->cb(RPC_ERROR, NULL, 0, fb->arg);
+        pool_put(self->fallback_pool, fb);
+        return;
+    }
+    int conn = node_connect_and_send_message(self, &msg, fb->want > 0 ? node_rpc_tcp_read : NULL,
+            node_rpc_tcp_event, fb, &tm);
+    if (conn < 0){
+        request_complete(self->requests, fb->req_id, REQ_ERROR, NULL);
+        return;
+    }
+    fb->connection = conn;
+    if (fb->want == 0){
+        net_connection_set_write_cb(self->net, conn, node_rpc_tcp_written); }
+    evbuffer_add(net_connection_get_write_buffer(self->net, conn), fb->payload, fb->len);
+}
+
+// the datagram went unanswered by a node that has never answered one, try TCP
+void node_rpc_fallback_reply(short status, const char *data, size_t len, void *arg)
+{
+    struct node_rpc_fallback* fb = (struct node_rpc_fallback*) arg;
+    struct node_self* self = fb->self;
+
+    if (status == RPC_TIMEOUT && !self->destroying &&
+            peer_dgrams(self->peers, fb->to.IP, fb->to.port) != PEER_DGRAMS_YES){
+        peer_request_failed(self->peers, fb->to.IP, fb->to.port); // node_rpc_observed left it
+        if (fb->want >= 0){
+            node_rpc_tcp(fb);
+            return;
+        }
+    }
+    fb->cb(status, data, len, fb->arg);
+    pool_put(self->fallback_pool, fb);
+}
+
+// control messages go as datagrams, retried with the peer's adaptive timeout.
+// nodes from before rpc.h only take them over TCP: one that hasn't answered a
+// datagram yet is asked over TCP when they time out, and from then on if it answers
+int node_rpc_call(struct node_self* self, struct node_info to, char type,
+        const void* payload, size_t len, rpc_reply_cb_t cb, void* arg)
+{
+    short dgrams = peer_dgrams(self->peers, to.IP, to.port);
+    struct node_rpc_fallback* fb = NULL;
+
+    if (dgrams != PEER_DGRAMS_YES){
+        int want = (len <= NODE_FALLBACK_PAYLOAD) ? node_tcp_reply_bytes(type) : -1;
+        if (want < 0 && dgrams == PEER_DGRAMS_NO){
+            return -1; } // it doesn't know this request
+        fb = pool_get(self->fallback_pool);
+        if (!fb){
+            return -1; }
+        fb->self = self;
+        fb->to   = to;
+        fb->type = type;
+        fb->want = want;
+        fb->len  = (want >= 0) ? len : 0;
+        if (fb->len){
+            memcpy(fb->payload, payload, fb->len); }
+        fb->cb   = cb;
+        fb->arg  = arg;
+        if (dgrams == PEER_DGRAMS_NO){
+            node_rpc_tcp(fb);
+            return 0;
+        }
+        cb  = node_rpc_fallback_reply;
+        arg = fb;
+    }
+
+    struct timeval tm;
+    peer_timeout(self->peers, to.IP, to.port, &tm);
+    peer_request_sent(self->peers, to.IP, to.port);
+    if (rpc_call(self->rpc, to.IP, to.port, type, payload, len, &tm, NODE_RPC_TRIES, cb, arg) < 0){
+        peer_request_failed(self->peers, to.IP, to.port);
+        if (fb){
+            pool_put(self->fallback_pool, fb); }
+        return -1;
+    }
+    return 0;
+}
+
 //
 // node creation and cleanup
 //
 
 void incoming_connection(int connection, short type, void *arg);
 
+void node_pools_destroy(struct node_self* node)
+{
+    pool_destroy(node->found_pool);
+    pool_destroy(node->finger_pool);
+    pool_destroy(node->succ_pool);
+    pool_destroy(node->check_pool);
+    pool_destroy(node->handler_pool);
+    pool_destroy(node->msg_pool);
+    pool_destroy(node->trace_pool);
+    pool_destroy(node->quorum_pool);
+    pool_destroy(node->fallback_pool);
+}
+
+// run the node's event loop on this thread, which its pools belong to from now on
+int node_run(struct node_self* self)
+{
+    struct pool* pools[] = { self->found_pool, self->finger_pool, self->succ_pool,
+            self->check_pool, self->handler_pool, self->msg_pool, self->trace_pool, self->quorum_pool,
+            self->fallback_pool };
+    for (int i = 0; i < (int)(sizeof(pools) / sizeof(pools[0])); ++i){
+        pool_set_owner(pools[i]); }
+    request_set_pool_owner(self->requests);
+    rpc_set_pool_owner(self->rpc);
+    return net_server_run(self->net);
+}
+
+int node_pools_create(struct node_self* node)
+{
+    node->found_pool   = pool_create("lookups", sizeof(struct node_found_cb_data));
+    node->finger_pool  = pool_create("finger updates", sizeof(struct finger_update_arg));
+    node->succ_pool    = pool_create("succ updates", sizeof(struct succ_update_arg));
+    node->check_pool   = pool_create("checks", sizeof(struct node_check_arg));
+    node->handler_pool = pool_create("incoming lookups", sizeof(struct incoming_handler_data));
+    node->msg_pool     = pool_create("node messages", sizeof(struct node_msg_arg));
+    node->trace_pool   = pool_create("traces", sizeof(struct node_trace));
+    node->quorum_pool  = pool_create("quorum ops", sizeof(struct node_quorum_op));
+    node->fallback_pool = pool_create("tcp fallbacks", sizeof(struct node_rpc_fallback));
+    if (!node->found_pool || !node->finger_pool || !node->succ_pool || !node->check_pool ||
+            !node->handler_pool || !node->msg_pool || !node->trace_pool || !node->quorum_pool ||
+            !node->fallback_pool){
+        node_pools_destroy(node);
+        return -1;
+    }
+    return 0;
+}
+
+void node_rpc_request(struct rpc *rpc, const struct rpc_req *req, const char *data, size_t len, void *arg);
+
 struct node_self* node_create(uint16_t listen_port, char* name)
 {
     struct node_self* node = malloc(sizeof(struct node_self));
@@ -137,39 +703,91 @@ struct node_self* node_create(uint16_t listen_port, char* name)
         log_err("failed to malloc node");
         return NULL;
     }
+    memset(node, 0, sizeof(struct node_self));
 
     node->self.id = get_id(name);
     node->self.port = listen_port;
     node->self.IP = 0x7F000001; // (127.0.0.1)
     memset(&(node->predecessor), 0, sizeof(struct node_info));
     memset(&(node->successor), 0, sizeof(struct node_info) * NUM_OF_SUCCS);
+    node->quorum_n = NODE_QUORUM_N;
+    node->quorum_r = NODE_QUORUM_R;
+    node->quorum_w = NODE_QUORUM_W;
+    node->hedge_pct = NODE_HEDGE_PCT;
 
     if (pthread_mutex_init(&(node->succs_lock), NULL) != 0){
         log_err("failed to init lock");
         free(node);
         return NULL;
     }
+    vivaldi_init(&(node->coord));
+    if (pthread_mutex_init(&(node->coord_lock), NULL) != 0){
+        log_err("failed to init lock");
+        free(node);
+        return NULL;
+    }
+    if (pthread_mutex_init(&(node->store_lock), NULL) != 0){
+        log_err("failed to init lock");
+        free(node);
+        return NULL;
+    }
+
+    node->fingers = finger_table_create(node->self.id, NODE_FINGER_BASE_DEFAULT);
+    if (!node->fingers){
+        free(node);
+        return NULL; }
+
+    if (node_pools_create(node) < 0){
+        finger_table_destroy(node->fingers);
+        free(node);
+        return NULL; }
 
-    node->finger_table = malloc(sizeof(struct node_info) * ID_BITS);
-    if (!node->finger_table){
-        log_err("failed to malloc finger table");
+    node->peers = peer_table_create();
+    if (!node->peers){
+        node_pools_destroy(node);
+        finger_table_destroy(node->fingers);
         free(node);
         return NULL; }
 
 #ifdef USE_NETW
     netw_init();
     node->net = netw_net_server_create(listen_port);
-    netw_register_handler(incoming_connection, (void*) node);
+    node->netw_handle = netw_register_handler(incoming_connection, (void*) node);
 #else
     node->net = net_server_create(listen_port, incoming_connection, (void*) node);
 #endif // USE_NETW
 
     if (!node->net){
         log_err("failed to create net");
-        free(node->finger_table);
+        peer_table_destroy(node->peers);
+        node_pools_destroy(node);
+        finger_table_destroy(node->fingers);
         free(node);
         return NULL; }
 
+    net_server_set_connect_observer(node->net, node_connect_observed, (void*) node);
+
+    node->requests = request_table_create(net_get_base(node->net));
+    if (!node->requests){
+        net_server_destroy(node->net);
+        peer_table_destroy(node->peers);
+        node_pools_destroy(node);
+        finger_table_destroy(node->fingers);
+        free(node);
+        return NULL; }
+
+    node->rpc = rpc_create(node->net, node->requests, listen_port, node_rpc_request, (void*) node);
+    if (!node->rpc){
+        log_err("failed to create rpc");
+        request_table_destroy(node->requests);
+        net_server_destroy(node->net);
+        peer_table_destroy(node->peers);
+        node_pools_destroy(node);
+        finger_table_destroy(node->fingers);
+        free(node);
+        return NULL; }
+    rpc_set_observer(node->rpc, node_rpc_observed, (void*) node);
+
     struct event_base* base = net_get_base(node->net);
 
     if (!NODE_WAIT_TM_DEFAULT){
@@ -192,9 +810,28 @@ void node_destroy(struct node_self* n)
 #endif // USE_NETW
 
     if (!n) { return; }
+    if (n->snapshot_path){
+        node_snapshot_save(n, n->snapshot_path);
+        free(n->snapshot_path);
+    }
+    if (n->snapshot_evt){ event_free(n->snapshot_evt); }
+    for (int i = 0; i < NODE_MAINT_EVTS; ++i){
+        if (n->maint_evts[i]){ event_free(n->maint_evts[i]); }
+    }
+    n->destroying = 1;
+    // outstanding requests complete now, while what they use still exists
+    request_table_destroy(n->requests);
+    store_close(n->store);
+    n->store = NULL;
     pthread_mutex_destroy(&(n->succs_lock));
+    pthread_mutex_destroy(&(n->coord_lock));
+    pthread_mutex_destroy(&(n->store_lock));
+    rpc_destroy(n->rpc);
     if (n->net){ net_server_destroy(n->net); }
-    if (n->finger_table){ free(n->finger_table); }
+    if (n->fingers){ finger_table_destroy(n->fingers); }
+    route_cache_destroy(n->route_cache);
+    peer_table_destroy(n->peers);
+    node_pools_destroy(n);
     free(n);
 }
 
@@ -203,6 +840,32 @@ struct net_server* node_get_net(struct node_self* self)
     return self->net;
 }
 
+struct finger_table* node_get_fingers(struct node_self* self)
+{
+    return self->fingers;
+}
+
+struct peer_table* node_get_peers(struct node_self* self)
+{
+    return self->peers;
+}
+
+int node_get_pool_stats(struct node_self* self, struct pool_stats* stats, int max)
+{
+    struct pool* pools[] = { self->found_pool, self->finger_pool, self->succ_pool,
+            self->check_pool, self->handler_pool, self->msg_pool, self->trace_pool, self->quorum_pool,
+            self->fallback_pool };
+    int n = 0;
+    for (int i = 0; i < (int)(sizeof(pools) / sizeof(pools[0])) && n < max; ++i){
+        pool_get_stats(pools[i], &(stats[n++]));
+    }
+    if (n < max){
+        request_get_pool_stats(self->requests, &(stats[n++])); }
+    if (n < max){
+        rpc_get_pool_stats(self->rpc, &(stats[n++])); }
+    return n;
+}
+
 //
 // node network join/create
 //
@@ -214,6 +877,18 @@ void node_set_node_msg_handler(struct node_self* self, node_msg_cb_t node_msg_cb
     self->msg_cb_arg = cb_arg;
 }
 
+void node_set_trace_sample_rate(struct node_self* self, unsigned int every)
+{
+    self->trace_every = every;
+    self->trace_count = 0;
+}
+
+void node_set_trace_handler(struct node_self* self, node_trace_cb_t trace_cb, void* cb_arg)
+{
+    self->trace_cb = trace_cb;
+    self->trace_cb_arg = cb_arg;
+}
+
 
 void node_network_joined(evutil_socket_t fd, short what, void *arg)
 {
@@ -227,37 +902,31 @@ void node_network_joined(evutil_socket_t fd, short what, void *arg)
     struct event_base *base = net_get_base(self->net);
     //log_info("got base\n");
 
-    struct event* stabilise_tm_ev;
-    struct event* fix_finger_tm_ev;
-    struct event* check_pred_tm_ev;
-    struct event* check_succs_tm_ev;
-    struct event* update_succs_tm_ev;
-
     struct timeval stab_tm = {STABILIZE_PERIOD, 0};
     const struct timeval *stab_tm_comm = event_base_init_common_timeout(base, &stab_tm);
     struct timeval stab_check_tm = {STABILIZE_CHECK_PERIOD, 0};
     const struct timeval *stab_check_tm_comm = event_base_init_common_timeout(base, &stab_tm);
     //log_info("got common timeval\n");
 
-    stabilise_tm_ev  = event_new(base, -1, EV_TIMEOUT|EV_PERSIST, node_tm_stabilise,   (void*) self);
-    fix_finger_tm_ev = event_new(base, -1, EV_TIMEOUT|EV_PERSIST, node_tm_fix_fingers, (void*) self);
-    check_pred_tm_ev = event_new(base, -1, EV_TIMEOUT|EV_PERSIST, node_tm_check_pred,  (void*) self);
-    check_succs_tm_ev = event_new(base, -1, EV_TIMEOUT|EV_PERSIST, node_tm_check_succs,  (void*) self);
-    update_succs_tm_ev = event_new(base, -1, EV_TIMEOUT|EV_PERSIST, node_tm_update_succs,  (void*) self);
+    // kept so a leave can stop them
+    self->maint_evts[0] = event_new(base, -1, EV_TIMEOUT|EV_PERSIST, node_tm_stabilise,   (void*) self);
+    self->maint_evts[1] = event_new(base, -1, EV_TIMEOUT|EV_PERSIST, node_tm_fix_fingers, (void*) self);
+    self->maint_evts[2] = event_new(base, -1, EV_TIMEOUT|EV_PERSIST, node_tm_check_pred,  (void*) self);
+    self->maint_evts[3] = event_new(base, -1, EV_TIMEOUT|EV_PERSIST, node_tm_check_succs,  (void*) self);
 
     //log_info("created stab evs\n");
 
-    event_add(stabilise_tm_ev, stab_tm_comm);
-    event_add(fix_finger_tm_ev, stab_tm_comm);
-    event_add(check_pred_tm_ev, stab_tm_comm);
-    event_add(check_succs_tm_ev, stab_check_tm_comm);
-    event_add(update_succs_tm_ev, stab_tm_comm);
+    event_add(self->maint_evts[0], stab_tm_comm);
+    event_add(self->maint_evts[1], stab_tm_comm);
+    event_add(self->maint_evts[2], stab_tm_comm);
+    event_add(self->maint_evts[3], stab_check_tm_comm);
     //TODO call stab now?
     //log_info("added stab evs\n");
 
     node_tm_stabilise(0,0,(void*)self);
     node_tm_update_succs(0,0,(void*)self);
-    node_tm_fix_fingers(0,0,(void*)self);
+    if (!cb_data->warm){ // loaded fingers are refreshed by the timer like any others
+        node_tm_fix_fingers(0,0,(void*)self); }
 
 
     free(cb_data);
@@ -275,6 +944,7 @@ int node_network_create(struct node_self* self, on_join_cb_t join_cb, void *arg)
     cb_data->joined_cb = join_cb;
     cb_data->joined_cb_arg = arg;
     cb_data->self = self;
+    cb_data->warm = 0;
 
     struct timeval tmo = {0,1};
     struct event* crtevt;
@@ -289,56 +959,447 @@ int node_network_create(struct node_self* self, on_join_cb_t join_cb, void *arg)
     event_active(crtevt, 0, 0);
 
     //log_info("running server...\n");
-    return net_server_run(self->net);
+    return node_run(self);
 }
 
-void node_network_join_succ_found(struct node_info succ, void *arg, short h)
-{
-    struct node_join_cb_data* cb_data = (struct node_join_cb_data*) arg;
+void node_network_join_succ_found(struct node_info succ, void *arg, short h);
 
-    //log_info("succ found for join\n");
+void node_network_join_retry(evutil_socket_t fd, short what, void *arg);
 
-    struct node_self* self = cb_data->self;
-    self->successor[0] = succ;
+// one round of join lookups, a lookup through every seed at once
+struct node_join_race{
+    struct node_join_cb_data* join; // NULL once a lookup has won
+    int pending; // lookups still out, plus one until they have all been sent
+};
 
-    struct event* crtevt;
-    crtevt = event_new(net_get_base(self->net), -1, 0, node_network_joined, cb_data);
-    if (!crtevt){
+void node_network_joined_soon(struct node_join_cb_data* join)
+{
+    join->evt = event_new(net_get_base(join->self->net), -1, 0, node_network_joined, join);
+    if (!join->evt){
         log_err("failed to create event");
-        free(cb_data);
-    }else{
-        cb_data->evt = crtevt;
-        event_active(crtevt, 0, 0);
+        free(join);
+        return;
     }
+    event_active(join->evt, 0, 0);
 }
 
-int node_network_join(struct node_self* self, struct node_info node, on_join_cb_t join_cb, void * cb_arg)
+void node_network_join_race_done(struct node_join_race* race)
 {
-    // TODO check malloc worked
-    struct node_found_cb_data* cb_data = malloc(sizeof(struct node_found_cb_data));
-    struct node_join_cb_data* cb_cb_data = malloc(sizeof(struct node_join_cb_data));
-
-    cb_cb_data->joined_cb = join_cb;
-    cb_cb_data->joined_cb_arg = cb_arg;
-    cb_cb_data->self = self;
+    if (--race->pending > 0){
+        return; }
+    struct node_join_cb_data* join = race->join;
+    free(race);
+    if (!join){
+        return; }
+
+    struct node_self* self = join->self;
+    log_warn("join lookups failed, asking %d seeds again", join->n_seeds);
+    struct timeval retry_tm = {NODE_JOIN_RETRY_PERIOD, 0};
+    if (event_base_once(net_get_base(self->net), -1, EV_TIMEOUT, node_network_join_retry, join, &retry_tm) < 0){
+        log_err("failed to schedule join retry");
+        free(join);
+    }
+}
 
-    cb_data->self = self;
-    cb_data->found_cb_arg = cb_cb_data;
-    cb_data->cb = node_network_join_succ_found;
-    self->has_pred = 0; // nil
-    node_find_successor_remote(self, node, self->self.id, cb_data);
-    //log_info("running server...\n");
-    return net_server_run(self->net);
+void node_network_join_retry(evutil_socket_t fd, short what, void *arg)
+{
+    struct node_join_cb_data* join = (struct node_join_cb_data*) arg;
+    struct node_self* self = join->self;
+    struct node_join_race* race = malloc(sizeof(struct node_join_race));
+    if (!race){
+        log_err("failed to malloc join lookups");
+        free(join);
+        return; }
+    race->join = join;
+    race->pending = join->n_seeds + 1;
+
+    for (int i = 0; i < join->n_seeds; ++i){
+        struct node_found_cb_data* cb_data = node_found_cb_data_new(self, node_network_join_succ_found, race);
+        if (!cb_data){
+            --race->pending;
+            continue; }
+        node_find_successor_remote(self, join->seeds[i], self->self.id, cb_data);
+    }
+    node_network_join_race_done(race);
 }
 
-//
-// Timeout callbacks for stabilization
-//
+// every node a join state reply told us about, to pick fingers from
+#define JOIN_MAX_KNOWN (1 + 1 + NUM_OF_SUCCS + NODE_MAX_FINGERS)
 
-void node_tm_stabilise(evutil_socket_t fd, short what, void *arg)
+// finger f is the first known node at or after its start, checked later by fix_fingers
+void node_derive_fingers(struct node_self* self, const struct node_info* known, int n)
 {
-    struct node_self* self = (struct node_self*) arg;
-    node_network_stabalize(self);
+    for (int f = 0; f < finger_count(self->fingers); ++f){
+        hash_type finger_id = finger_start(self->fingers, f);
+        struct node_info best = {0, 0, 0};
+        hash_type best_dist = 0;
+        for (int i = 0; i < n; ++i){
+            if (known[i].IP == 0 || node_id_compare(known[i].id, self->self.id) == 0){
+                continue; }
+            hash_type dist = known[i].id - finger_id;
+            if (best.IP == 0 || dist < best_dist){
+                best = known[i];
+                best_dist = dist;
+            }
+        }
+        finger_set(self->fingers, f, best);
+    }
+}
+
+void node_join_state_rpc_reply(short status, const char *data, size_t len, void *arg)
+{
+    struct node_join_cb_data* join = (struct node_join_cb_data*) arg;
+    struct node_self* self = join->self;
+
+    if (status != RPC_OK || len < JOIN_REPLY_MIN_BYTES){
+        // fingers get filled in by lookups as before
+        log_warn("no join state from %08X, fixing fingers by lookup", self->successor[0].id);
+        join->warm = 0;
+        node_network_joined_soon(join);
+        return;
+    }
+
+    struct node_info known[JOIN_MAX_KNOWN];
+    struct node_info pred;
+    struct node_info* list = known + 2;
+    struct node_info* fingers = list + NUM_OF_SUCCS;
+
+    known[0] = self->successor[0];
+    node_unpack_node_info(data + 1, &pred);
+    node_unpack_succ_list(data + 1 + NODE_INFO_BYTES, list);
+    // its finger base may differ from ours, any of its fingers will do
+    int n_fingers = (len - PRED_REPLY_BYTES) / NODE_INFO_BYTES;
+    if (n_fingers > NODE_MAX_FINGERS){
+        n_fingers = NODE_MAX_FINGERS; }
+    for (int i = 0; i < n_fingers; ++i){
+        node_unpack_node_info(data + PRED_REPLY_BYTES + i * NODE_INFO_BYTES, &(fingers[i])); }
+    if (data[0] != 'Y'){
+        memset(&pred, 0, sizeof(struct node_info)); }
+    known[1] = pred;
+
+    node_adopt_succ_list(self, known[0], list);
+    // succ's old predecessor now comes just before us, check_pred drops it if not
+    if (pred.IP != 0 && node_id_compare(pred.id, self->self.id) != 0){
+        self->predecessor = pred;
+        self->has_pred = 1;
+        self->pred_notified = 0;
+    }
+    node_derive_fingers(self, known, 2 + NUM_OF_SUCCS + n_fingers);
+
+    join->warm = 1;
+    node_network_joined_soon(join);
+}
+
+void node_network_join_succ_found(struct node_info succ, void *arg, short h)
+{
+    struct node_join_race* race = (struct node_join_race*) arg;
+    struct node_join_cb_data* join = race->join;
+
+    //log_info("succ found for join\n");
+
+    if (succ.IP == 0 || !join){ // failed, or another seed answered first
+        node_network_join_race_done(race);
+        return; }
+    race->join = NULL;
+    node_network_join_race_done(race);
+
+    struct node_self* self = join->self;
+    self->successor[0] = succ;
+
+    // successor's routing state, so we route in log N hops straight away
+    if (node_rpc_call(self, succ, MSG_T_JOIN_REQ, NULL, 0, node_join_state_rpc_reply, join) < 0){
+        join->warm = 0;
+        node_network_joined_soon(join);
+    }
+}
+
+int node_network_join_seeds(struct node_self* self, const struct node_info* seeds, int n_seeds,
+                            on_join_cb_t join_cb, void * cb_arg)
+{
+    if (n_seeds <= 0){
+        log_err("no seed nodes to join through");
+        return -1; }
+    if (n_seeds > NODE_JOIN_MAX_SEEDS){
+        n_seeds = NODE_JOIN_MAX_SEEDS; }
+
+    struct node_join_cb_data* cb_cb_data = malloc(sizeof(struct node_join_cb_data));
+    if (!cb_cb_data){
+        log_err("failed to malloc join data");
+        return -1; }
+
+    cb_cb_data->joined_cb = join_cb;
+    cb_cb_data->joined_cb_arg = cb_arg;
+    cb_cb_data->self = self;
+    memcpy(cb_cb_data->seeds, seeds, sizeof(struct node_info) * n_seeds);
+    cb_cb_data->n_seeds = n_seeds;
+    cb_cb_data->warm = 0;
+
+    self->has_pred = 0; // nil
+    node_network_join_retry(-1, 0, cb_cb_data);
+    //log_info("running server...\n");
+    return node_run(self);
+}
+
+int node_network_join(struct node_self* self, struct node_info node, on_join_cb_t join_cb, void * cb_arg)
+{
+    return node_network_join_seeds(self, &node, 1, join_cb, cb_arg);
+}
+
+//
+// routing state snapshots and warm join
+//
+
+void node_check_node(struct node_self* self, struct node_info node,
+                        node_check_cb cb, void* arg);
+
+int node_snapshot_save(struct node_self* self, const char* path)
+{
+    struct node_snapshot* snap = malloc(sizeof(struct node_snapshot));
+    if (!snap){
+        log_err("failed to malloc snapshot");
+        return -1; }
+
+    snap->self = self->self;
+    pthread_mutex_lock(&(self->succs_lock));
+    memcpy(snap->successor, self->successor, sizeof(struct node_info) * NUM_OF_SUCCS);
+    pthread_mutex_unlock(&(self->succs_lock));
+    snap->predecessor = self->predecessor;
+    snap->has_pred    = self->has_pred;
+    snap->n_fingers = finger_count(self->fingers);
+    for (int i = 0; i < snap->n_fingers; ++i){
+        snap->fingers[i] = finger_get(self->fingers, i); }
+    snap->n_peers = peer_export(self->peers, snap->peers, SNAPSHOT_MAX_PEERS);
+
+    int rc = snapshot_save(path, snap);
+    free(snap);
+    return rc;
+}
+
+void node_tm_snapshot(evutil_socket_t fd, short what, void *arg)
+{
+    struct node_self* self = (struct node_self*) arg;
+    node_snapshot_save(self, self->snapshot_path);
+}
+
+int node_set_snapshot_file(struct node_self* self, const char* path)
+{
+    if (self->snapshot_evt){
+        event_free(self->snapshot_evt);
+        self->snapshot_evt = NULL;
+    }
+    free(self->snapshot_path);
+    self->snapshot_path = NULL;
+    if (!path){
+        return 0; }
+
+    self->snapshot_path = strdup(path);
+    if (!self->snapshot_path){
+        log_err("failed to copy snapshot path");
+        return -1; }
+
+    struct timeval snap_tm = {NODE_SNAPSHOT_PERIOD, 0};
+    self->snapshot_evt = event_new(net_get_base(self->net), -1, EV_TIMEOUT|EV_PERSIST, node_tm_snapshot, (void*) self);
+    if (!self->snapshot_evt || event_add(self->snapshot_evt, &snap_tm) < 0){
+        log_err("failed to schedule snapshots");
+        return -1; }
+    return 0;
+}
+
+// the old store is closed before the new one is opened, dir may be the same one.
+// replicas answer that they have no store in between
+int node_set_store(struct node_self* self, const char* dir)
+{
+    pthread_mutex_lock(&(self->store_lock));
+    struct store* old = self->store;
+    self->store = NULL;
+    pthread_mutex_unlock(&(self->store_lock));
+    store_close(old);
+    if (!dir){
+        return 0; }
+    struct store* store = store_open(dir);
+    if (!store){
+        return -1; }
+    pthread_mutex_lock(&(self->store_lock));
+    self->store = store;
+    pthread_mutex_unlock(&(self->store_lock));
+    return 0;
+}
+
+struct store* node_get_store(struct node_self* self)
+{
+    return self->store;
+}
+
+// every distinct node in a loaded snapshot, probed at once
+#define WARM_MAX_NODES (NUM_OF_SUCCS + 1 + NODE_MAX_FINGERS)
+
+struct node_warm_join;
+
+struct node_warm_check{
+    struct node_warm_join* wj;
+    int i;
+};
+
+struct node_warm_join{
+    struct node_join_cb_data* join;
+    int pending; // checks still out, plus one until they have all been sent
+    int n;
+    struct node_info nodes[WARM_MAX_NODES];
+    short alive[WARM_MAX_NODES];
+    struct node_warm_check checks[WARM_MAX_NODES];
+};
+
+int node_warm_alive(struct node_warm_join* wj, struct node_info n)
+{
+    for (int i = 0; i < wj->n; ++i){
+        if (wj->nodes[i].IP == n.IP && wj->nodes[i].port == n.port){
+            return wj->alive[i]; }
+    }
+    return 0;
+}
+
+void node_warm_join_checked(struct node_warm_join* wj)
+{
+    struct node_join_cb_data* join = wj->join;
+    struct node_self* self = join->self;
+    int alive_succs = 0, stale = 0;
+
+    pthread_mutex_lock(&(self->succs_lock));
+    for (int i = 0; i < NUM_OF_SUCCS; ++i){
+        if (self->successor[i].IP == 0){ continue; }
+        if (node_warm_alive(wj, self->successor[i])){
+            self->successor[alive_succs++] = self->successor[i];
+        }else{
+            ++stale; }
+    }
+    for (int i = alive_succs; i < NUM_OF_SUCCS; ++i){
+        memset(&(self->successor[i]), 0, sizeof(struct node_info)); }
+    pthread_mutex_unlock(&(self->succs_lock));
+
+    if (self->has_pred && !node_warm_alive(wj, self->predecessor)){
+        self->has_pred = 0;
+        memset(&(self->predecessor), 0, sizeof(struct node_info));
+        ++stale;
+    }
+    for (int i = 0; i < finger_count(self->fingers); ++i){
+        struct node_info f = finger_get(self->fingers, i);
+        if (f.IP != 0 && !node_warm_alive(wj, f)){
+            finger_set(self->fingers, i, (struct node_info){0, 0, 0});
+            ++stale;
+        }
+    }
+    free(wj);
+
+    if (alive_succs == 0){
+        log_warn("no saved successor answered, joining through %08X:%d",
+                join->seeds[0].IP, join->seeds[0].port);
+        join->warm = 0;
+        node_network_join_retry(-1, 0, join);
+        return;
+    }
+    log_info("warm join, %d saved entries dropped", stale);
+    node_network_joined_soon(join);
+}
+
+void node_warm_check_result(struct node_self* self, short success, void* arg)
+{
+    struct node_warm_check* check = (struct node_warm_check*) arg;
+    struct node_warm_join* wj = check->wj;
+    wj->alive[check->i] = success;
+    if (--wj->pending == 0){
+        node_warm_join_checked(wj); }
+}
+
+void node_warm_add(struct node_warm_join* wj, struct node_self* self, struct node_info n)
+{
+    if (n.IP == 0 || (n.IP == self->self.IP && n.port == self->self.port)){
+        return; }
+    for (int i = 0; i < wj->n; ++i){
+        if (wj->nodes[i].IP == n.IP && wj->nodes[i].port == n.port){
+            return; }
+    }
+    wj->nodes[wj->n++] = n;
+}
+
+int node_network_warm_join(struct node_self* self, const char* path, struct node_info bootstrap,
+                           on_join_cb_t join_cb, void * cb_arg)
+{
+    struct node_snapshot* snap = malloc(sizeof(struct node_snapshot));
+    if (!snap){
+        log_err("failed to malloc snapshot");
+        return node_network_join(self, bootstrap, join_cb, cb_arg); }
+
+    if (snapshot_load(path, snap) < 0 || snap->self.id != self->self.id){
+        log_info("no usable snapshot in %s, joining cold", path);
+        free(snap);
+        return node_network_join(self, bootstrap, join_cb, cb_arg);
+    }
+
+    struct node_join_cb_data* join = malloc(sizeof(struct node_join_cb_data));
+    struct node_warm_join* wj = malloc(sizeof(struct node_warm_join));
+    if (!join || !wj){
+        log_err("failed to malloc warm join data");
+        free(join);
+        free(wj);
+        free(snap);
+        return node_network_join(self, bootstrap, join_cb, cb_arg);
+    }
+    join->joined_cb = join_cb;
+    join->joined_cb_arg = cb_arg;
+    join->self = self;
+    join->seeds[0] = bootstrap;
+    join->n_seeds = 1;
+    join->warm = 1;
+
+    // route with the saved state straight away, dead entries go once checked
+    memcpy(self->successor, snap->successor, sizeof(struct node_info) * NUM_OF_SUCCS);
+    self->predecessor = snap->predecessor;
+    self->has_pred    = snap->has_pred;
+    self->pred_notified = 0;
+    if (snap->n_fingers == finger_count(self->fingers)){
+        for (int i = 0; i < snap->n_fingers; ++i){
+            finger_set(self->fingers, i, snap->fingers[i]); }
+    }else{ // saved with another finger base
+        join->warm = 0;
+        snap->n_fingers = 0;
+    }
+    for (int i = 0; i < snap->n_peers; ++i){
+        peer_restore(self->peers, snap->peers[i].IP, snap->peers[i].port,
+                snap->peers[i].srtt_us, snap->peers[i].rttvar_us);
+    }
+
+    memset(wj, 0, sizeof(struct node_warm_join));
+    wj->join = join;
+    for (int i = 0; i < NUM_OF_SUCCS; ++i){
+        node_warm_add(wj, self, snap->successor[i]); }
+    if (snap->has_pred){
+        node_warm_add(wj, self, snap->predecessor); }
+    for (int i = 0; i < snap->n_fingers; ++i){
+        node_warm_add(wj, self, snap->fingers[i]); }
+    free(snap);
+
+    log_info("warm join from %s, checking %d saved nodes", path, wj->n);
+    // held at one until every check is out so early failures can't finish it
+    wj->pending = wj->n + 1;
+    for (int i = 0; i < wj->n; ++i){
+        wj->checks[i].wj = wj;
+        wj->checks[i].i  = i;
+        node_check_node(self, wj->nodes[i], node_warm_check_result, &(wj->checks[i]));
+    }
+    if (--wj->pending == 0){
+        node_warm_join_checked(wj); }
+
+    return node_run(self);
+}
+
+//
+// Timeout callbacks for stabilization
+//
+
+void node_tm_stabilise(evutil_socket_t fd, short what, void *arg)
+{
+    struct node_self* self = (struct node_self*) arg;
+    node_network_stabalize(self);
 }
 
 void node_tm_fix_fingers(evutil_socket_t fd, short what, void *arg)
@@ -374,63 +1435,203 @@ void node_tm_update_succs(evutil_socket_t fd, short what, void *arg)
 // callbacks for when node is found
 //
 
+struct node_found_cb_data* node_found_cb_data_new(struct node_self* self, node_found_cb_t cb, void* found_cb_arg)
+{
+    struct node_found_cb_data* cb_data = pool_get(self->found_pool);
+    if (!cb_data){
+        return NULL; }
+    cb_data->self         = self;
+    cb_data->cb           = cb;
+    cb_data->found_cb_arg = found_cb_arg;
+    cb_data->hops         = 0;
+    cb_data->connection   = -1;
+    cb_data->req_id       = 0;
+    cb_data->trace        = NULL;
+    cb_data->trace_owned  = 0;
+    cb_data->tries        = 0;
+    cb_data->route_around = 0;
+    cb_data->not_found    = 0;
+    cb_data->busy         = 0;
+    cb_data->busy_tries   = 0;
+    cb_data->cacheable    = 0;
+    return cb_data;
+}
+
 void node_found(evutil_socket_t fd, short what, void *arg)
 {
     struct node_found_cb_data* cb_data = (struct node_found_cb_data*) arg;
+    struct node_self* self = cb_data->self;
     ///log_info("found node %08X @ %08X:%d", cb_data->node.id, cb_data->node.IP, cb_data->node.port);
+
+    if (self->route_cache && cb_data->cacheable && cb_data->tries > 0 && cb_data->node.IP != 0){
+        route_cache_offer(self->route_cache, cb_data->target, cb_data->node); }
+
+    if (cb_data->trace){ // what's left of this node's time was its own work
+        struct node_trace_hop* me = &(cb_data->trace->hops[0]);
+        uint64_t total = peer_now_us() - cb_data->started_us;
+        me->proc_us = total > me->wait_us ? (uint32_t)(total - me->wait_us) : 0;
+        if (cb_data->trace_owned){
+            if (self->trace_cb){
+                self->trace_cb(cb_data->target, cb_data->trace, cb_data->node.IP != 0, self->trace_cb_arg); }
+            pool_put(self->trace_pool, cb_data->trace);
+        }
+    }
     cb_data->cb(cb_data->node, cb_data->found_cb_arg, cb_data->hops);
-    free(cb_data);
+    pool_put(self->found_pool, cb_data);
 }
 
-//TODO split into two parts one for header one for body so we can set watermarks
-void node_found_remote_cb(int connection, void *arg)
+// backoff after a busy reply over, try again unless the node is going away
+void node_lookup_backoff_done(uint32_t req_id, short status, void *result, void *arg)
 {
-    //log_info("reply from get succ remote");
     struct node_found_cb_data* cb_data = (struct node_found_cb_data*) arg;
     struct node_self* self = cb_data->self;
 
-    int rc = 0;
-    struct evbuffer *read_buf = net_connection_get_read_buffer(self->net, connection);
+    if (status == REQ_TIMEOUT && !self->destroying){
+        node_route_lookup(self, cb_data);
+        return;
+    }
+    memset(&(cb_data->node), 0, sizeof(struct node_info));
+    cb_data->hops = -1;
+    node_found(-1, 0, cb_data);
+}
 
-    char result[1];
+// the node asked is overloaded: give it a moment, then route again avoiding it.
+// returns -1 if the lookup has backed off enough times already
+int node_lookup_backoff(struct node_self* self, struct node_found_cb_data* cb_data)
+{
+    if (self->destroying || cb_data->busy_tries >= NODE_BUSY_TRIES){
+        return -1; }
+    struct timeval tm = {0, NODE_BUSY_BACKOFF_MS * 1000 << cb_data->busy_tries};
+    ++cb_data->busy_tries;
+    --cb_data->tries;
+    cb_data->req_id = request_start(self->requests, &tm, node_lookup_backoff_done, NULL, cb_data);
+    return cb_data->req_id ? 0 : -1;
+}
 
-    rc = evbuffer_remove(read_buf, result, 1);
+// lookup request done, success or not the caller's callback runs once from here
+void node_lookup_done(uint32_t req_id, short status, void *result, void *arg)
+{
+    struct node_found_cb_data* cb_data = (struct node_found_cb_data*) arg;
+    struct node_self* self = cb_data->self;
 
-    if (result[0] != 'Y'){
-        log_warn("couldn't find it");
-        cb_data->node.id = 0;
-        cb_data->node.IP = 0;
-        cb_data->node.port = 0;
-    }else{
-        if(evbuffer_remove(read_buf, (char*)&(cb_data->node.id), ID_BYTES) < 0 ||
-                evbuffer_remove(read_buf, (char*)&(cb_data->node.IP), 4) < 0 ||
-                evbuffer_remove(read_buf, (char*)&(cb_data->node.port), 2) < 0 ||
-                evbuffer_remove(read_buf, (char*)&(cb_data->hops), sizeof(short)) < 0)
-        {
-            log_err("found? but error reading");
-            net_connection_close(self->net, connection);
-            cb_data->node.id = 0;
-            cb_data->node.IP = 0;
-            cb_data->node.port = 0;
+    if (cb_data->connection >= 0){
+        net_connection_close(self->net, cb_data->connection);
+        cb_data->connection = -1;
+    }
+    if (cb_data->trace){
+        cb_data->trace->hops[0].wait_us += peer_now_us() - cb_data->sent_us; }
+    if (status != REQ_OK){
+        if (status == REQ_TIMEOUT){
+            log_warn("lookup timed out at %08X", cb_data->asked.id); }
+        if (cb_data->busy){
+            peer_mark_busy(self->peers, cb_data->asked.IP, cb_data->asked.port, (uint64_t)NODE_BUSY_MS * 1000);
+            if (cb_data->route_around && node_lookup_backoff(self, cb_data) == 0){
+                return; }
+        }else if (!cb_data->not_found){
+            node_evict(self, cb_data->asked);
+            if (cb_data->route_around && !self->destroying && cb_data->tries < NODE_LOOKUP_TRIES){
+                node_route_lookup(self, cb_data);
+                return;
+            }
         }
+        memset(&(cb_data->node), 0, sizeof(struct node_info));
+        cb_data->hops = -1;
     }
+    node_found(-1, 0, cb_data);
+}
 
-    net_connection_close(self->net, connection);
+// append the hops in a traced reply to this node's trace
+void node_read_trace_hops(struct evbuffer* buf, struct node_trace* trace, int count)
+{
+    for (int i = 0; i < count; ++i){
+        struct node_trace_hop hop;
+        evbuffer_remove(buf, (char*)&(hop.id), ID_BYTES);
+        evbuffer_remove(buf, (char*)&(hop.queue_us), 4);
+        evbuffer_remove(buf, (char*)&(hop.proc_us), 4);
+        evbuffer_remove(buf, (char*)&(hop.wait_us), 4);
+        if (trace->n_hops < NODE_TRACE_MAX_HOPS){
+            trace->hops[trace->n_hops++] = hop; }
+    }
+}
 
-    node_found(-1, 0, cb_data);
+void node_write_trace_hops(struct evbuffer* buf, const struct node_trace* trace)
+{
+    unsigned char count = trace->n_hops;
+    evbuffer_add(buf, &count, 1);
+    for (int i = 0; i < count; ++i){
+        const struct node_trace_hop* hop = &(trace->hops[i]);
+        evbuffer_add(buf, (char*)&(hop->id), ID_BYTES);
+        evbuffer_add(buf, (char*)&(hop->queue_us), 4);
+        evbuffer_add(buf, (char*)&(hop->proc_us), 4);
+        evbuffer_add(buf, (char*)&(hop->wait_us), 4);
+    }
+}
+
+void node_found_remote_cb(int connection, void *arg)
+{
+    //log_info("reply from get succ remote");
+    struct node_found_cb_data* cb_data = (struct node_found_cb_data*) arg;
+    struct node_self* self = cb_data->self;
+    struct evbuffer *read_buf = net_connection_get_read_buffer(self->net, connection);
+    size_t have = evbuffer_get_length(read_buf);
+    unsigned char count = 0;
+    char result;
+
+    if (have < 1){
+        return; }
+    node_heard_from_connection(self, connection);
+
+    evbuffer_copyout(read_buf, &result, 1);
+    size_t need = (result == 'Y') ? 1 + NODE_INFO_BYTES + sizeof(short) : 1;
+    if (cb_data->trace){
+        if (have < need + 1){
+            return; }
+        count = evbuffer_pullup(read_buf, need + 1)[need];
+        need += 1 + count * TRACE_HOP_BYTES;
+    }
+    if (have < need){
+        return; } // rest of the reply still to come
+
+    evbuffer_drain(read_buf, 1);
+    if (result == 'Y'){
+        node_read_node_info(read_buf, &(cb_data->node));
+        evbuffer_remove(read_buf, (char*)&(cb_data->hops), sizeof(short));
+    }
+    if (cb_data->trace){
+        evbuffer_drain(read_buf, 1);
+        node_read_trace_hops(read_buf, cb_data->trace, count);
+    }
+
+    if (result == 'B'){
+        log_warn("%08X is busy", cb_data->asked.id);
+        cb_data->busy = 1;
+        request_complete(self->requests, cb_data->req_id, REQ_ERROR, NULL);
+        return;
+    }
+    if (result != 'Y'){
+        log_warn("couldn't find it");
+        cb_data->not_found = 1;
+        request_complete(self->requests, cb_data->req_id, REQ_ERROR, NULL);
+        return;
+    }
+    request_complete(self->requests, cb_data->req_id, REQ_OK, NULL);
 }
 
-// TODO maybe close an free stuff
 void node_remote_find_event(int connection, short type, void *arg)
 {
     ///log_info("node_remote_find_event");
+    struct node_found_cb_data* cb_data = (struct node_found_cb_data*) arg;
+    if (type & (BEV_EVENT_ERROR|BEV_EVENT_TIMEOUT|BEV_EVENT_EOF)){
+        request_complete(cb_data->self->requests, cb_data->req_id, REQ_ERROR, NULL);
+    }
 }
 
 //
 // node finding
 //
 
-//ask node n for successor of id
+//ask node n for successor of id, cb_data's callback is always called, with
+//an all zero node and -1 hops if the lookup failed
 int node_find_successor_remote(struct node_self* self, struct node_info n,
         hash_type id, struct node_found_cb_data* cb_data)
 {
@@ -439,408 +1640,1426 @@ int node_find_successor_remote(struct node_self* self, struct node_info n,
     struct node_message msg;
     msg.from = self->self;
     msg.to   = n;
-    msg.type = MSG_T_SUCC_REQ;
+    msg.type = cb_data->trace ? MSG_T_SUCC_TRACE_REQ : MSG_T_SUCC_REQ;
     msg.len  = ID_BYTES;
     msg.content = NULL;
 
+    struct timeval connect_tm, reply_tm;
+    peer_timeout(self->peers, n.IP, n.port, &connect_tm);
+    node_lookup_timeout(self, n, &reply_tm);
+
+    cb_data->connection = -1;
+    cb_data->asked = n;
+    cb_data->tries++;
+    cb_data->not_found = 0;
+    cb_data->busy = 0;
+    cb_data->sent_us = peer_now_us();
+    cb_data->req_id = request_start(self->requests, &reply_tm, node_lookup_done, NULL, cb_data);
+    if (!cb_data->req_id){
+        memset(&(cb_data->node), 0, sizeof(struct node_info));
+        cb_data->hops = -1;
+        node_found(-1, 0, cb_data);
+        return -1;
+    }
+
     //log_info("built msg");
     int conn = node_connect_and_send_message(self, &msg, node_found_remote_cb,
-            node_remote_find_event, (void*) cb_data, NODE_WAIT_TM_LONG);
+            node_remote_find_event, (void*) cb_data, NULL);
     if (conn < 0){
         log_err("failed to create connection");
+        request_complete(self->requests, cb_data->req_id, REQ_ERROR, NULL);
         return conn;
     }
+    cb_data->connection = conn;
+    // the reply wait is the request's, the connection only times out connecting
+    net_connection_set_timeouts(self->net, conn, NULL, &connect_tm);
     struct evbuffer* write_buf = net_connection_get_write_buffer(self->net, conn);
-
-    if (!write_buf){
-        log_err("failed to get write buffer");
-        return -1;
-    }
-
     evbuffer_add(write_buf, (char*)&(id), ID_BYTES);
     return 0;
 }
 
-int node_find_successor(struct node_self* self, hash_type id, node_found_cb_t cb, void* found_cb_arg)
+// the owner of id if our own state says who it is, returns 0 if it does
+int node_local_owner(struct node_self* self, hash_type id, struct node_info* owner)
 {
-    ///log_info("looking for successor of %08X", id);
-    ///log_info("my id is %08X",self->self.id);
-    ///log_info("my succ's id is %08X",self->successor[0].id);
+    pthread_mutex_lock(&(self->succs_lock));
+    int succ_num = node_first_alive_succ(self);
+    struct node_info succ = (succ_num >= 0) ? self->successor[succ_num] : self->self;
+    pthread_mutex_unlock(&(self->succs_lock));
+
+    // once leaving, what was ours is our successor's
+    struct node_info me = (self->leaving && !node_same(succ, self->self)) ? succ : self->self;
 
-    struct node_found_cb_data *cb_data;
     if (node_id_compare(self->self.id, id) == 0){ // id is my id
         ///log_info("it's me");
+        *owner = me;
+        return 0;
+    }
+
+    if(node_id_in_range(id, self->self.id, succ.id) ||
+            node_id_compare(self->self.id, succ.id) == 0)
+    { // id is between me and my successor
+        ///log_info("it's my succ");
+        *owner = succ;
+        return 0;
+    }
+
+    // ours if it's between our predecessor and us. a predecessor we were only
+    // told about (on joining) may be far back in a ring still settling
+    if (self->has_pred && self->pred_notified && !node_same(self->predecessor, self->self) &&
+            node_id_in_range(id, self->predecessor.id + 1, self->self.id)){
+        *owner = me;
+        return 0;
+    }
+
+    // or the owner may be further down the successor list
+    struct node_info s_owner = {0, 0, 0};
+    pthread_mutex_lock(&(self->succs_lock));
+    hash_type prev = succ.id;
+    for (int i = succ_num + 1; i < NUM_OF_SUCCS; ++i){
+        struct node_info s = self->successor[i];
+        if (s.IP == 0 || node_same(s, self->self)){
+            break; }
+        if (node_id_in_range(id, prev + 1, s.id)){
+            s_owner = s;
+            break;
+        }
+        prev = s.id;
+    }
+    pthread_mutex_unlock(&(self->succs_lock));
+    if (s_owner.IP != 0 && !node_is_suspect(self, s_owner)){
+        *owner = s_owner;
+        return 0;
+    }
+    return -1;
+}
 
-        cb_data = malloc(sizeof(struct node_found_cb_data));
-        cb_data->self         = self;
-        cb_data->cb           = cb;
-        cb_data->found_cb_arg = found_cb_arg;
-        cb_data->node         = self->self;
-        cb_data->hops         = 0;
+// answer from our own state or ask the closest preceding node we know.
+// called again with the same cb_data when that node fails to answer
+int node_route_lookup(struct node_self* self, struct node_found_cb_data* cb_data)
+{
+    hash_type id = cb_data->target;
+    struct node_info owner;
 
+    if (node_local_owner(self, id, &owner) == 0){
+        cb_data->node = owner;
         node_found(0, 0, cb_data);
+        return 0;
     }
-    else
-        pthread_mutex_lock(&(self->succs_lock));
-        int succ_num = node_first_alive_succ(self);
-        if(node_id_in_range(id, self->self.id, self->successor[succ_num].id) ||
-                node_id_compare(self->self.id, self->successor[succ_num].id) == 0)
-        { // id is between me and my successor
-            ///log_info("it's my succ");
-
-            cb_data = malloc(sizeof(struct node_found_cb_data));
-            cb_data->self         = self;
-            cb_data->cb           = cb;
-            cb_data->found_cb_arg = found_cb_arg;
-            cb_data->node         = self->successor[succ_num];
-            cb_data->hops         = 0;
 
+    // a hot key someone looked up through here not long ago
+    if (self->route_cache && cb_data->cacheable){
+        if (cb_data->tries == 0){
+            route_cache_seen(self->route_cache, id); }
+        if (route_cache_get(self->route_cache, id, &owner) == 0 && !node_is_suspect(self, owner)){
+            cb_data->node = owner;
             node_found(0, 0, cb_data);
-            pthread_mutex_unlock(&(self->succs_lock));
-        }else{ // need to ask another node to find it
-            ///log_info("need to ask someone else");
-            pthread_mutex_unlock(&(self->succs_lock));
-            struct node_info n = node_closest_preceding_node(self, id); // node to ask
-
-            cb_data = malloc(sizeof(struct node_found_cb_data));
-            cb_data->self         = self;
-            cb_data->cb           = cb;
-            cb_data->found_cb_arg = found_cb_arg;
-
-            return node_find_successor_remote(self, n, id, cb_data);
+            return 0;
         }
-    return 0;
+    }
+
+    // need to ask another node to find it
+    ///log_info("need to ask someone else");
+    struct node_info n = node_closest_preceding_node(self, id); // node to ask
+    return node_find_successor_remote(self, n, id, cb_data);
+}
+
+// trace, if not NULL, gets this node as its first hop followed by the rest of the path.
+// an owned trace is handed to trace_cb and put back in the pool when the lookup is done
+// cacheable is 0 for lookups that maintain routing state, they need the real owner
+int node_find_successor_traced(struct node_self* self, hash_type id, node_found_cb_t cb, void* found_cb_arg,
+        struct node_trace* trace, short trace_owned, uint32_t queue_us, short cacheable)
+{
+    ///log_info("looking for successor of %08X", id);
+    ///log_info("my id is %08X",self->self.id);
+    ///log_info("my succ's id is %08X",self->successor[0].id);
+
+    struct node_found_cb_data *cb_data = node_found_cb_data_new(self, cb, found_cb_arg);
+    if (!cb_data){
+        if (trace_owned){
+            pool_put(self->trace_pool, trace); }
+        cb((struct node_info){0, 0, 0}, found_cb_arg, -1);
+        return -1;
+    }
+    cb_data->target = id;
+    cb_data->cacheable = cacheable;
+    if (trace){
+        cb_data->trace = trace;
+        cb_data->trace_owned = trace_owned;
+        cb_data->started_us = peer_now_us();
+        trace->n_hops = 1;
+        trace->hops[0].id       = self->self.id;
+        trace->hops[0].queue_us = queue_us;
+        trace->hops[0].proc_us  = 0;
+        trace->hops[0].wait_us  = 0;
+    }
+
+    cb_data->route_around = 1;
+    return node_route_lookup(self, cb_data);
+}
+
+static struct node_trace* node_trace_sample(struct node_self* self)
+{
+    if (self->trace_every && ++self->trace_count >= self->trace_every){
+        self->trace_count = 0;
+        return pool_get(self->trace_pool);
+    }
+    return NULL;
+}
+
+int node_find_successor(struct node_self* self, hash_type id, node_found_cb_t cb, void* found_cb_arg)
+{
+    return node_find_successor_traced(self, id, cb, found_cb_arg, node_trace_sample(self), 1, 0, 1);
+}
+
+// reply to pred request, also carries the successor list of the node asked
+void node_pred_rpc_reply(short status, const char *data, size_t len, void *arg)
+{
+    struct node_found_cb_data* cb_data = (struct node_found_cb_data*) arg;
+    struct node_self* self = cb_data->self;
+
+    if (status != RPC_OK || len < 1 + NODE_INFO_BYTES + SUCC_LIST_BYTES){
+        pool_put(self->found_pool, cb_data);
+        return;
+    }
+
+    struct node_info asked = cb_data->node;
+    struct node_info list[NUM_OF_SUCCS];
+
+    node_unpack_node_info(data + 1, &(cb_data->node));
+    node_unpack_succ_list(data + 1 + NODE_INFO_BYTES, list);
+
+    if (data[0] != 'Y'){
+        memset(&(cb_data->node), 0, sizeof(struct node_info));
+    }
+    struct node_info listed[1 + NUM_OF_SUCCS];
+    listed[0] = cb_data->node;
+    memcpy(listed + 1, list, sizeof(list));
+    node_take_coords(self, asked, data + PRED_REPLY_BYTES, len - PRED_REPLY_BYTES, listed, 1 + NUM_OF_SUCCS);
+    node_adopt_succ_list(self, asked, list);
+
+    cb_data->hops = 0;
+    node_found(-1, 0, cb_data);
 }
 
 void node_get_predecessor_remote(struct node_self* self, struct node_info n,
         node_found_cb_t cb, void* found_cb_arg)
 {
     struct node_found_cb_data* cb_data;
-    struct node_message msg;
-    msg.from = self->self;
-    msg.to   = n;
-    msg.type = MSG_T_PRED_REQ;
 
-    msg.len  = 0;
-    msg.content = NULL;
+    cb_data = node_found_cb_data_new(self, cb, found_cb_arg);
+    if (!cb_data){
+        return; }
+    cb_data->node         = n;
+
+
+    //log_info("asking for pred");
+
+    if (node_rpc_call(self, n, MSG_T_PRED_REQ, NULL, 0, node_pred_rpc_reply, cb_data) < 0){
+        pool_put(self->found_pool, cb_data);
+    }
+}
+
+// a next hop option and how far round the ring towards the target it gets
+struct node_hop{
+    struct node_info node;
+    hash_type progress; // its id - our id, 0 once ruled out
+    uint32_t rtt_us; // expected reply time
+    short busy; // turned work away lately, only used if nothing else will do
+};
+
+// expected reply time from a peer, measured if we can or else estimated from
+// coordinates. peers with neither rank after every other
+uint32_t node_state_rtt(const struct vivaldi_coord* mine, const struct peer_state* st)
+{
+    if (st->srtt_us){
+        return st->srtt_us; }
+    if (!vivaldi_known(&(st->coord))){
+        return UINT32_MAX; }
+    uint32_t est = vivaldi_estimate_us(mine, &(st->coord));
+    return est ? est : UINT32_MAX;
+}
+
+uint32_t node_expected_rtt(struct node_self* self, struct node_info n)
+{
+    struct peer_state st;
+    peer_lookup_many(self->peers, &n, 1, &st);
+    struct vivaldi_coord mine;
+    node_get_coord(self, &mine);
+    return node_state_rtt(&mine, &st);
+}
+
+// add n to the options if it gets somewhere without passing the target,
+// what the peer table knows of it is filled in by node_hops_fill
+int node_hop_add(struct node_self* self, struct node_hop* hops, int n_hops, struct node_info n, hash_type dist)
+{
+    if (n_hops >= NODE_HOP_CANDIDATES || n.IP == 0 || node_same(n, self->self)){
+        return n_hops; }
+    hash_type progress = n.id - self->self.id;
+    if (progress == 0 || progress > dist){
+        return n_hops; }
+    hops[n_hops].node = n;
+    hops[n_hops].progress = progress;
+    return n_hops + 1;
+}
+
+// fill in hops from..n_hops with one trip to the peer table, dropping dead ones.
+// returns the new count
+int node_hops_fill(struct node_self* self, struct node_hop* hops, int from, int n_hops,
+        const struct vivaldi_coord* mine)
+{
+    struct node_info nodes[NODE_HOP_CANDIDATES];
+    struct peer_state st[NODE_HOP_CANDIDATES];
+    for (int i = from; i < n_hops; ++i){
+        nodes[i - from] = hops[i].node; }
+    peer_lookup_many(self->peers, nodes, n_hops - from, st);
+    int n = from;
+    for (int i = from; i < n_hops; ++i){
+        if (st[i - from].dead){
+            continue; }
+        hops[n] = hops[i];
+        hops[n].rtt_us = node_state_rtt(mine, &(st[i - from]));
+        hops[n].busy = st[i - from].busy;
+        ++n;
+    }
+    return n;
+}
+
+// the next hop towards id from every node we know: fingers, the successor list
+// and the predecessor, which is the best hop for ids just behind us.
+// any that leaves at most one more bit of distance than the furthest will do,
+// of those the quickest to answer is taken (proximity route selection)
+struct node_info node_closest_preceding_node(struct node_self* self, hash_type id)
+{
+    hash_type dist = id - self->self.id;
+    struct node_hop hops[NODE_HOP_CANDIDATES];
+    int n_hops = 0;
+    struct vivaldi_coord mine;
+    node_get_coord(self, &mine);
+
+#ifndef NOFINGER
+    int f;
+    while ((f = finger_closest_preceding(self->fingers, id)) >= 0){
+        struct node_info n = finger_get(self->fingers, f);
+        if (!node_is_suspect(self, n)){
+            n_hops = node_hop_add(self, hops, n_hops, n, dist);
+            break;
+        }
+        // evict, fix_fingers will find a replacement
+        finger_replace(self->fingers, n, (struct node_info){0, 0, 0});
+    }
+#endif
+    pthread_mutex_lock(&(self->succs_lock));
+    struct node_info succs[NUM_OF_SUCCS];
+    memcpy(succs, self->successor, sizeof(succs));
+    int first = node_first_alive_succ(self);
+    pthread_mutex_unlock(&(self->succs_lock));
+    for (int i = 0; i < NUM_OF_SUCCS; ++i){
+        n_hops = node_hop_add(self, hops, n_hops, succs[i], dist); }
+    if (self->has_pred){
+        n_hops = node_hop_add(self, hops, n_hops, self->predecessor, dist); }
+    n_hops = node_hops_fill(self, hops, 0, n_hops, &mine);
+
+    if (n_hops == 0){
+        return (first >= 0 ? succs[first] : self->successor[0]); }
+
+    hash_type furthest = 0;
+    for (int i = 0; i < n_hops; ++i){
+        if (hops[i].progress > furthest){
+            furthest = hops[i].progress; }
+    }
+    // at least half the progress and at most twice the distance left
+    hash_type left = dist - furthest;
+    hash_type enough = furthest - ((furthest / 2 < left) ? furthest / 2 : left);
+
+#ifndef NOFINGER
+    if (enough < furthest){
+        int near[NODE_HOP_CANDIDATES];
+        int n_near = finger_within(self->fingers, enough, furthest, near, NODE_HOP_CANDIDATES - n_hops);
+        int from = n_hops;
+        for (int i = 0; i < n_near; ++i){
+            n_hops = node_hop_add(self, hops, n_hops, finger_get(self->fingers, near[i]), dist); }
+        n_hops = node_hops_fill(self, hops, from, n_hops, &mine);
+    }
+#endif
+
+    // only the pick is checked for an overdue reply, if it has one the next
+    // best is tried, and once none that go far enough are left any will do
+    for (;;){
+        struct node_hop* best = NULL;
+        for (int i = 0; i < n_hops; ++i){
+            if (hops[i].progress == 0 || hops[i].progress < enough){
+                continue; }
+            if (!best || hops[i].busy < best->busy || (hops[i].busy == best->busy &&
+                    (hops[i].rtt_us < best->rtt_us ||
+                    (hops[i].rtt_us == best->rtt_us && hops[i].progress > best->progress)))){
+                best = &(hops[i]); }
+        }
+        if (!best){
+            if (enough == 0){
+                break; }
+            enough = 0;
+            continue;
+        }
+        if (peer_phi(self->peers, best->node.IP, best->node.port) < PEER_PHI_SUSPECT){
+            return (best->node); }
+        best->progress = 0;
+    }
+    return (first >= 0 ? succs[first] : self->successor[0]);
+}
+
+//
+// network Stabilization
+//
+
+//found successor's predecessor (stabilize part 2)
+void node_stabilize_sp_found(struct node_info new_succ, void *arg, short hops)
+{
+    log_maint("got succ's pred for stab");
+
+    struct node_self* self = (struct node_self*) arg;
+
+    if (new_succ.port == 0 && new_succ.IP == 0){ // successor doesn't know its predecessor
+        log_maint("succ doesn't know its pred");
+    }else if (peer_has_left(self->peers, new_succ.IP, new_succ.port)){
+        log_maint("succ's pred %08X has left", new_succ.id);
+    }else{
+        log_maint("my id is      : %08X", self->self.id);
+        log_maint("my pred is    : %08X", self->predecessor.id);
+        log_maint("current succ  : %08X", self->successor[node_first_alive_succ(self)].id);
+        log_maint("potential succ: %08X", new_succ.id);
+        // if (me < s->p < s) then update me->s
+        pthread_mutex_lock(&(self->succs_lock));
+        int succ_num = node_first_alive_succ(self);
+        if (node_id_compare(new_succ.id, self->self.id) != 0 &&
+                (node_id_compare(self->self.id, self->successor[succ_num].id) == 0 ||
+                node_id_in_range(new_succ.id, self->self.id + 1, self->successor[succ_num].id))){
+            // s->p goes in front of s, the rest shift down one
+            memmove(&(self->successor[1]), &(self->successor[0]),
+                    sizeof(struct node_info) * (NUM_OF_SUCCS - 1));
+            self->successor[0] = new_succ;
+        }
+        log_maint("my succ now is: %08X", self->successor[node_first_alive_succ(self)].id);
+        pthread_mutex_unlock(&(self->succs_lock));
+    }
+    // notify s
+    pthread_mutex_lock(&(self->succs_lock));
+    struct node_info succ = self->successor[node_first_alive_succ(self)];
+    pthread_mutex_unlock(&(self->succs_lock));
+    node_notify_node(self, succ);
+}
+
+void node_network_stabalize(struct node_self* self)
+{
+    //log_info("stabilizing");
+    pthread_mutex_lock(&(self->succs_lock));
+    struct node_info succ = self->successor[node_first_alive_succ(self)];
+    pthread_mutex_unlock(&(self->succs_lock));
+    node_get_predecessor_remote(self, succ, node_stabilize_sp_found, self);
+}
+
+void node_notify_rpc_reply(short status, const char *data, size_t len, void *arg)
+{
+    // the rpc observer has already recorded whether node answered
+}
+
+void node_notify_node(struct node_self* self, struct node_info node)
+{
+    char payload[ID_BYTES + 2];
+    memcpy(payload, &(self->self.id), ID_BYTES);
+    memcpy(payload + ID_BYTES, &(self->self.port), 2);
+
+    node_rpc_call(self, node, MSG_T_NOTIF, payload, sizeof(payload), node_notify_rpc_reply, NULL);
+}
+
+void node_notified(struct node_self* self, struct node_info node)
+{
+    // a leaving node isn't anyone's successor any more, and one that has left isn't a predecessor
+    if (self->leaving || peer_has_left(self->peers, node.IP, node.port)){
+        return; }
+    log_maint("got notified");
+    if (self->has_pred){
+        log_maint("current pred is   %08X", self->predecessor.id);
+    }else{
+        log_maint("current pred is   NONE");
+    }
+        log_maint("potential pred is %08X", node.id);
+
+    if (!self->has_pred ||
+            node_id_in_range(node.id, self->predecessor.id, self->self.id) ||
+            node_id_compare(self->predecessor.id, self->self.id) == 0
+    ){
+        self->predecessor = node;
+        self->has_pred = 1;
+    }
+    if (node_same(self->predecessor, node)){
+        self->pred_notified = 1; }
+}
+
+//
+// Update Succs
+//
+
+void node_adopt_succ_list(struct node_self* self, struct node_info succ, const struct node_info* list)
+{
+    if (succ.IP == 0){
+        return; }
+
+    pthread_mutex_lock(&(self->succs_lock));
+    self->successor[0] = succ;
+    int n = 1;
+    for (int i = 0; i < NUM_OF_SUCCS && n < NUM_OF_SUCCS; ++i){
+        if (list[i].IP == 0 || peer_has_left(self->peers, list[i].IP, list[i].port)){
+            continue; } // dead entry in succ's list, or one it hasn't heard has left
+        if (node_id_compare(list[i].id, self->self.id) == 0 ||
+                node_id_compare(list[i].id, succ.id) == 0){
+            break; } // list has wrapped round the ring
+        self->successor[n++] = list[i];
+    }
+    for (; n < NUM_OF_SUCCS; ++n){
+        memset(&(self->successor[n]), 0, sizeof(struct node_info));
+    }
+    pthread_mutex_unlock(&(self->succs_lock));
+}
+
+void node_succ_list_rpc_reply(short status, const char *data, size_t len, void *arg)
+{
+    struct succ_update_arg* sua = (struct succ_update_arg*) arg;
+
+    if (status == RPC_OK && len >= 1 + SUCC_LIST_BYTES && data[0] == 'Y'){
+        struct node_info list[NUM_OF_SUCCS];
+        node_unpack_succ_list(data + 1, list);
+        node_take_coords(sua->self, sua->succ, data + 1 + SUCC_LIST_BYTES,
+                len - 1 - SUCC_LIST_BYTES, list, NUM_OF_SUCCS);
+        node_adopt_succ_list(sua->self, sua->succ, list);
+    }
+    pool_put(sua->self->succ_pool, sua);
+}
+
+void node_get_succ_list_remote(struct node_self* self, struct node_info n)
+{
+    struct succ_update_arg* sua = pool_get(self->succ_pool);
+    if (!sua){
+        return; }
+    sua->self = self;
+    sua->succ = n;
+
+    if (node_rpc_call(self, n, MSG_T_SUCCS_REQ, NULL, 0, node_succ_list_rpc_reply, sua) < 0){
+        pool_put(self->succ_pool, sua);
+    }
+}
+
+// one round trip: copy the first live successor's list
+void node_update_succs(struct node_self* self)
+{
+    //printf("node_update_succs called\n");
+
+    pthread_mutex_lock(&(self->succs_lock));
+    struct node_info succ = self->successor[node_first_alive_succ(self)];
+    pthread_mutex_unlock(&(self->succs_lock));
+
+    if (succ.IP == 0){
+        return; }
+    node_get_succ_list_remote(self, succ);
+}
+
+//
+// Fix Fingers
+//
+
+void node_probe_done(struct node_self* self, short alive, void* arg)
+{
+}
+
+// any node in the finger's interval routes as well as the first, take the
+// quickest of the first and the nodes after it there (proximity neighbour selection)
+void finger_pick_rpc_reply(short status, const char *data, size_t len, void *arg)
+{
+    struct finger_update_arg* fua = (struct finger_update_arg*) arg;
+    struct node_self* self = fua->self;
+    struct finger_table* ft = self->fingers;
+    int f = fua->finger_num;
+    struct node_info best = fua->first;
+
+    if (status == RPC_OK && len >= 1 + SUCC_LIST_BYTES && data[0] == 'Y' && f < finger_count(ft)){
+        struct node_info list[NUM_OF_SUCCS];
+        node_unpack_succ_list(data + 1, list);
+        node_take_coords(self, fua->first, data + 1 + SUCC_LIST_BYTES,
+                len - 1 - SUCC_LIST_BYTES, list, NUM_OF_SUCCS);
+        hash_type start = finger_start(ft, f);
+        hash_type span = finger_end(ft, f) - start;
+        uint32_t best_rtt = node_expected_rtt(self, best);
+        for (int i = 0; i < NUM_OF_SUCCS; ++i){
+            if (list[i].IP == 0 || node_same(list[i], self->self) ||
+                    (hash_type)(list[i].id - start) >= span){
+                break; } // past the interval
+            uint32_t rtt = node_expected_rtt(self, list[i]);
+            if (rtt == UINT32_MAX){
+                // measure it for next time round
+                node_check_node(self, list[i], node_probe_done, NULL);
+            }else if (rtt < best_rtt && !node_is_suspect(self, list[i])){
+                best = list[i];
+                best_rtt = rtt;
+            }
+        }
+    }
+    finger_set(ft, f, best);
+    pool_put(self->finger_pool, fua);
+}
+
+void finger_update(struct node_info node, void *arg, short hops)
+{
+    struct finger_update_arg* fua = (struct finger_update_arg*) arg;
+    struct node_self* self = fua->self;
+    int f = fua->finger_num;
+
+    // can't be my own finger, that clears it
+    finger_set(self->fingers, f, node);
+    fua->first = node;
+    // if it's in the interval there may be others there too
+    if (hops >= 0 && node.IP != 0 && !node_same(node, self->self) && !self->destroying &&
+            (hash_type)(node.id - finger_start(self->fingers, f)) <
+            (hash_type)(finger_end(self->fingers, f) - finger_start(self->fingers, f))){
+        if (node_rpc_call(self, node, MSG_T_SUCCS_REQ, NULL, 0, finger_pick_rpc_reply, fua) == 0){
+            return; }
+    }
+    pool_put(self->finger_pool, fua);
+}
+
+void node_fix_a_finger(struct node_self* self, int finger_num)
+{
+    if (finger_num >= finger_count(self->fingers) || finger_num < 0){
+        return; }// non-existent finger
+    hash_type finger_id = finger_start(self->fingers, finger_num);
+
+    struct finger_update_arg* fua = pool_get(self->finger_pool);
+    if (!fua){
+        return; }
+    fua->finger_num = finger_num;
+    fua->self = self;
+
+    node_find_successor_traced(self, finger_id, finger_update, fua, node_trace_sample(self), 1, 0, 0);
+}
+
+void node_fix_fingers(struct node_self* self)
+{
+    //log_info("fixing fingers");
+    for(int fnum = 0; fnum < finger_count(self->fingers); ++fnum){
+        // no node between the last finger's start and its node, so it is this one's too
+        struct node_info prev = fnum > 0 ? finger_get(self->fingers, fnum - 1) : (struct node_info){0, 0, 0};
+        if (prev.IP != 0 &&
+                node_id_in_range(finger_start(self->fingers, fnum), self->self.id, prev.id)){
+            finger_set(self->fingers, fnum, prev);
+            continue;
+        }
+        node_fix_a_finger(self, fnum);
+    }
+}
+
+int node_set_finger_base(struct node_self* self, unsigned int base)
+{
+    return finger_set_base(self->fingers, base);
+}
+
+int node_set_route_cache(struct node_self* self, int entries, unsigned int ttl_ms)
+{
+    struct route_cache* rc = NULL;
+    if (entries > 0){
+        rc = route_cache_create(entries, (uint64_t)ttl_ms * 1000, NODE_ROUTE_CACHE_ADMIT);
+        if (!rc){
+            return -1; }
+    }
+    route_cache_destroy(self->route_cache);
+    self->route_cache = rc;
+    return 0;
+}
+
+//
+// Check nodes
+//
+
+// arg is a check_pool entry naming the node probed, the list may have moved
+// round since, so it is dropped by who it is rather than where it was
+void node_check_neighbour_result(struct node_self* self, short success, void* arg)
+{
+    struct node_check_arg* probed = (struct node_check_arg*) arg;
+    if (!success){ // didn't respond
+        node_evict(self, probed->node); }
+    pool_put(self->check_pool, probed);
+}
+
+void node_check_neighbour(struct node_self* self, struct node_info node)
+{
+    struct node_check_arg* probed = pool_get(self->check_pool);
+    if (!probed){
+        return; }
+    probed->self = self;
+    probed->node = node;
+    node_check_node(self, node, node_check_neighbour_result, probed);
+}
+
+void node_check_node_rpc_reply(short status, const char *data, size_t len, void *arg)
+{
+    struct node_check_arg* nc_arg = (struct node_check_arg*) arg;
+
+    if (status == RPC_OK && len >= 1 && data[0] == 'Y'){
+        node_take_coords(nc_arg->self, nc_arg->node, data + 1, len - 1, NULL, 0);
+        // HOORAY
+        //log_info("node is not dead");
+        nc_arg->cb(nc_arg->self, 1, nc_arg->arg);
+    }else{
+        // couldn't reach node
+        nc_arg->cb(nc_arg->self, 0, nc_arg->arg);
+        //log_info("node is dead");
+    }
+    pool_put(nc_arg->self->check_pool, nc_arg);
+}
+
+void node_check_node(struct node_self* self, struct node_info node,
+                        node_check_cb cb, void* arg)
+{
+    struct node_check_arg* nc_arg = pool_get(self->check_pool);
+    if (!nc_arg){
+        cb(self, 0, arg);
+        return; }
+    nc_arg->self = self;
+    nc_arg->node = node;
+    nc_arg->arg  = arg;
+    nc_arg->cb   = cb;
+
+    if (node_rpc_call(self, node, MSG_T_ALIVE_REQ, NULL, 0, node_check_node_rpc_reply, nc_arg) < 0){
+        cb(self, 0, arg);
+        pool_put(self->check_pool, nc_arg);
+    }
+}
+
+// recent traffic from a node already shows it is alive
+int node_needs_probe(struct node_self* self, struct node_info node)
+{
+    return node_is_suspect(self, node) ||
+            peer_silent_for(self->peers, node.IP, node.port) >= (uint64_t)NODE_PROBE_SILENCE * 1000000;
+}
+
+void node_check_successors(struct node_self* self)
+{
+    struct node_info succs[NUM_OF_SUCCS];
+    pthread_mutex_lock(&(self->succs_lock));
+    memcpy(succs, self->successor, sizeof(succs));
+    pthread_mutex_unlock(&(self->succs_lock));
+    for (int i = 0; i < NUM_OF_SUCCS; ++i){
+        if (succs[i].IP != 0 && node_needs_probe(self, succs[i])){
+            //printf("checking: %d\n", i);
+            node_check_neighbour(self, succs[i]);
+        }
+    }
+}
+
+
+void node_check_predecessor(struct node_self* self)
+{
+    if (!self->has_pred || !node_needs_probe(self, self->predecessor)){ return; }
+    //log_info("checking predecessor");
+    node_check_neighbour(self, self->predecessor);
+
+}
+
+//
+// Leave
+//
+
+// a node told us it is going, route round it now rather than after timeouts
+void node_left(struct node_self* self, struct node_info gone, short has_pred,
+               struct node_info pred, const struct node_info* list)
+{
+    log_maint("%08X is leaving", gone.id);
+    // its leave may be retried, and others' stale lists may still name it
+    peer_mark_left(self->peers, gone.IP, gone.port, (uint64_t)NODE_DEAD_SECS * 1000000);
+
+    struct node_info next = {0, 0, 0}; // what now owns gone's ids
+    for (int i = 0; i < NUM_OF_SUCCS; ++i){
+        if (list[i].IP != 0 && !node_same(list[i], gone)){
+            next = list[i];
+            break;
+        }
+    }
+
+    // splice gone's successors in where it was in our list
+    pthread_mutex_lock(&(self->succs_lock));
+    int at = -1;
+    for (int i = 0; i < NUM_OF_SUCCS; ++i){
+        if (node_same(self->successor[i], gone)){
+            at = i;
+            break;
+        }
+    }
+    if (at >= 0){
+        int n = at;
+        for (int i = 0; i < NUM_OF_SUCCS && n < NUM_OF_SUCCS; ++i){
+            if (list[i].IP == 0 || node_same(list[i], gone)){
+                continue; }
+            if (node_same(list[i], self->self)){
+                break; } // list has wrapped round the ring
+            self->successor[n++] = list[i];
+        }
+        for (; n < NUM_OF_SUCCS; ++n){
+            memset(&(self->successor[n]), 0, sizeof(struct node_info)); }
+        if (self->successor[0].IP == 0){ // gone was the only other node
+            self->successor[0] = self->self; }
+    }
+    pthread_mutex_unlock(&(self->succs_lock));
+
+    if (self->has_pred && node_same(self->predecessor, gone)){
+        if (has_pred && !node_same(pred, gone)){
+            self->predecessor = pred; // may be us if we're the last node left
+            self->pred_notified = 0;
+        }else{
+            self->has_pred = 0;
+            memset(&(self->predecessor), 0, sizeof(struct node_info));
+        }
+    }
+
+    if (node_same(next, self->self)){
+        memset(&next, 0, sizeof(struct node_info)); }
+    finger_replace(self->fingers, gone, next);
+    if (self->route_cache){
+        route_cache_forget(self->route_cache, gone); }
+}
+
+struct node_leave{
+    struct node_self* self;
+    on_leave_cb_t cb;
+    void* cb_arg;
+    int pending; // leave messages not yet acked or given up on, plus one while sending
+};
+
+void node_leave_done(struct node_leave* leave)
+{
+    if (--leave->pending > 0){
+        return; }
+    struct node_self* self = leave->self;
+    log_info("left network");
+    if (leave->cb){
+        leave->cb(leave->cb_arg);
+    }else{
+        net_server_stop(self->net);
+    }
+    free(leave);
+}
+
+void node_leave_rpc_reply(short status, const char *data, size_t len, void *arg)
+{
+    node_leave_done((struct node_leave*) arg);
+}
+
+int node_network_leave(struct node_self* self, on_leave_cb_t cb, void* cb_arg)
+{
+    if (self->leaving){
+        return -1; }
+
+    struct node_leave* leave = malloc(sizeof(struct node_leave));
+    if (!leave){
+        log_err("failed to malloc leave");
+        return -1; }
+    self->leaving = 1;
+    for (int i = 0; i < NODE_MAINT_EVTS; ++i){
+        if (self->maint_evts[i]){
+            event_del(self->maint_evts[i]); }
+    }
+    leave->self = self;
+    leave->cb = cb;
+    leave->cb_arg = cb_arg;
+
+    char payload[LEAVE_BYTES];
+    memcpy(payload, &(self->self.id), ID_BYTES);
+    memcpy(payload + ID_BYTES, &(self->self.port), 2);
+    node_pack_pred_reply(self, payload + ID_BYTES + 2);
+
+    // everyone that routes through us the most: neighbours, and fingers as
+    // those are often the nodes whose fingers point back here
+    struct node_info to[1 + NUM_OF_SUCCS + NODE_MAX_FINGERS];
+    int n = 0;
+    if (self->has_pred){
+        to[n++] = self->predecessor; }
+    pthread_mutex_lock(&(self->succs_lock));
+    for (int i = 0; i < NUM_OF_SUCCS; ++i){
+        to[n++] = self->successor[i]; }
+    pthread_mutex_unlock(&(self->succs_lock));
+    for (int i = 0; i < finger_count(self->fingers); ++i){
+        to[n++] = finger_get(self->fingers, i); }
+
+    leave->pending = 1;
+    for (int i = 0; i < n; ++i){
+        if (to[i].IP == 0 || node_same(to[i], self->self)){
+            continue; }
+        int dup = 0;
+        for (int j = 0; j < i && !dup; ++j){
+            dup = node_same(to[i], to[j]); }
+        if (dup){
+            continue; }
+        ++leave->pending;
+        if (node_rpc_call(self, to[i], MSG_T_LEAVE, payload, sizeof(payload), node_leave_rpc_reply, leave) < 0){
+            --leave->pending; }
+    }
+    log_info("leaving network, telling %d nodes", leave->pending - 1);
+    node_leave_done(leave);
+    return 0;
+}
 
-    cb_data = malloc(sizeof(struct node_found_cb_data));
-    cb_data->self         = self;
-    cb_data->cb           = cb;
-    cb_data->found_cb_arg = found_cb_arg;
+//
+// Quorum reads and writes
+//
 
+#define QUORUM_PUT_HEADER_BYTES (8 + 1 + 2)
+#define QUORUM_REPLY_BYTES (1 + 8)
 
-    //log_info("asking for pred");
+#define QUORUM_UNASKED 0
+#define QUORUM_ASKED 1
+#define QUORUM_ANSWERED 2
+#define QUORUM_FAILED 3
 
-    node_connect_and_send_message(self, &msg, node_found_remote_cb,
-            node_remote_find_event, (void*) cb_data, NODE_WAIT_TM_LONG);
+int node_set_quorum(struct node_self* self, int n, int r, int w)
+{
+    if (n < 1 || n > NODE_QUORUM_MAX_N || r < 1 || r > n || w < 1 || w > n){
+        log_warn("bad quorum %d %d %d", n, r, w);
+        return -1;
+    }
+    self->quorum_n = (short) n;
+    self->quorum_r = (short) r;
+    self->quorum_w = (short) w;
+    return 0;
 }
 
-struct node_info node_closest_preceding_node(struct node_self* self, hash_type id)
+void node_set_read_hedge(struct node_self* self, unsigned int percentile)
 {
-#ifndef NOFINGER
-    for (hash_type i = ID_BITS-1; i > 0; --i){
-        struct node_info n = self->finger_table[i];
-        if ((n.IP != 0 && n.port != 0 && n.id != 0) && node_id_in_range(n.id, self->self.id, id)){
-            return (n);
-        }
-    }
-#endif
-    return (self->successor[node_first_alive_succ(self)]);
+    self->hedge_pct = percentile > 100 ? 100 : percentile;
 }
 
-//
-// network Stabilization
-//
+// versions are wall clock usecs with the low bits of the node's id, newer wins on every replica
+uint64_t node_quorum_version(struct node_self* self)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t v = (((uint64_t) tv.tv_sec * 1000000 + (uint64_t) tv.tv_usec) << 8) | (self->self.id & 0xFF);
+    if (v <= self->last_version){
+        v = self->last_version + 1; }
+    self->last_version = v;
+    return v;
+}
 
-//found successor's predecessor (stabilize part 2)
-void node_stabilize_sp_found(struct node_info new_succ, void *arg, short hops)
+// read reply times are counted in buckets a quarter of a power of 2 wide
+int node_hedge_bucket(uint64_t us)
 {
-    log_info("got succ's pred for stab");
+    if (us < 4){
+        return (int) us; }
+    int e = 63 - __builtin_clzll(us);
+    int b = 4 + (e - 2) * 4 + (int)((us >> (e - 2)) & 3);
+    return b < NODE_HEDGE_BUCKETS ? b : NODE_HEDGE_BUCKETS - 1;
+}
 
-    struct node_self* self = (struct node_self*) arg;
+// the longest time that goes in bucket b
+uint64_t node_hedge_bucket_us(int b)
+{
+    if (b < 4){
+        return (uint64_t) b; }
+    int e = (b - 4) / 4 + 2;
+    return ((uint64_t)(5 + ((b - 4) & 3)) << (e - 2)) - 1;
+}
 
-    if (new_succ.port == 0 && new_succ.IP == 0){ // successor doesn't know its predecessor
-        log_info("succ doesn't know its pred");
-    }else{
-        log_info("my id is      : %08X", self->self.id);
-        log_info("my pred is    : %08X", self->predecessor.id);
-        log_info("current succ  : %08X", self->successor[node_first_alive_succ(self)].id);
-        log_info("potential succ: %08X", new_succ.id);
-        // if (me < s->p < s) then update me->s
-        pthread_mutex_lock(&(self->succs_lock));
-        int succ_num = node_first_alive_succ(self);
-        if (node_id_compare(self->self.id, self->successor[succ_num].id) == 0 ||
-                node_id_in_range(new_succ.id, self->self.id + 1, self->successor[succ_num].id)){
-            self->successor[0] = new_succ;
-        }
-        log_info("my succ now is: %08X", self->successor[succ_num].id);
-        pthread_mutex_unlock(&(self->succs_lock));
+void node_hedge_sample(struct node_self* self, uint64_t us)
+{
+    ++self->read_hist[node_hedge_bucket(us)];
+    if (++self->read_hist_total < NODE_HEDGE_WINDOW){
+        return; }
+    // older replies count for less, so the percentile follows the replicas as they change
+    self->read_hist_total = 0;
+    for (int b = 0; b < NODE_HEDGE_BUCKETS; ++b){
+        self->read_hist[b] /= 2;
+        self->read_hist_total += self->read_hist[b];
     }
-    // notify s
-    pthread_mutex_lock(&(self->succs_lock));
-    node_notify_node(self, self->successor[node_first_alive_succ(self)]);
-    pthread_mutex_unlock(&(self->succs_lock));
 }
 
-void node_network_stabalize(struct node_self* self)
+// how long a read waits for those asked before asking another replica
+uint64_t node_hedge_delay_us(struct node_self* self)
 {
-    //log_info("stabilizing");
-    node_get_predecessor_remote(self, self->successor[node_first_alive_succ(self)], node_stabilize_sp_found, self);
+    if (self->read_hist_total < NODE_HEDGE_MIN_SAMPLES){
+        return NODE_HEDGE_DEFAULT_US; }
+    uint64_t want = ((uint64_t) self->read_hist_total * self->hedge_pct + 99) / 100;
+    uint64_t seen = 0;
+    for (int b = 0; b < NODE_HEDGE_BUCKETS; ++b){
+        seen += self->read_hist[b];
+        if (seen >= want){
+            uint64_t us = node_hedge_bucket_us(b);
+            return us < NODE_HEDGE_MIN_US ? NODE_HEDGE_MIN_US : us;
+        }
+    }
+    return NODE_HEDGE_DEFAULT_US;
 }
 
-// TODO
-void node_notify_rep_event(int connection, short type, void *arg){
-    struct node_self* self = (struct node_self*) arg;
-    if (type & (BEV_EVENT_EOF|BEV_EVENT_ERROR|BEV_EVENT_TIMEOUT)) {
-        net_connection_close(self->net, connection);
+// a replica's side, apply a write to or read a key from this node's store. returns the reply's length
+size_t node_quorum_serve(struct node_self* self, char type, const char* data, size_t len, char* reply)
+{
+    uint16_t key_len;
+    uint64_t version = 0;
+    size_t rep_len = QUORUM_REPLY_BYTES;
+
+    reply[0] = 'E';
+    pthread_mutex_lock(&(self->store_lock));
+    if (type == MSG_T_QPUT_REQ){
+        if (self->store && len >= QUORUM_PUT_HEADER_BYTES){
+            memcpy(&version, data, 8);
+            memcpy(&key_len, data + 9, 2);
+            const char* key = data + QUORUM_PUT_HEADER_BYTES;
+            if (QUORUM_PUT_HEADER_BYTES + (size_t) key_len <= len){
+                int rc = store_apply(self->store, key, key_len, key + key_len,
+                        len - QUORUM_PUT_HEADER_BYTES - key_len, version, data[8] == 'D' ? STORE_REC_DEL : 0);
+                if (rc == 0){
+                    reply[0] = 'Y';
+                }else if (rc == 1){
+                    reply[0] = 'O';
+                    version = store_version(self->store, key, key_len);
+                }
+            }
+        }
+    }else if (self->store && len >= 2){
+        memcpy(&key_len, data, 2);
+        if (2 + (size_t) key_len <= len){
+            size_t val_len = 0;
+            if (store_get(self->store, data + 2, key_len, reply + QUORUM_REPLY_BYTES,
+                        RPC_MAX_PAYLOAD - QUORUM_REPLY_BYTES, &val_len, &version) == 0){
+                // written some other way than node_quorum_put, too big for a datagram
+                if (val_len <= RPC_MAX_PAYLOAD - QUORUM_REPLY_BYTES){
+                    reply[0] = 'Y';
+                    rep_len += val_len;
+                }
+            }else{
+                version = store_version(self->store, data + 2, key_len);
+                reply[0] = version ? 'D' : 'N';
+            }
+        }
     }
-    // TODO remove successor if conn error
+    pthread_mutex_unlock(&(self->store_lock));
+    if (reply[0] == 'E'){
+        version = 0; }
+    memcpy(reply + 1, &version, 8);
+    return rep_len;
 }
 
-void node_notify_node(struct node_self* self, struct node_info node)
+// the request for a replica, a read or the op's record as a write
+size_t node_quorum_pack(struct node_quorum_op* op, char type, char* buf)
 {
-    struct node_message msg;
-    msg.from    = self->self;
-    msg.to      = node;
-    msg.type    = MSG_T_NOTIF;
-    msg.len     = ID_BYTES + 2;
-    msg.content = NULL;
-
-    int conn = node_connect_and_send_message(self, &msg, NULL, node_notify_rep_event, (void*)self, NODE_WAIT_TM_DEFAULT);
-    struct evbuffer* write_buf = net_connection_get_write_buffer(self->net, conn);
-
-    evbuffer_add(write_buf, (char*)&(self->self.id), ID_BYTES);
-    evbuffer_add(write_buf, (char*)&(self->self.port), 2);
+    uint16_t key_len = (uint16_t) op->key_len;
+    if (type == MSG_T_QGET_REQ){
+        memcpy(buf, &key_len, 2);
+        memcpy(buf + 2, op->key, op->key_len);
+        return 2 + op->key_len;
+    }
+    memcpy(buf, &(op->version), 8);
+    buf[8] = op->deleted ? 'D' : 'Y';
+    memcpy(buf + 9, &key_len, 2);
+    memcpy(buf + QUORUM_PUT_HEADER_BYTES, op->key, op->key_len);
+    memcpy(buf + QUORUM_PUT_HEADER_BYTES + op->key_len, op->val, op->val_len);
+    return QUORUM_PUT_HEADER_BYTES + op->key_len + op->val_len;
 }
 
-void node_notified(struct node_self* self, struct node_info node)
+void node_quorum_finish(struct node_quorum_op* op, short status)
 {
-    log_info("got notified");
-    if (self->has_pred){
-        log_info("current pred is   %08X", self->predecessor.id);
-    }else{
-        log_info("current pred is   NONE");
+    struct node_self* self = op->self;
+    op->done = 1;
+    if (op->hedge_evt){
+        event_del(op->hedge_evt); }
+    if (status < 0){
+        // the replicas may have moved, look them up again next time
+        struct node_replicas* r = &(self->replicas[op->owner.id % NODE_REPLICA_CACHE]);
+        if (node_same(r->owner, op->owner)){
+            memset(r, 0, sizeof(struct node_replicas)); }
     }
-        log_info("potential pred is %08X", node.id);
-
-    if (!self->has_pred ||
-            node_id_in_range(node.id, self->predecessor.id, self->self.id) ||
-            node_id_compare(self->predecessor.id, self->self.id) == 0
-    ){
-        self->predecessor = node;
-        self->has_pred = 1;
+    if (op->type == MSG_T_QPUT_REQ){
+        if (op->put_cb){
+            op->put_cb(status, op->cb_arg); }
+    }else if (op->get_cb){
+        if (status < 0){
+            op->get_cb(-1, NULL, 0, op->cb_arg);
+        }else if (op->version == 0 || op->deleted){
+            op->get_cb(1, NULL, 0, op->cb_arg);
+        }else{
+            op->get_cb(0, op->val, op->val_len, op->cb_arg);
+        }
     }
 }
 
-//
-// Update Succs
-//
-void node_update_succ(struct node_self* self, int succ_num);
-
-void node_update_succs_found(struct node_info found, void* arg, short hops)
+void node_quorum_repaired(short status, const char *data, size_t len, void *arg)
 {
-    struct succ_update_arg* sua = (struct succ_update_arg*) arg;
-    pthread_mutex_lock(&(sua->self->succs_lock));
+}
 
-    sua->self->successor[sua->succ_num] = found;
-    if (sua->succ_num < (NUM_OF_SUCCS - 1)){
-        node_update_succ(sua->self, sua->succ_num);
+// replicas that answered a read with an older version are sent the newest, nothing waits for them
+void node_quorum_repair(struct node_quorum_op* op)
+{
+    struct node_self* self = op->self;
+    char req[RPC_MAX_PAYLOAD];
+    size_t len = 0;
+    for (int i = 0; i < op->n_calls; ++i){
+        struct node_quorum_call* call = &(op->calls[i]);
+        if (call->state != QUORUM_ANSWERED || call->version >= op->version){
+            continue; }
+        if (!len){
+            len = node_quorum_pack(op, MSG_T_QPUT_REQ, req); }
+        if (node_same(call->node, self->self)){
+            char reply[RPC_MAX_PAYLOAD];
+            node_quorum_serve(self, MSG_T_QPUT_REQ, req, len, reply);
+        }else{
+            node_rpc_call(self, call->node, MSG_T_QPUT_REQ, req, len, node_quorum_repaired, NULL);
+        }
     }
-    pthread_mutex_unlock(&(sua->self->succs_lock));
 }
 
-void node_update_succ(struct node_self* self, int succ_num)
+// drop a reference, the op goes back to the pool with the last
+void node_quorum_release(struct node_quorum_op* op)
 {
-    //printf("node_update_succ %d\n", succ_num);
-    struct node_found_cb_data* cb_data = malloc(sizeof(struct node_found_cb_data));
-    struct succ_update_arg* arg = malloc(sizeof(struct succ_update_arg));
-
-    arg->self     = self;
-    arg->succ_num = succ_num + 1;
-
-    cb_data->self         = self;
-    cb_data->cb           = node_update_succs_found;
-    cb_data->found_cb_arg = arg;
+    if (--op->refs > 0){
+        return; }
+    if (!op->done){
+        node_quorum_finish(op, -1);
+    }else if (op->type == MSG_T_QGET_REQ && op->n_ok >= op->need && op->version && !op->self->destroying){
+        node_quorum_repair(op);
+    }
+    if (op->hedge_evt){
+        event_free(op->hedge_evt); }
+    pool_put(op->self->quorum_pool, op);
+}
 
-    struct node_info succ = self->successor[succ_num];
-    if (succ.IP == 0) return;
-    node_find_successor_remote(self, succ, succ.id + 1, cb_data);
+int node_quorum_count(struct node_quorum_op* op, short state)
+{
+    int n = 0;
+    for (int i = 0; i < op->n_calls; ++i){
+        n += op->calls[i].state == state; }
+    return n;
 }
 
-void node_update_succs(struct node_self* self)
+// done once enough replicas have answered, failed once too few are left to
+void node_quorum_check(struct node_quorum_op* op)
 {
-    //printf("node_update_succs called\n");
+    if (op->done){
+        return; }
+    if (op->n_ok >= op->need){
+        node_quorum_finish(op, 0);
+        return;
+    }
+    int could = op->n_ok + node_quorum_count(op, QUORUM_ASKED) + node_quorum_count(op, QUORUM_UNASKED);
+    if (could < op->need){
+        node_quorum_finish(op, -1); }
+}
 
-    pthread_mutex_lock(&(self->succs_lock));
-    node_update_succ(self, node_first_alive_succ(self));
-    pthread_mutex_unlock(&(self->succs_lock));
+// the newest record a replica has replied with so far is the one a read gives
+void node_quorum_take(struct node_quorum_op* op, uint64_t version, const char* data, size_t len)
+{
+    if (version <= op->version){
+        return; }
+    op->version = version;
+    op->deleted = data[0] != 'Y';
+    op->val_len = op->deleted ? 0 : len - QUORUM_REPLY_BYTES;
+    memcpy(op->val, data + QUORUM_REPLY_BYTES, op->val_len);
 }
 
-//
-// Fix Fingers
-//
+int node_quorum_ask_next(struct node_quorum_op* op);
 
-void finger_update(struct node_info node, void *arg, short hops)
+void node_quorum_reply(short status, const char *data, size_t len, void *arg)
 {
-    struct finger_update_arg* fua = (struct finger_update_arg*) arg;
-
-    // can't be my own finger
-    if (node_id_compare(fua->self->self.id, node.id) != 0){
-        fua->self->finger_table[fua->finger_num] = node;
+    struct node_quorum_call* call = (struct node_quorum_call*) arg;
+    struct node_quorum_op* op = call->op;
+    struct node_self* self = op->self;
+
+    short ok = status == RPC_OK && len >= QUORUM_REPLY_BYTES && data[0] != 'E';
+    if (ok && op->type == MSG_T_QGET_REQ && (data[0] == 'Y' ? len - QUORUM_REPLY_BYTES > NODE_QUORUM_MAX_RECORD :
+                len != QUORUM_REPLY_BYTES)){
+        ok = 0; }
+    if (ok){
+        call->state = QUORUM_ANSWERED;
+        memcpy(&(call->version), data + 1, 8);
+        ++op->n_ok;
+        if (op->type == MSG_T_QGET_REQ){
+            if (!node_same(call->node, self->self)){
+                node_hedge_sample(self, peer_now_us() - call->sent_us); }
+            node_quorum_take(op, call->version, data, len);
+        }
     }else{
-        struct node_info null_node;
-        null_node.IP = 0;
-        null_node.id = 0;
-        null_node.port = 0;
-        fua->self->finger_table[fua->finger_num] = null_node;
+        call->state = QUORUM_FAILED;
+        // another replica in its place
+        if (op->type == MSG_T_QGET_REQ && !op->done){
+            node_quorum_ask_next(op); }
     }
-    free(fua);
+    node_quorum_check(op);
+    node_quorum_release(op);
 }
 
-void node_fix_a_finger(struct node_self* self, int finger_num)
+void node_quorum_ask(struct node_quorum_op* op, struct node_quorum_call* call)
 {
-    if (finger_num >= ID_BITS || finger_num <= 0){
-        return; }// non-existent finger
-    // this might need redoing if hash_type changes
-    hash_type finger_id = self->self.id + (hash_type) two_to_the_n(finger_num - 1);
+    struct node_self* self = op->self;
+    char req[RPC_MAX_PAYLOAD];
+    size_t len = node_quorum_pack(op, op->type, req);
+
+    call->state = QUORUM_ASKED;
+    call->sent_us = peer_now_us();
+    ++op->refs;
+    if (self->destroying){ // the node is going, start nothing new
+        node_quorum_reply(RPC_ERROR, NULL, 0, call);
+    }else if (node_same(call->node, self->self)){
+        char reply[RPC_MAX_PAYLOAD];
+        size_t rep_len = node_quorum_serve(self, op->type, req, len, reply);
+        node_quorum_reply(RPC_OK, reply, rep_len, call);
+    }else if (node_rpc_call(self, call->node, op->type, req, len, node_quorum_reply, call) < 0){
+        node_quorum_reply(RPC_ERROR, NULL, 0, call);
+    }
+}
 
-    struct finger_update_arg* fua = malloc(sizeof(struct finger_update_arg));
-    fua->finger_num = finger_num;
-    fua->self = self;
+// ask the first replica not asked yet, -1 if there is none
+int node_quorum_ask_next(struct node_quorum_op* op)
+{
+    for (int i = 0; i < op->n_calls; ++i){
+        if (op->calls[i].state == QUORUM_UNASKED){
+            node_quorum_ask(op, &(op->calls[i]));
+            return 0;
+        }
+    }
+    return -1;
+}
 
-    node_find_successor(self, finger_id, finger_update, fua);
+void node_quorum_hedge(evutil_socket_t fd, short what, void *arg);
+
+void node_quorum_arm_hedge(struct node_quorum_op* op)
+{
+    struct node_self* self = op->self;
+    if (op->done || !self->hedge_pct){
+        return; }
+    if (!node_quorum_count(op, QUORUM_UNASKED)){
+        return; }
+    if (!op->hedge_evt){
+        op->hedge_evt = evtimer_new(net_get_base(self->net), node_quorum_hedge, (void*) op); }
+    uint64_t us = node_hedge_delay_us(self);
+    struct timeval tv = {us / 1000000, us % 1000000};
+    if (!op->hedge_evt || evtimer_add(op->hedge_evt, &tv) < 0){
+        log_warn("failed to schedule read hedge"); }
 }
 
-void node_fix_fingers(struct node_self* self)
+// the replicas asked are slower than they usually are, ask one more
+void node_quorum_hedge(evutil_socket_t fd, short what, void *arg)
 {
-    //log_info("fixing fingers");
-    for(int fnum = 0; fnum < ID_BITS; ++fnum){
-        node_fix_a_finger(self, fnum);
-    }
+    struct node_quorum_op* op = (struct node_quorum_op*) arg;
+    if (op->done || op->self->destroying){
+        return; }
+    // a local answer could finish the op, but not free it, the replicas asked before still hold it
+    node_quorum_ask_next(op);
+    node_quorum_arm_hedge(op);
 }
 
-//
-// Check nodes
-//
+void node_quorum_fail(struct node_quorum_op* op)
+{
+    op->refs = 1;
+    node_quorum_finish(op, -1);
+    node_quorum_release(op);
+}
 
-void node_check_predecessor_reply(int connection, void *arg)
+// the owner and its successors are the replicas, a read asks those expected to answer first
+void node_quorum_fan_out(struct node_quorum_op* op, const struct node_info* succs)
 {
-    struct node_self* self = (struct node_self*) arg;
-    struct evbuffer* read_buf = net_connection_get_read_buffer(self->net, connection);
+    struct node_self* self = op->self;
+
+    op->n_calls = 0;
+    short wrapped = 0;
+    for (int i = -1; i < NUM_OF_SUCCS && op->n_calls < self->quorum_n && !wrapped; ++i){
+        struct node_info n = i < 0 ? op->owner : succs[i];
+        if (n.IP == 0){
+            continue; }
+        int dup = 0;
+        for (int j = 0; j < op->n_calls && !dup; ++j){
+            dup = node_same(n, op->calls[j].node); }
+        if (dup){
+            wrapped = 1; // list has wrapped round the ring
+            continue;
+        }
+        struct node_quorum_call* call = &(op->calls[op->n_calls++]);
+        memset(call, 0, sizeof(struct node_quorum_call));
+        call->op = op;
+        call->node = n;
+    }
+    // a ring with fewer than n nodes keeps every record on all of them, but a
+    // list short of nodes that were evicted can't give the quorum asked for
+    op->need = op->type == MSG_T_QPUT_REQ ? self->quorum_w : self->quorum_r;
+    if (op->need > op->n_calls){
+        if (!wrapped){
+            log_warn("%08X has %d of the %d replicas needed", op->owner.id, op->n_calls, op->need);
+            node_quorum_fail(op);
+            return;
+        }
+        op->need = op->n_calls;
+    }
 
-    size_t line_len;
-    char* token;
+    if (op->type == MSG_T_QGET_REQ){
+        uint32_t rtt[NODE_QUORUM_MAX_N];
+        for (int i = 0; i < op->n_calls; ++i){
+            rtt[i] = node_same(op->calls[i].node, self->self) ? 0 : node_expected_rtt(self, op->calls[i].node);
+            for (int j = i; j > 0 && rtt[j] < rtt[j - 1]; --j){
+                struct node_quorum_call c = op->calls[j];
+                op->calls[j] = op->calls[j - 1];
+                op->calls[j - 1] = c;
+                uint32_t t = rtt[j];
+                rtt[j] = rtt[j - 1];
+                rtt[j - 1] = t;
+            }
+        }
+    }
 
-    token = evbuffer_readln(read_buf, &line_len, EVBUFFER_EOL_LF);
-    if (token[0] == 'Y'){
-        // HOORAY
-        //log_info("pred is not dead");
+    op->refs = 1;
+    if (op->type == MSG_T_QPUT_REQ){
+        while (node_quorum_ask_next(op) == 0){}
     }else{
-        // couldn't reach pred
-        self->has_pred = 0;
-        memset(&(self->predecessor), 0, sizeof(struct node_info));
-        //log_info("pred is dead");
+        // a replica that fails straight away has already been replaced by the next
+        while (!op->done && op->n_calls - node_quorum_count(op, QUORUM_UNASKED) < op->need &&
+                node_quorum_ask_next(op) == 0){}
+        node_quorum_arm_hedge(op);
     }
-    free(token);
-    net_connection_close(self->net, connection);
+    node_quorum_release(op);
 }
 
-void node_check_pred_result(struct node_self* self, short success, void* arg)
+// owner's reply to a successor list request into the cache, NULL if it wasn't one
+struct node_replicas* node_replicas_take(struct node_self* self, struct node_info owner,
+        short status, const char *data, size_t len)
 {
-    if (!success){ // pred didn't respond
-        self->has_pred = 0;
-        memset(&(self->predecessor), 0, sizeof(struct node_info));
-    }
+    if (status != RPC_OK || len < 1 + SUCC_LIST_BYTES || data[0] != 'Y'){
+        return NULL; }
+    struct node_replicas* r = &(self->replicas[owner.id % NODE_REPLICA_CACHE]);
+    r->owner = owner;
+    node_unpack_succ_list(data + 1, r->succs);
+    node_take_coords(self, owner, data + 1 + SUCC_LIST_BYTES, len - 1 - SUCC_LIST_BYTES,
+            r->succs, NUM_OF_SUCCS);
+    r->expires_us = peer_now_us() + (uint64_t) NODE_REPLICA_TTL_MS * 1000;
+    r->refreshing = 0;
+    return r;
 }
 
-void node_check_succ_result(struct node_self* self, short success, void* arg)
+void node_replicas_refreshed(short status, const char *data, size_t len, void *arg)
 {
-    int* sn = (int*) arg;
-    //printf("check result: %d\n", *sn);
-    if (!success){ // succ *sn didn't respond
-        memset(&(self->successor[*sn]), 0, sizeof(struct node_info));
+    struct succ_update_arg* sua = (struct succ_update_arg*) arg;
+    struct node_self* self = sua->self;
+    if (!node_replicas_take(self, sua->succ, status, data, len)){
+        struct node_replicas* r = &(self->replicas[sua->succ.id % NODE_REPLICA_CACHE]);
+        if (node_same(r->owner, sua->succ)){
+            r->refreshing = 0; }
     }
-    free(sn);
+    pool_put(self->succ_pool, sua);
 }
 
-void node_check_node_reply(int connection, void *arg)
+// an expired entry is still used while it is refreshed, so ops don't wait on the owner twice
+void node_replicas_refresh(struct node_self* self, struct node_replicas* r)
 {
-    struct node_check_arg* nc_arg = (struct node_check_arg*) arg;
-
-    struct evbuffer* read_buf = net_connection_get_read_buffer(nc_arg->self->net, connection);
-
-    size_t line_len;
-    char* token;
-
-    token = evbuffer_readln(read_buf, &line_len, EVBUFFER_EOL_LF);
-    if (token[0] == 'Y'){
-        // HOORAY
-        //log_info("node is not dead");
-        nc_arg->cb(nc_arg->self, 1, nc_arg->arg);
-    }else{
-        // couldn't reach node
-        nc_arg->cb(nc_arg->self, 0, nc_arg->arg);
-        //log_info("node is dead");
+    struct succ_update_arg* sua = pool_get(self->succ_pool);
+    if (!sua){
+        return; }
+    sua->self = self;
+    sua->succ = r->owner;
+    r->refreshing = 1;
+    if (node_rpc_call(self, r->owner, MSG_T_SUCCS_REQ, NULL, 0, node_replicas_refreshed, sua) < 0){
+        r->refreshing = 0;
+        pool_put(self->succ_pool, sua);
     }
-    free(token);
-
-    net_connection_close(nc_arg->self->net, connection);
-    free(arg);
 }
 
-void node_check_node_event(int connection, short type, void *arg)
+void node_quorum_succs_reply(short status, const char *data, size_t len, void *arg)
 {
-    struct node_check_arg* nc_arg = (struct node_check_arg*) arg;
-
-    if (type & (BEV_EVENT_EOF|BEV_EVENT_ERROR|BEV_EVENT_TIMEOUT)) {
-        if (type & (BEV_EVENT_ERROR|BEV_EVENT_TIMEOUT)) {
-            nc_arg->cb(nc_arg->self, 0, nc_arg->arg);
-        }
-        net_connection_close(nc_arg->self->net, connection);
-        free(arg);
+    struct node_quorum_op* op = (struct node_quorum_op*) arg;
+    struct node_replicas* r = node_replicas_take(op->self, op->owner, status, data, len);
+    if (!r){
+        node_quorum_fail(op);
+        return;
     }
+    node_quorum_fan_out(op, r->succs);
 }
 
-void node_check_node(struct node_self* self, struct node_info node,
-                        node_check_cb cb, void* arg)
+void node_quorum_owner_found(struct node_info owner, void *arg, short hops)
 {
-    struct node_message msg;
-    msg.from    = self->self;
-    msg.to      = node;
-    msg.type    = MSG_T_ALIVE_REQ;
-    msg.len     = 0;
-    msg.content = NULL;
+    struct node_quorum_op* op = (struct node_quorum_op*) arg;
+    struct node_self* self = op->self;
 
-    struct node_check_arg* nc_arg = malloc(sizeof(nc_arg));
-    nc_arg->self = self;
-    nc_arg->arg  = arg;
-    nc_arg->cb   = cb;
+    if (hops < 0 || owner.IP == 0){
+        node_quorum_fail(op);
+        return;
+    }
+    op->owner = owner;
+    if (node_same(owner, self->self)){
+        struct node_info succs[NUM_OF_SUCCS];
+        pthread_mutex_lock(&(self->succs_lock));
+        memcpy(succs, self->successor, sizeof(succs));
+        pthread_mutex_unlock(&(self->succs_lock));
+        node_quorum_fan_out(op, succs);
+        return;
+    }
+    struct node_replicas* r = &(self->replicas[owner.id % NODE_REPLICA_CACHE]);
+    if (node_same(r->owner, owner)){
+        if (r->expires_us < peer_now_us() && !r->refreshing && !self->destroying){
+            node_replicas_refresh(self, r); }
+        node_quorum_fan_out(op, r->succs);
+        return;
+    }
+    if (node_rpc_call(self, owner, MSG_T_SUCCS_REQ, NULL, 0, node_quorum_succs_reply, op) < 0){
+        node_quorum_fail(op); }
+}
 
-    node_connect_and_send_message(self, &msg, node_check_node_reply,
-            node_check_node_event, nc_arg, NODE_WAIT_TM_DEFAULT);
+struct node_quorum_op* node_quorum_op_new(struct node_self* self, char type, const char* key, void* cb_arg)
+{
+    size_t key_len = strlen(key);
+    if (key_len == 0 || key_len > NODE_QUORUM_MAX_RECORD){
+        log_warn("key of %lu bytes can't be stored", (unsigned long) key_len);
+        return NULL;
+    }
+    struct node_quorum_op* op = pool_get(self->quorum_pool);
+    if (!op){
+        return NULL; }
+    memset(op, 0, offsetof(struct node_quorum_op, key));
+    op->self = self;
+    op->type = type;
+    op->cb_arg = cb_arg;
+    op->key_len = key_len;
+    memcpy(op->key, key, key_len + 1);
+    return op;
 }
 
-void node_check_successors(struct node_self* self)
+int node_quorum_write(struct node_self* self, const char* key, const void* val, size_t len, short deleted,
+        node_put_cb_t cb, void* cb_arg)
 {
-    int* sn;
-    for (int i = 0; i < NUM_OF_SUCCS; ++i){
-        if (self->successor[i].IP != 0){
-            sn = malloc(sizeof(int));
-            *sn = i;
-            //printf("checking: %d\n", *sn);
-            node_check_node(self, self->successor[i], node_check_succ_result , (void*) sn);
-        }
+    if (strlen(key) + len > NODE_QUORUM_MAX_RECORD){
+        log_warn("record of %lu bytes is too big for a quorum write", (unsigned long)(strlen(key) + len));
+        return -1;
     }
+    struct node_quorum_op* op = node_quorum_op_new(self, MSG_T_QPUT_REQ, key, cb_arg);
+    if (!op){
+        return -1; }
+    op->put_cb = cb;
+    op->version = node_quorum_version(self);
+    op->deleted = deleted;
+    op->val_len = len;
+    if (len){
+        memcpy(op->val, val, len); }
+    node_find_successor(self, get_id(op->key), node_quorum_owner_found, (void*) op);
+    return 0;
 }
 
+int node_quorum_put(struct node_self* self, const char* key, const void* val, size_t len,
+        node_put_cb_t cb, void* cb_arg)
+{
+    return node_quorum_write(self, key, val, len, 0, cb, cb_arg);
+}
 
-void node_check_predecessor(struct node_self* self)
+int node_quorum_delete(struct node_self* self, const char* key, node_put_cb_t cb, void* cb_arg)
 {
-    if (!self->has_pred){ return; }
-    //log_info("checking predecessor");
-    node_check_node(self, self->predecessor, node_check_pred_result, NULL);
+    return node_quorum_write(self, key, NULL, 0, 1, cb, cb_arg);
+}
 
+int node_quorum_get(struct node_self* self, const char* key, node_get_cb_t cb, void* cb_arg)
+{
+    struct node_quorum_op* op = node_quorum_op_new(self, MSG_T_QGET_REQ, key, cb_arg);
+    if (!op){
+        return -1; }
+    op->get_cb = cb;
+    node_find_successor(self, get_id(op->key), node_quorum_owner_found, (void*) op);
+    return 0;
 }
 
 //
@@ -855,12 +3074,22 @@ char* node_msg_type_str(int msg_type){
             return "REQ_NOTIFY";
         case MSG_T_PRED_REQ:
             return "REQ_PRED";
+        case MSG_T_SUCCS_REQ:
+            return "REQ_SUCCS";
         case MSG_T_SUCC_REQ:
             return "REQ_SUCC";
+        case MSG_T_SUCC_TRACE_REQ:
+            return "REQ_SUCC_TRACE";
+        case MSG_T_JOIN_REQ:
+            return "REQ_JOIN";
+        case MSG_T_LEAVE:
+            return "REQ_LEAVE";
         case MSG_T_ALIVE_REP:
             return "RESP_ALIVE";
         case MSG_T_PRED_REP:
             return "RESP_PRED";
+        case MSG_T_SUCCS_REP:
+            return "RESP_SUCCS";
         case MSG_T_SUCC_REP:
             return "RESP_SUCC";
         case MSG_T_NODE_MSG:
@@ -932,71 +3161,260 @@ int node_connect_and_send_message(struct node_self* self,
         net_connection_set_cb_arg(self->net, connection, cb_arg);
     }
 
+    // the connect observer marks the reply (or failure)
+    peer_request_sent(self->peers, msg->to.IP, msg->to.port);
+
     //log_info("calling send msg");
     int rc = node_send_message(self, msg, connection);
     if (rc == 0){
         return connection;
     }else{
+        net_connection_close(self->net, connection);
         return rc;
     }
 
 }
 
 
+void incoming_event_cb(int connection, short type, void *arg);
+
+// asker went away while we were still looking
+void incoming_event_lookup_cb(int connection, short type, void *arg)
+{
+    struct incoming_handler_data* handler_data = (struct incoming_handler_data*) arg;
+    if (type & (BEV_ERROR|BEV_EVENT_EOF)){
+        net_connection_close(handler_data->self->net, connection);
+        handler_data->connection = -1;
+    }
+}
+
 void node_successor_found_for_remote(struct node_info succ, void *data, short hops)
 {
     //log_info("successor found for remote at %08X:%d", succ.IP, succ.port);
     struct incoming_handler_data* handler_data = (struct incoming_handler_data*) data;
-    struct evbuffer* write_buf = net_connection_get_write_buffer(
-            handler_data->self->net, handler_data->connection);
-
-    evbuffer_add(write_buf, "Y", 1);
-    evbuffer_add(write_buf, (char*)&(succ.id), ID_BYTES);
-    evbuffer_add(write_buf, (char*)&(succ.IP), 4);
-    evbuffer_add(write_buf, (char*)&(succ.port), 2);
-    ++hops;
-    evbuffer_add(write_buf, (char*)&(hops), sizeof(short));
+    struct node_self* self = handler_data->self;
+    int connection = handler_data->connection;
+    struct node_trace* trace = handler_data->trace;
+    pool_put(self->handler_pool, handler_data);
+
+    if (connection >= 0){
+        net_connection_set_event_cb(self->net, connection, incoming_event_cb);
+        net_connection_set_cb_arg(self->net, connection, (void*) self);
+        struct evbuffer* write_buf = net_connection_get_write_buffer(self->net, connection);
+
+        if (succ.IP == 0){ // lookup failed further along
+            evbuffer_add(write_buf, "N", 1);
+        }else{
+            evbuffer_add(write_buf, "Y", 1);
+            evbuffer_add(write_buf, (char*)&(succ.id), ID_BYTES);
+            evbuffer_add(write_buf, (char*)&(succ.IP), 4);
+            evbuffer_add(write_buf, (char*)&(succ.port), 2);
+            ++hops;
+            evbuffer_add(write_buf, (char*)&(hops), sizeof(short));
+        }
+        if (trace){
+            node_write_trace_hops(write_buf, trace); }
+    }
+    if (trace){
+        pool_put(self->trace_pool, trace); }
+}
 
-    free(handler_data);
+// how long the current callback waited behind the others in this loop iteration
+uint32_t node_queue_delay_us(struct node_self* self)
+{
+    struct timeval now, cached;
+    gettimeofday(&now, NULL);
+    if (event_base_gettimeofday_cached(net_get_base(self->net), &cached) < 0){
+        return 0; }
+    int64_t us = ((int64_t)now.tv_sec - cached.tv_sec) * 1000000 + (now.tv_usec - cached.tv_usec);
+    return us > 0 ? (uint32_t) us : 0;
 }
 
 
-void handle_succ_request(int connection, void *arg)
+// turn a lookup away, the asker backs off and routes around us
+void node_reply_busy(struct node_self* self, int connection, short traced)
+{
+    net_connection_set_read_cb(self->net, connection, NULL);
+    net_connection_set_event_cb(self->net, connection, incoming_event_cb);
+    net_connection_set_cb_arg(self->net, connection, (void*) self);
+    struct evbuffer* write_buf = net_connection_get_write_buffer(self->net, connection);
+
+    evbuffer_add(write_buf, "B", 1);
+    if (traced){
+        unsigned char count = 0;
+        evbuffer_add(write_buf, &count, 1);
+    }
+}
+
+void node_handle_succ_request(struct node_self* self, int connection, short traced)
 {
     //log_info("handling succ req");
 
     hash_type r_id;
-    struct node_self* self = (struct node_self*) arg;
+    uint32_t queue_us = traced ? node_queue_delay_us(self) : 0;
     struct evbuffer* read_buf = net_connection_get_read_buffer(self->net, connection);
 
+    if (evbuffer_get_length(read_buf) < ID_BYTES){
+        return; } // wait for the rest
     if (evbuffer_remove(read_buf, (char*)&(r_id), ID_BYTES) < 0){
         log_err("error reading id");
         net_connection_close(self->net, connection);
+        return;
     }
 
+    // lookups we'd have to forward are the first work shed, they can go
+    // round us and each one ties up a connection until it is answered
+    struct node_info owner;
+    if (net_server_busy(self->net) && node_local_owner(self, r_id, &owner) != 0){
+        node_reply_busy(self, connection, traced);
+        return;
+    }
     struct incoming_handler_data *handler_data;
-    handler_data = malloc(sizeof(struct incoming_handler_data));
+    handler_data = pool_get(self->handler_pool);
+    if (!handler_data){
+        node_reply_busy(self, connection, traced);
+        return; }
     handler_data->self = self;
     handler_data->connection = connection;
-    node_find_successor(self, r_id, node_successor_found_for_remote, handler_data);
+    handler_data->trace = traced ? pool_get(self->trace_pool) : NULL;
+    if (traced && !handler_data->trace){
+        pool_put(self->handler_pool, handler_data);
+        node_reply_busy(self, connection, traced);
+        return;
+    }
+    // until the reply is written the connection's callbacks must not touch self's handlers
+    net_connection_set_read_cb(self->net, connection, NULL);
+    net_connection_set_event_cb(self->net, connection, incoming_event_lookup_cb);
+    net_connection_set_cb_arg(self->net, connection, (void*) handler_data);
+    node_find_successor_traced(self, r_id, node_successor_found_for_remote, handler_data,
+            handler_data->trace, 0, queue_us, 1);
+}
+
+void handle_succ_request(int connection, void *arg)
+{
+    node_handle_succ_request((struct node_self*) arg, connection, 0);
 }
 
+void handle_succ_trace_request(int connection, void *arg)
+{
+    node_handle_succ_request((struct node_self*) arg, connection, 1);
+}
+
+
 // TODO
 void handle_pred_request(int connection, void *arg)
 {
     //log_info("handling pred req");
     struct node_self* self = (struct node_self*) arg;
     struct evbuffer* write_buf = net_connection_get_write_buffer(self->net, connection);
-    if (self->has_pred){
-        //log_info("pred is %08X@%08X:%04X", self->predecessor.id, self->predecessor.IP, self->predecessor.port);
-        evbuffer_add(write_buf, "Y", 1);
-        evbuffer_add(write_buf, (char*)&(self->predecessor.id), ID_BYTES);
-        evbuffer_add(write_buf, (char*)&(self->predecessor.IP), 4);
-        evbuffer_add(write_buf, (char*)&(self->predecessor.port), 2);
+    char reply[PRED_REPLY_BYTES];
+    evbuffer_add(write_buf, reply, node_pack_pred_reply(self, reply));
+}
 
-    }else{
-        //log_info("No pred");
-        evbuffer_add(write_buf, "N", 1);
+void handle_succs_request(int connection, void *arg)
+{
+    //log_info("handling succ list req");
+    struct node_self* self = (struct node_self*) arg;
+    struct evbuffer* write_buf = net_connection_get_write_buffer(self->net, connection);
+    evbuffer_add(write_buf, "Y", 1);
+    node_write_succ_list(self, write_buf);
+}
+
+// control requests that arrived as datagrams
+void node_rpc_request(struct rpc *rpc, const struct rpc_req *req, const char *data, size_t len, void *arg)
+{
+    struct node_self* self = (struct node_self*) arg;
+    char reply[RPC_MAX_PAYLOAD];
+    size_t rep_len = 0;
+    char rep_type = MSG_T_UNKNOWN;
+    struct node_info other;
+
+    peer_heard_from(self->peers, req->IP, req->listen_port);
+    peer_set_dgrams(self->peers, req->IP, req->listen_port, PEER_DGRAMS_YES);
+
+    switch (req->type){
+
+        case MSG_T_PRED_REQ:
+            rep_len = node_pack_pred_reply(self, reply);
+            {
+                struct node_info listed[1 + NUM_OF_SUCCS];
+                node_unpack_node_info(reply + 1, &(listed[0]));
+                node_unpack_succ_list(reply + 1 + NODE_INFO_BYTES, listed + 1);
+                rep_len += node_pack_coords(self, reply + rep_len, listed, 1 + NUM_OF_SUCCS);
+            }
+            rep_type = MSG_T_PRED_REP;
+            break;
+
+        case MSG_T_JOIN_REQ:
+            rep_len = node_pack_pred_reply(self, reply);
+            for (int i = 0; i < finger_count(self->fingers); ++i){
+                struct node_info f = finger_get(self->fingers, i);
+                rep_len += node_pack_node_info(reply + rep_len, &f);
+            }
+            rep_type = MSG_T_JOIN_REP;
+            break;
+
+        case MSG_T_SUCCS_REQ:
+            reply[0] = 'Y';
+            rep_len = 1 + node_pack_succ_list(self, reply + 1);
+            {
+                struct node_info listed[NUM_OF_SUCCS];
+                node_unpack_succ_list(reply + 1, listed);
+                rep_len += node_pack_coords(self, reply + rep_len, listed, NUM_OF_SUCCS);
+            }
+            rep_type = MSG_T_SUCCS_REP;
+            break;
+
+        case MSG_T_QPUT_REQ:
+            rep_len = node_quorum_serve(self, req->type, data, len, reply);
+            rep_type = MSG_T_QPUT_REP;
+            break;
+
+        case MSG_T_QGET_REQ:
+            rep_len = node_quorum_serve(self, req->type, data, len, reply);
+            rep_type = MSG_T_QGET_REP;
+            break;
+
+        case MSG_T_ALIVE_REQ:
+            reply[0] = 'Y';
+            rep_len = 1 + node_pack_coords(self, reply + 1, NULL, 0);
+            rep_type = MSG_T_ALIVE_REP;
+            break;
+
+        case MSG_T_NOTIF:
+            if (len < ID_BYTES + 2){
+                break; }
+            other.IP = req->IP;
+            memcpy(&(other.id), data, ID_BYTES);
+            memcpy(&(other.port), data + ID_BYTES, 2);
+            node_notified(self, other);
+            rep_type = MSG_T_NOTIFIED;
+            break;
+
+        case MSG_T_LEAVE:
+            if (len < LEAVE_BYTES){
+                break; }
+            {
+                struct node_info pred;
+                struct node_info list[NUM_OF_SUCCS];
+                const char* state = data + ID_BYTES + 2;
+                other.IP = req->IP;
+                memcpy(&(other.id), data, ID_BYTES);
+                memcpy(&(other.port), data + ID_BYTES, 2);
+                node_unpack_node_info(state + 1, &pred);
+                node_unpack_succ_list(state + 1 + NODE_INFO_BYTES, list);
+                node_left(self, other, state[0] == 'Y', pred, list);
+            }
+            rep_type = MSG_T_LEFT;
+            break;
+
+        default:
+            log_warn("unexpected datagram type %c", req->type);
+            break;
+    }
+
+    if (rep_type != MSG_T_UNKNOWN){
+        rpc_reply(rpc, req, rep_type, reply, rep_len);
     }
 }
 
@@ -1005,7 +3423,7 @@ void handle_alive_request(int connection, void *arg)
     //log_info("handling alive req");
     struct node_self* self = (struct node_self*) arg;
     struct evbuffer* write_buf = net_connection_get_write_buffer(self->net, connection);
-    evbuffer_add(write_buf, "Y\n", 6);
+    evbuffer_add(write_buf, "Y\n", 2);
 }
 
 void handle_notif_request(int connection, void *arg)
@@ -1039,7 +3457,12 @@ void handle_node_message(int connection, void *arg)
     struct node_self* self = msgarg->self;
 
     (self->msg_cb)(self, &msgarg->msg, connection, self->msg_cb_arg);
-    free(msgarg);
+    // the connection's callbacks mustn't see msgarg once it's back in the pool
+    if (net_connection_get_cb_arg(self->net, connection) == msgarg){
+        net_connection_set_event_cb(self->net, connection, incoming_event_cb);
+        net_connection_set_cb_arg(self->net, connection, (void*) self);
+    }
+    pool_put(self->msg_pool, msgarg);
 
     //log_info("handle node msg called");
 }
@@ -1101,8 +3524,7 @@ void incoming_read_cb(int connection, void *arg)
 
     struct node_message msg;
     struct evbuffer* read_buf = net_connection_get_read_buffer(self->net, connection);
-
-    struct node_msg_arg* msgarg = malloc(sizeof(struct node_msg_arg));
+    struct node_msg_arg* msgarg;
 
     if (node_parse_message_header(&msg, read_buf) < 0){
         log_err("error parsing incoming header");
@@ -1110,6 +3532,8 @@ void incoming_read_cb(int connection, void *arg)
         net_connection_close(self->net, connection);
         return;
     }
+    msg.from.IP = net_connection_get_remote_address(self->net, connection);
+    msg.from.port = 0; // not in the header, see proto.h
     if (evbuffer_get_length(read_buf) < msg.len){
 
         //log_info("less data in buffer than msg length, setting handlers");
@@ -1119,10 +3543,18 @@ void incoming_read_cb(int connection, void *arg)
                 net_connection_set_read_cb(self->net, connection, handle_succ_request);
                 break;
 
+            case MSG_T_SUCC_TRACE_REQ:
+                net_connection_set_read_cb(self->net, connection, handle_succ_trace_request);
+                break;
+
             case MSG_T_PRED_REQ:
                 net_connection_set_read_cb(self->net, connection, handle_pred_request);
                 break;
 
+            case MSG_T_SUCCS_REQ:
+                net_connection_set_read_cb(self->net, connection, handle_succs_request);
+                break;
+
             case MSG_T_ALIVE_REQ:
                 net_connection_set_read_cb(self->net, connection, handle_alive_request);
                 break;
@@ -1132,7 +3564,10 @@ void incoming_read_cb(int connection, void *arg)
                 break;
 
             case MSG_T_NODE_MSG:
-                msgarg = malloc(sizeof(struct node_msg_arg));
+                msgarg = pool_get(self->msg_pool);
+                if (!msgarg){
+                    net_connection_close(self->net, connection);
+                    return; }
                 msgarg->self = self;
                 msgarg->msg = msg;
                 net_connection_set_read_cb(self->net, connection, handle_node_message);
@@ -1142,14 +3577,14 @@ void incoming_read_cb(int connection, void *arg)
 
             case MSG_T_SUCC_REP:
             case MSG_T_PRED_REP:
+            case MSG_T_SUCCS_REP:
             case MSG_T_ALIVE_REP:
             default:
                 log_warn("unexpected message type received on incoming connection");
                 break;
         }
 
-        struct bufferevent* bufev = net_connection_get_bufev(self->net, connection);
-        bufferevent_setwatermark(bufev, EV_READ, msg.len, 0);
+        net_connection_set_read_watermark(self->net, connection, msg.len);
     }
     else{
         //log_info("whole message already in buffer, calling handler");
@@ -1159,10 +3594,18 @@ void incoming_read_cb(int connection, void *arg)
                 handle_succ_request(connection, (void*) self);
                 break;
 
+            case MSG_T_SUCC_TRACE_REQ:
+                handle_succ_trace_request(connection, (void*) self);
+                break;
+
             case MSG_T_PRED_REQ:
                 handle_pred_request(connection, (void*) self);
                 break;
 
+            case MSG_T_SUCCS_REQ:
+                handle_succs_request(connection, (void*) self);
+                break;
+
             case MSG_T_ALIVE_REQ:
                 handle_alive_request(connection, (void*) self);
                 break;
@@ -1173,7 +3616,10 @@ void incoming_read_cb(int connection, void *arg)
 
             case MSG_T_NODE_MSG:
                 //log_info("sending node msg up");
-                msgarg = malloc(sizeof(struct node_msg_arg));
+                msgarg = pool_get(self->msg_pool);
+                if (!msgarg){
+                    net_connection_close(self->net, connection);
+                    return; }
                 msgarg->self = self;
                 msgarg->msg = msg;
                 handle_node_message(connection, msgarg);
@@ -1181,6 +3627,7 @@ void incoming_read_cb(int connection, void *arg)
 
             case MSG_T_SUCC_REP:
             case MSG_T_PRED_REP:
+            case MSG_T_SUCCS_REP:
             case MSG_T_ALIVE_REP:
             default:
                 log_warn("unexpected message type received on incoming connection");
@@ -1201,8 +3648,7 @@ void incoming_connection(int connection, short type, void *arg)
     net_connection_set_event_cb(self->net, connection, incoming_event_cb);
     net_connection_set_cb_arg(self->net, connection, (void*)self);
     net_connection_set_timeouts(self->net, connection, NODE_WAIT_TM_DEFAULT, NODE_WAIT_TM_DEFAULT);
-    struct bufferevent* bufev = net_connection_get_bufev(self->net, connection);
-    bufferevent_setwatermark(bufev, EV_READ, 1 + LEN_STR_BYTES, 0);
+    net_connection_set_read_watermark(self->net, connection, MSG_HEADER_BYTES);
 }
 
 //
@@ -6,25 +6,99 @@
 
 #include "libdht.h"
 #include "netio.h"
+#include "pool.h"
 
 #define NUM_OF_SUCCS 8
 #define ID_BITS 32
 #define ID_BYTES (ID_BITS/8)
 #define ID_HEX_CHARS (ID_BITS/4)
+// id + IP + port as sent on the wire
+#define NODE_INFO_BYTES (ID_BYTES + 4 + 2)
+#define SUCC_LIST_BYTES (NODE_INFO_BYTES * NUM_OF_SUCCS)
 #define FINGER_SIZE_INIT 6
+// a finger base of k keeps k - 1 fingers per level and takes log_k(N) hops, see node_set_finger_base
+#define NODE_FINGER_BASE_DEFAULT 2
+#define NODE_FINGER_BASE_MAX 16
+#define NODE_MAX_FINGERS ((NODE_FINGER_BASE_MAX - 1) * ((ID_BITS + 3) / 4))
 // wait 20 secs before timout node
 #define NODE_TIMEOUT 20
 #define STABILIZE_PERIOD 30
 #define STABILIZE_CHECK_PERIOD 9
+// only probe nodes not heard from in this many secs
+#define NODE_PROBE_SILENCE 15
+// a lookup may take several hops so waits this many times the next hop's timeout
+#define NODE_LOOKUP_TIMEOUT_MULT 4
+// sends of a control datagram before giving up
+#define NODE_RPC_TRIES 3
+// nodes a lookup is sent to, each failure evicts one and routes around it
+#define NODE_LOOKUP_TRIES 3
+// secs a node that failed to answer is skipped for unless heard from
+#define NODE_DEAD_SECS 5
+// msecs a node that said it was busy is routed around for
+#define NODE_BUSY_MS 1000
+// a lookup turned away waits this long before asking again, doubling each time
+#define NODE_BUSY_BACKOFF_MS 100
+// busy replies a lookup takes before it fails
+#define NODE_BUSY_TRIES 4
+// lookups of a key a node routes before it caches the key's owner, see node_set_route_cache
+#define NODE_ROUTE_CACHE_ADMIT 4
+// secs to wait before asking the bootstrap node again after a failed join
+#define NODE_JOIN_RETRY_PERIOD 2
+// seed nodes a join asks at once
+#define NODE_JOIN_MAX_SEEDS 8
+// maintenance timers a node runs once it has joined, stopped when it leaves
+#define NODE_MAINT_EVTS 4
+// pools a node keeps, see node_get_pool_stats
+#define NODE_POOL_COUNT 11
+// next hops a lookup weighs against each other by expected latency
+#define NODE_HOP_CANDIDATES 32
+// secs between routing state snapshots, see node_set_snapshot_file
+#define NODE_SNAPSHOT_PERIOD 60
+// a record is kept on its owner and the owner's successors, n of them in all, see node_set_quorum
+#define NODE_QUORUM_MAX_N (NUM_OF_SUCCS + 1)
+#define NODE_QUORUM_N 3
+#define NODE_QUORUM_R 2
+#define NODE_QUORUM_W 2
+// a read asks one more replica once those asked have taken longer than this percentile of read replies
+#define NODE_HEDGE_PCT 95
+// read replies seen before the percentile is used, reads hedge after NODE_HEDGE_DEFAULT_US until then
+#define NODE_HEDGE_MIN_SAMPLES 32
+#define NODE_HEDGE_DEFAULT_US 20000
+#define NODE_HEDGE_MIN_US 200
+// buckets read reply times are counted in, older counts are halved every NODE_HEDGE_WINDOW replies
+#define NODE_HEDGE_BUCKETS 128
+#define NODE_HEDGE_WINDOW 1024
+// owners whose successor lists quorum ops remember, each refreshed once it is this many msecs old
+#define NODE_REPLICA_CACHE 64
+#define NODE_REPLICA_TTL_MS 5000
 
 
 struct node_found_cb_data;
 struct node_join_cb_data;
 struct node_found_cb_data;
 struct finger_update_arg;
+struct finger_table;
+struct peer_table;
 
 
 
+/**
+ * whether id is in [min, max], going round the ring if max < min
+ */
+int node_id_in_range(hash_type id, hash_type min, hash_type max);
+
+/**
+ * take a message header off the front of read_buf into msg, -1 if it couldn't
+ */
+int node_parse_message_header(struct node_message* msg, struct evbuffer* read_buf);
+
+/**
+ * the node's routing tables, for benchmarks and tools that fill them in by hand
+ */
+struct finger_table* node_get_fingers(struct node_self* self);
+
+struct peer_table* node_get_peers(struct node_self* self);
+
 /**
  * ask node n for the successor of id
  */
@@ -40,6 +114,17 @@ struct node_info node_closest_preceding_node(struct node_self* self, hash_type i
  */
 void node_get_predecessor_remote(struct node_self* self, struct node_info n, node_found_cb_t cb, void* found_cb_arg);
 
+/**
+ * ask node n for its successor list, the reply replaces self's successor list
+ * with n followed by n's successors
+ */
+void node_get_succ_list_remote(struct node_self* self, struct node_info n);
+
+/**
+ * make succ the first successor and fill the rest of the list from succ's list
+ */
+void node_adopt_succ_list(struct node_self* self, struct node_info succ, const struct node_info* list);
+
 /**
  *
  * called periodically
@@ -68,6 +153,11 @@ void node_check_successors(struct node_self* self);
 
 void node_alive_timeout(struct node_self* self, struct node_info* node);
 
+/**
+ * fills up to max entries of stats, one per pool, returns how many were filled
+ */
+int node_get_pool_stats(struct node_self* self, struct pool_stats* stats, int max);
+
 /**
  * called when a message from another node is received
  */
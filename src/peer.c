@@ -0,0 +1,372 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "peer.h"
+
+#define LOG_SUBSYS LOG_SYS_MAINT
+#include "logging.h"
+
+uint64_t peer_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static unsigned int peer_hash(uint32_t IP, uint16_t port)
+{
+    uint32_t h = IP ^ ((uint32_t)port << 16) ^ port;
+    h *= 0x9E3779B1;
+    return (h >> 16) & (PEER_TABLE_SIZE - 1);
+}
+
+struct peer_table* peer_table_create()
+{
+    struct peer_table* pt = malloc(sizeof(struct peer_table));
+    if (!pt){
+        log_err("failed to malloc peer table");
+        return NULL; }
+
+    memset(pt->peers, 0, sizeof(pt->peers));
+    if (pthread_mutex_init(&(pt->lock), NULL) != 0){
+        log_err("failed to init peer table lock");
+        free(pt);
+        return NULL;
+    }
+    return pt;
+}
+
+void peer_table_destroy(struct peer_table* pt)
+{
+    if (!pt) { return; }
+    pthread_mutex_destroy(&(pt->lock));
+    free(pt);
+}
+
+// must use lock with this!!!
+// returns the peer's slot, or if create is set the slot it should go in
+static struct node_peer* peer_find(struct peer_table* pt, uint32_t IP, uint16_t port, short create)
+{
+    unsigned int start = peer_hash(IP, port);
+    struct node_peer* stalest = NULL;
+
+    for (int i = 0; i < PEER_PROBE_LEN; ++i){
+        struct node_peer* p = &(pt->peers[(start + i) & (PEER_TABLE_SIZE - 1)]);
+        if (p->IP == IP && p->port == port){
+            return p; }
+        if (!stalest || p->last_heard < stalest->last_heard){
+            stalest = p; }
+    }
+    if (!create){
+        return NULL; }
+
+    memset(stalest, 0, sizeof(struct node_peer));
+    stalest->IP = IP;
+    stalest->port = port;
+    return stalest;
+}
+
+void peer_heard_from(struct peer_table* pt, uint32_t IP, uint16_t port)
+{
+    if (!pt || IP == 0) { return; }
+    uint64_t now = peer_now_us();
+
+    pthread_mutex_lock(&(pt->lock));
+    struct node_peer* p = peer_find(pt, IP, port, 1);
+    p->last_heard = now;
+    p->dead_until = 0;
+    if (p->awaiting_since){ // it's alive, so only count waiting from now
+        p->awaiting_since = p->outstanding ? now : 0; }
+    pthread_mutex_unlock(&(pt->lock));
+}
+
+void peer_request_sent(struct peer_table* pt, uint32_t IP, uint16_t port)
+{
+    if (!pt || IP == 0) { return; }
+    uint64_t now = peer_now_us();
+
+    pthread_mutex_lock(&(pt->lock));
+    struct node_peer* p = peer_find(pt, IP, port, 1);
+    if (p->outstanding++ == 0){
+        p->awaiting_since = now; }
+    pthread_mutex_unlock(&(pt->lock));
+}
+
+// RFC 6298 style smoothing
+static void peer_rtt_sample(struct node_peer* p, uint64_t rtt_us)
+{
+    if (rtt_us > UINT32_MAX) { rtt_us = UINT32_MAX; }
+    uint32_t r = (uint32_t) rtt_us;
+
+    if (p->srtt_us == 0){
+        p->srtt_us = r;
+        p->rttvar_us = r / 2;
+    }else{
+        uint32_t diff = (p->srtt_us > r) ? (p->srtt_us - r) : (r - p->srtt_us);
+        p->rttvar_us = (3 * (uint64_t)p->rttvar_us + diff) / 4;
+        p->srtt_us = (7 * (uint64_t)p->srtt_us + r) / 8;
+        if (p->srtt_us == 0) { p->srtt_us = 1; }
+    }
+}
+
+void peer_reply_received(struct peer_table* pt, uint32_t IP, uint16_t port, uint64_t rtt_us)
+{
+    if (!pt || IP == 0) { return; }
+    uint64_t now = peer_now_us();
+
+    pthread_mutex_lock(&(pt->lock));
+    struct node_peer* p = peer_find(pt, IP, port, 1);
+    p->last_heard = now;
+    if (p->outstanding > 0 && --p->outstanding > 0){
+        p->awaiting_since = now; // still waiting on the others
+    }else{
+        p->awaiting_since = 0;
+    }
+    if (rtt_us){
+        peer_rtt_sample(p, rtt_us); }
+    pthread_mutex_unlock(&(pt->lock));
+}
+
+void peer_request_failed(struct peer_table* pt, uint32_t IP, uint16_t port)
+{
+    if (!pt) { return; }
+
+    pthread_mutex_lock(&(pt->lock));
+    struct node_peer* p = peer_find(pt, IP, port, 0);
+    // awaiting_since is kept so phi keeps rising until the peer answers something
+    if (p && p->outstanding > 0){
+        p->outstanding--; }
+    pthread_mutex_unlock(&(pt->lock));
+}
+
+// must use lock with this!!!
+static double peer_std_us(struct node_peer* p)
+{
+    return (p->rttvar_us > PEER_MIN_STD_US) ? p->rttvar_us : PEER_MIN_STD_US;
+}
+
+double peer_phi(struct peer_table* pt, uint32_t IP, uint16_t port)
+{
+    if (!pt) { return 0; }
+    double phi = 0;
+    uint64_t now = peer_now_us();
+
+    pthread_mutex_lock(&(pt->lock));
+    struct node_peer* p = peer_find(pt, IP, port, 0);
+    if (p && p->awaiting_since){
+        double waited = (double)(now - p->awaiting_since);
+        double mean = p->srtt_us ? p->srtt_us : (PEER_INITIAL_TIMEOUT_MS * 1000.0 / 2);
+        double z = (waited - mean) / peer_std_us(p);
+        // P(reply takes longer than waited) for normally distributed reply times
+        double p_later = 0.5 * erfc(z / M_SQRT2);
+        phi = (p_later > 1e-300) ? -log10(p_later) : 300;
+    }
+    pthread_mutex_unlock(&(pt->lock));
+    return phi;
+}
+
+void peer_timeout(struct peer_table* pt, uint32_t IP, uint16_t port, struct timeval* tv)
+{
+    uint64_t tm_us = (uint64_t)PEER_INITIAL_TIMEOUT_MS * 1000;
+
+    if (pt){
+        pthread_mutex_lock(&(pt->lock));
+        struct node_peer* p = peer_find(pt, IP, port, 0);
+        if (p && p->srtt_us){
+            tm_us = p->srtt_us + (uint64_t)(PEER_SUSPECT_STDS * peer_std_us(p)); }
+        pthread_mutex_unlock(&(pt->lock));
+    }
+
+    if (tm_us < (uint64_t)PEER_MIN_TIMEOUT_MS * 1000) { tm_us = (uint64_t)PEER_MIN_TIMEOUT_MS * 1000; }
+    if (tm_us > (uint64_t)PEER_MAX_TIMEOUT_MS * 1000) { tm_us = (uint64_t)PEER_MAX_TIMEOUT_MS * 1000; }
+    tv->tv_sec  = tm_us / 1000000;
+    tv->tv_usec = tm_us % 1000000;
+}
+
+uint32_t peer_srtt(struct peer_table* pt, uint32_t IP, uint16_t port)
+{
+    if (!pt) { return 0; }
+    uint32_t srtt = 0;
+
+    pthread_mutex_lock(&(pt->lock));
+    struct node_peer* p = peer_find(pt, IP, port, 0);
+    if (p){
+        srtt = p->srtt_us; }
+    pthread_mutex_unlock(&(pt->lock));
+    return srtt;
+}
+
+void peer_set_coord(struct peer_table* pt, uint32_t IP, uint16_t port, const struct vivaldi_coord* c)
+{
+    if (!pt || IP == 0 || !vivaldi_known(c)) { return; }
+
+    pthread_mutex_lock(&(pt->lock));
+    struct node_peer* p = peer_find(pt, IP, port, 1);
+    p->coord = *c;
+    pthread_mutex_unlock(&(pt->lock));
+}
+
+int peer_get_coord(struct peer_table* pt, uint32_t IP, uint16_t port, struct vivaldi_coord* c)
+{
+    if (!pt) { return -1; }
+    int rc = -1;
+
+    pthread_mutex_lock(&(pt->lock));
+    struct node_peer* p = peer_find(pt, IP, port, 0);
+    if (p && vivaldi_known(&(p->coord))){
+        *c = p->coord;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&(pt->lock));
+    return rc;
+}
+
+uint64_t peer_silent_for(struct peer_table* pt, uint32_t IP, uint16_t port)
+{
+    if (!pt) { return UINT64_MAX; }
+    uint64_t silent = UINT64_MAX;
+    uint64_t now = peer_now_us();
+
+    pthread_mutex_lock(&(pt->lock));
+    struct node_peer* p = peer_find(pt, IP, port, 0);
+    if (p && p->last_heard){
+        silent = now - p->last_heard; }
+    pthread_mutex_unlock(&(pt->lock));
+    return silent;
+}
+
+void peer_mark_dead(struct peer_table* pt, uint32_t IP, uint16_t port, uint64_t dead_us)
+{
+    if (!pt || IP == 0) { return; }
+    uint64_t now = peer_now_us();
+
+    pthread_mutex_lock(&(pt->lock));
+    struct node_peer* p = peer_find(pt, IP, port, 1);
+    p->dead_until = now + dead_us;
+    pthread_mutex_unlock(&(pt->lock));
+}
+
+int peer_is_dead(struct peer_table* pt, uint32_t IP, uint16_t port)
+{
+    if (!pt) { return 0; }
+    uint64_t now = peer_now_us();
+
+    pthread_mutex_lock(&(pt->lock));
+    struct node_peer* p = peer_find(pt, IP, port, 0);
+    int dead = p && (p->dead_until > now || p->left_until > now);
+    pthread_mutex_unlock(&(pt->lock));
+    return dead;
+}
+
+void peer_mark_left(struct peer_table* pt, uint32_t IP, uint16_t port, uint64_t left_us)
+{
+    if (!pt || IP == 0) { return; }
+    uint64_t now = peer_now_us();
+
+    pthread_mutex_lock(&(pt->lock));
+    struct node_peer* p = peer_find(pt, IP, port, 1);
+    p->left_until = now + left_us;
+    pthread_mutex_unlock(&(pt->lock));
+}
+
+int peer_has_left(struct peer_table* pt, uint32_t IP, uint16_t port)
+{
+    if (!pt) { return 0; }
+    uint64_t now = peer_now_us();
+
+    pthread_mutex_lock(&(pt->lock));
+    struct node_peer* p = peer_find(pt, IP, port, 0);
+    int left = p && p->left_until > now;
+    pthread_mutex_unlock(&(pt->lock));
+    return left;
+}
+
+void peer_mark_busy(struct peer_table* pt, uint32_t IP, uint16_t port, uint64_t busy_us)
+{
+    if (!pt || IP == 0) { return; }
+    uint64_t now = peer_now_us();
+
+    pthread_mutex_lock(&(pt->lock));
+    struct node_peer* p = peer_find(pt, IP, port, 1);
+    p->busy_until = now + busy_us;
+    pthread_mutex_unlock(&(pt->lock));
+}
+
+int peer_is_busy(struct peer_table* pt, uint32_t IP, uint16_t port)
+{
+    if (!pt) { return 0; }
+    uint64_t now = peer_now_us();
+
+    pthread_mutex_lock(&(pt->lock));
+    struct node_peer* p = peer_find(pt, IP, port, 0);
+    int busy = p && p->busy_until > now;
+    pthread_mutex_unlock(&(pt->lock));
+    return busy;
+}
+
+void peer_set_dgrams(struct peer_table* pt, uint32_t IP, uint16_t port, short dgrams)
+{
+    if (!pt || IP == 0) { return; }
+
+    pthread_mutex_lock(&(pt->lock));
+    struct node_peer* p = peer_find(pt, IP, port, 1);
+    p->dgrams = dgrams;
+    pthread_mutex_unlock(&(pt->lock));
+}
+
+short peer_dgrams(struct peer_table* pt, uint32_t IP, uint16_t port)
+{
+    if (!pt) { return PEER_DGRAMS_UNKNOWN; }
+
+    pthread_mutex_lock(&(pt->lock));
+    struct node_peer* p = peer_find(pt, IP, port, 0);
+    short dgrams = p ? p->dgrams : PEER_DGRAMS_UNKNOWN;
+    pthread_mutex_unlock(&(pt->lock));
+    return dgrams;
+}
+
+void peer_lookup_many(struct peer_table* pt, const struct node_info* nodes, int n, struct peer_state* out)
+{
+    memset(out, 0, sizeof(struct peer_state) * n);
+    if (!pt) { return; }
+    uint64_t now = peer_now_us();
+
+    pthread_mutex_lock(&(pt->lock));
+    for (int i = 0; i < n; ++i){
+        struct node_peer* p = peer_find(pt, nodes[i].IP, nodes[i].port, 0);
+        if (!p){
+            continue; }
+        out[i].srtt_us = p->srtt_us;
+        out[i].coord = p->coord;
+        out[i].busy = p->busy_until > now;
+        out[i].dead = p->dead_until > now || p->left_until > now;
+    }
+    pthread_mutex_unlock(&(pt->lock));
+}
+
+int peer_export(struct peer_table* pt, struct node_peer* out, int max)
+{
+    int n = 0;
+    pthread_mutex_lock(&(pt->lock));
+    for (int i = 0; i < PEER_TABLE_SIZE && n < max; ++i){
+        if (pt->peers[i].IP != 0 && pt->peers[i].srtt_us != 0){
+            out[n++] = pt->peers[i]; }
+    }
+    pthread_mutex_unlock(&(pt->lock));
+    return n;
+}
+
+void peer_restore(struct peer_table* pt, uint32_t IP, uint16_t port, uint32_t srtt_us, uint32_t rttvar_us)
+{
+    if (!pt || IP == 0) { return; }
+
+    pthread_mutex_lock(&(pt->lock));
+    struct node_peer* p = peer_find(pt, IP, port, 1);
+    if (p->srtt_us == 0){
+        p->srtt_us   = srtt_us;
+        p->rttvar_us = rttvar_us;
+    }
+    pthread_mutex_unlock(&(pt->lock));
+}
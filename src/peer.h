@@ -0,0 +1,182 @@
+#ifndef PEER_H
+#define PEER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "libdht.h"
+#include "vivaldi.h"
+
+// must be a power of 2
+#define PEER_TABLE_SIZE 256
+// slots checked for a peer before the stalest one is replaced
+#define PEER_PROBE_LEN 8
+
+// suspicion level at which a peer is treated as failed
+#define PEER_PHI_SUSPECT 8.0
+// std devs above the mean reply time where phi reaches PEER_PHI_SUSPECT
+#define PEER_SUSPECT_STDS 5.6
+// floor on reply time std dev so a very steady peer isn't suspected on one hiccup
+#define PEER_MIN_STD_US 50000
+// timeout used before any reply time samples
+#define PEER_INITIAL_TIMEOUT_MS 3000
+#define PEER_MIN_TIMEOUT_MS 100
+#define PEER_MAX_TIMEOUT_MS 20000
+
+// whether a peer takes control requests as datagrams (see rpc.h), older nodes only take them over TCP
+#define PEER_DGRAMS_UNKNOWN 0
+#define PEER_DGRAMS_YES 1
+#define PEER_DGRAMS_NO -1
+
+/**
+ * what this node knows about another node it has talked to
+ */
+struct node_peer{
+    uint32_t IP;
+    uint16_t port;
+    uint64_t last_heard; // usecs, monotonic
+    uint64_t awaiting_since; // when the oldest unanswered request was sent, 0 if none
+    short outstanding;
+    uint32_t srtt_us; // smoothed reply time, 0 if no samples
+    uint32_t rttvar_us;
+    uint64_t dead_until; // usecs, failed recently so not worth routing through
+    uint64_t left_until; // usecs, said it was leaving, hearing from it doesn't bring it back
+    uint64_t busy_until; // usecs, turned work away recently, alive but best avoided
+    struct vivaldi_coord coord; // its last reported coordinate, error 0 if none
+    short dgrams; // PEER_DGRAMS_*
+};
+
+// what picking a next hop needs to know about a peer, see peer_lookup_many
+struct peer_state{
+    uint32_t srtt_us; // 0 if no samples
+    struct vivaldi_coord coord; // error 0 if none
+    short busy;
+    short dead; // as peer_is_dead
+};
+
+struct peer_table{
+    struct node_peer peers[PEER_TABLE_SIZE];
+    pthread_mutex_t lock;
+};
+
+struct peer_table* peer_table_create();
+
+void peer_table_destroy(struct peer_table* pt);
+
+/**
+ * record that IP:port was just heard from
+ */
+void peer_heard_from(struct peer_table* pt, uint32_t IP, uint16_t port);
+
+/**
+ * record a request sent to IP:port that expects a reply
+ */
+void peer_request_sent(struct peer_table* pt, uint32_t IP, uint16_t port);
+
+/**
+ * record the reply to a request, rtt_us is how long it took (0 to not sample it)
+ */
+void peer_reply_received(struct peer_table* pt, uint32_t IP, uint16_t port, uint64_t rtt_us);
+
+/**
+ * record a request that ended without a reply
+ */
+void peer_request_failed(struct peer_table* pt, uint32_t IP, uint16_t port);
+
+/**
+ * phi accrual suspicion level: -log10 of the chance the reply we are still
+ * waiting on is merely late, given the peer's reply time distribution.
+ * 0 when nothing is outstanding
+ */
+double peer_phi(struct peer_table* pt, uint32_t IP, uint16_t port);
+
+/**
+ * how long to wait for a reply from IP:port before it should be suspected
+ */
+void peer_timeout(struct peer_table* pt, uint32_t IP, uint16_t port, struct timeval* tv);
+
+/**
+ * smoothed reply time of IP:port in usecs, 0 if it has no samples
+ */
+uint32_t peer_srtt(struct peer_table* pt, uint32_t IP, uint16_t port);
+
+/**
+ * remember the coordinate IP:port was last reported at, by itself or another node
+ */
+void peer_set_coord(struct peer_table* pt, uint32_t IP, uint16_t port, const struct vivaldi_coord* c);
+
+/**
+ * IP:port's last reported coordinate, returns 0 if there is one
+ */
+int peer_get_coord(struct peer_table* pt, uint32_t IP, uint16_t port, struct vivaldi_coord* c);
+
+/**
+ * usecs since IP:port was last heard from, or UINT64_MAX if never
+ */
+uint64_t peer_silent_for(struct peer_table* pt, uint32_t IP, uint16_t port);
+
+/**
+ * remember IP:port as dead for the next dead_us, or until it is heard from
+ */
+void peer_mark_dead(struct peer_table* pt, uint32_t IP, uint16_t port, uint64_t dead_us);
+
+/**
+ * whether IP:port has been marked dead and not heard from since, or has left
+ */
+int peer_is_dead(struct peer_table* pt, uint32_t IP, uint16_t port);
+
+/**
+ * remember IP:port as gone for the next left_us, even if it is heard from
+ * (it may still be finishing its leave)
+ */
+void peer_mark_left(struct peer_table* pt, uint32_t IP, uint16_t port, uint64_t left_us);
+
+/**
+ * whether IP:port said it was leaving less than its left_us ago
+ */
+int peer_has_left(struct peer_table* pt, uint32_t IP, uint16_t port);
+
+/**
+ * remember IP:port as too busy to take work for the next busy_us, hearing
+ * from it doesn't clear this (the busy reply is how we hear)
+ */
+void peer_mark_busy(struct peer_table* pt, uint32_t IP, uint16_t port, uint64_t busy_us);
+
+/**
+ * whether IP:port said it was busy less than its busy_us ago
+ */
+int peer_is_busy(struct peer_table* pt, uint32_t IP, uint16_t port);
+
+/**
+ * remember whether IP:port takes datagrams, PEER_DGRAMS_*
+ */
+void peer_set_dgrams(struct peer_table* pt, uint32_t IP, uint16_t port, short dgrams);
+
+/**
+ * PEER_DGRAMS_UNKNOWN until it has answered a datagram or failed to
+ */
+short peer_dgrams(struct peer_table* pt, uint32_t IP, uint16_t port);
+
+/**
+ * the state of n peers at once under one lock, e.g. every next hop a lookup
+ * could take. peers the table doesn't know come back all 0
+ */
+void peer_lookup_many(struct peer_table* pt, const struct node_info* nodes, int n, struct peer_state* out);
+
+/**
+ * copy out up to max peers that have reply time samples, returns how many
+ */
+int peer_export(struct peer_table* pt, struct node_peer* out, int max);
+
+/**
+ * seed IP:port's reply time estimate, e.g. from a snapshot, if it has no samples of its own
+ */
+void peer_restore(struct peer_table* pt, uint32_t IP, uint16_t port, uint32_t srtt_us, uint32_t rttvar_us);
+
+/**
+ * monotonic clock in usecs
+ */
+uint64_t peer_now_us();
+
+#endif // PEER_H
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "logging.h"
+
+// objects are kept this aligned
+#define POOL_ALIGN 16
+// owner hands objects over to other threads once it has this many spare
+#define POOL_OWNER_SPARE (POOL_SLAB_OBJS * 2)
+
+struct pool_obj{
+    struct pool_obj* next;
+};
+
+struct pool_slab{
+    struct pool_slab* next;
+};
+
+#define POOL_SLAB_HEADER ((sizeof(struct pool_slab) + POOL_ALIGN - 1) & ~((size_t)POOL_ALIGN - 1))
+
+struct pool{
+    const char* name;
+    size_t obj_size;
+    pthread_t owner;
+
+    // owner only, no lock
+    struct pool_obj* free_list;
+    int free_count;
+
+    // everything else under lock
+    pthread_mutex_t lock;
+    struct pool_obj* shared_free;
+    struct pool_slab* slabs;
+    char* carve; // next never used object in the newest slab
+    int carve_left;
+    int slab_count;
+
+    int live; // atomic
+    int high_water; // atomic
+};
+
+static void pool_count_get(struct pool* pool)
+{
+    int live = __atomic_add_fetch(&(pool->live), 1, __ATOMIC_RELAXED);
+    int high = __atomic_load_n(&(pool->high_water), __ATOMIC_RELAXED);
+    while (live > high &&
+            !__atomic_compare_exchange_n(&(pool->high_water), &high, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// must use lock with this!!!
+static void* pool_take_locked(struct pool* pool)
+{
+    if (pool->shared_free){
+        struct pool_obj* obj = pool->shared_free;
+        pool->shared_free = obj->next;
+        return obj;
+    }
+    if (pool->carve_left == 0){
+        struct pool_slab* slab = malloc(POOL_SLAB_HEADER + pool->obj_size * POOL_SLAB_OBJS);
+        if (!slab){
+            log_err("failed to malloc slab for %s pool", pool->name);
+            return NULL; }
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->slab_count++;
+        pool->carve = (char*)slab + POOL_SLAB_HEADER;
+        pool->carve_left = POOL_SLAB_OBJS;
+    }
+    void* obj = pool->carve;
+    pool->carve += pool->obj_size;
+    pool->carve_left--;
+    return obj;
+}
+
+struct pool* pool_create(const char* name, size_t obj_size)
+{
+    struct pool* pool = malloc(sizeof(struct pool));
+    if (!pool){
+        log_err("failed to malloc %s pool", name);
+        return NULL; }
+
+    memset(pool, 0, sizeof(struct pool));
+    if (pthread_mutex_init(&(pool->lock), NULL) != 0){
+        log_err("failed to init %s pool lock", name);
+        free(pool);
+        return NULL;
+    }
+    if (obj_size < sizeof(struct pool_obj)){
+        obj_size = sizeof(struct pool_obj); }
+    pool->name     = name;
+    pool->obj_size = (obj_size + POOL_ALIGN - 1) & ~((size_t)POOL_ALIGN - 1);
+    pool->owner    = pthread_self();
+    return pool;
+}
+
+void pool_set_owner(struct pool* pool)
+{
+    if (pthread_equal(pthread_self(), pool->owner)){
+        return; }
+    // the old owner's spare objects go where anyone can take them
+    pthread_mutex_lock(&(pool->lock));
+    while (pool->free_list){
+        struct pool_obj* obj = pool->free_list;
+        pool->free_list = obj->next;
+        obj->next = pool->shared_free;
+        pool->shared_free = obj;
+    }
+    pool->free_count = 0;
+    pool->owner = pthread_self();
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+void pool_destroy(struct pool* pool)
+{
+    if (!pool) { return; }
+    if (pool->live > 0){
+        log_warn("%s pool destroyed with %d objects live", pool->name, pool->live); }
+    while (pool->slabs){
+        struct pool_slab* slab = pool->slabs;
+        pool->slabs = slab->next;
+        free(slab);
+    }
+    pthread_mutex_destroy(&(pool->lock));
+    free(pool);
+}
+
+void* pool_get(struct pool* pool)
+{
+    struct pool_obj* obj;
+
+    if (pthread_equal(pthread_self(), pool->owner)){
+        obj = pool->free_list;
+        if (obj){ // fast path
+            pool->free_list = obj->next;
+            pool->free_count--;
+            pool_count_get(pool);
+            return obj;
+        }
+        // take back whatever other threads have put
+        pthread_mutex_lock(&(pool->lock));
+        obj = pool_take_locked(pool);
+        if (obj && pool->shared_free){
+            pool->free_list = pool->shared_free;
+            pool->shared_free = NULL;
+            for (struct pool_obj* o = pool->free_list; o; o = o->next){
+                pool->free_count++; }
+        }
+        pthread_mutex_unlock(&(pool->lock));
+    }else{
+        pthread_mutex_lock(&(pool->lock));
+        obj = pool_take_locked(pool);
+        pthread_mutex_unlock(&(pool->lock));
+    }
+
+    if (obj){
+        pool_count_get(pool); }
+    return obj;
+}
+
+void pool_put(struct pool* pool, void* ptr)
+{
+    if (!ptr) { return; }
+    struct pool_obj* obj = (struct pool_obj*) ptr;
+    __atomic_sub_fetch(&(pool->live), 1, __ATOMIC_RELAXED);
+
+    if (!pthread_equal(pthread_self(), pool->owner)){
+        pthread_mutex_lock(&(pool->lock));
+        obj->next = pool->shared_free;
+        pool->shared_free = obj;
+        pthread_mutex_unlock(&(pool->lock));
+        return;
+    }
+
+    obj->next = pool->free_list;
+    pool->free_list = obj;
+    pool->free_count++;
+
+    // other threads can't reach the owner's list, give them some back
+    if (pool->free_count > POOL_OWNER_SPARE && pthread_mutex_trylock(&(pool->lock)) == 0){
+        for (int i = 0; i < POOL_SLAB_OBJS; ++i){
+            obj = pool->free_list;
+            pool->free_list = obj->next;
+            obj->next = pool->shared_free;
+            pool->shared_free = obj;
+        }
+        pool->free_count -= POOL_SLAB_OBJS;
+        pthread_mutex_unlock(&(pool->lock));
+    }
+}
+
+void pool_get_stats(struct pool* pool, struct pool_stats* stats)
+{
+    stats->name       = pool->name;
+    stats->obj_size   = pool->obj_size;
+    stats->live       = __atomic_load_n(&(pool->live), __ATOMIC_RELAXED);
+    stats->high_water = __atomic_load_n(&(pool->high_water), __ATOMIC_RELAXED);
+    pthread_mutex_lock(&(pool->lock));
+    stats->slabs      = pool->slab_count;
+    pthread_mutex_unlock(&(pool->lock));
+}
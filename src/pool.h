@@ -0,0 +1,52 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/**
+ * pool of fixed size objects carved from slabs and recycled through a free
+ * list so the steady state does no malloc/free. the owner thread (the node's
+ * event loop, see pool_set_owner) gets and puts without locking, other
+ * threads can also get and put but take the slow path
+ */
+
+// objects per slab
+#define POOL_SLAB_OBJS 64
+
+struct pool;
+
+struct pool_stats{
+    const char* name;
+    size_t obj_size;
+    int live; // handed out and not put back
+    int high_water; // most ever live at once
+    int slabs;
+};
+
+/**
+ * owned by the calling thread until pool_set_owner
+ */
+struct pool* pool_create(const char* name, size_t obj_size);
+
+/**
+ * the calling thread owns the pool from now on. the old owner must not be
+ * getting or putting while this runs, e.g. call it as the loop starts
+ */
+void pool_set_owner(struct pool* pool);
+
+/**
+ * frees every slab, objects still live are gone too
+ */
+void pool_destroy(struct pool* pool);
+
+/**
+ * returns NULL only if a new slab was needed and couldn't be malloc'd
+ */
+void* pool_get(struct pool* pool);
+
+void pool_put(struct pool* pool, void* obj);
+
+void pool_get_stats(struct pool* pool, struct pool_stats* stats);
+
+#endif // POOL_H
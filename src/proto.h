@@ -22,6 +22,23 @@ resp: successor [of id] is s_id
 #define MSG_T_SUCC_REQ 'S'
 #define MSG_T_SUCC_REP 's'
 
+/* succ reply:
+Y/N/B                   found, not, or busy     1
+IDXXIPXXPO              successor (Y only)      10
+HO                      hops (Y only)           2
+
+B is an overloaded node turning the lookup away, laid out like N. the asker
+waits a little and routes around it, it isn't dead
+
+a traced find successor ('T', same request) gets the hop path appended,
+on N replies too so the caller can see where it failed:
+C                       hops in path            1
+[IDXXQQQQPPPPWWWW x C]  id, queue delay, processing and waiting usecs
+*/
+
+#define MSG_T_SUCC_TRACE_REQ 'T'
+#define TRACE_HOP_BYTES (ID_BYTES + 12)
+
 /*
 stabilize:
 req: who is your predecessor?
@@ -31,6 +48,55 @@ resp: predecessor is id
 #define MSG_T_PRED_REQ 'P'
 #define MSG_T_PRED_REP 'p'
 
+/* pred reply:
+Y/N                     pred known              1
+IDXXIPXXPO              pred (zero if N)        10
+[IDXXIPXXPO x NUM_OF_SUCCS] successor list      80
+
+the successor list is piggybacked so stabilize also refreshes the
+asking node's successor list
+
+as a datagram it is followed by coordinates, see below
+*/
+
+/* coordinates:
+pred, successor list and alive replies sent as datagrams end with the
+replier's coordinate, then one for each node in the reply in order
+(pred then successors, successors, none). coordinates are vivaldi.h's, all
+zero when the replier doesn't know one. receivers ignore them if the reply
+is too short to hold them. replies over TCP, which older nodes also read,
+never carry them
+*/
+
+/*
+get successor list:
+req: what is your successor list?
+resp: Y + successor list (same layout as in pred reply)
+*/
+
+#define MSG_T_SUCCS_REQ 'L'
+#define MSG_T_SUCCS_REP 'l'
+
+/*
+join state:
+req: send me what I need to route straight away
+resp: pred reply followed by the finger table
+*/
+
+#define MSG_T_JOIN_REQ 'J'
+#define MSG_T_JOIN_REP 'j'
+
+/* join reply:
+Y/N                     pred known              1
+IDXXIPXXPO              pred (zero if N)        10
+[IDXXIPXXPO x NUM_OF_SUCCS] successor list      80
+[IDXXIPXXPO x F]        finger table            10 each
+
+F is however many fingers the node keeps, up to NODE_MAX_FINGERS. the
+joining node takes its successor list from it and picks its own fingers
+from all of these nodes, fix_fingers corrects them later
+*/
+
 /*
 notify:
 req: notify id
@@ -38,7 +104,26 @@ resp: [ok]
 */
 
 #define MSG_T_NOTIF 'N'
-#define MSG_T_NOTIFIED 'n' // is this necessary ?
+#define MSG_T_NOTIFIED 'n' // ack for notifies sent as datagrams
+
+/*
+leave:
+req: I'm going, here is who to use instead
+resp: [ok]
+*/
+
+#define MSG_T_LEAVE 'X'
+#define MSG_T_LEFT 'x'
+
+/* leave request:
+IDXXPO                  leaving node, listen port   6
+Y/N                     its pred known          1
+IDXXIPXXPO              its pred (zero if N)    10
+[IDXXIPXXPO x NUM_OF_SUCCS] its successor list  80
+
+sent to the leaving node's predecessor, successors and fingers. they
+drop it from their successor lists, predecessor and fingers straight away
+*/
 
 /*
 check_predecessor:
@@ -49,16 +134,64 @@ resp: yes i am here
 #define MSG_T_ALIVE_REQ 'A'
 #define MSG_T_ALIVE_REP 'a'
 
+/*
+quorum write / read:
+req: store this record / what have you got for this key
+resp: stored (or had newer) / the record
+*/
+
+#define MSG_T_QPUT_REQ 'W'
+#define MSG_T_QPUT_REP 'w'
+#define MSG_T_QGET_REQ 'G'
+#define MSG_T_QGET_REP 'g'
+
+/* write request:
+VVVVVVVV                version                 8
+D/Y                     delete or not           1
+KK                      key length              2
+key                                             K
+value                                           the rest
+
+write reply:
+Y/O/E                   stored, had newer, or no store  1
+VVVVVVVV                version it has now      8
+
+read request:
+KK                      key length              2
+key                                             K
+
+read reply:
+Y/D/N/E                 has it, deleted, never had it, or no store  1
+VVVVVVVV                its version (0 if N)    8
+value                   (Y only)                the rest
+
+a newer version always wins, a replica that had newer still counts as
+having stored the write. see node_quorum_put
+*/
+
 #define MSG_T_NODE_MSG 'M'
 
 #define MSG_T_UNKNOWN '0'
 
+// requests are upper case, their replies lower case
+#define MSG_T_IS_REPLY(t) ((t) >= 'a' && (t) <= 'z')
+
+/*
+ * pred, successor list, join state, notify, leave and alive requests are sent as datagrams
+ * (see rpc.h) with the same payloads as over TCP. quorum writes and reads only go as datagrams
+ */
+
 #define LEN_STR_BYTES 8
+#define MSG_HEADER_BYTES (1 + LEN_STR_BYTES)
 /*
  * TLV proto pls        what                    size
 R                       message type            1
 XXXXXXXX                content length          4
 ASJDGKADBJOTJGEJB...    [content]
+
+every node in a ring reads this header, so it can't change without a flag day.
+it has no sender's listen port, so a request over TCP can't be put down to a
+peer. datagrams carry one (see rpc.h) and replies are put down to who was asked
 */
 
 
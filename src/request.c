@@ -0,0 +1,345 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "request.h"
+#include "pool.h"
+#include "logging.h"
+
+#define REQ_WHEEL_MASK (REQ_WHEEL_SLOTS - 1)
+// furthest ahead the top level can hold without wrapping onto its current slot
+#define REQ_MAX_TICKS ((uint64_t)(REQ_WHEEL_SLOTS - 1) << (REQ_WHEEL_BITS * (REQ_WHEEL_LEVELS - 1)))
+
+struct request_entry{
+    uint32_t id;
+    uint64_t expires; // tick
+    request_done_cb_t done;
+    request_retry_cb_t retry;
+    void* arg;
+    short level; // where in the wheel it is
+    short slot;
+    struct request_entry* prev; // wheel slot list
+    struct request_entry* next;
+    struct request_entry* hnext; // id hash chain
+};
+
+struct request_table{
+    struct request_entry* wheel[REQ_WHEEL_LEVELS][REQ_WHEEL_SLOTS];
+    struct request_entry* by_id[REQ_BUCKETS];
+    uint64_t now_tick; // last tick processed
+    uint64_t start_us;
+    uint32_t next_id;
+    int count;
+    struct event* tick_evt;
+    short ticking;
+    struct pool* entries;
+    pthread_mutex_t lock;
+};
+
+void request_tick_cb(evutil_socket_t fd, short what, void *arg);
+
+static uint64_t request_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static uint64_t request_current_tick(struct request_table* rt)
+{
+    return (request_now_us() - rt->start_us) / (REQ_TICK_MS * 1000);
+}
+
+static uint64_t request_tv_ticks(const struct timeval* tv)
+{
+    uint64_t ms = (uint64_t)tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+    uint64_t ticks = (ms + REQ_TICK_MS - 1) / REQ_TICK_MS;
+    if (ticks == 0) { ticks = 1; }
+    if (ticks > REQ_MAX_TICKS) { ticks = REQ_MAX_TICKS; }
+    return ticks;
+}
+
+//
+// wheel, must use lock with these!!!
+//
+
+// an entry goes in the lowest level whose current span of slots includes its expiry
+static void request_wheel_insert(struct request_table* rt, struct request_entry* e)
+{
+    if (e->expires <= rt->now_tick){
+        e->expires = rt->now_tick + 1; }
+
+    int level = 0;
+    while (level < REQ_WHEEL_LEVELS - 1 &&
+            (e->expires >> (REQ_WHEEL_BITS * (level + 1))) != (rt->now_tick >> (REQ_WHEEL_BITS * (level + 1)))){
+        level++; }
+    e->level = level;
+    e->slot  = (e->expires >> (REQ_WHEEL_BITS * level)) & REQ_WHEEL_MASK;
+
+    struct request_entry** head = &(rt->wheel[e->level][e->slot]);
+    e->prev = NULL;
+    e->next = *head;
+    if (*head){
+        (*head)->prev = e; }
+    *head = e;
+}
+
+static void request_wheel_remove(struct request_table* rt, struct request_entry* e)
+{
+    if (e->prev){
+        e->prev->next = e->next;
+    }else{
+        rt->wheel[e->level][e->slot] = e->next;
+    }
+    if (e->next){
+        e->next->prev = e->prev; }
+    e->prev = e->next = NULL;
+}
+
+static struct request_entry* request_hash_unlink(struct request_table* rt, uint32_t id)
+{
+    struct request_entry** pp = &(rt->by_id[id & (REQ_BUCKETS - 1)]);
+    for (; *pp; pp = &((*pp)->hnext)){
+        if ((*pp)->id == id){
+            struct request_entry* e = *pp;
+            *pp = e->hnext;
+            e->hnext = NULL;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void request_hash_insert(struct request_table* rt, struct request_entry* e)
+{
+    e->hnext = rt->by_id[e->id & (REQ_BUCKETS - 1)];
+    rt->by_id[e->id & (REQ_BUCKETS - 1)] = e;
+}
+
+static void request_start_ticking(struct request_table* rt)
+{
+    if (rt->ticking){
+        return; }
+    struct timeval tick = {0, REQ_TICK_MS * 1000};
+    rt->now_tick = request_current_tick(rt); // wheel is empty so can jump ahead
+    event_add(rt->tick_evt, &tick);
+    rt->ticking = 1;
+}
+
+// move the entries of a higher level slot down now their time is near
+static void request_cascade(struct request_table* rt, int level, int slot)
+{
+    struct request_entry* e = rt->wheel[level][slot];
+    rt->wheel[level][slot] = NULL;
+    while (e){
+        struct request_entry* next = e->next;
+        request_wheel_insert(rt, e);
+        e = next;
+    }
+}
+
+//
+// table
+//
+
+struct request_table* request_table_create(struct event_base* base)
+{
+    struct request_table* rt = malloc(sizeof(struct request_table));
+    if (!rt){
+        log_err("failed to malloc request table");
+        return NULL; }
+
+    memset(rt, 0, sizeof(struct request_table));
+    if (pthread_mutex_init(&(rt->lock), NULL) != 0){
+        log_err("failed to init request table lock");
+        free(rt);
+        return NULL;
+    }
+    rt->tick_evt = event_new(base, -1, EV_PERSIST, request_tick_cb, rt);
+    if (!rt->tick_evt){
+        log_err("failed to create request tick event");
+        pthread_mutex_destroy(&(rt->lock));
+        free(rt);
+        return NULL;
+    }
+    rt->entries = pool_create("requests", sizeof(struct request_entry));
+    if (!rt->entries){
+        event_free(rt->tick_evt);
+        pthread_mutex_destroy(&(rt->lock));
+        free(rt);
+        return NULL;
+    }
+    rt->start_us = request_now_us();
+    rt->next_id  = (uint32_t) rt->start_us;
+    return rt;
+}
+
+void request_table_destroy(struct request_table* rt)
+{
+    if (!rt) { return; }
+
+    for (;;){
+        struct request_entry* e = NULL;
+        pthread_mutex_lock(&(rt->lock));
+        for (int b = 0; b < REQ_BUCKETS && !e; ++b){
+            if (rt->by_id[b]){
+                e = request_hash_unlink(rt, rt->by_id[b]->id); }
+        }
+        if (e){
+            request_wheel_remove(rt, e);
+            rt->count--;
+        }
+        pthread_mutex_unlock(&(rt->lock));
+
+        if (!e){
+            break; }
+        e->done(e->id, REQ_ERROR, NULL, e->arg);
+        pool_put(rt->entries, e);
+    }
+
+    event_free(rt->tick_evt);
+    pool_destroy(rt->entries);
+    pthread_mutex_destroy(&(rt->lock));
+    free(rt);
+}
+
+uint32_t request_start(struct request_table* rt, const struct timeval* timeout,
+        request_done_cb_t done, request_retry_cb_t retry, void* arg)
+{
+    struct request_entry* e = pool_get(rt->entries);
+    if (!e){
+        return 0; }
+
+    e->done  = done;
+    e->retry = retry;
+    e->arg   = arg;
+    e->hnext = NULL;
+
+    pthread_mutex_lock(&(rt->lock));
+    request_start_ticking(rt);
+    do {
+        e->id = rt->next_id++;
+    } while (e->id == 0);
+    e->expires = request_current_tick(rt) + request_tv_ticks(timeout);
+    request_wheel_insert(rt, e);
+    request_hash_insert(rt, e);
+    rt->count++;
+    pthread_mutex_unlock(&(rt->lock));
+
+    return e->id;
+}
+
+int request_complete(struct request_table* rt, uint32_t req_id, short status, void* result)
+{
+    pthread_mutex_lock(&(rt->lock));
+    struct request_entry* e = request_hash_unlink(rt, req_id);
+    if (e){
+        request_wheel_remove(rt, e);
+        rt->count--;
+    }
+    pthread_mutex_unlock(&(rt->lock));
+
+    if (!e){
+        return -1; }
+    e->done(e->id, status, result, e->arg);
+    pool_put(rt->entries, e);
+    return 0;
+}
+
+void* request_get_arg(struct request_table* rt, uint32_t req_id, request_done_cb_t done)
+{
+    void* arg = NULL;
+    pthread_mutex_lock(&(rt->lock));
+    struct request_entry* e = rt->by_id[req_id & (REQ_BUCKETS - 1)];
+    for (; e; e = e->hnext){
+        if (e->id == req_id){
+            arg = (e->done == done) ? e->arg : NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&(rt->lock));
+    return arg;
+}
+
+void request_get_pool_stats(struct request_table* rt, struct pool_stats* stats)
+{
+    pool_get_stats(rt->entries, stats);
+}
+
+void request_set_pool_owner(struct request_table* rt)
+{
+    pool_set_owner(rt->entries);
+}
+
+int request_count(struct request_table* rt)
+{
+    pthread_mutex_lock(&(rt->lock));
+    int count = rt->count;
+    pthread_mutex_unlock(&(rt->lock));
+    return count;
+}
+
+void request_tick_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct request_table* rt = (struct request_table*) arg;
+    struct request_entry* expired = NULL;
+
+    pthread_mutex_lock(&(rt->lock));
+    uint64_t target = request_current_tick(rt);
+    while (rt->now_tick < target){
+        rt->now_tick++;
+        int slot = rt->now_tick & REQ_WHEEL_MASK;
+        if (slot == 0){
+            // cascade from the top so entries can fall more than one level
+            for (int level = REQ_WHEEL_LEVELS - 1; level > 0; --level){
+                int upper = (rt->now_tick >> (REQ_WHEEL_BITS * level)) & REQ_WHEEL_MASK;
+                uint64_t below = rt->now_tick & (((uint64_t)1 << (REQ_WHEEL_BITS * level)) - 1);
+                if (below == 0){
+                    request_cascade(rt, level, upper); }
+            }
+        }
+
+        struct request_entry* e = rt->wheel[0][slot];
+        rt->wheel[0][slot] = NULL;
+        while (e){
+            struct request_entry* next = e->next;
+            if (e->expires > rt->now_tick){
+                request_wheel_insert(rt, e); // not yet, e.g. clamped timeout
+            }else{
+                request_hash_unlink(rt, e->id);
+                rt->count--;
+                e->prev = NULL;
+                e->next = expired;
+                expired = e;
+            }
+            e = next;
+        }
+    }
+    pthread_mutex_unlock(&(rt->lock));
+
+    while (expired){
+        struct request_entry* e = expired;
+        expired = e->next;
+        e->next = NULL;
+
+        struct timeval next;
+        if (e->retry && e->retry(e->id, e->arg, &next)){
+            pthread_mutex_lock(&(rt->lock));
+            e->expires = request_current_tick(rt) + request_tv_ticks(&next);
+            request_wheel_insert(rt, e);
+            request_hash_insert(rt, e);
+            rt->count++;
+            pthread_mutex_unlock(&(rt->lock));
+            continue;
+        }
+        e->done(e->id, REQ_TIMEOUT, NULL, e->arg);
+        pool_put(rt->entries, e);
+    }
+
+    pthread_mutex_lock(&(rt->lock));
+    if (rt->count == 0 && rt->ticking){
+        event_del(rt->tick_evt);
+        rt->ticking = 0;
+    }
+    pthread_mutex_unlock(&(rt->lock));
+}
@@ -0,0 +1,83 @@
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <event2/event.h>
+
+#include "pool.h"
+
+/**
+ * table of outstanding requests. every request started here completes exactly
+ * once, with REQ_OK, REQ_ERROR or REQ_TIMEOUT, and its done callback is where
+ * the caller's state gets reclaimed. timeouts are kept in a hierarchical timer
+ * wheel driven by one timer event on the node's event_base
+ */
+
+#define REQ_OK 0
+#define REQ_ERROR 1
+#define REQ_TIMEOUT 2
+
+#define REQ_TICK_MS 10
+#define REQ_WHEEL_BITS 8
+#define REQ_WHEEL_SLOTS (1 << REQ_WHEEL_BITS)
+#define REQ_WHEEL_LEVELS 3
+// must be a power of 2
+#define REQ_BUCKETS 256
+
+struct request_table;
+
+/**
+ * called once when the request completes, result is whatever was passed to request_complete
+ */
+typedef void (*request_done_cb_t)(uint32_t req_id, short status, void *result, void *arg);
+
+/**
+ * called when the request's time runs out, return 1 and fill next to keep it
+ * going for another next (e.g. after a retransmit), or 0 to time it out
+ */
+typedef int (*request_retry_cb_t)(uint32_t req_id, void *arg, struct timeval *next);
+
+struct request_table* request_table_create(struct event_base* base);
+
+/**
+ * any requests still outstanding complete with REQ_ERROR
+ */
+void request_table_destroy(struct request_table* rt);
+
+/**
+ * start a request that times out after timeout, retry may be NULL
+ * returns the request id, never 0 unless it failed to start
+ */
+uint32_t request_start(struct request_table* rt, const struct timeval* timeout,
+        request_done_cb_t done, request_retry_cb_t retry, void* arg);
+
+/**
+ * complete a request, returns 0 if this call completed it or -1 if it had
+ * already completed (or never existed)
+ */
+int request_complete(struct request_table* rt, uint32_t req_id, short status, void* result);
+
+/**
+ * arg the request was started with, or NULL if it is not outstanding or wasn't
+ * started with done. done says whose it is, several kinds of request share a
+ * table and ids are sequential, so an id alone could be another's. only safe
+ * on the thread that completes requests (the event loop)
+ */
+void* request_get_arg(struct request_table* rt, uint32_t req_id, request_done_cb_t done);
+
+/**
+ * number of requests outstanding
+ */
+int request_count(struct request_table* rt);
+
+void request_get_pool_stats(struct request_table* rt, struct pool_stats* stats);
+
+/**
+ * the calling thread starts and completes most requests from now on, see pool_set_owner
+ */
+void request_set_pool_owner(struct request_table* rt);
+
+#endif // REQUEST_H
@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "route_cache.h"
+#include "peer.h"
+
+#define LOG_SUBSYS LOG_SYS_ROUTING
+#include "logging.h"
+
+static const uint32_t route_cache_seeds[ROUTE_CACHE_SKETCH_ROWS] = {
+    0x9E3779B1, 0x85EBCA77, 0xC2B2AE3D, 0x27D4EB2F
+};
+
+static unsigned int route_cache_hash(hash_type key, uint32_t seed)
+{
+    uint32_t h = (key ^ seed) * 0x9E3779B1;
+    h ^= h >> 15;
+    h *= 0x85EBCA77;
+    return h ^ (h >> 13);
+}
+
+struct route_cache* route_cache_create(int n_entries, uint64_t ttl_us, unsigned int admit)
+{
+    int n = ROUTE_CACHE_WAYS;
+    while (n < n_entries){
+        n <<= 1; }
+
+    struct route_cache* rc = malloc(sizeof(struct route_cache));
+    if (!rc){
+        log_err("failed to malloc route cache");
+        return NULL; }
+    memset(rc, 0, sizeof(struct route_cache));
+    rc->entries = calloc(n, sizeof(struct route_cache_entry));
+    if (!rc->entries){
+        log_err("failed to malloc route cache entries");
+        free(rc);
+        return NULL;
+    }
+    if (pthread_mutex_init(&(rc->lock), NULL) != 0){
+        log_err("failed to init route cache lock");
+        free(rc->entries);
+        free(rc);
+        return NULL;
+    }
+    rc->n_entries = n;
+    rc->ttl_us = ttl_us;
+    rc->admit = admit;
+    return rc;
+}
+
+void route_cache_destroy(struct route_cache* rc)
+{
+    if (!rc) { return; }
+    pthread_mutex_destroy(&(rc->lock));
+    free(rc->entries);
+    free(rc);
+}
+
+// must use lock with this!!!
+static struct route_cache_entry* route_cache_set(struct route_cache* rc, hash_type key)
+{
+    unsigned int set = route_cache_hash(key, 0) & (rc->n_entries - 1) & ~(ROUTE_CACHE_WAYS - 1);
+    return &(rc->entries[set]);
+}
+
+unsigned int route_cache_seen(struct route_cache* rc, hash_type key)
+{
+    unsigned int est = UINT16_MAX;
+
+    pthread_mutex_lock(&(rc->lock));
+    for (int r = 0; r < ROUTE_CACHE_SKETCH_ROWS; ++r){
+        uint16_t* c = &(rc->sketch[r][route_cache_hash(key, route_cache_seeds[r]) & (ROUTE_CACHE_SKETCH_WIDTH - 1)]);
+        if (*c < UINT16_MAX){
+            ++(*c); }
+        if (*c < est){
+            est = *c; }
+    }
+    if (++rc->counted >= ROUTE_CACHE_SKETCH_AGE){
+        for (int r = 0; r < ROUTE_CACHE_SKETCH_ROWS; ++r){
+            for (int i = 0; i < ROUTE_CACHE_SKETCH_WIDTH; ++i){
+                rc->sketch[r][i] >>= 1; }
+        }
+        rc->counted = 0;
+    }
+    pthread_mutex_unlock(&(rc->lock));
+    return est;
+}
+
+// must use lock with this!!!
+static unsigned int route_cache_popularity(struct route_cache* rc, hash_type key)
+{
+    unsigned int est = UINT16_MAX;
+    for (int r = 0; r < ROUTE_CACHE_SKETCH_ROWS; ++r){
+        uint16_t c = rc->sketch[r][route_cache_hash(key, route_cache_seeds[r]) & (ROUTE_CACHE_SKETCH_WIDTH - 1)];
+        if (c < est){
+            est = c; }
+    }
+    return est;
+}
+
+int route_cache_get(struct route_cache* rc, hash_type key, struct node_info* owner)
+{
+    int rc_hit = -1;
+    uint64_t now = peer_now_us();
+
+    pthread_mutex_lock(&(rc->lock));
+    struct route_cache_entry* set = route_cache_set(rc, key);
+    for (int w = 0; w < ROUTE_CACHE_WAYS; ++w){
+        if (set[w].owner.IP != 0 && set[w].key == key){
+            if (set[w].expires > now){
+                *owner = set[w].owner;
+                rc_hit = 0;
+            }else{
+                memset(&(set[w]), 0, sizeof(struct route_cache_entry)); }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&(rc->lock));
+    return rc_hit;
+}
+
+void route_cache_offer(struct route_cache* rc, hash_type key, struct node_info owner)
+{
+    if (owner.IP == 0){
+        return; }
+    uint64_t now = peer_now_us();
+
+    pthread_mutex_lock(&(rc->lock));
+    if (route_cache_popularity(rc, key) >= rc->admit){
+        struct route_cache_entry* set = route_cache_set(rc, key);
+        struct route_cache_entry* slot = &(set[0]);
+        for (int w = 0; w < ROUTE_CACHE_WAYS; ++w){
+            if (set[w].owner.IP != 0 && set[w].key == key){
+                slot = &(set[w]);
+                break;
+            }
+            if (set[w].expires < slot->expires){ // empty slots expire at 0
+                slot = &(set[w]); }
+        }
+        slot->key = key;
+        slot->owner = owner;
+        slot->expires = now + rc->ttl_us;
+    }
+    pthread_mutex_unlock(&(rc->lock));
+}
+
+void route_cache_forget(struct route_cache* rc, struct node_info node)
+{
+    pthread_mutex_lock(&(rc->lock));
+    for (int i = 0; i < rc->n_entries; ++i){
+        if (rc->entries[i].owner.IP == node.IP && rc->entries[i].owner.port == node.port){
+            memset(&(rc->entries[i]), 0, sizeof(struct route_cache_entry)); }
+    }
+    pthread_mutex_unlock(&(rc->lock));
+}
@@ -0,0 +1,68 @@
+#ifndef ROUTE_CACHE_H
+#define ROUTE_CACHE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "libdht.h"
+
+/**
+ * short lived cache of resolved lookups, key id -> owner, so nodes on the
+ * path of a hot key answer it without going further. only keys looked up
+ * often enough get in, counted in a count-min sketch that halves itself
+ * every so often so old popularity fades
+ */
+
+// slots checked for a key, the oldest of them is replaced
+#define ROUTE_CACHE_WAYS 4
+#define ROUTE_CACHE_SKETCH_ROWS 4
+// must be a power of 2
+#define ROUTE_CACHE_SKETCH_WIDTH 1024
+// counts between halvings of the sketch
+#define ROUTE_CACHE_SKETCH_AGE (ROUTE_CACHE_SKETCH_WIDTH * 8)
+
+struct route_cache_entry{
+    hash_type key;
+    struct node_info owner; // IP 0 if the slot is empty
+    uint64_t expires; // usecs, monotonic
+};
+
+struct route_cache{
+    struct route_cache_entry* entries;
+    int n_entries; // a power of 2, multiple of ROUTE_CACHE_WAYS
+    uint64_t ttl_us;
+    unsigned int admit; // lookups of a key seen before it is cached
+    uint16_t sketch[ROUTE_CACHE_SKETCH_ROWS][ROUTE_CACHE_SKETCH_WIDTH];
+    unsigned int counted; // since the last halving
+    pthread_mutex_t lock;
+};
+
+/**
+ * n_entries is rounded up to a power of 2, admit is how many lookups of a key
+ * it takes to be cached. NULL on failure
+ */
+struct route_cache* route_cache_create(int n_entries, uint64_t ttl_us, unsigned int admit);
+
+void route_cache_destroy(struct route_cache* rc);
+
+/**
+ * count a lookup of key, returns its estimated popularity
+ */
+unsigned int route_cache_seen(struct route_cache* rc, hash_type key);
+
+/**
+ * the owner of key if it is cached and still fresh, returns 0 on a hit
+ */
+int route_cache_get(struct route_cache* rc, hash_type key, struct node_info* owner);
+
+/**
+ * cache that owner has key, if key is popular enough
+ */
+void route_cache_offer(struct route_cache* rc, hash_type key, struct node_info owner);
+
+/**
+ * drop everything pointing at node (by address), e.g. when it fails or leaves
+ */
+void route_cache_forget(struct route_cache* rc, struct node_info node);
+
+#endif // ROUTE_CACHE_H
@@ -0,0 +1,225 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rpc.h"
+#include "proto.h"
+#include "pool.h"
+
+#define LOG_SUBSYS LOG_SYS_NET
+#include "logging.h"
+
+struct rpc_pending{
+    struct rpc* rpc;
+    uint32_t IP;
+    uint16_t port;
+    char dgram[NET_MAX_DGRAM]; // kept for retransmits
+    size_t len;
+    int tries_left;
+    struct timeval try_tm;
+    uint64_t sent_us;
+    short retransmitted;
+    rpc_reply_cb_t cb;
+    void* cb_arg;
+};
+
+// what a reply completes its request with
+struct rpc_result{
+    const char* data;
+    size_t len;
+};
+
+struct rpc{
+    struct net_server* net;
+    struct request_table* requests;
+    struct pool* pending;
+    uint16_t listen_port;
+    rpc_request_cb_t request_cb;
+    void* request_cb_arg;
+    net_connect_observer_t observer;
+    void* observer_arg;
+};
+
+static uint64_t rpc_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static size_t rpc_build(char* dgram, char type, uint32_t req_id, uint16_t port, const void* payload, size_t len)
+{
+    dgram[0] = type;
+    memcpy(dgram + 1, &req_id, 4);
+    memcpy(dgram + 5, &port, 2);
+    if (len){
+        memcpy(dgram + RPC_HEADER_BYTES, payload, len); }
+    return RPC_HEADER_BYTES + len;
+}
+
+// request done, called exactly once per call
+void rpc_req_done(uint32_t req_id, short status, void *result, void *arg)
+{
+    struct rpc_pending* p = (struct rpc_pending*) arg;
+    struct rpc* rpc = p->rpc;
+    struct rpc_result* res = (struct rpc_result*) result;
+
+    if (rpc->observer){
+        uint64_t rtt = 0;
+        if (status == RPC_OK && !p->retransmitted){
+            rtt = rpc_now_us() - p->sent_us;
+            if (rtt == 0) { rtt = 1; }
+        }
+        rpc->observer(p->IP, p->port, rtt, status == RPC_OK, rpc->observer_arg);
+    }
+    if (status == RPC_OK && res){
+        p->cb(status, res->data, res->len, p->cb_arg);
+    }else{
+        p->cb(status, NULL, 0, p->cb_arg);
+    }
+    pool_put(rpc->pending, p);
+}
+
+// the wait ran out, retransmit while there are tries left
+int rpc_req_retry(uint32_t req_id, void *arg, struct timeval *next)
+{
+    struct rpc_pending* p = (struct rpc_pending*) arg;
+
+    if (p->tries_left <= 0){
+        return 0; }
+    p->tries_left--;
+    p->retransmitted = 1;
+    memcpy(p->dgram + 1, &req_id, 4); // see rpc_call
+    // back off
+    p->try_tm.tv_sec  *= 2;
+    p->try_tm.tv_usec *= 2;
+    if (p->try_tm.tv_usec >= 1000000){
+        p->try_tm.tv_sec  += p->try_tm.tv_usec / 1000000;
+        p->try_tm.tv_usec %= 1000000;
+    }
+    net_dgram_send(p->rpc->net, p->IP, p->port, p->dgram, p->len);
+    *next = p->try_tm;
+    return 1;
+}
+
+void rpc_dgram_cb(uint32_t IP, uint16_t port, const char *data, size_t len, void *arg)
+{
+    struct rpc* rpc = (struct rpc*) arg;
+    if (len < RPC_HEADER_BYTES){
+        log_warn("short datagram from %08X:%d", IP, port);
+        return;
+    }
+
+    struct rpc_req req;
+    req.IP       = IP;
+    req.src_port = port;
+    req.type     = data[0];
+    memcpy(&(req.req_id), data + 1, 4);
+    memcpy(&(req.listen_port), data + 5, 2);
+
+    if (!MSG_T_IS_REPLY(req.type)){
+        if (rpc->request_cb){
+            rpc->request_cb(rpc, &req, data + RPC_HEADER_BYTES, len - RPC_HEADER_BYTES, rpc->request_cb_arg); }
+        return;
+    }
+
+    struct rpc_pending* p = (struct rpc_pending*) request_get_arg(rpc->requests, req.req_id, rpc_req_done);
+    if (!p || p->IP != IP || p->port != port){
+        return; } // duplicate or late reply, not a call's id, or not from who we asked
+
+    struct rpc_result res = { data + RPC_HEADER_BYTES, len - RPC_HEADER_BYTES };
+    request_complete(rpc->requests, req.req_id, RPC_OK, &res);
+}
+
+struct rpc* rpc_create(struct net_server* net, struct request_table* requests, uint16_t listen_port,
+        rpc_request_cb_t request_cb, void* arg)
+{
+    struct rpc* rpc = malloc(sizeof(struct rpc));
+    if (!rpc){
+        log_err("failed to malloc rpc");
+        return NULL; }
+
+    memset(rpc, 0, sizeof(struct rpc));
+    rpc->pending = pool_create("rpc calls", sizeof(struct rpc_pending));
+    if (!rpc->pending){
+        free(rpc);
+        return NULL; }
+    rpc->net            = net;
+    rpc->requests       = requests;
+    rpc->listen_port    = listen_port;
+    rpc->request_cb     = request_cb;
+    rpc->request_cb_arg = arg;
+
+    net_server_set_dgram_cb(net, rpc_dgram_cb, rpc);
+    return rpc;
+}
+
+void rpc_destroy(struct rpc* rpc)
+{
+    if (!rpc) { return; }
+    net_server_set_dgram_cb(rpc->net, NULL, NULL);
+    pool_destroy(rpc->pending);
+    free(rpc);
+}
+
+void rpc_set_observer(struct rpc* rpc, net_connect_observer_t cb, void* arg)
+{
+    rpc->observer = cb;
+    rpc->observer_arg = arg;
+}
+
+int rpc_call(struct rpc* rpc, uint32_t IP, uint16_t port, char type,
+        const void* payload, size_t len, const struct timeval* try_tm, int tries,
+        rpc_reply_cb_t cb, void* arg)
+{
+    if (len > RPC_MAX_PAYLOAD || IP == 0){
+        return -1; }
+
+    struct rpc_pending* p = pool_get(rpc->pending);
+    if (!p){
+        return -1; }
+
+    p->rpc        = rpc;
+    p->IP         = IP;
+    p->port       = port;
+    p->tries_left = tries - 1;
+    p->try_tm     = *try_tm;
+    p->cb         = cb;
+    p->cb_arg     = arg;
+    p->retransmitted = 0;
+    p->sent_us = rpc_now_us();
+    // built before the request starts, once it has the loop thread may retransmit or even
+    // time it out before this returns, so p isn't touched after. retransmits put the id in
+    char dgram[NET_MAX_DGRAM];
+    size_t dlen = rpc_build(dgram, type, 0, rpc->listen_port, payload, len);
+    memcpy(p->dgram, dgram, dlen);
+    p->len = dlen;
+
+    uint32_t req_id = request_start(rpc->requests, try_tm, rpc_req_done, rpc_req_retry, p);
+    if (!req_id){
+        pool_put(rpc->pending, p);
+        return -1;
+    }
+    memcpy(dgram + 1, &req_id, 4);
+    net_dgram_send(rpc->net, IP, port, dgram, dlen);
+    return 0;
+}
+
+void rpc_get_pool_stats(struct rpc* rpc, struct pool_stats* stats)
+{
+    pool_get_stats(rpc->pending, stats);
+}
+
+void rpc_set_pool_owner(struct rpc* rpc)
+{
+    pool_set_owner(rpc->pending);
+}
+
+int rpc_reply(struct rpc* rpc, const struct rpc_req* req, char type, const void* payload, size_t len)
+{
+    char dgram[NET_MAX_DGRAM];
+    if (len > RPC_MAX_PAYLOAD){
+        return -1; }
+    size_t dlen = rpc_build(dgram, type, req->req_id, rpc->listen_port, payload, len);
+    return net_dgram_send(rpc->net, req->IP, req->src_port, dgram, dlen);
+}
@@ -0,0 +1,82 @@
+#ifndef RPC_H
+#define RPC_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <event2/event.h>
+
+#include "libdhtnet.h"
+#include "request.h"
+#include "pool.h"
+
+/**
+ * small request/reply messages over the server's UDP socket, with request
+ * ids, retransmits and timeouts. used for control messages where a TCP
+ * handshake would cost more than the message itself
+ */
+
+/*
+ * datagram             what                    size
+T                       message type            1
+XXXX                    request id              4
+PO                      sender's listen port    2
+ASJDGKADBJOTJGEJB...    [payload]
+*/
+#define RPC_HEADER_BYTES 7
+#define RPC_MAX_PAYLOAD (NET_MAX_DGRAM - RPC_HEADER_BYTES)
+
+#define RPC_OK REQ_OK
+#define RPC_ERROR REQ_ERROR
+#define RPC_TIMEOUT REQ_TIMEOUT
+
+struct rpc;
+
+struct rpc_req{
+    uint32_t IP;
+    uint16_t src_port;
+    uint16_t listen_port;
+    char type;
+    uint32_t req_id;
+};
+
+typedef void (*rpc_reply_cb_t)(short status, const char *data, size_t len, void *arg);
+typedef void (*rpc_request_cb_t)(struct rpc *rpc, const struct rpc_req *req, const char *data, size_t len, void *arg);
+
+/**
+ * calls are tracked in requests, which must outlive the rpc
+ */
+struct rpc* rpc_create(struct net_server* net, struct request_table* requests, uint16_t listen_port,
+        rpc_request_cb_t request_cb, void* arg);
+
+void rpc_destroy(struct rpc* rpc);
+
+/**
+ * observer told about every call's outcome, with the reply time if it was
+ * answered first try (0 otherwise, retransmitted replies are ambiguous)
+ */
+void rpc_set_observer(struct rpc* rpc, net_connect_observer_t cb, void* arg);
+
+/**
+ * send a request, retransmitting up to tries times with the wait doubling each time.
+ * cb is called exactly once with the reply, RPC_TIMEOUT, or RPC_ERROR if the
+ * request table is destroyed first
+ * returns 0 on success
+ */
+int rpc_call(struct rpc* rpc, uint32_t IP, uint16_t port, char type,
+        const void* payload, size_t len, const struct timeval* try_tm, int tries,
+        rpc_reply_cb_t cb, void* arg);
+
+/**
+ * reply to a received request
+ */
+int rpc_reply(struct rpc* rpc, const struct rpc_req* req, char type, const void* payload, size_t len);
+
+void rpc_get_pool_stats(struct rpc* rpc, struct pool_stats* stats);
+
+/**
+ * the calling thread makes most calls from now on, see pool_set_owner
+ */
+void rpc_set_pool_owner(struct rpc* rpc);
+
+#endif // RPC_H
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+#include "logging.h"
+
+static uint32_t snapshot_checksum(const char* buf, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i){
+        h ^= (unsigned char) buf[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static size_t snapshot_put(char* buf, size_t at, const void* data, size_t len)
+{
+    memcpy(buf + at, data, len);
+    return at + len;
+}
+
+static size_t snapshot_put_node(char* buf, size_t at, const struct node_info* n)
+{
+    at = snapshot_put(buf, at, &(n->id), ID_BYTES);
+    at = snapshot_put(buf, at, &(n->IP), 4);
+    return snapshot_put(buf, at, &(n->port), 2);
+}
+
+// reads return -1 once they would run past the end
+static int snapshot_get(const char* buf, size_t len, size_t* at, void* data, size_t n)
+{
+    if (*at + n > len){
+        return -1; }
+    memcpy(data, buf + *at, n);
+    *at += n;
+    return 0;
+}
+
+static int snapshot_get_node(const char* buf, size_t len, size_t* at, struct node_info* n)
+{
+    memset(n, 0, sizeof(struct node_info));
+    if (snapshot_get(buf, len, at, &(n->id), ID_BYTES) < 0 ||
+            snapshot_get(buf, len, at, &(n->IP), 4) < 0 ||
+            snapshot_get(buf, len, at, &(n->port), 2) < 0){
+        return -1; }
+    return 0;
+}
+
+int snapshot_save(const char* path, const struct node_snapshot* snap)
+{
+    char* buf = malloc(SNAPSHOT_MAX_BYTES);
+    if (!buf){
+        log_err("failed to malloc snapshot buffer");
+        return -1; }
+
+    uint16_t version = SNAPSHOT_VERSION;
+    uint16_t n_peers = snap->n_peers;
+    char has_pred = snap->has_pred ? 'Y' : 'N';
+    size_t at = 0;
+
+    at = snapshot_put(buf, at, SNAPSHOT_MAGIC, 4);
+    at = snapshot_put(buf, at, &version, 2);
+    at = snapshot_put_node(buf, at, &(snap->self));
+    for (int i = 0; i < NUM_OF_SUCCS; ++i){
+        at = snapshot_put_node(buf, at, &(snap->successor[i])); }
+    at = snapshot_put(buf, at, &has_pred, 1);
+    at = snapshot_put_node(buf, at, &(snap->predecessor));
+    unsigned char n_fingers = snap->n_fingers;
+    at = snapshot_put(buf, at, &n_fingers, 1);
+    for (int i = 0; i < n_fingers; ++i){
+        at = snapshot_put_node(buf, at, &(snap->fingers[i])); }
+    at = snapshot_put(buf, at, &n_peers, 2);
+    for (int i = 0; i < n_peers; ++i){
+        const struct node_peer* p = &(snap->peers[i]);
+        at = snapshot_put(buf, at, &(p->IP), 4);
+        at = snapshot_put(buf, at, &(p->port), 2);
+        at = snapshot_put(buf, at, &(p->srtt_us), 4);
+        at = snapshot_put(buf, at, &(p->rttvar_us), 4);
+    }
+    uint32_t sum = snapshot_checksum(buf, at);
+    at = snapshot_put(buf, at, &sum, 4);
+
+    // write beside it then rename so a crash never leaves half a snapshot
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE* f = fopen(tmp_path, "wb");
+    if (!f){
+        log_err("failed to open %s", tmp_path);
+        free(buf);
+        return -1;
+    }
+    int rc = (fwrite(buf, 1, at, f) == at) ? 0 : -1;
+    if (fclose(f) != 0){
+        rc = -1; }
+    free(buf);
+    if (rc == 0 && rename(tmp_path, path) != 0){
+        rc = -1; }
+    if (rc < 0){
+        log_err("failed to write snapshot %s", path);
+        remove(tmp_path);
+    }
+    return rc;
+}
+
+int snapshot_load(const char* path, struct node_snapshot* snap)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f){
+        return -1; }
+    char* buf = malloc(SNAPSHOT_MAX_BYTES);
+    if (!buf){
+        log_err("failed to malloc snapshot buffer");
+        fclose(f);
+        return -1;
+    }
+    size_t len = fread(buf, 1, SNAPSHOT_MAX_BYTES, f);
+    fclose(f);
+
+    uint32_t sum;
+    uint16_t version, n_peers;
+    unsigned char n_fingers;
+    char has_pred;
+    size_t at = 0;
+    int rc = -1;
+
+    memset(snap, 0, sizeof(struct node_snapshot));
+    if (len < 4 + 2 + 4 || memcmp(buf, SNAPSHOT_MAGIC, 4) != 0){
+        goto out; }
+    memcpy(&sum, buf + len - 4, 4);
+    if (sum != snapshot_checksum(buf, len - 4)){
+        log_warn("snapshot %s is corrupt", path);
+        goto out;
+    }
+    len -= 4;
+    at = 4;
+    if (snapshot_get(buf, len, &at, &version, 2) < 0 || version != SNAPSHOT_VERSION){
+        log_warn("snapshot %s is from another version", path);
+        goto out;
+    }
+    if (snapshot_get_node(buf, len, &at, &(snap->self)) < 0){
+        goto out; }
+    for (int i = 0; i < NUM_OF_SUCCS; ++i){
+        if (snapshot_get_node(buf, len, &at, &(snap->successor[i])) < 0){
+            goto out; }
+    }
+    if (snapshot_get(buf, len, &at, &has_pred, 1) < 0 ||
+            snapshot_get_node(buf, len, &at, &(snap->predecessor)) < 0){
+        goto out; }
+    snap->has_pred = (has_pred == 'Y');
+    if (snapshot_get(buf, len, &at, &n_fingers, 1) < 0 || n_fingers > NODE_MAX_FINGERS){
+        goto out; }
+    snap->n_fingers = n_fingers;
+    for (int i = 0; i < n_fingers; ++i){
+        if (snapshot_get_node(buf, len, &at, &(snap->fingers[i])) < 0){
+            goto out; }
+    }
+    if (snapshot_get(buf, len, &at, &n_peers, 2) < 0 || n_peers > SNAPSHOT_MAX_PEERS){
+        goto out; }
+    for (int i = 0; i < n_peers; ++i){
+        struct node_peer* p = &(snap->peers[i]);
+        if (snapshot_get(buf, len, &at, &(p->IP), 4) < 0 ||
+                snapshot_get(buf, len, &at, &(p->port), 2) < 0 ||
+                snapshot_get(buf, len, &at, &(p->srtt_us), 4) < 0 ||
+                snapshot_get(buf, len, &at, &(p->rttvar_us), 4) < 0){
+            goto out; }
+    }
+    snap->n_peers = n_peers;
+    rc = 0;
+
+out:
+    free(buf);
+    return rc;
+}
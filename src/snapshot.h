@@ -0,0 +1,57 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "node.h"
+#include "peer.h"
+
+/**
+ * a node's routing state written to disk so a restarted node can route well
+ * straight away instead of rebuilding it through stabilize and fix_fingers
+ */
+
+/*
+ * file                 what                    size
+DHTS                    magic                   4
+VV                      version                 2
+IDXXIPXXPO              self                    10
+[IDXXIPXXPO x NUM_OF_SUCCS] successor list      80
+Y/N                     predecessor known       1
+IDXXIPXXPO              predecessor             10
+F                       fingers                 1
+[IDXXIPXXPO x F]        finger table            10 each
+CC                      peers                   2
+[IPXXPOSSSSVVVV x CC]   peer, srtt, rttvar      14 each
+SSSS                    FNV-1a of all before    4
+*/
+#define SNAPSHOT_MAGIC "DHTS"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_PEER_BYTES 14
+#define SNAPSHOT_MAX_PEERS PEER_TABLE_SIZE
+#define SNAPSHOT_MAX_BYTES (4 + 2 + NODE_INFO_BYTES * (2 + NUM_OF_SUCCS + NODE_MAX_FINGERS) + 1 + 1 + 2 + \
+        SNAPSHOT_PEER_BYTES * SNAPSHOT_MAX_PEERS + 4)
+
+struct node_snapshot{
+    struct node_info self;
+    struct node_info successor[NUM_OF_SUCCS];
+    struct node_info predecessor;
+    short has_pred;
+    int n_fingers;
+    struct node_info fingers[NODE_MAX_FINGERS];
+    int n_peers;
+    struct node_peer peers[SNAPSHOT_MAX_PEERS]; // only IP, port, srtt and rttvar are kept
+};
+
+/**
+ * write snap to path, replacing it atomically. returns 0 on success
+ */
+int snapshot_save(const char* path, const struct node_snapshot* snap);
+
+/**
+ * read path into snap, returns 0 on success or -1 if it is missing, corrupt
+ * or from another version
+ */
+int snapshot_load(const char* path, struct node_snapshot* snap);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,916 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "store.h"
+#include "logging.h"
+
+#define STORE_CKPT_FILE "index.ckpt"
+#define STORE_MIN_SLOTS 1024
+// records compaction copies per turn of the lock
+#define STORE_COMPACT_BATCH 256
+#define STORE_SUM_INIT 2166136261u
+
+_Static_assert(sizeof(struct store_slot) == 32, "store_slot is written to checkpoints as is");
+
+// FNV-1a 8 bytes at a time then the odd bytes, folded to 32 bits. chained over a record's parts
+static uint32_t store_checksum(uint32_t sum, const void* data, size_t len)
+{
+    const unsigned char* p = (const unsigned char*) data;
+    uint64_t h = sum;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8){
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 1099511628211ull;
+        h ^= h >> 32;
+    }
+    for (; i < len; ++i){
+        h = (h ^ p[i]) * 1099511628211ull; }
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static uint64_t store_key_hash(const void* key, size_t len)
+{
+    const unsigned char* p = (const unsigned char*) key;
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; ++i){
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static uint32_t store_rec_len(size_t key_len, size_t val_len)
+{
+    return (uint32_t)((STORE_REC_BYTES + key_len + val_len + 7) & ~(size_t) 7);
+}
+
+static uint64_t store_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+struct store_rec_view{
+    uint32_t sum;
+    uint16_t key_len;
+    uint16_t flags;
+    uint32_t val_len;
+    uint64_t version;
+    const char* key;
+    const char* val;
+};
+
+static void store_rec_parse(const char* p, struct store_rec_view* r)
+{
+    memcpy(&(r->sum), p, 4);
+    memcpy(&(r->key_len), p + 4, 2);
+    memcpy(&(r->flags), p + 6, 2);
+    memcpy(&(r->val_len), p + 8, 4);
+    memcpy(&(r->version), p + 16, 8);
+    r->key = p + STORE_REC_BYTES;
+    r->val = r->key + r->key_len;
+}
+
+//
+// segments
+//
+
+static void store_segment_path(const struct store* st, uint32_t id, char* path, size_t len)
+{
+    snprintf(path, len, "%s/seg-%08u.log", st->dir, id);
+}
+
+// must use lock with this!!!
+static struct store_segment* store_segment_find(struct store* st, uint32_t id)
+{
+    int lo = 0, hi = st->n_segs - 1;
+    while (lo <= hi){
+        int mid = (lo + hi) / 2;
+        if (st->segs[mid].id == id){
+            return &(st->segs[mid]); }
+        if (st->segs[mid].id < id){
+            lo = mid + 1;
+        }else{
+            hi = mid - 1; }
+    }
+    return NULL;
+}
+
+/**
+ * map segment id after the others, ids have to come in order. its fd goes to
+ * fd_out, or is closed if that is NULL. must use lock with this!!!
+ */
+static int store_segment_add(struct store* st, uint32_t id, short create, int* fd_out)
+{
+    char path[1024];
+    store_segment_path(st, id, path, sizeof(path));
+    int fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (fd < 0){
+        log_err("failed to open store segment %s", path);
+        return -1;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || sb.st_size > STORE_SEGMENT_BYTES){
+        log_err("store segment %s is unreadable or too big", path);
+        close(fd);
+        return -1;
+    }
+    if (st->n_segs == st->cap_segs){
+        int cap = st->cap_segs ? st->cap_segs * 2 : 16;
+        struct store_segment* segs = realloc(st->segs, cap * sizeof(struct store_segment));
+        if (!segs){
+            log_err("failed to grow store segments");
+            close(fd);
+            return -1;
+        }
+        st->segs = segs;
+        st->cap_segs = cap;
+    }
+    // mapped at full size once, appends past the end of the file show up in it
+    char* map = mmap(NULL, STORE_SEGMENT_BYTES, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED){
+        log_err("failed to map store segment %s", path);
+        close(fd);
+        return -1;
+    }
+    struct store_segment* seg = &(st->segs[st->n_segs++]);
+    seg->id = id;
+    seg->map = map;
+    seg->size = (uint32_t) sb.st_size;
+    seg->live = 0;
+    seg->tomb = 0;
+    if (fd_out){
+        *fd_out = fd;
+    }else{
+        close(fd); }
+    return 0;
+}
+
+// must use lock with this!!!
+static void store_segment_remove(struct store* st, uint32_t id)
+{
+    struct store_segment* seg = store_segment_find(st, id);
+    if (!seg){
+        return; }
+    char path[1024];
+    store_segment_path(st, id, path, sizeof(path));
+    munmap(seg->map, STORE_SEGMENT_BYTES);
+    int i = seg - st->segs;
+    memmove(seg, seg + 1, (st->n_segs - i - 1) * sizeof(struct store_segment));
+    --st->n_segs;
+    if (unlink(path) < 0){
+        log_warn("failed to remove store segment %s", path); }
+}
+
+// start a new segment to append to. must use lock with this!!!
+static int store_roll(struct store* st)
+{
+    int fd;
+    if (store_segment_add(st, st->segs[st->n_segs - 1].id + 1, 1, &fd) < 0){
+        return -1; }
+    // a checkpoint only syncs the active segment, so the ones before it go now
+    if (fdatasync(st->active_fd) < 0){
+        log_warn("failed to sync store segment %u", st->segs[st->n_segs - 2].id); }
+    close(st->active_fd);
+    st->active_fd = fd;
+    return 0;
+}
+
+/**
+ * write a record to the end of the active segment, at gets where it went.
+ * must use lock with this!!!
+ */
+static int store_append(struct store* st, const void* key, size_t key_len, const void* val, size_t val_len,
+        uint64_t version, uint16_t flags, uint64_t khash, struct store_slot* at)
+{
+    static const char pad[8];
+    uint32_t len = store_rec_len(key_len, val_len);
+    if (st->segs[st->n_segs - 1].size + (uint64_t) len > STORE_SEGMENT_BYTES && store_roll(st) < 0){
+        return -1; }
+    struct store_segment* seg = &(st->segs[st->n_segs - 1]);
+
+    char hdr[STORE_REC_BYTES];
+    uint16_t kl = (uint16_t) key_len;
+    uint32_t vl = (uint32_t) val_len;
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr + 4, &kl, 2);
+    memcpy(hdr + 6, &flags, 2);
+    memcpy(hdr + 8, &vl, 4);
+    memcpy(hdr + 16, &version, 8);
+    uint32_t sum = store_checksum(STORE_SUM_INIT, hdr + 4, STORE_REC_BYTES - 4);
+    sum = store_checksum(sum, key, key_len);
+    sum = store_checksum(sum, val, val_len);
+    memcpy(hdr, &sum, 4);
+
+    struct iovec iov[4] = {
+        {hdr, STORE_REC_BYTES},
+        {(void*) key, key_len},
+        {(void*) val, val_len},
+        {(void*) pad, len - (STORE_REC_BYTES + key_len + val_len)},
+    };
+    if (pwritev(st->active_fd, iov, 4, seg->size) != (ssize_t) len){
+        log_err("failed to append to store segment %u", seg->id);
+        // don't leave part of a record for the next one to go after
+        if (ftruncate(st->active_fd, seg->size) < 0){
+            log_err("failed to cut store segment %u back", seg->id); }
+        return -1;
+    }
+    at->khash = khash;
+    at->version = version;
+    at->seg = seg->id;
+    at->off = seg->size;
+    at->len = len;
+    at->flags = flags;
+    seg->size += len;
+    st->since_ckpt += len;
+    return 0;
+}
+
+//
+// index
+//
+
+/**
+ * the slot with key, or the empty slot it would go in. the table always has
+ * empty slots. must use lock with this!!!
+ */
+static struct store_slot* store_index_find(struct store* st, uint64_t khash, const void* key, size_t key_len)
+{
+    uint64_t mask = st->n_slots - 1;
+    struct store_segment* seg = NULL;
+    for (uint64_t i = khash & mask; ; i = (i + 1) & mask){
+        struct store_slot* s = &(st->slots[i]);
+        if (s->len == 0){
+            return s; }
+        if (s->khash != khash){
+            continue; }
+        if (!seg || seg->id != s->seg){
+            seg = store_segment_find(st, s->seg); }
+        uint16_t kl;
+        memcpy(&kl, seg->map + s->off + 4, 2);
+        if (kl == key_len && memcmp(seg->map + s->off + STORE_REC_BYTES, key, key_len) == 0){
+            return s; }
+    }
+}
+
+// must use lock with this!!!
+static int store_index_grow(struct store* st)
+{
+    uint64_t n = st->n_slots * 2;
+    struct store_slot* slots = calloc(n, sizeof(struct store_slot));
+    if (!slots){
+        log_err("failed to grow store index to %llu slots", (unsigned long long) n);
+        return -1;
+    }
+    for (uint64_t i = 0; i < st->n_slots; ++i){
+        if (!st->slots[i].len){
+            continue; }
+        uint64_t j = st->slots[i].khash & (n - 1);
+        while (slots[j].len){
+            j = (j + 1) & (n - 1); }
+        slots[j] = st->slots[i];
+    }
+    free(st->slots);
+    st->slots = slots;
+    st->n_slots = n;
+    return 0;
+}
+
+// room for one more key. must use lock with this!!!
+static int store_index_reserve(struct store* st)
+{
+    if ((st->n_used + 1) * 4 > st->n_slots * 3){
+        return store_index_grow(st); }
+    return 0;
+}
+
+// point s, found by store_index_find, at rec. must use lock with this!!!
+static void store_index_set(struct store* st, struct store_slot* s, const struct store_slot* rec)
+{
+    if (s->len){
+        struct store_segment* old = store_segment_find(st, s->seg);
+        if (old){
+            old->live -= s->len;
+            old->tomb -= (s->flags & STORE_REC_DEL) ? s->len : 0;
+        }
+    }else{
+        ++st->n_used;
+    }
+    *s = *rec;
+    struct store_segment* seg = store_segment_find(st, rec->seg);
+    if (seg){
+        seg->live += rec->len;
+        seg->tomb += (rec->flags & STORE_REC_DEL) ? rec->len : 0;
+    }
+    if (rec->version >= st->next_version){
+        st->next_version = rec->version + 1; }
+}
+
+// must use lock with this!!!
+static void store_index_remove(struct store* st, struct store_slot* s)
+{
+    uint64_t mask = st->n_slots - 1;
+    uint64_t i = s - st->slots;
+    struct store_segment* seg = store_segment_find(st, s->seg);
+    if (seg){
+        seg->live -= s->len;
+        seg->tomb -= (s->flags & STORE_REC_DEL) ? s->len : 0;
+    }
+    // shift back what follows in the run, unless it would go before its home slot
+    for (uint64_t j = (i + 1) & mask; st->slots[j].len; j = (j + 1) & mask){
+        uint64_t home = st->slots[j].khash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)){
+            st->slots[i] = st->slots[j];
+            i = j;
+        }
+    }
+    memset(&(st->slots[i]), 0, sizeof(struct store_slot));
+    --st->n_used;
+}
+
+//
+// recovery
+//
+
+/**
+ * index seg's records from off on. a bad record ends the scan, the segment is
+ * cut there if it is the one appended to or skipped from there if not
+ */
+static int store_scan(struct store* st, int seg_i, uint32_t off)
+{
+    struct store_segment* seg = &(st->segs[seg_i]);
+    if (seg->size > off){
+        madvise(seg->map, seg->size, MADV_SEQUENTIAL); }
+
+    while (off + STORE_REC_BYTES <= seg->size){
+        struct store_rec_view r;
+        store_rec_parse(seg->map + off, &r);
+        uint32_t len = store_rec_len(r.key_len, r.val_len);
+        if (r.key_len == 0 || r.key_len > STORE_MAX_KEY || r.val_len > STORE_MAX_VALUE || len > seg->size - off){
+            break; }
+        uint32_t sum = store_checksum(STORE_SUM_INIT, seg->map + off + 4, STORE_REC_BYTES - 4);
+        sum = store_checksum(sum, r.key, r.key_len);
+        if (store_checksum(sum, r.val, r.val_len) != r.sum){
+            break; }
+
+        struct store_slot rec = {store_key_hash(r.key, r.key_len), r.version, seg->id, off, len, r.flags};
+        if (store_index_reserve(st) < 0){
+            return -1; }
+        struct store_slot* s = store_index_find(st, rec.khash, r.key, r.key_len);
+        // compaction copies keep their version, the copy comes later in the log
+        if (!s->len || rec.version >= s->version){
+            store_index_set(st, s, &rec); }
+        off += len;
+    }
+    madvise(seg->map, STORE_SEGMENT_BYTES, MADV_NORMAL);
+
+    if (off < seg->size){
+        if (seg_i == st->n_segs - 1){
+            log_warn("store segment %u ends in a torn record at %u, cut off", seg->id, off);
+            if (ftruncate(st->active_fd, off) < 0){
+                log_err("failed to cut store segment %u", seg->id);
+                return -1;
+            }
+        }else{
+            log_warn("store segment %u is corrupt from %u, the rest of it is skipped", seg->id, off);
+        }
+        seg->size = off;
+    }
+    return 0;
+}
+
+/**
+ * the index from the checkpoint, and the segment and offset it was written
+ * up to. -1 if there is none or it doesn't fit the segments there are now.
+ * segments' live bytes are counted from it, store_index_set keeps them after
+ */
+static int store_ckpt_load(struct store* st, uint32_t* seg_id, uint32_t* off)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/" STORE_CKPT_FILE, st->dir);
+    FILE* f = fopen(path, "rb");
+    if (!f){
+        return -1; }
+
+    char hdr[STORE_CKPT_HEADER_BYTES];
+    uint16_t version;
+    uint64_t next_version, n_slots, n_used;
+    uint32_t sum;
+    struct store_slot* slots = NULL;
+    struct store_segment** by_id = NULL;
+    int rc = -1;
+
+    if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr) || memcmp(hdr, STORE_CKPT_MAGIC, 4) != 0){
+        goto out; }
+    memcpy(&version, hdr + 4, 2);
+    memcpy(seg_id, hdr + 8, 4);
+    memcpy(off, hdr + 12, 4);
+    memcpy(&next_version, hdr + 16, 8);
+    memcpy(&n_slots, hdr + 24, 8);
+    memcpy(&n_used, hdr + 32, 8);
+    if (version != STORE_CKPT_VERSION || n_slots < STORE_MIN_SLOTS || (n_slots & (n_slots - 1)) ||
+            n_used * 4 > n_slots * 3){
+        log_warn("store checkpoint %s is from another version", path);
+        goto out;
+    }
+    slots = malloc(n_slots * sizeof(struct store_slot));
+    if (!slots){
+        log_err("failed to malloc store index of %llu slots", (unsigned long long) n_slots);
+        goto out;
+    }
+    if (fread(slots, sizeof(struct store_slot), n_slots, f) != n_slots || fread(&sum, 4, 1, f) != 1 ||
+            sum != store_checksum(store_checksum(STORE_SUM_INIT, hdr, sizeof(hdr)), slots, n_slots * sizeof(struct store_slot))){
+        log_warn("store checkpoint %s is corrupt", path);
+        goto out;
+    }
+
+    // a crash can leave one older than the segments, e.g. mid compaction
+    struct store_segment* at = store_segment_find(st, *seg_id);
+    if (!at || *off > at->size){
+        log_warn("store checkpoint %s is past the end of the log", path);
+        goto out;
+    }
+    // segments by id for the pass over the slots, which counts what is live in them
+    uint32_t first = st->segs[0].id;
+    uint32_t n_ids = st->segs[st->n_segs - 1].id - first + 1;
+    by_id = calloc(n_ids, sizeof(struct store_segment*));
+    if (!by_id){
+        log_err("failed to malloc store segment table");
+        goto out;
+    }
+    for (int i = 0; i < st->n_segs; ++i){
+        by_id[st->segs[i].id - first] = &(st->segs[i]); }
+    for (uint64_t i = 0; i < n_slots; ++i){
+        if (!slots[i].len){
+            continue; }
+        struct store_segment* seg = (slots[i].seg >= first && slots[i].seg - first < n_ids) ?
+            by_id[slots[i].seg - first] : NULL;
+        if (!seg || slots[i].off + (uint64_t) slots[i].len > seg->size){
+            log_warn("store checkpoint %s points at records that are gone", path);
+            for (int j = 0; j < st->n_segs; ++j){
+                st->segs[j].live = 0;
+                st->segs[j].tomb = 0;
+            }
+            goto out;
+        }
+        seg->live += slots[i].len;
+        seg->tomb += (slots[i].flags & STORE_REC_DEL) ? slots[i].len : 0;
+    }
+
+    free(st->slots);
+    st->slots = slots;
+    st->n_slots = n_slots;
+    st->n_used = n_used;
+    st->next_version = next_version;
+    slots = NULL;
+    rc = 0;
+
+out:
+    free(by_id);
+    free(slots);
+    fclose(f);
+    return rc;
+}
+
+// segment ids in dir, sorted. -1 if it can't be read
+static int store_list_segments(const char* dir, uint32_t** ids)
+{
+    DIR* d = opendir(dir);
+    if (!d){
+        log_err("failed to open store dir %s", dir);
+        return -1;
+    }
+    int n = 0, cap = 0;
+    *ids = NULL;
+    struct dirent* de;
+    while ((de = readdir(d))){
+        unsigned int id;
+        char end;
+        if (sscanf(de->d_name, "seg-%8u.lo%c", &id, &end) != 2 || end != 'g' || strlen(de->d_name) != 16){
+            continue; }
+        if (n == cap){
+            cap = cap ? cap * 2 : 64;
+            uint32_t* grown = realloc(*ids, cap * sizeof(uint32_t));
+            if (!grown){
+                log_err("failed to list store segments");
+                free(*ids);
+                closedir(d);
+                return -1;
+            }
+            *ids = grown;
+        }
+        (*ids)[n++] = id;
+    }
+    closedir(d);
+    for (int i = 1; i < n; ++i){ // few enough that insertion sort does
+        uint32_t id = (*ids)[i];
+        int j = i;
+        for (; j > 0 && (*ids)[j - 1] > id; --j){
+            (*ids)[j] = (*ids)[j - 1]; }
+        (*ids)[j] = id;
+    }
+    return n;
+}
+
+//
+// checkpoints and compaction
+//
+
+// must use maint_lock with this!!!
+static int store_ckpt_write(struct store* st)
+{
+    char hdr[STORE_CKPT_HEADER_BYTES];
+    uint16_t version = STORE_CKPT_VERSION;
+
+    pthread_mutex_lock(&(st->lock));
+    uint64_t n_slots = st->n_slots;
+    uint64_t n_used = st->n_used;
+    struct store_slot* slots = malloc(n_slots * sizeof(struct store_slot));
+    if (!slots){
+        pthread_mutex_unlock(&(st->lock));
+        log_err("failed to malloc store checkpoint");
+        return -1;
+    }
+    memcpy(slots, st->slots, n_slots * sizeof(struct store_slot));
+    uint32_t seg_id = st->segs[st->n_segs - 1].id;
+    uint32_t off = st->segs[st->n_segs - 1].size;
+    uint64_t next_version = st->next_version;
+    int fd = dup(st->active_fd);
+    uint64_t since = st->since_ckpt;
+    st->since_ckpt = 0;
+    pthread_mutex_unlock(&(st->lock));
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, STORE_CKPT_MAGIC, 4);
+    memcpy(hdr + 4, &version, 2);
+    memcpy(hdr + 8, &seg_id, 4);
+    memcpy(hdr + 12, &off, 4);
+    memcpy(hdr + 16, &next_version, 8);
+    memcpy(hdr + 24, &n_slots, 8);
+    memcpy(hdr + 32, &n_used, 8);
+    uint32_t sum = store_checksum(store_checksum(STORE_SUM_INIT, hdr, sizeof(hdr)), slots,
+            n_slots * sizeof(struct store_slot));
+
+    char path[1024], tmp_path[1040];
+    snprintf(path, sizeof(path), "%s/" STORE_CKPT_FILE, st->dir);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int rc = -1;
+    // what it points at has to be on disk before it is
+    if (fd < 0 || fdatasync(fd) < 0){
+        log_err("failed to sync store segment %u", seg_id);
+        goto out;
+    }
+    FILE* f = fopen(tmp_path, "wb");
+    if (!f){
+        log_err("failed to open %s", tmp_path);
+        goto out;
+    }
+    rc = (fwrite(hdr, 1, sizeof(hdr), f) == sizeof(hdr) &&
+            fwrite(slots, sizeof(struct store_slot), n_slots, f) == n_slots &&
+            fwrite(&sum, 4, 1, f) == 1 && fflush(f) == 0 && fsync(fileno(f)) == 0) ? 0 : -1;
+    if (fclose(f) != 0){
+        rc = -1; }
+    if (rc == 0 && rename(tmp_path, path) != 0){
+        rc = -1; }
+    if (rc < 0){
+        log_err("failed to write store checkpoint %s", path);
+        remove(tmp_path);
+    }
+
+out:
+    if (rc < 0){ // try again next time
+        pthread_mutex_lock(&(st->lock));
+        st->since_ckpt += since;
+        pthread_mutex_unlock(&(st->lock));
+    }
+    if (fd >= 0){
+        close(fd); }
+    free(slots);
+    return rc;
+}
+
+// must use maint_lock with this!!!
+static int store_compact_one(struct store* st)
+{
+    pthread_mutex_lock(&(st->lock));
+    int pick = -1;
+    uint64_t pick_kept = 0;
+    for (int i = 0; i < st->n_segs - 1; ++i){
+        const struct store_segment* seg = &(st->segs[i]);
+        uint64_t kept = (i == 0) ? seg->live - seg->tomb : seg->live;
+        if (seg->size && kept * 100 >= (uint64_t) seg->size * STORE_COMPACT_PCT){
+            continue; }
+        if (pick < 0 || kept * st->segs[pick].size < pick_kept * seg->size){
+            pick = i;
+            pick_kept = kept;
+        }
+    }
+    if (pick < 0){
+        pthread_mutex_unlock(&(st->lock));
+        return 0;
+    }
+    uint32_t id = st->segs[pick].id;
+    uint32_t size = st->segs[pick].size;
+    uint64_t live = st->segs[pick].live;
+    const char* map = st->segs[pick].map;
+    // nothing older can have a record a tombstone here hides, so they can go
+    short oldest = (pick == 0);
+    pthread_mutex_unlock(&(st->lock));
+
+    // it isn't appended to any more and only we remove it, so it's read without the lock
+    uint32_t off = 0;
+    while (off < size){
+        pthread_mutex_lock(&(st->lock));
+        for (int n = 0; n < STORE_COMPACT_BATCH && off < size; ++n){
+            struct store_rec_view r;
+            store_rec_parse(map + off, &r);
+            uint64_t khash = store_key_hash(r.key, r.key_len);
+            struct store_slot* s = store_index_find(st, khash, r.key, r.key_len);
+            if (s->len && s->seg == id && s->off == off){
+                struct store_slot rec;
+                if ((s->flags & STORE_REC_DEL) && oldest){
+                    store_index_remove(st, s);
+                }else if (store_append(st, r.key, r.key_len, r.val, r.val_len, r.version, r.flags, khash, &rec) < 0){
+                    pthread_mutex_unlock(&(st->lock));
+                    return -1;
+                }else{
+                    store_index_set(st, s, &rec);
+                }
+            }
+            off += store_rec_len(r.key_len, r.val_len);
+        }
+        pthread_mutex_unlock(&(st->lock));
+    }
+
+    // the checkpoint can't point into it once it's gone
+    if (store_ckpt_write(st) < 0){
+        return -1; }
+    pthread_mutex_lock(&(st->lock));
+    store_segment_remove(st, id);
+    pthread_mutex_unlock(&(st->lock));
+    log_info("compacted store segment %u, %llu of its %u bytes were live", id, (unsigned long long) live, size);
+    return 1;
+}
+
+static void* store_maint_main(void* arg)
+{
+    struct store* st = (struct store*) arg;
+    struct timespec slice = {0, 100 * 1000000};
+    uint64_t last_ckpt = store_now_ms();
+    uint64_t last_run = last_ckpt;
+
+    while (__atomic_load_n(&(st->maint_running), __ATOMIC_ACQUIRE)){
+        nanosleep(&slice, NULL);
+        uint64_t now = store_now_ms();
+        if (now - last_run < STORE_MAINT_MS){
+            continue; }
+        last_run = now;
+
+        store_sync(st);
+        pthread_mutex_lock(&(st->maint_lock));
+        pthread_mutex_lock(&(st->lock));
+        uint64_t since = st->since_ckpt;
+        pthread_mutex_unlock(&(st->lock));
+        if (since >= STORE_CKPT_BYTES || (since && now - last_ckpt >= STORE_CKPT_SECS * 1000)){
+            if (store_ckpt_write(st) == 0){
+                last_ckpt = now; }
+        }
+        store_compact_one(st);
+        pthread_mutex_unlock(&(st->maint_lock));
+    }
+    return arg;
+}
+
+//
+// the store
+//
+
+struct store* store_open(const char* dir)
+{
+    struct store* st = calloc(1, sizeof(struct store));
+    if (!st){
+        log_err("failed to malloc store");
+        return NULL; }
+    st->active_fd = -1;
+    st->next_version = 1;
+    st->dir = strdup(dir);
+    st->n_slots = STORE_MIN_SLOTS;
+    st->slots = calloc(st->n_slots, sizeof(struct store_slot));
+    if (!st->dir || !st->slots){
+        log_err("failed to malloc store");
+        free(st->dir);
+        free(st->slots);
+        free(st);
+        return NULL;
+    }
+    pthread_mutex_init(&(st->lock), NULL);
+    pthread_mutex_init(&(st->maint_lock), NULL);
+
+    uint64_t started = store_now_ms();
+    uint32_t* ids = NULL;
+    int n_ids;
+    if ((mkdir(dir, 0755) < 0 && errno != EEXIST) || (n_ids = store_list_segments(dir, &ids)) < 0){
+        log_err("failed to open store dir %s", dir);
+        goto fail;
+    }
+    for (int i = 0; i < n_ids; ++i){
+        if (store_segment_add(st, ids[i], 0, (i == n_ids - 1) ? &(st->active_fd) : NULL) < 0){
+            free(ids);
+            goto fail;
+        }
+    }
+    free(ids);
+    if (st->n_segs == 0 && store_segment_add(st, 1, 1, &(st->active_fd)) < 0){
+        goto fail; }
+
+    uint32_t from_seg, from_off;
+    short warm = (store_ckpt_load(st, &from_seg, &from_off) == 0);
+    if (!warm){
+        from_seg = st->segs[0].id;
+        from_off = 0;
+    }
+    uint64_t scanned = 0;
+    for (int i = 0; i < st->n_segs; ++i){
+        if (st->segs[i].id < from_seg){
+            continue; }
+        uint32_t off = (st->segs[i].id == from_seg) ? from_off : 0;
+        scanned += st->segs[i].size - off;
+        if (store_scan(st, i, off) < 0){
+            goto fail; }
+    }
+    log_info("store %s open in %llu ms, %llu keys in %d segments, %llu bytes scanned%s", dir,
+            (unsigned long long)(store_now_ms() - started), (unsigned long long) st->n_used, st->n_segs,
+            (unsigned long long) scanned, warm ? " after the checkpoint" : "");
+
+    st->maint_running = 1;
+    if (pthread_create(&(st->maint_thread), NULL, store_maint_main, st) != 0){
+        log_err("failed to start store maintenance");
+        st->maint_running = 0;
+        goto fail;
+    }
+    return st;
+
+fail:
+    store_close(st);
+    return NULL;
+}
+
+void store_close(struct store* st)
+{
+    if (!st) { return; }
+    if (st->maint_running){
+        __atomic_store_n(&(st->maint_running), 0, __ATOMIC_RELEASE);
+        pthread_join(st->maint_thread, NULL);
+        store_checkpoint(st);
+    }
+    for (int i = 0; i < st->n_segs; ++i){
+        munmap(st->segs[i].map, STORE_SEGMENT_BYTES); }
+    if (st->active_fd >= 0){
+        close(st->active_fd); }
+    pthread_mutex_destroy(&(st->lock));
+    pthread_mutex_destroy(&(st->maint_lock));
+    free(st->segs);
+    free(st->slots);
+    free(st->dir);
+    free(st);
+}
+
+int store_get(struct store* st, const void* key, size_t key_len, void* buf, size_t buf_len,
+        size_t* val_len, uint64_t* version)
+{
+    if (key_len == 0 || key_len > STORE_MAX_KEY){
+        return -1; }
+    uint64_t khash = store_key_hash(key, key_len);
+    int rc = -1;
+
+    pthread_mutex_lock(&(st->lock));
+    struct store_slot* s = store_index_find(st, khash, key, key_len);
+    if (s->len && !(s->flags & STORE_REC_DEL)){
+        struct store_rec_view r;
+        store_rec_parse(store_segment_find(st, s->seg)->map + s->off, &r);
+        memcpy(buf, r.val, r.val_len < buf_len ? r.val_len : buf_len);
+        if (val_len){
+            *val_len = r.val_len; }
+        if (version){
+            *version = r.version; }
+        rc = 0;
+    }
+    pthread_mutex_unlock(&(st->lock));
+    return rc;
+}
+
+// version 0 is newer than anything there
+static int store_write(struct store* st, const void* key, size_t key_len, const void* val, size_t val_len,
+        uint64_t version, uint16_t flags)
+{
+    if (key_len == 0 || key_len > STORE_MAX_KEY || val_len > STORE_MAX_VALUE){
+        log_warn("store record of %zu byte key, %zu byte value is too big", key_len, val_len);
+        return -1;
+    }
+    uint64_t khash = store_key_hash(key, key_len);
+    int rc = 0;
+
+    pthread_mutex_lock(&(st->lock));
+    if (store_index_reserve(st) < 0){
+        rc = -1;
+        goto out;
+    }
+    struct store_slot* s = store_index_find(st, khash, key, key_len);
+    if (!version){
+        version = st->next_version;
+    }else if (s->len && s->version >= version){
+        rc = 1;
+        goto out;
+    }
+    struct store_slot rec;
+    if (store_append(st, key, key_len, val, val_len, version, flags, khash, &rec) < 0){
+        rc = -1;
+        goto out;
+    }
+    store_index_set(st, s, &rec);
+
+out:
+    pthread_mutex_unlock(&(st->lock));
+    return rc;
+}
+
+int store_put(struct store* st, const void* key, size_t key_len, const void* val, size_t val_len)
+{
+    return store_write(st, key, key_len, val, val_len, 0, 0);
+}
+
+int store_delete(struct store* st, const void* key, size_t key_len)
+{
+    return store_write(st, key, key_len, NULL, 0, 0, STORE_REC_DEL);
+}
+
+int store_apply(struct store* st, const void* key, size_t key_len, const void* val, size_t val_len,
+        uint64_t version, uint16_t flags)
+{
+    if (!version){
+        return -1; }
+    return store_write(st, key, key_len, val, val_len, version, flags & STORE_REC_DEL);
+}
+
+uint64_t store_version(struct store* st, const void* key, size_t key_len)
+{
+    if (key_len == 0 || key_len > STORE_MAX_KEY){
+        return 0; }
+    uint64_t khash = store_key_hash(key, key_len);
+    pthread_mutex_lock(&(st->lock));
+    struct store_slot* s = store_index_find(st, khash, key, key_len);
+    uint64_t version = s->len ? s->version : 0;
+    pthread_mutex_unlock(&(st->lock));
+    return version;
+}
+
+int store_checkpoint(struct store* st)
+{
+    pthread_mutex_lock(&(st->maint_lock));
+    int rc = store_ckpt_write(st);
+    pthread_mutex_unlock(&(st->maint_lock));
+    return rc;
+}
+
+int store_compact(struct store* st)
+{
+    pthread_mutex_lock(&(st->maint_lock));
+    int rc = store_compact_one(st);
+    pthread_mutex_unlock(&(st->maint_lock));
+    return rc;
+}
+
+int store_sync(struct store* st)
+{
+    pthread_mutex_lock(&(st->lock));
+    int fd = dup(st->active_fd);
+    pthread_mutex_unlock(&(st->lock));
+    int rc = (fd >= 0 && fdatasync(fd) == 0) ? 0 : -1;
+    if (fd >= 0){
+        close(fd); }
+    return rc;
+}
+
+void store_get_stats(struct store* st, struct store_stats* stats)
+{
+    memset(stats, 0, sizeof(struct store_stats));
+    pthread_mutex_lock(&(st->lock));
+    stats->keys = st->n_used;
+    stats->segments = st->n_segs;
+    for (int i = 0; i < st->n_segs; ++i){
+        stats->bytes += st->segs[i].size;
+        stats->live_bytes += st->segs[i].live;
+    }
+    pthread_mutex_unlock(&(st->lock));
+}
@@ -0,0 +1,169 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * a node's records on disk, so a restarted node can serve what it owned
+ * straight away instead of fetching it all back over the network.
+ *
+ * records are appended to a log split into segment files, each mapped for
+ * reading. an index in memory says where each key's newest record is. the
+ * index table is written out as is to a checkpoint every so often, so opening
+ * the store reads the checkpoint and only scans what was appended after it.
+ * a background thread syncs, checkpoints and copies the live records out of
+ * mostly dead segments so their files can go
+ */
+
+/*
+ * dir/seg-NNNNNNNN.log, records back to back, each padded to 8 bytes
+ * record               what                        size
+SSSS                    checksum of the rest        4
+KK                      key length                  2
+FF                      flags, STORE_REC_*          2
+LLLL                    value length                4
+RRRR                    reserved, 0                 4
+VVVVVVVV                version                     8
+key                                                 K
+value                                               L
+ *
+ * dir/index.ckpt
+DHTI                    magic                       4
+VV                      version                     2
+RR                      reserved, 0                 2
+SSSS                    segment written up to       4
+OOOO                    offset in it                4
+NNNNNNNN                next version                8
+CCCCCCCC                index slots                 8
+EEEEEEEE                used slots                  8
+[struct store_slot x C] the index table             32 each
+SSSS                    checksum of all before      4
+ */
+#define STORE_CKPT_MAGIC "DHTI"
+#define STORE_CKPT_VERSION 1
+#define STORE_REC_BYTES 24
+#define STORE_CKPT_HEADER_BYTES 40
+
+// a tombstone, the key was deleted at its version
+#define STORE_REC_DEL 1
+
+// segment files are mapped at this size and a new one is started once it is full
+#define STORE_SEGMENT_BYTES (64u << 20)
+#define STORE_MAX_KEY 1024
+#define STORE_MAX_VALUE (1u << 20)
+// how often the background thread looks at the store
+#define STORE_MAINT_MS 1000
+// a checkpoint is written once this much was appended since the last, or after STORE_CKPT_SECS
+#define STORE_CKPT_BYTES (64ull << 20)
+#define STORE_CKPT_SECS 30
+// segments with less than this percent of their bytes live are compacted. tombstones
+// count as live, except in the oldest segment where compaction drops them
+#define STORE_COMPACT_PCT 50
+
+struct store_slot{
+    uint64_t khash;
+    uint64_t version;
+    uint32_t seg;
+    uint32_t off;
+    uint32_t len; // whole record, 0 if the slot is empty
+    uint32_t flags;
+};
+
+struct store_segment{
+    uint32_t id;
+    char* map; // STORE_SEGMENT_BYTES, size bytes of it are in the file
+    uint32_t size;
+    uint64_t live; // bytes of the records the index points at
+    uint64_t tomb; // those of them that are tombstones
+};
+
+struct store{
+    char* dir;
+    pthread_mutex_t lock;
+    // index, linear probing, power of 2 slots
+    struct store_slot* slots;
+    uint64_t n_slots;
+    uint64_t n_used;
+    // segments by id, the last is the one appended to
+    struct store_segment* segs;
+    int n_segs;
+    int cap_segs;
+    int active_fd;
+    uint64_t next_version;
+    uint64_t since_ckpt; // bytes appended since the last checkpoint
+    // checkpoints and compaction, one at a time
+    pthread_mutex_t maint_lock;
+    pthread_t maint_thread;
+    short maint_running;
+};
+
+struct store_stats{
+    uint64_t keys; // deleted ones too until their tombstones are compacted away
+    int segments;
+    uint64_t bytes;
+    uint64_t live_bytes;
+};
+
+/**
+ * open the store in dir, creating it if needed, and start its background
+ * thread. the index comes from the checkpoint plus a scan of the segments
+ * after it, or a scan of everything if there is no usable checkpoint. a torn
+ * record at the end of the log is cut off. NULL on failure
+ */
+struct store* store_open(const char* dir);
+
+/**
+ * stops the background thread and writes a checkpoint, so the next open is quick
+ */
+void store_close(struct store* st);
+
+/**
+ * key's value into buf, up to buf_len bytes of it. val_len gets its whole
+ * length and version its version, either can be NULL. returns 0 if key is
+ * there, -1 if not or deleted
+ */
+int store_get(struct store* st, const void* key, size_t key_len, void* buf, size_t buf_len,
+        size_t* val_len, uint64_t* version);
+
+/**
+ * set key to val at a version newer than anything in the store. returns 0, or
+ * -1 if it couldn't be written
+ */
+int store_put(struct store* st, const void* key, size_t key_len, const void* val, size_t val_len);
+
+int store_delete(struct store* st, const void* key, size_t key_len);
+
+/**
+ * set key to val (or delete it, flags STORE_REC_DEL) at version, written
+ * elsewhere. returns 0 if it was stored, 1 if the store has key at that
+ * version or newer already, -1 on error
+ */
+int store_apply(struct store* st, const void* key, size_t key_len, const void* val, size_t val_len,
+        uint64_t version, uint16_t flags);
+
+/**
+ * key's version, deleted or not, 0 if the store has never seen it
+ */
+uint64_t store_version(struct store* st, const void* key, size_t key_len);
+
+/**
+ * write the index to the checkpoint now, returns 0 on success
+ */
+int store_checkpoint(struct store* st);
+
+/**
+ * compact the segment with the fewest live bytes if it is below
+ * STORE_COMPACT_PCT. returns 1 if one was, 0 if none needed it, -1 on error
+ */
+int store_compact(struct store* st);
+
+/**
+ * fdatasync what has been appended
+ */
+int store_sync(struct store* st);
+
+void store_get_stats(struct store* st, struct store_stats* stats);
+
+#endif // STORE_H
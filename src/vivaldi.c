@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "vivaldi.h"
+
+void vivaldi_init(struct vivaldi_coord* c)
+{
+    memset(c, 0, sizeof(struct vivaldi_coord));
+    c->height = VIVALDI_MIN_HEIGHT_US;
+    c->error = VIVALDI_MAX_ERROR;
+}
+
+static double vivaldi_plane_distance(const struct vivaldi_coord* a, const struct vivaldi_coord* b)
+{
+    double sum = 0;
+    for (int i = 0; i < VIVALDI_DIMS; ++i){
+        double d = (double) a->pos[i] - b->pos[i];
+        sum += d * d;
+    }
+    return sqrt(sum);
+}
+
+double vivaldi_distance_us(const struct vivaldi_coord* a, const struct vivaldi_coord* b)
+{
+    return vivaldi_plane_distance(a, b) + a->height + b->height;
+}
+
+uint32_t vivaldi_estimate_us(const struct vivaldi_coord* a, const struct vivaldi_coord* b)
+{
+    if (!vivaldi_known(a) || !vivaldi_known(b) ||
+            a->error > VIVALDI_TRUST_ERROR || b->error > VIVALDI_TRUST_ERROR){
+        return 0; }
+    double d = vivaldi_distance_us(a, b);
+    return d < 1 ? 1 : (d > UINT32_MAX - 1.0 ? UINT32_MAX - 1 : (uint32_t) d);
+}
+
+void vivaldi_update(struct vivaldi_coord* c, const struct vivaldi_coord* remote, double rtt_us)
+{
+    if (!vivaldi_known(remote) || rtt_us <= 0){
+        return; }
+    if (!vivaldi_known(c)){
+        vivaldi_init(c); }
+
+    double dist = vivaldi_distance_us(c, remote);
+    // trust the sample more the surer we are of the remote than of ourselves
+    double w = c->error / (c->error + remote->error);
+    double sample_err = fabs(dist - rtt_us) / (rtt_us > VIVALDI_NOISE_US ? rtt_us : VIVALDI_NOISE_US);
+    double err = sample_err * VIVALDI_CE * w + c->error * (1 - VIVALDI_CE * w);
+    c->error = err > VIVALDI_MAX_ERROR ? VIVALDI_MAX_ERROR : err;
+
+    // push away if the reply was slower than predicted, pull in if quicker
+    double force = VIVALDI_CC * w * (rtt_us - dist);
+    double plane = vivaldi_plane_distance(c, remote);
+    double unit[VIVALDI_DIMS];
+    if (plane > 1e-3){
+        for (int i = 0; i < VIVALDI_DIMS; ++i){
+            unit[i] = ((double) c->pos[i] - remote->pos[i]) / plane; }
+    }else{ // same place, pick a direction at random to split them
+        double len = 0;
+        for (int i = 0; i < VIVALDI_DIMS; ++i){
+            unit[i] = (double) rand() / RAND_MAX - 0.5;
+            len += unit[i] * unit[i];
+        }
+        len = sqrt(len) > 1e-9 ? sqrt(len) : 1;
+        for (int i = 0; i < VIVALDI_DIMS; ++i){
+            unit[i] /= len; }
+    }
+    for (int i = 0; i < VIVALDI_DIMS; ++i){
+        c->pos[i] += (float)(unit[i] * force); }
+    if (plane > 1e-3){
+        double h = c->height + (c->height + remote->height) * force / plane;
+        c->height = h < VIVALDI_MIN_HEIGHT_US ? VIVALDI_MIN_HEIGHT_US : (float) h;
+    }
+}
+
+int vivaldi_pack(char* buf, const struct vivaldi_coord* c)
+{
+    memcpy(buf, c->pos, sizeof(float) * VIVALDI_DIMS);
+    memcpy(buf + 4 * VIVALDI_DIMS, &(c->height), 4);
+    memcpy(buf + 4 * VIVALDI_DIMS + 4, &(c->error), 4);
+    return VIVALDI_BYTES;
+}
+
+void vivaldi_unpack(const char* buf, struct vivaldi_coord* c)
+{
+    memcpy(c->pos, buf, sizeof(float) * VIVALDI_DIMS);
+    memcpy(&(c->height), buf + 4 * VIVALDI_DIMS, 4);
+    memcpy(&(c->error), buf + 4 * VIVALDI_DIMS + 4, 4);
+    // anything that isn't a sane coordinate counts as none
+    int sane = c->error > 0 && c->error <= VIVALDI_MAX_ERROR && isfinite(c->height);
+    for (int i = 0; i < VIVALDI_DIMS; ++i){
+        sane = sane && isfinite(c->pos[i]); }
+    if (!sane){
+        memset(c, 0, sizeof(struct vivaldi_coord)); }
+}
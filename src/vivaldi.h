@@ -0,0 +1,60 @@
+#ifndef VIVALDI_H
+#define VIVALDI_H
+
+#include <stdint.h>
+
+/**
+ * Vivaldi synthetic network coordinates: each node places itself in a small
+ * euclidean space plus a height (its access link) so that distances between
+ * coordinates predict reply times, including to nodes never talked to
+ */
+
+#define VIVALDI_DIMS 2
+// on the wire: the position, height and error as floats
+#define VIVALDI_BYTES ((VIVALDI_DIMS + 2) * 4)
+// how fast the error and position move towards a new sample
+#define VIVALDI_CE 0.25
+#define VIVALDI_CC 0.25
+#define VIVALDI_MIN_HEIGHT_US 10.0
+// misses smaller than this are jitter, not the coordinate being wrong
+#define VIVALDI_NOISE_US 1000.0
+// error a fresh coordinate starts at and never goes above
+#define VIVALDI_MAX_ERROR 1.5
+// estimates between coordinates with more error than this are not worth using
+#define VIVALDI_TRUST_ERROR 0.6
+
+struct vivaldi_coord{
+    float pos[VIVALDI_DIMS]; // usecs
+    float height; // usecs
+    float error; // relative, 0 means no coordinate
+};
+
+/**
+ * a coordinate at the origin with the most error, for a node that has no samples yet
+ */
+void vivaldi_init(struct vivaldi_coord* c);
+
+static inline int vivaldi_known(const struct vivaldi_coord* c)
+{
+    return c->error > 0;
+}
+
+/**
+ * move c towards where a reply from remote taking rtt_us says it should be
+ */
+void vivaldi_update(struct vivaldi_coord* c, const struct vivaldi_coord* remote, double rtt_us);
+
+/**
+ * predicted reply time between a and b in usecs
+ */
+double vivaldi_distance_us(const struct vivaldi_coord* a, const struct vivaldi_coord* b);
+
+/**
+ * predicted reply time between a and b, 0 unless both are known and trusted
+ */
+uint32_t vivaldi_estimate_us(const struct vivaldi_coord* a, const struct vivaldi_coord* b);
+
+int vivaldi_pack(char* buf, const struct vivaldi_coord* c);
+void vivaldi_unpack(const char* buf, struct vivaldi_coord* c);
+
+#endif // VIVALDI_H